@@ -0,0 +1,65 @@
+#version 330 core
+
+// Light passes of the deferred shading, the material model of fragment.glsl. Feature flags:
+//     SPECULAR      specular exponent in the alpha of the albedo, otherwise the material is purely diffuse
+//     LIGHT_VOLUME  one point light per sphere drawn by light_volume.glsl, blended over the color;
+//                   otherwise the full-screen pass of the ambient term and of the light of PerFrame
+
+layout(std140) uniform PerFrame {
+    mat4 V;
+    mat4 P;
+    vec4 LightPosition_cameraspace;
+};
+
+uniform sampler2D GAlbedoSpec;
+uniform sampler2D GNormal;
+uniform sampler2D GDepth;
+uniform mat4 InvP;      // window depth back to camera space
+
+#ifdef LIGHT_VOLUME
+flat in vec4 Light_cameraspace;
+flat in vec3 LightColor;
+#endif
+
+out vec3 color;
+
+vec3 oct_decode(vec2 e) {
+    vec2 f = e*2 - 1;
+    vec3 n = vec3(f, 1 - abs(f.x) - abs(f.y));
+    float t = max(-n.z, 0);     // unfold the lower half
+    n.xy += vec2(n.x>=0 ? -t : t, n.y>=0 ? -t : t);
+    return normalize(n);
+}
+
+void main() {
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    float depth = texelFetch(GDepth, pixel, 0).r;
+    if (depth==0) discard;      // nothing was drawn there, the reverse-Z depth is still cleared
+    vec4 ndc = vec4(gl_FragCoord.xy/vec2(textureSize(GDepth, 0))*2 - 1, depth*2 - 1, 1);
+    vec4 h = InvP*ndc;
+    vec3 position = h.xyz/h.w;
+    vec4 ds = texelFetch(GAlbedoSpec, pixel, 0);
+    vec3 n = oct_decode(texelFetch(GNormal, pixel, 0).rg);
+
+#ifdef LIGHT_VOLUME
+    vec3 L = Light_cameraspace.xyz - position;
+    float d2 = dot(L, L);
+    float falloff = max(0, 1 - d2/(Light_cameraspace.w*Light_cameraspace.w));
+    if (falloff==0) discard;    // inside the polyhedron, outside of the sphere
+    vec3 l = L*inversesqrt(d2);
+    vec3 power = LightColor*falloff*falloff;
+    float ambient = 0;
+#else
+    vec3 l = normalize(LightPosition_cameraspace.xyz - position);
+    vec3 power = vec3(1.5f);
+    float ambient = 0.1;
+#endif
+    float cosTheta = clamp(dot(n, l), 0, 1);
+#ifdef SPECULAR
+    vec3 E = vec3(0, 0, 1);     // as in vertex.glsl
+    float cosAlpha = clamp(dot(E, -reflect(l, n)), 0, 1);
+    color = ds.rgb*(ambient + power*cosTheta + power*pow(cosAlpha, ds.a*250+1));
+#else
+    color = ds.rgb*(ambient + power*cosTheta);
+#endif
+}
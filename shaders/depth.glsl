@@ -0,0 +1,6 @@
+#version 330 core
+
+// Fragment stage of the depth pre-pass: no color output, the depth is written by the fixed function
+
+void main() {
+}
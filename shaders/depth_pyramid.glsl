@@ -0,0 +1,27 @@
+#version 430 core
+
+// One level of the hierarchical depth buffer. Every texel keeps the farthest depth (the smallest,
+// the depth is reversed) of the source texels it covers; with an odd source size the last row or
+// column is folded into its neighbour, so a level never misses a texel of the level below.
+// Level 0 is built from the depth texture itself, with a one to one footprint.
+
+layout(local_size_x = 8, local_size_y = 8) in;
+
+layout(binding = 4) uniform sampler2D Source;   // the depth texture or the pyramid itself
+uniform int SourceLevel;
+layout(r32f, binding = 0) writeonly uniform image2D Destination;
+
+void main() {
+    ivec2 size = imageSize(Destination);
+    ivec2 p = ivec2(gl_GlobalInvocationID.xy);
+    if (any(greaterThanEqual(p, size))) return;
+
+    ivec2 source = textureSize(Source, SourceLevel);
+    ivec2 first = p*source/size;
+    ivec2 last  = ((p+1)*source + size - 1)/size;   // exclusive, at most 3 texels away
+    float depth = 1.;
+    for (int y=first.y; y<last.y; y++)
+        for (int x=first.x; x<last.x; x++)
+            depth = min(depth, texelFetch(Source, ivec2(x, y), SourceLevel).r);
+    imageStore(Destination, p, vec4(depth));
+}
@@ -1,39 +1,206 @@
 #version 330 core
 
+// Feature flags prepended by the program cache, see shader.h:
+//     NORMAL_MAP  perturb the normal with the tangent space normal map, otherwise the interpolated normal is used
+//     SPECULAR    specular exponent in the alpha of diffspec, otherwise the material is purely diffuse
+//     GBUFFER     write the material and the normal for the deferred light passes instead of lighting
+//     CLUSTERED   add the point lights of the cluster of the fragment, see clustered.h
+//     VISIBILITY  the full-screen pass of the visibility buffer: the values below are rebuilt from the
+//                 triangle under the pixel instead of being interpolated, see visibility.h
+
+#ifdef VISIBILITY
+vec2 UV;
+vec3 Normal_cameraspace;
+vec3 EyeDirection_cameraspace;
+vec3 LightDirection_cameraspace;
+#ifdef NORMAL_MAP
+vec3 tangent_cameraspace;
+vec3 bitangent_cameraspace;
+#endif
+#ifdef CLUSTERED
+vec3 Position_cameraspace;
+#endif
+vec2 dUVdx, dUVdy;          // per pixel, there are no quads to take the derivatives from
+#define SAMPLE(tex, uv) textureGrad(tex, uv, dUVdx, dUVdy)
+#else
 // Interpolated values from the vertex shaders
 in vec2 UV;
 in vec3 Normal_cameraspace;
 in vec3 EyeDirection_cameraspace;
 in vec3 LightDirection_cameraspace;
+#ifdef NORMAL_MAP
 in vec3 tangent_cameraspace;
 in vec3 bitangent_cameraspace;
+#endif
+#ifdef CLUSTERED
+in vec3 Position_cameraspace;
+#endif
+#define SAMPLE(tex, uv) texture(tex, uv)
+#endif
 
 // Output data
+#ifdef GBUFFER
+layout(location = 0) out vec4 albedo_spec;  // diffspec as it is
+layout(location = 1) out vec2 normal_oct;   // camera space normal, octahedral encoding in [0,1]
+#else
 out vec3 color;
+#endif
 
 // Values that stay constant for the entire mesh
-uniform sampler2D diffuse;
-uniform sampler2D tangentnm;
-uniform sampler2D specular;
-uniform mat4 MV;
-uniform vec3 LightPosition_worldspace;
+uniform sampler2D diffspec;   // rgb: diffuse color, a: specular exponent
+#ifdef NORMAL_MAP
+uniform sampler2D tangentnm;  // rg: xy of the tangent space normal
+#endif
+
+#ifdef VISIBILITY
+layout(std140) uniform PerFrame {
+    mat4 V;
+    mat4 P;
+    vec4 LightPosition_cameraspace;
+};
+uniform usampler2D VisibilityIds;   // object*NumFaces + triangle + 1, 0 where nothing was drawn
+uniform samplerBuffer Corners;      // 4 texels per triangle corner, model space: position and u, normal and v, tangent, bitangent
+uniform samplerBuffer ModelViews;   // MV of the objects of the frame, one column per texel
+uniform uint NumFaces;
+
+vec2 interpolate(vec2 a, vec2 b, vec2 c, vec3 l) { return a*l.x + b*l.y + c*l.z; }
+vec3 interpolate(vec3 a, vec3 b, vec3 c, vec3 l) { return a*l.x + b*l.y + c*l.z; }
+
+// Fetch the triangle of the pixel and set what the vertex shader outputs would be. The perspective
+// correct barycentrics: lambda/w is affine on the screen, its gradient comes from the projected
+// corners, and the barycentrics of the neighbour pixels give the derivatives of the uvs.
+bool resolve() {
+    uint id = texelFetch(VisibilityIds, ivec2(gl_FragCoord.xy), 0).r;
+    if (id==0u) return false;
+    int object = int((id - 1u)/NumFaces), corner = 3*int((id - 1u)%NumFaces);
+    mat4 MV = mat4(texelFetch(ModelViews, 4*object), texelFetch(ModelViews, 4*object+1),
+                   texelFetch(ModelViews, 4*object+2), texelFetch(ModelViews, 4*object+3));
+    vec4 pu[3], nv[3], clip[3];
+    for (int k=0; k<3; k++) {
+        pu[k] = texelFetch(Corners, 4*(corner+k));
+        nv[k] = texelFetch(Corners, 4*(corner+k)+1);
+        clip[k] = P*(MV*vec4(pu[k].xyz, 1));
+    }
+
+    vec3 invW = 1/vec3(clip[0].w, clip[1].w, clip[2].w);
+    vec2 p0 = clip[0].xy*invW.x, p1 = clip[1].xy*invW.y, p2 = clip[2].xy*invW.z;
+    float invDet = 1/determinant(mat2(p2 - p1, p0 - p1));
+    vec3 ddx = vec3(p1.y - p2.y, p2.y - p0.y, p0.y - p1.y)*invDet*invW;   // d(lambda/w)/dx in NDC
+    vec3 ddy = vec3(p2.x - p1.x, p0.x - p2.x, p1.x - p0.x)*invDet*invW;
+    vec2 size = vec2(textureSize(VisibilityIds, 0));
+    vec2 delta = gl_FragCoord.xy/size*2 - 1 - p0;
+    vec3 h  = vec3(invW.x, 0, 0) + delta.x*ddx + delta.y*ddy;
+    vec3 hx = h + ddx*(2/size.x), hy = h + ddy*(2/size.y);     // one pixel right, one pixel up
+    vec3 lambda = h/dot(h, vec3(1));
+    vec3 lambda_dx = hx/dot(hx, vec3(1)) - lambda;
+    vec3 lambda_dy = hy/dot(hy, vec3(1)) - lambda;
+
+    vec2 uv0 = vec2(pu[0].w, nv[0].w), uv1 = vec2(pu[1].w, nv[1].w), uv2 = vec2(pu[2].w, nv[2].w);
+    UV    = interpolate(uv0, uv1, uv2, lambda);
+    dUVdx = interpolate(uv0, uv1, uv2, lambda_dx);
+    dUVdy = interpolate(uv0, uv1, uv2, lambda_dy);
+    vec3 position = (MV*vec4(interpolate(pu[0].xyz, pu[1].xyz, pu[2].xyz, lambda), 1)).xyz;
+    mat3 N = mat3(MV);      // the instances are only rotated and translated, as for GPU_DRIVEN
+    Normal_cameraspace = N*interpolate(nv[0].xyz, nv[1].xyz, nv[2].xyz, lambda);
+    EyeDirection_cameraspace = vec3(0,0,1);
+    LightDirection_cameraspace = LightPosition_cameraspace.xyz - position;
+#ifdef NORMAL_MAP
+    tangent_cameraspace   = N*interpolate(texelFetch(Corners, 4*corner+2).xyz, texelFetch(Corners, 4*corner+6).xyz, texelFetch(Corners, 4*corner+10).xyz, lambda);
+    bitangent_cameraspace = N*interpolate(texelFetch(Corners, 4*corner+3).xyz, texelFetch(Corners, 4*corner+7).xyz, texelFetch(Corners, 4*corner+11).xyz, lambda);
+#endif
+#ifdef CLUSTERED
+    Position_cameraspace = position;
+#endif
+    return true;
+}
+#endif
+
+#ifdef CLUSTERED
+layout(std140) uniform PointLights {
+    vec4  ClusterDepth;     // x: offset added to the depth, y: scale and z: bias of its logarithm, the slice
+    ivec4 ClusterGrid;      // tiles along x and y, slices, tile size in pixels
+    vec4  Lights[2*MAX_LIGHTS];     // camera space position and radius, then the color
+};
+uniform usamplerBuffer Clusters;    // first and count of every cluster in pairs, then the light indices
+
+// The lights whose sphere may touch the cluster, the falloff does the exact test
+vec3 point_lights(vec3 n, vec4 ds) {
+    float d = -Position_cameraspace.z;
+    int slice = clamp(int(log(max(d + ClusterDepth.x, 1e-30))*ClusterDepth.y + ClusterDepth.z), 0, ClusterGrid.z - 1);
+    ivec2 tile = min(ivec2(gl_FragCoord.xy)/ClusterGrid.w, ClusterGrid.xy - 1);
+    int cluster = 2*((slice*ClusterGrid.y + tile.y)*ClusterGrid.x + tile.x);
+    int first = int(texelFetch(Clusters, cluster).r);
+    int count = int(texelFetch(Clusters, cluster + 1).r);
+    vec3 sum = vec3(0);
+    for (int i=0; i<count; i++) {
+        int light = int(texelFetch(Clusters, first + i).r);
+        vec4 position_radius = Lights[2*light];
+        vec3 L = position_radius.xyz - Position_cameraspace;
+        float d2 = dot(L, L);
+        float falloff = max(0, 1 - d2/(position_radius.w*position_radius.w));
+        if (falloff==0) continue;
+        vec3 l = L*inversesqrt(d2);
+        vec3 power = Lights[2*light + 1].rgb*falloff*falloff;
+        float cosTheta = clamp(dot(n, l), 0, 1);
+#ifdef SPECULAR
+        float cosAlpha = clamp(dot(normalize(EyeDirection_cameraspace), -reflect(l, n)), 0, 1);
+        sum += power*(cosTheta + pow(cosAlpha, ds.a*250+1));
+#else
+        sum += power*cosTheta;
+#endif
+    }
+    return ds.rgb*sum;
+}
+#endif
+
+#ifdef GBUFFER
+// Octahedral encoding: the unit sphere is projected onto the octahedron |x|+|y|+|z|=1, whose lower
+// half is folded over the upper one, two channels with an almost uniform error
+vec2 oct_encode(vec3 n) {
+    n /= abs(n.x) + abs(n.y) + abs(n.z);
+    vec2 s = vec2(n.x>=0 ? 1 : -1, n.y>=0 ? 1 : -1);
+    vec2 p = n.z>=0 ? n.xy : (1 - abs(n.yx))*s;
+    return p*.5 + .5;
+}
+#endif
 
 void main() {
+#ifdef VISIBILITY
+    if (!resolve()) discard;    // the background keeps the clear color
+#endif
     float LightPower = 1.5f;                   // Light emission properties
     vec3 n = normalize( Normal_cameraspace );  // Normal of the computed fragment, in camera space
 
+    vec4 ds = SAMPLE(diffspec, UV);            // diffuse color and specular exponent in one fetch
+#ifdef NORMAL_MAP
+    vec2 nxy = SAMPLE(tangentnm, UV).rg*2 - 1;
+    vec3 nt = vec3(nxy, sqrt(max(0, 1 - dot(nxy, nxy))));  // z of the unit tangent space normal is always positive
+
     mat3 B = mat3(normalize(tangent_cameraspace), normalize(bitangent_cameraspace), n);
-    n = normalize((B*normalize(texture(tangentnm, UV).rgb * 2 - 1))); // tangent space normal mapping
+    n = normalize(B*nt); // tangent space normal mapping
+#endif
     
+#ifdef GBUFFER
+    albedo_spec = ds;
+    normal_oct  = oct_encode(n);
+#else
     vec3 l = normalize( LightDirection_cameraspace );  // Direction of the light (from the fragment to the light)
     float cosTheta = clamp( dot( n,l ), 0,1 );         // Cosine of the angle between the normal and the light direction, 
     
+#ifdef SPECULAR
     vec3 E = normalize(EyeDirection_cameraspace);  // Eye vector (towards the camera)
     vec3 R = -reflect(l,n);                        // Direction in which the triangle reflects the light
     float cosAlpha = clamp( dot( E,R ), 0,1 );     // Cosine of the angle between the Eye vector and the Reflect vector,
 
-    color =  texture(diffuse, UV).xyz*(0.1 +
-                                       LightPower*cosTheta  +
-                                       LightPower*pow(cosAlpha, texture(specular, UV).r*250+1));
+    color =  ds.rgb*(0.1 +
+                     LightPower*cosTheta  +
+                     LightPower*pow(cosAlpha, ds.a*250+1));
+#else
+    color =  ds.rgb*(0.1 + LightPower*cosTheta);
+#endif
+#ifdef CLUSTERED
+    color += point_lights(n, ds);
+#endif
+#endif
 }
 
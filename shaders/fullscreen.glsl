@@ -0,0 +1,8 @@
+#version 330 core
+
+// One triangle that covers the viewport, without vertex buffers: draw 3 vertices with an empty VAO
+
+void main() {
+    vec2 p = vec2((gl_VertexID<<1) & 2, gl_VertexID & 2);  // (0,0), (2,0), (0,2)
+    gl_Position = vec4(p*2 - 1, 0, 1);
+}
@@ -0,0 +1,32 @@
+#version 430 core
+
+// The triangles the compute rasterizer left to the hardware, 3 vertices each from its list, drawn
+// by an indirect draw without vertex buffers, see micro_raster.h. visibility.glsl writes the ids.
+
+layout(std430, binding = 1) readonly buffer Large {
+    uvec4 command;
+    uint small;
+    uint pad[3];
+    uint large[];           // id - 1 of the listed triangles
+};
+
+layout(std140) uniform PerFrame {
+    mat4 V;
+    mat4 P;
+    vec4 LightPosition_cameraspace;
+};
+
+uniform samplerBuffer Corners;      // 4 texels per triangle corner, the position first
+uniform samplerBuffer ModelViews;   // MV of the objects of the frame, one column per texel
+uniform uint NumFaces;
+
+flat out uint TriangleId;
+
+void main() {
+    uint index = large[gl_VertexID/3];
+    int object = int(index/NumFaces), corner = 3*int(index%NumFaces) + gl_VertexID%3;
+    mat4 MV = mat4(texelFetch(ModelViews, 4*object), texelFetch(ModelViews, 4*object+1),
+                   texelFetch(ModelViews, 4*object+2), texelFetch(ModelViews, 4*object+3));
+    gl_Position = P*(MV*vec4(texelFetch(Corners, 4*corner).xyz, 1.));
+    TriangleId = index + 1u;
+}
@@ -0,0 +1,24 @@
+#version 330 core
+
+// One sphere per point light, instanced. The unit sphere is a polyhedron scaled to contain the sphere,
+// it is moved in camera space so the light is passed to the fragment shader once per vertex.
+
+layout(location = 0) in vec3 vertexPosition_modelspace;
+layout(location = 1) in vec4 LightPositionRadius;  // per instance, world space
+layout(location = 2) in vec3 LightColorIntensity;  // per instance
+
+flat out vec4 Light_cameraspace;    // xyz the center, w the radius
+flat out vec3 LightColor;
+
+layout(std140) uniform PerFrame {
+    mat4 V;
+    mat4 P;
+    vec4 LightPosition_cameraspace;
+};
+
+void main() {
+    vec4 center = V*vec4(LightPositionRadius.xyz, 1);
+    Light_cameraspace = vec4(center.xyz, LightPositionRadius.w);
+    LightColor = LightColorIntensity;
+    gl_Position = P*(center + vec4(vertexPosition_modelspace*LightPositionRadius.w, 0));
+}
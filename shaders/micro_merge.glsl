@@ -0,0 +1,16 @@
+#version 430 core
+
+// The pixels of the compute rasterizer into the visibility buffer, with their depth, before the
+// hardware pass of the large triangles tests against them, see micro_raster.h
+
+layout(std430, binding = 0) readonly buffer Pixels { uint pixels[]; };     // id and depth bits of every pixel
+uniform int Width;
+
+out uint id;
+
+void main() {
+    uint pixel = uint(int(gl_FragCoord.y)*Width + int(gl_FragCoord.x));
+    id = pixels[2u*pixel];
+    if (id==0u) discard;
+    gl_FragDepth = uintBitsToFloat(pixels[2u*pixel + 1u]);
+}
@@ -0,0 +1,97 @@
+#version 430 core
+#ifdef ATOMIC64
+#extension GL_ARB_gpu_shader_int64 : require
+#extension GL_NV_shader_atomic_int64 : require
+#endif
+
+// Compute rasterization of the triangles that cover a few pixels, see micro_raster.h. One invocation
+// per triangle of every object: the triangles that cross the near or the far plane or whose bounds
+// exceed MicroSize pixels are listed for the hardware pass, the others test the few pixel centers of
+// their bounds and keep the nearest depth (reverse-Z: the greatest) and its triangle id per pixel.
+//     ATOMIC64   one atomicMax of depth<<32 | id per covered pixel
+//     otherwise  two dispatches of 32-bit atomics: Pass 0 the depth, Pass 1 the ids of the
+//                triangles whose depth won (the greatest id on a tie, as with ATOMIC64)
+
+layout(local_size_x = 64) in;
+
+struct DrawCommand {
+    uint count;
+    uint instanceCount;
+    uint first;
+    uint baseInstance;
+};
+
+layout(std430, binding = 0) buffer Pixels {
+#ifdef ATOMIC64
+    uint64_t pixels[];
+#else
+    uint pixels[];      // id and depth bits of every pixel, the low and the high word of the 64-bit layout
+#endif
+};
+layout(std430, binding = 1) buffer Large {
+    DrawCommand command;    // 3 vertices per listed triangle, see large_triangles.glsl
+    uint small;             // triangles rasterized here
+    uint pad[3];
+    uint large[];           // id - 1 of the listed triangles
+};
+
+layout(binding = 10) uniform samplerBuffer Corners;      // 4 texels per triangle corner, the position first
+layout(binding = 11) uniform samplerBuffer ModelViews;   // MV of the objects of the frame, one column per texel
+
+uniform mat4  P;
+uniform uint  NumFaces;
+uniform uint  Count;        // objects
+uniform ivec2 Size;         // of the viewport
+uniform float MicroSize;    // largest bounds rasterized here, in pixels
+uniform int   Pass;
+
+void main() {
+    uint index = (gl_WorkGroupID.y*gl_NumWorkGroups.x + gl_WorkGroupID.x)*64u + gl_LocalInvocationID.x;
+    if (index>=Count*NumFaces) return;
+    int object = int(index/NumFaces), corner = 3*int(index%NumFaces);
+    mat4 MV = mat4(texelFetch(ModelViews, 4*object), texelFetch(ModelViews, 4*object+1),
+                   texelFetch(ModelViews, 4*object+2), texelFetch(ModelViews, 4*object+3));
+    mat4 MVP = P*MV;
+    vec4 clip[3];
+    for (int k=0; k<3; k++) clip[k] = MVP*vec4(texelFetch(Corners, 4*(corner+k)).xyz, 1.);
+
+    bool crossing = false;
+    for (int k=0; k<3; k++) {
+        // all three corners out of the same plane of the frustum
+        if (clip[0][k]>clip[0].w && clip[1][k]>clip[1].w && clip[2][k]>clip[2].w) return;
+        if (clip[0][k]<-clip[0].w && clip[1][k]<-clip[1].w && clip[2][k]<-clip[2].w) return;
+        crossing = crossing || abs(clip[k].z)>clip[k].w;    // the hardware clips it
+    }
+
+    vec3 s[3];      // pixels and window depth
+    for (int k=0; k<3; k++) s[k] = vec3((clip[k].xy/clip[k].w*.5 + .5)*vec2(Size), clip[k].z/clip[k].w*.5 + .5);
+    vec2 lo = min(s[0].xy, min(s[1].xy, s[2].xy)), hi = max(s[0].xy, max(s[1].xy, s[2].xy));
+    if (crossing || any(greaterThan(hi - lo, vec2(MicroSize)))) {
+        if (Pass==0) large[atomicAdd(command.count, 3u)/3u] = index;
+        return;
+    }
+    ivec2 first = max(ivec2(ceil(lo - .5)), ivec2(0)), last = min(ivec2(floor(hi - .5)), Size - 1);
+    if (any(greaterThan(first, last))) return;     // between the pixel centers
+    float area = (s[1].x - s[0].x)*(s[2].y - s[0].y) - (s[2].x - s[0].x)*(s[1].y - s[0].y);
+    if (area==0.) return;
+    if (Pass==0) atomicAdd(small, 1u);
+
+    uint id = index + 1u;   // 0 is the background
+    for (int y=first.y; y<=last.y; y++) {
+        for (int x=first.x; x<=last.x; x++) {
+            vec2 p = vec2(x, y) + .5;
+            float l0 = ((s[1].x - p.x)*(s[2].y - p.y) - (s[2].x - p.x)*(s[1].y - p.y))/area;
+            float l1 = ((s[2].x - p.x)*(s[0].y - p.y) - (s[0].x - p.x)*(s[2].y - p.y))/area;
+            float l2 = 1. - l0 - l1;
+            if (l0<0. || l1<0. || l2<0.) continue;
+            uint depth = floatBitsToUint(l0*s[0].z + l1*s[1].z + l2*s[2].z);   // the order of the bits is the one of the positive floats
+            uint pixel = uint(y*Size.x + x);
+#ifdef ATOMIC64
+            atomicMax(pixels[pixel], packUint2x32(uvec2(id, depth)));
+#else
+            if (Pass==0)                          atomicMax(pixels[2u*pixel + 1u], depth);
+            else if (pixels[2u*pixel + 1u]==depth) atomicMax(pixels[2u*pixel], id);
+#endif
+        }
+    }
+}
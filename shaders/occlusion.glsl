@@ -0,0 +1,78 @@
+#version 430 core
+
+// Two-phase occlusion culling of the instances, see occlusion.h.
+//     phase 0: list the candidates that were visible last frame, they are drawn first
+//     phase 1: test every candidate against the depth pyramid of what phase 0 drew, list the visible
+//              ones that phase 0 did not draw and record the visibility for the next frame
+// The lists are read by indirect draws, their instance counts are bumped with atomics.
+
+layout(local_size_x = 64) in;
+
+struct DrawCommand {
+    uint count;
+    uint instanceCount;
+    uint first;
+    uint baseInstance;
+};
+
+layout(std430, binding = 0) readonly buffer Ids { uint ids[]; };          // stable index of every candidate
+layout(std430, binding = 1) buffer Visibility { uint visible[]; };        // by stable index
+layout(std430, binding = 2) writeonly buffer Lists { uint list[]; };      // phase 0 from 0, phase 1 from Count
+layout(std430, binding = 3) buffer Commands { DrawCommand commands[2]; };
+
+layout(binding = 2) uniform samplerBuffer Models;  // model matrices of the candidates, one column per texel
+layout(binding = 3) uniform sampler2D DepthPyramid;
+
+uniform int  Phase;
+uniform uint Count;         // number of candidates
+uniform mat4 PV;
+uniform vec3 BoxMin;        // model space bounds of the mesh
+uniform vec3 BoxMax;
+uniform int  Levels;        // of the depth pyramid
+
+// The projected box is behind the depth pyramid: its nearest corner is farther than the farthest
+// occluder in the screen rectangle it covers. The level is chosen so that the rectangle spans
+// at most 2x2 texels.
+bool occluded(mat4 MVP) {
+    vec2 lo = vec2(1.), hi = vec2(0.);
+    float nearest = 0.;
+    for (int i=0; i<8; i++) {
+        vec3 corner = vec3((i&1)!=0 ? BoxMax.x : BoxMin.x, (i&2)!=0 ? BoxMax.y : BoxMin.y, (i&4)!=0 ? BoxMax.z : BoxMin.z);
+        vec4 clip = MVP*vec4(corner, 1.);
+        if (clip.w<=0.) return false;   // crosses the plane of the eye, the projection is meaningless
+        vec3 ndc = clip.xyz/clip.w;
+        lo = min(lo, ndc.xy*.5 + .5);
+        hi = max(hi, ndc.xy*.5 + .5);
+        nearest = max(nearest, ndc.z*.5 + .5);
+    }
+    if (nearest>=1.) return false;      // in front of the near plane
+    lo = clamp(lo, 0., 1.);
+    hi = clamp(hi, 0., 1.);
+
+    ivec2 size0 = textureSize(DepthPyramid, 0);
+    vec2 extent = (hi - lo)*vec2(size0);
+    int level = clamp(int(ceil(log2(max(max(extent.x, extent.y), 1.)))), 0, Levels-1);
+    ivec2 size = max(size0 >> level, 1);   // the sizes of glTexStorage2D, textureSize() of a varying level is not reliable
+    // the texels of a level cover 2^level texels of level 0, the last one also the odd remainder
+    ivec2 a = min(ivec2(lo*vec2(size0)) >> level, size-1);
+    ivec2 b = min(ivec2(hi*vec2(size0)) >> level, size-1);
+    float farthest = min(min(texelFetch(DepthPyramid, a, level).r, texelFetch(DepthPyramid, ivec2(b.x, a.y), level).r),
+                         min(texelFetch(DepthPyramid, ivec2(a.x, b.y), level).r, texelFetch(DepthPyramid, b, level).r));
+    return nearest<farthest;
+}
+
+void main() {
+    uint k = gl_GlobalInvocationID.x;
+    if (k>=Count) return;
+    uint id = ids[k];
+    bool drawn = visible[id]!=0u;
+    if (Phase==0) {
+        if (drawn) list[atomicAdd(commands[0].instanceCount, 1u)] = k;
+        return;
+    }
+    int column = 4*int(k);
+    mat4 M = mat4(texelFetch(Models, column), texelFetch(Models, column+1), texelFetch(Models, column+2), texelFetch(Models, column+3));
+    bool visible_now = !occluded(PV*M);
+    visible[id] = visible_now ? 1u : 0u;
+    if (visible_now && !drawn) list[Count + atomicAdd(commands[1].instanceCount, 1u)] = k;
+}
@@ -1,40 +1,113 @@
 #version 330 core
 
+// Feature flags prepended by the program cache, see shader.h:
+//     NORMAL_MAP  tangent space normal mapping, the tangent frame is passed to the fragment shader
+//     QUANTIZED   positions come as normalized shorts, QuantScale and QuantOffset bring them back to model space
+//     INSTANCING  one draw call for many objects, PerObject holds an array indexed by gl_InstanceID
+//     GPU_DRIVEN  indirect draws of the lists written by the culling compute shader: the instance index
+//                 comes as an attribute and the model matrix from the Models buffer texture
+//     DEPTH_ONLY  the depth pre-pass, only the position is read and transformed
+//     CLUSTERED   the fragment shader needs the camera space position for the point lights
+//     VISIBILITY  with DEPTH_ONLY: the index of the object goes to visibility.glsl
+
 // Input vertex data, different for all executions of this shader
 layout(location = 0) in vec3 vertexPosition_modelspace;
 layout(location = 1) in vec2 vertexUV;
 layout(location = 2) in vec3 vertexNormal_modelspace;
+#ifdef NORMAL_MAP
 layout(location = 3) in vec3 tangent;
 layout(location = 4) in vec3 bitangent;
+#endif
+
+// The shading pass tests the depth of the pre-pass for equality, both must compute the same position
+invariant gl_Position;
 
+#ifndef DEPTH_ONLY
 // Output data; will be interpolated for each fragment
 out vec2 UV;
 out vec3 Normal_cameraspace;
 out vec3 EyeDirection_cameraspace;
 out vec3 LightDirection_cameraspace;
+#ifdef NORMAL_MAP
 out vec3 tangent_cameraspace;
 out vec3 bitangent_cameraspace;
+#endif
+#ifdef CLUSTERED
+out vec3 Position_cameraspace;
+#endif
+#elif defined(VISIBILITY)
+flat out uint ObjectIndex;
+#endif
 
 // Values that stay constant for the entire mesh
-uniform mat4 MVP;
-uniform mat4 V;
-uniform mat4 M;
-uniform vec3 LightPosition_worldspace;
+layout(std140) uniform PerFrame {
+    mat4 V;
+    mat4 P;
+    vec4 LightPosition_cameraspace;
+};
+
+struct Object {
+    mat4 M;
+    mat4 MV;
+    mat4 MVP;
+    mat3 N;      // normal matrix, transpose(inverse(MV)) computed once per object on the CPU
+    vec4 info;      // x: index of the object in the frame; pads the struct to 256 bytes, the stride of the uniform ring
+};
+
+#if defined(GPU_DRIVEN)
+layout(location = 5) in uint instance;  // per instance, index in Models
+uniform samplerBuffer Models;           // model matrices, one column per texel
+#elif defined(INSTANCING)
+layout(std140) uniform PerObject {
+    Object objects[MAX_INSTANCES];
+};
+#define object objects[gl_InstanceID]
+#else
+layout(std140) uniform PerObject {
+    Object object;
+};
+#endif
+
+#ifdef QUANTIZED
+uniform vec3 QuantScale;    // half the extent of the bounding box
+uniform vec3 QuantOffset;   // center of the bounding box
+#endif
 
 void main() {
-    gl_Position = MVP * vec4(vertexPosition_modelspace, 1);              // Output position of the vertex, in clip space : MVP * position
-    
+#ifdef GPU_DRIVEN
+    int column = 4*int(instance);
+    Object object;
+    object.M   = mat4(texelFetch(Models, column), texelFetch(Models, column+1), texelFetch(Models, column+2), texelFetch(Models, column+3));
+    object.MV  = V*object.M;
+    object.MVP = P*object.MV;
+    object.N   = mat3(object.MV);  // the instances are only rotated and translated, the normal matrix is MV itself
+#endif
+#ifdef QUANTIZED
+    vec4 position = vec4(vertexPosition_modelspace*QuantScale + QuantOffset, 1);
+#else
+    vec4 position = vec4(vertexPosition_modelspace, 1);
+#endif
+    gl_Position = object.MVP * position;              // Output position of the vertex, in clip space : MVP * position
+#if defined(DEPTH_ONLY) && defined(VISIBILITY)
+    ObjectIndex = uint(object.info.x);
+#endif
+#ifndef DEPTH_ONLY
     EyeDirection_cameraspace = vec3(0,0,1);  // Vector that goes from the vertex to the camera, in camera space.
 
-    vec3 vertexPosition_cameraspace = (V*M*vec4(vertexPosition_modelspace,1)).xyz;
-    vec3 LightPosition_cameraspace  = (V*  vec4(LightPosition_worldspace, 1)).xyz;   // M is ommited because it's identity.
-    LightDirection_cameraspace = LightPosition_cameraspace - vertexPosition_cameraspace;
+    vec3 vertexPosition_cameraspace = (object.MV*position).xyz;
+    LightDirection_cameraspace = LightPosition_cameraspace.xyz - vertexPosition_cameraspace;
+#ifdef CLUSTERED
+    Position_cameraspace = vertexPosition_cameraspace;
+#endif
 
-    Normal_cameraspace = (transpose(inverse(V*M)) * vec4(vertexNormal_modelspace, 0)).xyz;  // Normal of the the vertex, in camera space
+    Normal_cameraspace = object.N * vertexNormal_modelspace;  // Normal of the the vertex, in camera space
 
     UV = vertexUV;  // UV of the vertex. No special space for this one.
 
-    tangent_cameraspace   = (V*vec4(  tangent, 0)).xyz;
-    bitangent_cameraspace = (V*vec4(bitangent, 0)).xyz;
+#ifdef NORMAL_MAP
+    tangent_cameraspace   = (object.MV*vec4(  tangent, 0)).xyz;  // tangents lie in the surface, they follow MV, not the normal matrix
+    bitangent_cameraspace = (object.MV*vec4(bitangent, 0)).xyz;
+#endif
+#endif
 }
 
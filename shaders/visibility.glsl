@@ -0,0 +1,22 @@
+#version 330 core
+
+// The geometry pass of the visibility buffer: one 32-bit id per pixel, the shading comes later in
+// the full-screen pass of fragment.glsl with VISIBILITY, see visibility.h
+//     MICRO  the large triangles of the compute rasterizer, the id comes from large_triangles.glsl
+
+#ifdef MICRO
+flat in uint TriangleId;
+#else
+flat in uint ObjectIndex;
+uniform uint NumFaces;
+#endif
+
+out uint id;
+
+void main() {
+#ifdef MICRO
+    id = TriangleId;
+#else
+    id = ObjectIndex*NumFaces + uint(gl_PrimitiveID) + 1u;  // 0 is the background
+#endif
+}
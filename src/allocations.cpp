@@ -0,0 +1,55 @@
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include "allocations.h"
+
+static std::atomic<long> allocations(0), allocated_bytes(0);
+
+AllocationCounts allocation_counts() {
+    AllocationCounts counts;
+    counts.allocations = allocations.load(std::memory_order_relaxed);
+    counts.bytes = allocated_bytes.load(std::memory_order_relaxed);
+    return counts;
+}
+
+static void *counted_malloc(std::size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    allocated_bytes.fetch_add((long)size, std::memory_order_relaxed);
+    return std::malloc(size ? size : 1);
+}
+
+void *operator new(std::size_t size) {
+    void *p = counted_malloc(size);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+void *operator new[](std::size_t size) {
+    void *p = counted_malloc(size);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept {
+    return counted_malloc(size);
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept {
+    return counted_malloc(size);
+}
+
+void operator delete(void *p) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void *p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void *p, const std::nothrow_t &) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void *p, const std::nothrow_t &) noexcept {
+    std::free(p);
+}
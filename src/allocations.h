@@ -0,0 +1,15 @@
+#ifndef __ALLOCATIONS_H__
+#define __ALLOCATIONS_H__
+
+// Heap allocations of the process, all the threads, counted by the replaced global operator new:
+// one relaxed atomic add per allocation. The benchmark records them per frame, the steady state
+// of the frame loop is expected to allocate nothing.
+struct AllocationCounts {
+    AllocationCounts() : allocations(0), bytes(0) {}
+    long allocations;
+    long bytes;         // requested, since the start of the process
+};
+
+AllocationCounts allocation_counts();
+
+#endif //__ALLOCATIONS_H__
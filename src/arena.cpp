@@ -0,0 +1,36 @@
+#include <cstdint>
+#include "arena.h"
+
+static char *align_up(char *p, size_t align) {
+    return (char *)(((uintptr_t)p + align - 1) & ~(uintptr_t)(align - 1));
+}
+
+void *Arena::allocate(size_t bytes, size_t align) {
+    if (!blocks.empty()) {
+        char *p = align_up(blocks.back() + used, align);
+        if (p + bytes<=blocks.back() + size) {
+            used = p + bytes - blocks.back();
+            total += bytes;
+            return p;
+        }
+    }
+    total += bytes;
+    if (bytes + align>BLOCK/2) {    // its own block, before the current one that keeps filling
+        char *block = new char[bytes + align];
+        blocks.insert(blocks.empty() ? blocks.end() : blocks.end() - 1, block);
+        if (blocks.size()==1) used = size = 0;  // no current block yet
+        return align_up(block, align);
+    }
+    blocks.push_back(new char[BLOCK]);
+    size = BLOCK;
+    char *p = align_up(blocks.back(), align);
+    used = p + bytes - blocks.back();
+    return p;
+}
+
+void Arena::release() {
+    for (size_t i=0; i<blocks.size(); i++) delete[] blocks[i];
+    blocks.clear();
+    blocks.shrink_to_fit();
+    used = size = total = 0;
+}
@@ -0,0 +1,41 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <cstddef>
+#include <vector>
+
+// Linear allocator for the load-time scratch: an allocation bumps an offset in the current block,
+// nothing is freed one by one and release() gives every block back at once. The requests larger
+// than half a block get a block of their own. Not thread safe: one arena per thread.
+class Arena {
+public:
+    Arena() : blocks(), used(0), size(0), total(0) {}
+    ~Arena() { release(); }
+    void *allocate(size_t bytes, size_t align);
+    void release();
+    size_t allocated() const { return total; }  // bytes handed out since the last release()
+private:
+    Arena(const Arena &);   // the containers keep a pointer to their arena
+    Arena &operator=(const Arena &);
+    enum { BLOCK = 1<<20 };
+
+    std::vector<char *> blocks;     // the current one last
+    size_t used, size;              // of the current block
+    size_t total;
+};
+
+// Adapter for the standard containers: std::vector<T, ArenaAllocator<T> > v(ArenaAllocator<T>(arena)).
+// deallocate() does nothing, a growing container leaves its old storage in the arena until release().
+template <typename T> struct ArenaAllocator {
+    typedef T value_type;
+    ArenaAllocator(Arena &arena) : arena(&arena) {}
+    template <typename U> ArenaAllocator(const ArenaAllocator<U> &other) : arena(other.arena) {}
+    T *allocate(size_t n) { return static_cast<T *>(arena->allocate(n*sizeof(T), alignof(T))); }
+    void deallocate(T *, size_t) {}
+    Arena *arena;
+};
+
+template <typename T, typename U> bool operator==(const ArenaAllocator<T> &a, const ArenaAllocator<U> &b) { return a.arena==b.arena; }
+template <typename T, typename U> bool operator!=(const ArenaAllocator<T> &a, const ArenaAllocator<U> &b) { return a.arena!=b.arena; }
+
+#endif //__ARENA_H__
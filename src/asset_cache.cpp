@@ -0,0 +1,25 @@
+#include <sstream>
+#include <iomanip>
+#include <sys/stat.h>
+#include "asset_cache.h"
+#include "shader.h"
+
+AssetCache::AssetCache(const std::string &dir) : dir(dir) {
+    if (!dir.empty()) mkdir(dir.c_str(), 0755);    // fails harmlessly if it exists
+}
+
+std::string AssetCache::file(const std::string &kind, const std::vector<std::string> &sources) const {
+    if (dir.empty()) return "";
+    uint64_t hash = fnv1a(kind);
+    for (size_t i=0; i<sources.size(); i++) {
+        struct stat st;
+        std::ostringstream key;
+        key << sources[i] << "\n";
+        if (stat(sources[i].c_str(), &st)) key << "missing\n";
+        else key << st.st_size << "\n" << st.st_mtime << "\n";
+        hash = fnv1a(key.str(), hash);
+    }
+    std::ostringstream name;
+    name << dir << "/" << std::hex << std::setw(16) << std::setfill('0') << hash << "." << kind;
+    return name.str();
+}
@@ -0,0 +1,56 @@
+#ifndef __ASSET_CACHE_H__
+#define __ASSET_CACHE_H__
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <cstdio>
+#include <cstdint>
+
+// Binary copies of the decoded assets (the mesh streams, the packed textures) in one directory, like
+// shadercache/ for the programs. A file is keyed by its kind and by the path, the size and the
+// modification time of its sources, so an edited source misses the cache. The residency manager
+// reads them back when a released CPU copy is needed again.
+class AssetCache {
+public:
+    AssetCache(const std::string &dir);     // empty dir disables the cache
+    bool enabled() const { return !dir.empty(); }
+    // the file of the data of kind (with its format version) made from sources, "" if disabled; a missing
+    // source is part of the key as well
+    std::string file(const std::string &kind, const std::vector<std::string> &sources) const;
+private:
+    std::string dir;
+};
+
+// The arrays of the cache files: a 64-bit count, then the raw elements
+template <typename V> bool write_array(std::ostream &out, const V &v) {
+    uint64_t n = v.size();
+    out.write((const char *)&n, sizeof(n));
+    out.write((const char *)v.data(), n*sizeof(typename V::value_type));
+    return out.good();
+}
+
+// fails unless the file holds exactly the expected count, a stale or short file is never trusted
+template <typename V> bool read_array(std::istream &in, V &v, size_t expected) {
+    uint64_t n = 0;
+    if (!in.read((char *)&n, sizeof(n)) || n!=expected) return false;
+    v.resize(n);
+    if (n) in.read((char *)v.data(), n*sizeof(typename V::value_type));
+    return !in.fail();
+}
+
+// write(out) fills a file aside, renamed to file once complete: a concurrent run never reads a partial file
+template <typename F> bool write_cache_file(const std::string &file, const F &write) {
+    if (file.empty()) return false;
+    std::string tmp = file + ".tmp";
+    std::ofstream out(tmp.c_str(), std::ios::out|std::ios::binary);
+    if (!out || !write(out)) {
+        out.close();
+        std::remove(tmp.c_str());
+        return false;
+    }
+    out.close();
+    return !std::rename(tmp.c_str(), file.c_str());
+}
+
+#endif //__ASSET_CACHE_H__
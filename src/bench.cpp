@@ -0,0 +1,177 @@
+#include <iostream>
+#include <fstream>
+#include <cmath>
+#include <algorithm>
+#include <sys/resource.h>
+#include <glad/glad.h>
+#include "stats.h"
+#include "bench.h"
+#include "allocations.h"
+#include "model.h"
+#include "mesh.h"
+#include "material.h"
+#include "scene.h"
+#include "parallel.h"
+
+void bench_pose(int frame, int nframes, Matrix &M, Matrix &V) {
+    float t = 2*M_PI*frame/nframes;
+    M = Matrix::identity();
+    M[0][0] = M[2][2] = cos(t);
+    M[2][0] = sin(t);
+    M[0][2] = -sin(t);
+
+    float tilt = .3f*sin(t);
+    V = Matrix::identity();
+    V[1][1] = V[2][2] = cos(tilt);
+    V[1][2] = -sin(tilt);
+    V[2][1] = sin(tilt);
+}
+
+long peak_rss_kb() {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage)) return -1;
+    return usage.ru_maxrss; // kilobytes on Linux
+}
+
+Bench::Bench(int frames, int warmup) : frames(frames), warmup(warmup), current(0), frame_start_allocations(0), cpu_ms(), allocations() {
+    cpu_ms.reserve(frames);
+    allocations.reserve(frames);
+    run_start = run_end = clock::now();
+}
+
+void Bench::frame_start() {
+    frame_start_time = clock::now();
+    if (current==warmup) run_start = frame_start_time;
+    frame_start_allocations = allocation_counts().allocations;
+}
+
+void Bench::frame_end() {
+    if (current>=warmup) {
+        cpu_ms.push_back(std::chrono::duration<double, std::milli>(clock::now() - frame_start_time).count());
+        allocations.push_back(allocation_counts().allocations - frame_start_allocations);
+    }
+    current++;
+}
+
+void Bench::record(const char *name, double value) {
+    size_t i = std::find(series_names.begin(), series_names.end(), name) - series_names.begin();
+    if (i==series_names.size()) {
+        series_names.push_back(name);
+        series.push_back(std::vector<double>());
+        series.back().reserve(frames);
+    }
+    if (current>=warmup) series[i].push_back(value);
+}
+
+void Bench::finish() {
+    run_end = clock::now();
+}
+
+bool Bench::write_json(const std::string &filename, const std::string &model, long triangles, int width, int height, GpuTimer &gpu_timer) {
+    std::ofstream out(filename.c_str());
+    if (!out.is_open()) {
+        std::cerr << "Failed to write " << filename << std::endl;
+        return false;
+    }
+    double wall = std::chrono::duration<double>(run_end - run_start).count();
+    Summary cpu = summarize(cpu_ms);
+    Summary gpu = summarize(gpu_timer.samples("frame", warmup));
+    Summary heap = summarize(allocations);
+
+    out << "{" << std::endl;
+    out << "  \"model\": \"" << model << "\"," << std::endl;
+    out << "  \"renderer\": \"" << glGetString(GL_RENDERER) << "\"," << std::endl;
+    out << "  \"version\": \"" << glGetString(GL_VERSION) << "\"," << std::endl;
+    out << "  \"width\": " << width << ", \"height\": " << height << "," << std::endl;
+    out << "  \"frames\": " << frames << ", \"warmup\": " << warmup << "," << std::endl;
+    out << "  \"triangles_per_frame\": " << triangles << "," << std::endl;
+    out << "  \"wall_seconds\": " << wall << "," << std::endl;
+    out << "  \"fps\": " << frames/wall << "," << std::endl;
+    out << "  \"triangles_per_second\": " << triangles*frames/wall << "," << std::endl;
+    out << "  \"peak_rss_kb\": " << peak_rss_kb() << "," << std::endl;
+    out << "  \"cpu_frame_ms\": "; ::write_json(out, cpu); out << "," << std::endl;
+    out << "  \"heap_allocations\": "; ::write_json(out, heap); out << "," << std::endl;
+    for (size_t i=0; i<series.size(); i++) {
+        out << "  \"" << series_names[i] << "\": "; ::write_json(out, summarize(series[i])); out << "," << std::endl;
+    }
+    out << "  \"gpu_frame_ms\": "; ::write_json(out, gpu); out << std::endl;
+    out << "}" << std::endl;
+
+    std::cerr << "bench: " << frames << " frames in " << wall << " s, " << frames/wall << " fps, cpu p50 " << cpu.p50
+              << " ms p99 " << cpu.p99 << " ms, gpu p50 " << gpu.p50 << " ms p99 " << gpu.p99 << " ms, " << heap.mean
+              << " heap allocations per frame, written to " << filename << std::endl;
+    return true;
+}
+
+
+namespace {
+    // the stages log their loading, the benchmark runs them many times
+    struct QuietErrors {
+        QuietErrors() : saved(std::cerr.rdbuf(NULL)) {}
+        ~QuietErrors() {
+            std::cerr.rdbuf(saved);
+            std::cerr.clear();
+        }
+        std::streambuf *saved;
+    };
+    enum { SCALING_REPS = 5 };
+}
+
+template <typename F> static double median_ms(const F &stage) {
+    std::vector<double> ms;
+    for (int rep=0; rep<SCALING_REPS; rep++) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        stage();
+        ms.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+    }
+    return summarize(ms).p50;
+}
+
+bool scaling_bench(const std::string &filename, const char *obj, const char *diffuse, const char *tangentnm, const char *specular,
+                   int instances, int max_threads, bool pin) {
+    const char *names[5] = { "obj_parse", "bbox", "tangents", "texture_decode", "frustum_cull" };
+    std::vector<int> threads;
+    for (int n=1; n<max_threads; n*=2) threads.push_back(n);
+    threads.push_back(max_threads);
+    std::vector<std::vector<double> > ms(5);
+    int nodes = 1;
+    for (size_t t=0; t<threads.size(); t++) {
+        JobSystem::configure(threads[t], pin);
+        nodes = JobSystem::get().nodes();
+        QuietErrors quiet;
+        Model model(obj);
+        Scene scene(model, instances, 1);
+        std::vector<Matrix> visible;
+        Vec3f min, max;
+        ms[0].push_back(median_ms([&]() { Model parsed(obj); }));
+        ms[1].push_back(median_ms([&]() { model.get_bbox(min, max); }));
+        ms[2].push_back(median_ms([&]() { Mesh mesh(model); }));
+        ms[3].push_back(median_ms([&]() { Material material(diffuse, tangentnm, specular); }));
+        ms[4].push_back(median_ms([&]() { scene.cull(visible); }));
+    }
+
+    std::ofstream out(filename.c_str());
+    if (!out.is_open()) {
+        std::cerr << "Failed to write " << filename << std::endl;
+        return false;
+    }
+    out << "{" << std::endl;
+    out << "  \"model\": \"" << obj << "\"," << std::endl;
+    out << "  \"instances\": " << instances << ", \"hardware_threads\": " << std::thread::hardware_concurrency()
+        << ", \"pinned\": " << (pin ? "true" : "false") << ", \"numa_nodes\": " << nodes << "," << std::endl;
+    std::cerr << "scaling: median of " << SCALING_REPS << " runs, ms (speedup)" << std::endl;
+    for (int s=0; s<5; s++) {
+        out << "  \"" << names[s] << "\": [";
+        std::cerr << "    " << names[s] << ":";
+        for (size_t t=0; t<threads.size(); t++) {
+            double speedup = ms[s][t]>0 ? ms[s][0]/ms[s][t] : 1;
+            out << (t ? ", " : "") << "{\"threads\": " << threads[t] << ", \"ms\": " << ms[s][t] << ", \"speedup\": " << speedup << "}";
+            std::cerr << "  " << threads[t] << " threads " << ms[s][t] << " (" << speedup << "x)";
+        }
+        out << "]" << (s<4 ? "," : "") << std::endl;
+        std::cerr << std::endl;
+    }
+    out << "}" << std::endl;
+    std::cerr << "scaling written to " << filename << std::endl;
+    return true;
+}
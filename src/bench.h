@@ -0,0 +1,51 @@
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include "geometry.h"
+#include "gpu_timer.h"
+
+// Scripted camera and model path: one full turn of the model over the run while
+// the camera tilts back and forth, so every run renders exactly the same frames.
+void bench_pose(int frame, int nframes, Matrix &M, Matrix &V);
+
+// Collects the frame times of an unpaced run and writes them as JSON,
+// so the runs can be diffed across commits and machines.
+class Bench {
+public:
+    Bench(int frames, int warmup);
+    int total_frames() const { return warmup + frames; }
+    void frame_start();
+    void frame_end();
+    // per-frame series, between frame_start and frame_end; only registered during the warmup, so the
+    // measured frames do not allocate for them
+    void record(const char *name, double value);
+    void finish();                  // stop the clock, call after the GPU is idle
+
+    // model, triangles per frame, size of the framebuffer, the GPU timer that measured the run
+    bool write_json(const std::string &filename, const std::string &model, long triangles, int width, int height, GpuTimer &gpu_timer);
+
+    int frames, warmup;
+private:
+    typedef std::chrono::steady_clock clock;
+    int current;
+    clock::time_point frame_start_time, run_start, run_end;
+    long frame_start_allocations;
+    std::vector<double> cpu_ms;
+    std::vector<double> allocations;    // heap allocations of every measured frame, see allocations.h
+    std::vector<std::string> series_names;
+    std::vector<std::vector<double> > series;
+};
+
+long peak_rss_kb();                 // peak resident set size of the process
+
+// Scaling of the CPU stages that run on the job system: the OBJ parse, the bounding box, the tangent
+// loop, the texture decode and the frustum culling of the instances, each timed with 1, 2, 4... up to
+// max_threads workers (the median of a few runs). Prints the speedups and writes them as JSON.
+bool scaling_bench(const std::string &filename, const char *obj, const char *diffuse, const char *tangentnm, const char *specular,
+                   int instances, int max_threads, bool pin);
+
+#endif //__BENCH_H__
+
@@ -0,0 +1,184 @@
+#include <iostream>
+#include <cmath>
+#include <cstring>
+#include <chrono>
+#include <algorithm>
+#include "clustered.h"
+#include "uniforms.h"
+#include "parallel.h"
+#include "profiler.h"
+
+enum { HEADER_FLOATS = 8, LIGHT_FLOATS = 8 };  // std140: two vec4 of header, two vec4 per light
+
+LightClusters::LightClusters() : ubo(0), lists(0), lists_tex(0), tiles_x(0), tiles_y(0), depth_offset(0), depth_scale(0), depth_bias(0),
+    block(HEADER_FLOATS + LIGHT_FLOATS*MAX_LIGHTS, 0.f), extents(), data(), slice_refs(SLICES, 0), last(), truncated(false) {}
+
+void LightClusters::init() {
+    glGenBuffers(1, &ubo);
+    glBindBuffer(GL_UNIFORM_BUFFER, ubo);
+    glBufferData(GL_UNIFORM_BUFFER, block.size()*sizeof(float), NULL, GL_STREAM_DRAW);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    glGenBuffers(1, &lists);
+    glBindBuffer(GL_TEXTURE_BUFFER, lists);
+    glBufferData(GL_TEXTURE_BUFFER, 2*sizeof(GLuint), NULL, GL_STREAM_DRAW);
+    glGenTextures(1, &lists_tex);
+    glBindTexture(GL_TEXTURE_BUFFER, lists_tex);
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_R32UI, lists);
+    glBindTexture(GL_TEXTURE_BUFFER, 0);
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+}
+
+void LightClusters::setup_program(GLuint prog) {
+    GLuint idx = glGetUniformBlockIndex(prog, "PointLights");
+    if (GL_INVALID_INDEX!=idx) glUniformBlockBinding(prog, idx, LIGHT_UNIFORMS_BINDING);
+    glUseProgram(prog);
+    glUniform1i(glGetUniformLocation(prog, "Clusters"), CLUSTERS_UNIT);
+}
+
+int LightClusters::slice(float depth) const {
+    float s = std::floor(std::log(std::max(depth + depth_offset, 1e-30f))*depth_scale + depth_bias);
+    return (int)std::min((float)SLICES - 1, std::max(0.f, s));
+}
+
+void LightClusters::update(const std::vector<PointLight> &lights, const Matrix &V, const Matrix &P, int width, int height) {
+    PROFILE_ZONE("light clusters");
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    int n = std::min((int)lights.size(), (int)MAX_LIGHTS);
+    if (n<(int)lights.size() && !truncated) {
+        std::cerr << "Clustered shading: " << lights.size() << " lights, only the first " << MAX_LIGHTS << " are shaded" << std::endl;
+        truncated = true;
+    }
+    tiles_x = (std::max(1, width)  + TILE - 1)/TILE;
+    tiles_y = (std::max(1, height) + TILE - 1)/TILE;
+    int nclusters = tiles_x*tiles_y*SLICES;
+
+    // camera space lights and the depth range they cover
+    float dmin = 1e30f, dmax = -1e30f;
+    for (int i=0; i<n; i++) {
+        Vec4f c = V*embed<4>(lights[i].position);
+        float *dst = &block[HEADER_FLOATS + i*LIGHT_FLOATS];
+        for (int k=0; k<3; k++) dst[k] = c[k];
+        dst[3] = lights[i].radius;
+        for (int k=0; k<3; k++) dst[4+k] = lights[i].color[k];
+        dst[7] = 0;
+        dmin = std::min(dmin, -c[2] - lights[i].radius);
+        dmax = std::max(dmax, -c[2] + lights[i].radius);
+    }
+    if (n && dmax>dmin) {
+        // shifted so that the nearest slice is a hundredth of the range, whatever the sign of the depths
+        depth_offset = std::max(0.f, (dmax - dmin)/100 - dmin);
+        depth_scale  = SLICES/std::log((dmax + depth_offset)/(dmin + depth_offset));
+        depth_bias   = -std::log(dmin + depth_offset)*depth_scale;
+    } else {
+        depth_offset = 1;
+        depth_scale = depth_bias = 0;
+    }
+
+    // the clusters every light may touch: the screen rectangle of the corners of its bounding cube
+    extents.resize(n);
+    parallel_for(0, n, 64, [&](int i, int) {
+        const float *c = &block[HEADER_FLOATS + i*LIGHT_FLOATS];
+        float r = c[3];
+        Extent &e = extents[i];
+        e.x0 = e.y0 = 0;
+        e.x1 = tiles_x - 1;
+        e.y1 = tiles_y - 1;
+        float xmin = 1e30f, ymin = 1e30f, xmax = -1e30f, ymax = -1e30f;
+        bool behind = false;
+        for (int j=0; j<8; j++) {
+            Vec4f corner;
+            corner[0] = c[0] + (j&1 ? r : -r);
+            corner[1] = c[1] + (j&2 ? r : -r);
+            corner[2] = c[2] + (j&4 ? r : -r);
+            corner[3] = 1;
+            Vec4f clip = P*corner;
+            if (clip[3]<=1e-6f) {
+                behind = true;  // the cube crosses the plane of the eye, the whole screen
+                break;
+            }
+            float x = (clip[0]/clip[3]*.5f + .5f)*width, y = (clip[1]/clip[3]*.5f + .5f)*height;
+            xmin = std::min(xmin, x);
+            xmax = std::max(xmax, x);
+            ymin = std::min(ymin, y);
+            ymax = std::max(ymax, y);
+        }
+        if (!behind) {
+            e.x0 = std::max(0, (int)std::floor(xmin/TILE));
+            e.y0 = std::max(0, (int)std::floor(ymin/TILE));
+            e.x1 = std::min(tiles_x - 1, (int)std::floor(xmax/TILE));
+            e.y1 = std::min(tiles_y - 1, (int)std::floor(ymax/TILE));
+        }
+        e.z0 = slice(-c[2] - r);
+        e.z1 = slice(-c[2] + r);
+    });
+
+    // count, prefix sum, fill: the slices are independent, the light indices stay sorted in every list
+    int per_slice = tiles_x*tiles_y;
+    data.resize(2*nclusters);
+    parallel_for(0, SLICES, 1, [&](int z, int) {
+        GLuint *counts = &data[2*z*per_slice];
+        for (int c=0; c<per_slice; c++) counts[2*c+1] = 0;
+        for (int i=0; i<n; i++) {
+            const Extent &e = extents[i];
+            if (z<e.z0 || z>e.z1) continue;
+            for (int y=e.y0; y<=e.y1; y++)
+                for (int x=e.x0; x<=e.x1; x++) counts[2*(y*tiles_x + x)+1]++;
+        }
+    });
+    GLuint first = 2*nclusters;
+    for (int c=0; c<nclusters; c++) {
+        data[2*c] = first;
+        first += data[2*c+1];
+    }
+    if (first>data.capacity()) data.reserve(first + first/2);     // room for the lights and the camera to move
+    data.resize(first);
+    parallel_for(0, SLICES, 1, [&](int z, int) {
+        GLuint *ranges = &data[2*z*per_slice];
+        int refs = 0;
+        for (int c=0; c<per_slice; c++) ranges[2*c+1] = 0;
+        for (int i=0; i<n; i++) {
+            const Extent &e = extents[i];
+            if (z<e.z0 || z>e.z1) continue;
+            for (int y=e.y0; y<=e.y1; y++) {
+                for (int x=e.x0; x<=e.x1; x++) {
+                    GLuint *range = &ranges[2*(y*tiles_x + x)];
+                    data[range[0] + range[1]++] = i;
+                    refs++;
+                }
+            }
+        }
+        slice_refs[z] = refs;
+    });
+
+    float header[4] = { depth_offset, depth_scale, depth_bias, 0 };
+    GLint grid[4] = { tiles_x, tiles_y, SLICES, TILE };
+    std::memcpy(&block[0], header, sizeof(header));
+    std::memcpy(&block[4], grid, sizeof(grid));
+    glBindBuffer(GL_UNIFORM_BUFFER, ubo);
+    glBufferData(GL_UNIFORM_BUFFER, block.size()*sizeof(float), NULL, GL_STREAM_DRAW);     // orphan, the block is always bound whole
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, (HEADER_FLOATS + n*LIGHT_FLOATS)*sizeof(float), block.data());
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    glBindBuffer(GL_TEXTURE_BUFFER, lists);
+    glBufferData(GL_TEXTURE_BUFFER, data.size()*sizeof(GLuint), data.data(), GL_STREAM_DRAW);
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+    last.lights = n;
+    last.clusters = nclusters;
+    last.references = 0;
+    for (int z=0; z<SLICES; z++) last.references += slice_refs[z];
+    last.ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+void LightClusters::bind() {
+    glBindBufferBase(GL_UNIFORM_BUFFER, LIGHT_UNIFORMS_BINDING, ubo);
+    glActiveTexture(GL_TEXTURE0 + CLUSTERS_UNIT);
+    glBindTexture(GL_TEXTURE_BUFFER, lists_tex);
+    glActiveTexture(GL_TEXTURE0);
+}
+
+void LightClusters::release() {
+    glDeleteBuffers(1, &ubo);
+    glDeleteBuffers(1, &lists);
+    glDeleteTextures(1, &lists_tex);
+    ubo = lists = lists_tex = 0;
+}
@@ -0,0 +1,57 @@
+#ifndef __CLUSTERED_H__
+#define __CLUSTERED_H__
+
+#include <vector>
+#include <glad/glad.h>
+#include "geometry.h"
+#include "lights.h"
+#include "shader.h"
+
+struct ClusterStats {
+    ClusterStats() : lights(0), clusters(0), references(0), ms(0) {}
+    int lights;         // assigned, at most MAX_LIGHTS
+    int clusters;
+    int references;     // entries of all the light lists, a light counts once per cluster it touches
+    double ms;          // light assignment on the CPU
+};
+
+// Clustered forward shading: the view frustum is cut into froxels, TILE x TILE pixels on the screen
+// and SLICES slices in depth, and every froxel lists the point lights whose sphere may reach it.
+// The slices are spaced logarithmically between the nearest and the farthest light, so they grow
+// with the distance like the tiles do. The lists are rebuilt on the CPU every frame, one slice per
+// task: the screen rectangle and the slice range of every light are computed first, then every
+// slice counts and fills its clusters. The lights go to the PointLights uniform block, the lists
+// to a buffer texture; the CLUSTERED fragment shader loops over the lights of its cluster only.
+class LightClusters {
+public:
+    LightClusters();
+    void init();
+    void release();
+    void setup_program(GLuint prog);    // block binding and sampler unit of a CLUSTERED program
+    bool enabled() const { return ubo!=0; }
+
+    // assign the lights, camera space from V, for a viewport of width x height and upload the lists
+    void update(const std::vector<PointLight> &lights, const Matrix &V, const Matrix &P, int width, int height);
+    void bind();        // the uniform block and the buffer texture for the draws
+    const ClusterStats &stats() const { return last; }
+
+    enum { CLUSTERS_UNIT = 8 };     // texture unit of Clusters
+private:
+    enum { TILE = 64, SLICES = 24 };
+    struct Extent {     // of one light, in clusters, inclusive
+        int x0, y0, x1, y1, z0, z1;
+    };
+    int slice(float depth) const;
+
+    GLuint ubo, lists, lists_tex;
+    int tiles_x, tiles_y;
+    float depth_offset, depth_scale, depth_bias;   // slice = log(depth + offset)*scale + bias
+    std::vector<float> block;           // staging of PointLights
+    std::vector<Extent> extents;
+    std::vector<GLuint> data;           // first and count of every cluster, then the indices
+    std::vector<int> slice_refs;        // entries of every slice
+    ClusterStats last;
+    bool truncated;                     // the warning was printed
+};
+
+#endif //__CLUSTERED_H__
@@ -0,0 +1,223 @@
+#include <cmath>
+#include <map>
+#include <algorithm>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "cpu_occlusion.h"
+#include "parallel.h"
+#include "profiler.h"
+
+OccluderMesh simplify(Model &model, int cells) {
+    Vec3f min, max;
+    model.get_bbox(min, max);
+    float size = std::max(max.x - min.x, std::max(max.y - min.y, max.z - min.z))/std::max(1, cells);
+    size = std::max(size, 1e-20f);
+
+    // one cluster per occupied cell, its vertex is the mean of the vertices that fall in it
+    std::map<long, int> cluster_of_cell;
+    std::vector<int> cluster(model.nverts());
+    std::vector<Vec3f> sums;
+    std::vector<int> counts;
+    for (int i=0; i<model.nverts(); i++) {
+        Vec3f p = model.point(i);
+        long key = 0;
+        for (int k=0; k<3; k++) key = key*(cells + 1) + std::min(cells, (int)((p[k] - min[k])/size));
+        std::map<long, int>::iterator it = cluster_of_cell.find(key);
+        if (it==cluster_of_cell.end()) {
+            it = cluster_of_cell.insert(std::make_pair(key, (int)sums.size())).first;
+            sums.push_back(Vec3f(0, 0, 0));
+            counts.push_back(0);
+        }
+        cluster[i] = it->second;
+        sums[it->second] = sums[it->second] + p;
+        counts[it->second]++;
+    }
+
+    OccluderMesh mesh;
+    for (size_t c=0; c<sums.size(); c++) mesh.verts.push_back(sums[c]*(1.f/counts[c]));
+    std::map<std::pair<int, std::pair<int,int> >, int> seen;   // a triangle survives once, in its first orientation
+    for (int f=0; f<model.nfaces(); f++) {
+        int a = cluster[model.vert(f, 0)], b = cluster[model.vert(f, 1)], c = cluster[model.vert(f, 2)];
+        if (a==b || b==c || c==a) continue;
+        int lo = std::min(a, std::min(b, c)), hi = std::max(a, std::max(b, c));
+        if (!seen.insert(std::make_pair(std::make_pair(lo, std::make_pair(a+b+c-lo-hi, hi)), f)).second) continue;
+        mesh.tris.push_back(Vec3i(a, b, c));
+    }
+    return mesh;
+}
+
+CpuOcclusion::CpuOcclusion(int w, int h) : width((std::max(4, w) + 3)/4*4), height(std::max(1, h)), triangles(0), mesh(), PV(Matrix::identity()), bin_start(), binned() {
+    tiles_x = (width  + TILE_W - 1)/TILE_W;
+    tiles_y = (height + TILE_H - 1)/TILE_H;
+    depth.assign(width*height, 0.f);
+    bin_start.assign(tiles_x*tiles_y + 1, 0);
+}
+
+void CpuOcclusion::set_occluder(const OccluderMesh &m) {
+    mesh = m;
+}
+
+static inline Vec4f transform_point(const Matrix &M, const Vec3f &p) {
+    Vec4f ret;
+    for (int i=0; i<4; i++) ret[i] = M[i][0]*p.x + M[i][1]*p.y + M[i][2]*p.z + M[i][3];
+    return ret;
+}
+
+void CpuOcclusion::setup(const Matrix &MVP, std::vector<Vec4f> &screen, std::vector<Triangle> &out) const {
+    // x, y in pixels, z the depth and w<0 when the vertex is behind the eye or in front of the near plane
+    screen.resize(mesh.verts.size());
+    for (size_t i=0; i<screen.size(); i++) {
+        Vec4f c = transform_point(MVP, mesh.verts[i]);
+        float inv = 1.f/c[3];
+        Vec4f &s = screen[i];
+        s[0] = (c[0]*inv*.5f + .5f)*width;
+        s[1] = (c[1]*inv*.5f + .5f)*height;
+        s[2] = c[2]*inv;
+        s[3] = c[3]>0 && c[2]<=c[3] ? 1.f : -1.f;
+    }
+    for (size_t f=0; f<mesh.tris.size(); f++) {
+        const Vec4f &v0 = screen[mesh.tris[f][0]], &v1 = screen[mesh.tris[f][1]], &v2 = screen[mesh.tris[f][2]];
+        if (v0[3]<0 || v1[3]<0 || v2[3]<0) continue;   // dropping an occluder is always safe
+        Triangle t;
+        float z[3] = { v0[2], v1[2], v2[2] };
+        t.x[0] = v0[0]; t.x[1] = v1[0]; t.x[2] = v2[0];
+        t.y[0] = v0[1]; t.y[1] = v1[1]; t.y[2] = v2[1];
+        float area = (t.x[1]-t.x[0])*(t.y[2]-t.y[0]) - (t.x[2]-t.x[0])*(t.y[1]-t.y[0]);
+        if (area<=0) continue;  // back face or degenerate, the front faces of the closed mesh hide as much
+        t.za = ((z[1]-z[0])*(t.y[2]-t.y[0]) - (z[2]-z[0])*(t.y[1]-t.y[0]))/area;
+        t.zb = ((z[2]-z[0])*(t.x[1]-t.x[0]) - (z[1]-z[0])*(t.x[2]-t.x[0]))/area;
+        t.zc = z[0] - t.za*t.x[0] - t.zb*t.y[0];
+        // pixels whose centers may be inside
+        t.xmin = std::max(0,        (int)std::ceil (std::min(t.x[0], std::min(t.x[1], t.x[2])) - .5f));
+        t.xmax = std::min(width-1,  (int)std::floor(std::max(t.x[0], std::max(t.x[1], t.x[2])) - .5f));
+        t.ymin = std::max(0,        (int)std::ceil (std::min(t.y[0], std::min(t.y[1], t.y[2])) - .5f));
+        t.ymax = std::min(height-1, (int)std::floor(std::max(t.y[0], std::max(t.y[1], t.y[2])) - .5f));
+        if (t.xmin>t.xmax || t.ymin>t.ymax) continue;
+        out.push_back(t);
+    }
+}
+
+void CpuOcclusion::raster(const Triangle &t, int tile) {
+    int tx = tile%tiles_x, ty = tile/tiles_x;
+    int x0 = std::max(tx*TILE_W, t.xmin & ~3);     // 4-pixel groups never cross a tile, TILE_W and width are multiples of 4
+    int x1 = std::min(std::min((tx+1)*TILE_W, width) - 1, t.xmax);
+    int y0 = std::max(ty*TILE_H, t.ymin);
+    int y1 = std::min(std::min((ty+1)*TILE_H, height) - 1, t.ymax);
+
+    // edge i goes from the vertex i+1 to the vertex i+2, positive on the inner side
+    float ea[3], eb[3], ec[3];
+    for (int i=0; i<3; i++) {
+        int j = (i+1)%3, k = (i+2)%3;
+        ea[i] = t.y[j] - t.y[k];
+        eb[i] = t.x[k] - t.x[j];
+        ec[i] = t.x[j]*t.y[k] - t.x[k]*t.y[j];
+    }
+#ifdef __SSE2__
+    const __m128 centers = _mm_setr_ps(.5f, 1.5f, 2.5f, 3.5f);
+    const __m128 zero = _mm_setzero_ps();
+    __m128 a0 = _mm_set1_ps(ea[0]), a1 = _mm_set1_ps(ea[1]), a2 = _mm_set1_ps(ea[2]), za = _mm_set1_ps(t.za);
+    for (int y=y0; y<=y1; y++) {
+        float py = y + .5f;
+        __m128 r0 = _mm_set1_ps(eb[0]*py + ec[0]), r1 = _mm_set1_ps(eb[1]*py + ec[1]), r2 = _mm_set1_ps(eb[2]*py + ec[2]);
+        __m128 rz = _mm_set1_ps(t.zb*py + t.zc);
+        float *row = &depth[y*width];
+        for (int x=x0; x<=x1; x+=4) {
+            __m128 px = _mm_add_ps(_mm_set1_ps((float)x), centers);
+            __m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(a0, px), r0), zero),
+                                                  _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(a1, px), r1), zero)),
+                                       _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(a2, px), r2), zero));
+            __m128 old = _mm_loadu_ps(row + x);
+            __m128 z = _mm_max_ps(old, _mm_add_ps(_mm_mul_ps(za, px), rz));
+            _mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, z), _mm_andnot_ps(inside, old)));
+        }
+    }
+#else
+    for (int y=y0; y<=y1; y++) {
+        float py = y + .5f;
+        float *row = &depth[y*width];
+        for (int x=x0; x<=x1; x++) {
+            float px = x + .5f;
+            bool inside = true;
+            for (int i=0; i<3; i++) inside = inside && ea[i]*px + eb[i]*py + ec[i]>=0;
+            if (inside) row[x] = std::max(row[x], t.za*px + t.zb*py + t.zc);
+        }
+    }
+#endif
+}
+
+void CpuOcclusion::render(const std::vector<Matrix> &occluders, const Matrix &PV_) {
+    PROFILE_ZONE("occluder raster");
+    PV = PV_;
+    worker_triangles.resize(worker_count());
+    worker_screen.resize(worker_count());
+    for (size_t w=0; w<worker_triangles.size(); w++) {
+        worker_triangles[w].clear();
+        worker_triangles[w].reserve(occluders.size()*mesh.tris.size());   // any worker may set up every occluder
+    }
+    parallel_for(0, (int)occluders.size(), 4, [&](int i, int worker) {
+        setup(PV*occluders[i], worker_screen[worker], worker_triangles[worker]);
+    });
+
+    // counting sort of the triangles into the tiles, one array for all the bins
+    triangles = 0;
+    std::fill(bin_start.begin(), bin_start.end(), 0);
+    for (size_t w=0; w<worker_triangles.size(); w++) {
+        triangles += worker_triangles[w].size();
+        for (size_t i=0; i<worker_triangles[w].size(); i++) {
+            const Triangle &t = worker_triangles[w][i];
+            for (int ty=t.ymin/TILE_H; ty<=t.ymax/TILE_H; ty++)
+                for (int tx=t.xmin/TILE_W; tx<=t.xmax/TILE_W; tx++) bin_start[ty*tiles_x + tx + 1]++;
+        }
+    }
+    for (size_t b=1; b<bin_start.size(); b++) bin_start[b] += bin_start[b-1];
+    if ((size_t)bin_start.back()>binned.capacity()) binned.reserve(bin_start.back() + bin_start.back()/2);    // room for the camera moves
+    binned.resize(bin_start.back());
+    for (size_t w=0; w<worker_triangles.size(); w++) {
+        for (size_t i=0; i<worker_triangles[w].size(); i++) {
+            const Triangle &t = worker_triangles[w][i];
+            for (int ty=t.ymin/TILE_H; ty<=t.ymax/TILE_H; ty++)
+                for (int tx=t.xmin/TILE_W; tx<=t.xmax/TILE_W; tx++) binned[bin_start[ty*tiles_x + tx]++] = &t;
+        }
+    }
+    for (size_t b=bin_start.size()-1; b>0; b--) bin_start[b] = bin_start[b-1];    // the fill moved every start to the next one
+    bin_start[0] = 0;
+
+    parallel_for(0, tiles_x*tiles_y, 1, [&](int tile, int) {
+        int tx = tile%tiles_x, ty = tile/tiles_x;
+        int x0 = tx*TILE_W, x1 = std::min((tx+1)*TILE_W, width);
+        for (int y=ty*TILE_H; y<std::min((ty+1)*TILE_H, height); y++) std::fill(&depth[y*width + x0], &depth[y*width + x1], 0.f);
+        for (int i=bin_start[tile]; i<bin_start[tile+1]; i++) raster(*binned[i], tile);
+    });
+}
+
+bool CpuOcclusion::visible(const Matrix &M, const Aabb &box) const {
+    Matrix MVP = PV*M;  // the corners of the oriented box give a tighter rectangle than a world AABB
+    float xmin = 1e30f, ymin = 1e30f, xmax = -1e30f, ymax = -1e30f, nearest = 0;
+    for (int i=0; i<8; i++) {
+        Vec3f corner(i&1 ? box.max.x : box.min.x, i&2 ? box.max.y : box.min.y, i&4 ? box.max.z : box.min.z);
+        Vec4f c = transform_point(MVP, corner);
+        if (c[3]<=0) return true;
+        float x = (c[0]/c[3]*.5f + .5f)*width, y = (c[1]/c[3]*.5f + .5f)*height;
+        xmin = std::min(xmin, x);
+        xmax = std::max(xmax, x);
+        ymin = std::min(ymin, y);
+        ymax = std::max(ymax, y);
+        nearest = std::max(nearest, c[2]/c[3]);
+    }
+    if (nearest>=1) return true;    // crosses the near plane
+    // every pixel the rectangle touches
+    int x0 = std::max(0, (int)std::floor(xmin)), x1 = std::min(width-1,  (int)std::floor(xmax));
+    int y0 = std::max(0, (int)std::floor(ymin)), y1 = std::min(height-1, (int)std::floor(ymax));
+    if (x0>x1 || y0>y1) return true;    // off screen, the frustum test has the last word
+    for (int y=y0; y<=y1; y++) {
+        const float *row = &depth[y*width];
+        int x = x0;
+#ifdef __SSE2__
+        __m128 n = _mm_set1_ps(nearest);
+        for (; x+3<=x1; x+=4) if (_mm_movemask_ps(_mm_cmple_ps(_mm_loadu_ps(row + x), n))) return true;
+#endif
+        for (; x<=x1; x++) if (row[x]<=nearest) return true;
+    }
+    return false;
+}
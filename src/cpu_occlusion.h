@@ -0,0 +1,54 @@
+#ifndef __CPU_OCCLUSION_H__
+#define __CPU_OCCLUSION_H__
+
+#include <vector>
+#include "geometry.h"
+#include "model.h"
+#include "culling.h"
+
+// Coarse stand-in of a model for the occluder rasterization: vertex clustering on a grid of
+// cells along the largest extent of the bounding box, every cluster collapses to the mean of its
+// vertices and the triangles that degenerate are dropped. Averaging pulls the surface inwards,
+// so the simplified mesh hides a little less than the original, not more.
+struct OccluderMesh {
+    std::vector<Vec3f> verts;
+    std::vector<Vec3i> tris;
+};
+
+OccluderMesh simplify(Model &model, int cells);
+
+// Occlusion culling on the CPU, independent of the GPU: the nearest instances are rasterized with
+// a coarse mesh into a low resolution reverse-Z depth buffer (SSE edge functions, 4 pixels per step),
+// then the screen rectangle of every box is compared to it. The screen is split into tiles, the
+// triangles are binned and the tiles rasterized in parallel; the box tests run in parallel as well.
+// The coverage is sampled at the pixel centers and a box covers every pixel its rectangle touches.
+class CpuOcclusion {
+public:
+    CpuOcclusion(int width, int height);
+    void set_occluder(const OccluderMesh &mesh);
+    void render(const std::vector<Matrix> &occluders, const Matrix &PV);   // clear and rasterize
+    bool visible(const Matrix &M, const Aabb &box) const;  // some pixel under the box (in model space, moved by M) is behind it
+
+    int width, height;
+    int triangles;              // rasterized by the last render()
+private:
+    enum { TILE_W = 64, TILE_H = 32 };
+    struct Triangle {
+        float x[3], y[3];       // pixels, counterclockwise
+        float za, zb, zc;       // depth plane: z = za*x + zb*y + zc
+        int xmin, ymin, xmax, ymax;     // pixel bounds, inclusive
+    };
+    void setup(const Matrix &MVP, std::vector<Vec4f> &screen, std::vector<Triangle> &out) const;
+    void raster(const Triangle &t, int tile);
+
+    OccluderMesh mesh;
+    Matrix PV;
+    int tiles_x, tiles_y;
+    std::vector<float> depth;   // rows of width floats, larger is nearer, 0 at infinity
+    std::vector<std::vector<Vec4f> > worker_screen;      // projected vertices, scratch of the setup
+    std::vector<std::vector<Triangle> > worker_triangles;
+    std::vector<int> bin_start;                 // per tile, its triangles in binned, and the end
+    std::vector<const Triangle *> binned;
+};
+
+#endif //__CPU_OCCLUSION_H__
@@ -0,0 +1,219 @@
+#include <cmath>
+#include <algorithm>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "culling.h"
+#include "parallel.h"
+
+Aabb transform_aabb(const Matrix &M, const Aabb &box) {
+    Aabb ret;
+    for (int i=0; i<3; i++) {
+        float c = M[i][3], e = 0;
+        for (int j=0; j<3; j++) {
+            c += M[i][j]*(box.min[j] + box.max[j])*.5f;
+            e += std::abs(M[i][j])*(box.max[j] - box.min[j])*.5f;
+        }
+        ret.min[i] = c - e;
+        ret.max[i] = c + e;
+    }
+    return ret;
+}
+
+Frustum::Frustum(const Matrix &PV) {
+    // Gribb-Hartmann: w+x, w-x, w+y, w-y, w+z, w-z; valid for the reverse-Z projections as well
+    for (int i=0; i<6; i++) {
+        float sign = i%2 ? -1.f : 1.f;
+        const int row = i/2;
+        nx[i] = PV[3][0] + sign*PV[row][0];
+        ny[i] = PV[3][1] + sign*PV[row][1];
+        nz[i] = PV[3][2] + sign*PV[row][2];
+        d[i]  = PV[3][3] + sign*PV[row][3];
+    }
+    for (int i=6; i<8; i++) {   // padding planes that everything is fully inside
+        nx[i] = ny[i] = nz[i] = 0;
+        d[i] = 1;
+    }
+    for (int i=0; i<8; i++) {
+        ax[i] = std::abs(nx[i]);
+        ay[i] = std::abs(ny[i]);
+        az[i] = std::abs(nz[i]);
+    }
+}
+
+int frustum_test(const Frustum &f, const Aabb &box, int mask) {
+    float c[3], e[3];
+    for (int k=0; k<3; k++) {
+        c[k] = (box.min[k] + box.max[k])*.5f;
+        e[k] = (box.max[k] - box.min[k])*.5f;
+    }
+#ifdef __SSE2__
+    int outside = 0, straddle = 0;
+    for (int h=0; h<8; h+=4) {
+        __m128 dist = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(f.nx+h), _mm_set1_ps(c[0])),
+                                            _mm_mul_ps(_mm_loadu_ps(f.ny+h), _mm_set1_ps(c[1]))),
+                                 _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(f.nz+h), _mm_set1_ps(c[2])), _mm_loadu_ps(f.d+h)));
+        __m128 reach = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(f.ax+h), _mm_set1_ps(e[0])),
+                                             _mm_mul_ps(_mm_loadu_ps(f.ay+h), _mm_set1_ps(e[1]))),
+                                  _mm_mul_ps(_mm_loadu_ps(f.az+h), _mm_set1_ps(e[2])));
+        outside  |= _mm_movemask_ps(_mm_cmplt_ps(_mm_add_ps(dist, reach), _mm_setzero_ps())) << h;
+        straddle |= _mm_movemask_ps(_mm_cmplt_ps(_mm_sub_ps(dist, reach), _mm_setzero_ps())) << h;
+    }
+    if (outside & mask) return -1;
+    return straddle & mask;
+#else
+    int straddle = 0;
+    for (int i=0; i<6; i++) {
+        if (!(mask & (1<<i))) continue;
+        float dist  = f.nx[i]*c[0] + f.ny[i]*c[1] + f.nz[i]*c[2] + f.d[i];
+        float reach = f.ax[i]*e[0] + f.ay[i]*e[1] + f.az[i]*e[2];
+        if (dist + reach < 0) return -1;
+        if (dist - reach < 0) straddle |= 1<<i;
+    }
+    return straddle;
+#endif
+}
+
+static Aabb merge(const Aabb &a, const Aabb &b) {
+    Aabb ret;
+    for (int k=0; k<3; k++) {
+        ret.min[k] = std::min(a.min[k], b.min[k]);
+        ret.max[k] = std::max(a.max[k], b.max[k]);
+    }
+    return ret;
+}
+
+void InstanceBvh::build(const std::vector<Aabb> &boxes) {
+    this->boxes = boxes;
+    int n = boxes.size();
+    order.resize(n);
+    leaf_of.assign(n, -1);
+    std::vector<Vec3f> centers(n);
+    for (int i=0; i<n; i++) {
+        order[i] = i;
+        centers[i] = (boxes[i].min + boxes[i].max)*.5f;
+    }
+    tree.clear();
+    if (n) build_node(0, n, -1, centers);
+    dirty.assign(tree.size(), 0);
+    dirty_nodes.clear();
+}
+
+int InstanceBvh::build_node(int first, int count, int parent, std::vector<Vec3f> &centers) {
+    int index = tree.size();
+    tree.push_back(Node());
+    Node node;
+    node.parent = parent;
+    node.left = node.right = -1;
+    node.first = first;
+    node.count = count;
+    node.box = boxes[order[first]];
+    for (int i=first+1; i<first+count; i++) node.box = merge(node.box, boxes[order[i]]);
+
+    if (count<=LEAF_SIZE) {
+        for (int i=first; i<first+count; i++) leaf_of[order[i]] = index;
+    } else {
+        // median split along the largest extent of the centers
+        Vec3f cmin = centers[order[first]], cmax = cmin;
+        for (int i=first+1; i<first+count; i++) {
+            for (int k=0; k<3; k++) {
+                cmin[k] = std::min(cmin[k], centers[order[i]][k]);
+                cmax[k] = std::max(cmax[k], centers[order[i]][k]);
+            }
+        }
+        int axis = 0;
+        for (int k=1; k<3; k++) if (cmax[k]-cmin[k] > cmax[axis]-cmin[axis]) axis = k;
+        int half = count/2;
+        std::nth_element(order.begin()+first, order.begin()+first+half, order.begin()+first+count,
+                         [&](int a, int b) { return centers[a][axis] < centers[b][axis]; });
+        node.left  = build_node(first, half, index, centers);
+        node.right = build_node(first+half, count-half, index, centers);
+    }
+    tree[index] = node;
+    return index;
+}
+
+void InstanceBvh::update(int instance, const Aabb &box) {
+    boxes[instance] = box;
+    for (int node=leaf_of[instance]; node>=0 && !dirty[node]; node=tree[node].parent) {
+        dirty[node] = 1;
+        dirty_nodes.push_back(node);
+    }
+}
+
+void InstanceBvh::refit() {
+    // children have larger indices than their parents: decreasing order refits bottom-up
+    std::sort(dirty_nodes.begin(), dirty_nodes.end(), std::greater<int>());
+    for (size_t i=0; i<dirty_nodes.size(); i++) {
+        Node &node = tree[dirty_nodes[i]];
+        if (node.left<0) {
+            node.box = boxes[order[node.first]];
+            for (int j=node.first+1; j<node.first+node.count; j++) node.box = merge(node.box, boxes[order[j]]);
+        } else {
+            node.box = merge(tree[node.left].box, tree[node.right].box);
+        }
+        dirty[dirty_nodes[i]] = 0;
+    }
+    dirty_nodes.clear();
+}
+
+void InstanceBvh::append_all(int node, std::vector<int> &out) const {
+    const Node &n = tree[node];
+    out.insert(out.end(), order.begin()+n.first, order.begin()+n.first+n.count);
+}
+
+void InstanceBvh::cull_node(int node, int mask, const Frustum &frustum, std::vector<int> &out) const {
+    for (;;) {
+        const Node &n = tree[node];
+        if (mask) mask = frustum_test(frustum, n.box, mask);
+        if (mask<0) return;
+        if (!mask) {            // fully inside, no more tests below
+            append_all(node, out);
+            return;
+        }
+        if (n.left<0) {
+            for (int i=n.first; i<n.first+n.count; i++) {
+                if (frustum_test(frustum, boxes[order[i]], mask)>=0) out.push_back(order[i]);
+            }
+            return;
+        }
+        cull_node(n.left, mask, frustum, out);
+        node = n.right;         // the right child iteratively
+    }
+}
+
+void InstanceBvh::cull(const Frustum &frustum, std::vector<int> &visible) {
+    visible.clear();
+    visible.reserve(boxes.size());
+    if (tree.empty()) return;
+
+    // split the top of the tree until there are enough subtrees to keep the workers busy
+    size_t wanted = 4*worker_count();
+    tasks.clear();
+    tasks.reserve(wanted + 1);
+    tasks.push_back(std::make_pair(0, (int)FRUSTUM_PLANES));
+    for (size_t i=0; i<tasks.size() && tasks.size()<wanted; ) {
+        int node = tasks[i].first;
+        const Node &n = tree[node];
+        int mask = frustum_test(frustum, n.box, tasks[i].second);
+        if (mask<0) {
+            tasks.erase(tasks.begin()+i);
+        } else if (!mask || n.left<0) {
+            tasks[i].second = mask;     // resolved by its task
+            i++;
+        } else {
+            tasks[i] = std::make_pair(n.left, mask);
+            tasks.insert(tasks.begin()+i+1, std::make_pair(n.right, mask));
+        }
+    }
+
+    if (task_visible.size()<tasks.size()) task_visible.resize(tasks.size());
+    parallel_for(0, tasks.size(), 1, [&](int t, int) {
+        task_visible[t].clear();
+        task_visible[t].reserve(tree[tasks[t].first].count);   // the whole subtree at most, no allocation once it fits
+        if (tasks[t].second) cull_node(tasks[t].first, tasks[t].second, frustum, task_visible[t]);
+        else append_all(tasks[t].first, task_visible[t]);
+    });
+    for (size_t t=0; t<tasks.size(); t++) visible.insert(visible.end(), task_visible[t].begin(), task_visible[t].end());
+}
+
@@ -0,0 +1,64 @@
+#ifndef __CULLING_H__
+#define __CULLING_H__
+
+#include <vector>
+#include "geometry.h"
+
+struct Aabb {
+    Vec3f min, max;
+};
+
+Aabb transform_aabb(const Matrix &M, const Aabb &box);     // bounds of the transformed box
+
+// The six clip planes of a P*V matrix (a point p is inside if n.p + d >= 0 for all of them), stored
+// as structure of arrays padded to 8 so that a box is tested against 4 planes per SSE instruction.
+struct Frustum {
+    Frustum(const Matrix &PV);
+    float nx[8], ny[8], nz[8], d[8];
+    float ax[8], ay[8], az[8];      // |n|, the reach of a box extent along the normal
+};
+
+enum { FRUSTUM_PLANES = 0x3F };     // mask of the six real planes
+
+// Tests the box against the planes of the mask: -1 if it is outside one of them, otherwise
+// the mask of the planes it straddles (0 means fully inside, the children need no more tests).
+int frustum_test(const Frustum &frustum, const Aabb &box, int mask);
+
+// Bounding volume hierarchy over the world AABBs of the instances. Built once with median splits,
+// then refit when the transforms change: only the leaves of the updated instances and their
+// ancestors are recomputed. The cull walks the top of the tree on the calling thread and the
+// subtrees it finds in parallel.
+class InstanceBvh {
+public:
+    void build(const std::vector<Aabb> &boxes);
+    void update(int instance, const Aabb &box);     // recorded, applied by the next refit()
+    void refit();
+    void cull(const Frustum &frustum, std::vector<int> &visible);   // indices of the visible instances
+
+    int size() const { return (int)boxes.size(); }
+    int nodes() const { return (int)tree.size(); }
+private:
+    struct Node {
+        Aabb box;
+        int left, right;    // children, -1 for the leaves
+        int first, count;   // leaves: range in order
+        int parent;
+    };
+    enum { LEAF_SIZE = 4 };
+
+    int  build_node(int first, int count, int parent, std::vector<Vec3f> &centers);
+    void cull_node(int node, int mask, const Frustum &frustum, std::vector<int> &out) const;
+    void append_all(int node, std::vector<int> &out) const;
+
+    std::vector<Node> tree;             // parents come before their children
+    std::vector<int> order;             // instances sorted by leaf
+    std::vector<int> leaf_of;           // leaf node of every instance
+    std::vector<Aabb> boxes;            // world AABB of every instance
+    std::vector<char> dirty;
+    std::vector<int> dirty_nodes;
+    std::vector<std::pair<int,int> > tasks;     // subtree roots and their plane masks for the parallel part
+    std::vector<std::vector<int> > task_visible;
+};
+
+#endif //__CULLING_H__
+
@@ -0,0 +1,253 @@
+#include <iostream>
+#include <cmath>
+#include <map>
+#include <algorithm>
+#include "deferred.h"
+#include "profiler.h"
+
+static const char *fullscreen_shader   = "../shaders/fullscreen.glsl";
+static const char *light_volume_shader = "../shaders/light_volume.glsl";
+static const char *deferred_shader     = "../shaders/deferred.glsl";
+
+DeferredShading::DeferredShading() : uniforms(NULL), sun_prog(0), volume_prog(0), gbuffer_fbo(0), albedo(0), normal(0), depth(0),
+    light_fbo(0), light_color(0), light_depth(0), empty_vao(0), sphere_vao(0), light_buffer(0), sphere_indices(0),
+    width(0), height(0), previous_fbo(0), nlights(0) {
+    sphere_buffers[0] = sphere_buffers[1] = 0;
+}
+
+bool DeferredShading::init(ProgramCache &programs, UniformRing &uniforms_, unsigned features) {
+    uniforms = &uniforms_;
+    features &= SHADER_SPECULAR;
+    int sun_build = programs.submit(fullscreen_shader, deferred_shader, features);
+    int volume_build = programs.submit(light_volume_shader, deferred_shader, features | SHADER_LIGHT_VOLUME);
+    sun_prog = programs.get(sun_build);
+    volume_prog = programs.get(volume_build);
+    if (!sun_prog || !volume_prog) {
+        sun_prog = volume_prog = 0;
+        return false;
+    }
+    setup_program(sun_prog);
+    setup_program(volume_prog);
+    glGenVertexArrays(1, &empty_vao);
+    make_sphere();
+    return true;
+}
+
+void DeferredShading::setup_program(GLuint prog) {
+    uniforms->bind_blocks(prog);
+    glUseProgram(prog);
+    glUniform1i(glGetUniformLocation(prog, "GAlbedoSpec"), ALBEDO_UNIT);
+    glUniform1i(glGetUniformLocation(prog, "GNormal"), NORMAL_UNIT);
+    glUniform1i(glGetUniformLocation(prog, "GDepth"), DEPTH_UNIT);
+    glUseProgram(0);
+}
+
+bool DeferredShading::reloaded(const std::vector<std::string> &files, unsigned features, GLuint prog) {
+    if (!enabled() || files.size()!=2 || files[1]!=deferred_shader) return false;
+    bool volume = (features & SHADER_LIGHT_VOLUME)!=0;
+    if (files[0]!=(volume ? light_volume_shader : fullscreen_shader)) return false;
+    (volume ? volume_prog : sun_prog) = prog;
+    setup_program(prog);
+    return true;
+}
+
+// Icosahedron subdivided once, 80 triangles, scaled so that its faces lie outside of the unit sphere
+void DeferredShading::make_sphere() {
+    const float t = (1 + std::sqrt(5.f))/2;
+    std::vector<Vec3f> verts;
+    const float ico[12][3] = { {-1, t, 0}, {1, t, 0}, {-1, -t, 0}, {1, -t, 0}, {0, -1, t}, {0, 1, t},
+                               {0, -1, -t}, {0, 1, -t}, {t, 0, -1}, {t, 0, 1}, {-t, 0, -1}, {-t, 0, 1} };
+    for (int i=0; i<12; i++) verts.push_back(Vec3f(ico[i][0], ico[i][1], ico[i][2]).normalize());
+    const int faces[20][3] = { {0, 11, 5}, {0, 5, 1}, {0, 1, 7}, {0, 7, 10}, {0, 10, 11}, {1, 5, 9}, {5, 11, 4},
+                               {11, 10, 2}, {10, 7, 6}, {7, 1, 8}, {3, 9, 4}, {3, 4, 2}, {3, 2, 6}, {3, 6, 8},
+                               {3, 8, 9}, {4, 9, 5}, {2, 4, 11}, {6, 2, 10}, {8, 6, 7}, {9, 8, 1} };
+    std::map<std::pair<int,int>, int> middle;
+    std::vector<GLuint> indices;
+    for (int f=0; f<20; f++) {
+        int m[3];
+        for (int e=0; e<3; e++) {
+            int a = faces[f][e], b = faces[f][(e+1)%3];
+            std::pair<int,int> key(std::min(a, b), std::max(a, b));
+            std::map<std::pair<int,int>, int>::iterator it = middle.find(key);
+            if (it==middle.end()) {
+                it = middle.insert(std::make_pair(key, (int)verts.size())).first;
+                verts.push_back((verts[a] + verts[b]).normalize());
+            }
+            m[e] = it->second;
+        }
+        const int sub[4][3] = { {faces[f][0], m[0], m[2]}, {faces[f][1], m[1], m[0]}, {faces[f][2], m[2], m[1]}, {m[0], m[1], m[2]} };
+        for (int s=0; s<4; s++)
+            for (int k=0; k<3; k++) indices.push_back(sub[s][k]);
+    }
+    float inner = 1;    // distance of the nearest face plane to the center
+    for (size_t i=0; i<indices.size(); i+=3) {
+        Vec3f a = verts[indices[i]], b = verts[indices[i+1]], c = verts[indices[i+2]];
+        inner = std::min(inner, std::abs(cross(b - a, c - a).normalize()*a));
+    }
+    std::vector<GLfloat> positions;
+    for (size_t i=0; i<verts.size(); i++)
+        for (int k=0; k<3; k++) positions.push_back(verts[i][k]/inner);
+    sphere_indices = (int)indices.size();
+
+    glGenVertexArrays(1, &sphere_vao);
+    glBindVertexArray(sphere_vao);
+    glGenBuffers(2, sphere_buffers);
+    glBindBuffer(GL_ARRAY_BUFFER, sphere_buffers[0]);
+    glBufferData(GL_ARRAY_BUFFER, positions.size()*sizeof(GLfloat), positions.data(), GL_STATIC_DRAW);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, sphere_buffers[1]);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size()*sizeof(GLuint), indices.data(), GL_STATIC_DRAW);
+
+    glGenBuffers(1, &light_buffer);     // PointLight as it is: position, radius, color
+    glBindBuffer(GL_ARRAY_BUFFER, light_buffer);
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, sizeof(PointLight), (void*)0);
+    glVertexAttribDivisor(1, 1);
+    glEnableVertexAttribArray(2);
+    glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(PointLight), (void*)(4*sizeof(GLfloat)));
+    glVertexAttribDivisor(2, 1);
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+static GLuint make_texture(GLint format, GLenum base, GLenum type, int width, int height) {
+    GLuint tex;
+    glGenTextures(1, &tex);
+    glBindTexture(GL_TEXTURE_2D, tex);
+    glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, base, type, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    return tex;
+}
+
+void DeferredShading::resize(int w, int h) {
+    if (w==width && h==height) return;
+    if (gbuffer_fbo) {
+        GLuint textures[3] = { albedo, normal, depth };
+        GLuint renderbuffers[2] = { light_color, light_depth };
+        glDeleteFramebuffers(1, &gbuffer_fbo);
+        glDeleteFramebuffers(1, &light_fbo);
+        glDeleteTextures(3, textures);
+        glDeleteRenderbuffers(2, renderbuffers);
+    }
+    width  = w;
+    height = h;
+
+    albedo = make_texture(GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE, width, height);
+    normal = make_texture(GL_RG16, GL_RG, GL_UNSIGNED_SHORT, width, height);
+    depth  = make_texture(GL_DEPTH_COMPONENT32F, GL_DEPTH_COMPONENT, GL_FLOAT, width, height);
+    glGenFramebuffers(1, &gbuffer_fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, gbuffer_fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, albedo, 0);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, normal, 0);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,  GL_TEXTURE_2D, depth, 0);
+    const GLenum buffers[2] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+    glDrawBuffers(2, buffers);
+    if (GL_FRAMEBUFFER_COMPLETE!=glCheckFramebufferStatus(GL_FRAMEBUFFER)) {
+        std::cerr << "Incomplete G-buffer " << width << "x" << height << std::endl;
+    }
+
+    // the light passes test against a copy of the depth: the G-buffer depth is read as a texture meanwhile
+    glGenRenderbuffers(1, &light_color);
+    glBindRenderbuffer(GL_RENDERBUFFER, light_color);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glGenRenderbuffers(1, &light_depth);
+    glBindRenderbuffer(GL_RENDERBUFFER, light_depth);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT32F, width, height);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+    glGenFramebuffers(1, &light_fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, light_fbo);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, light_color);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,  GL_RENDERBUFFER, light_depth);
+    if (GL_FRAMEBUFFER_COMPLETE!=glCheckFramebufferStatus(GL_FRAMEBUFFER)) {
+        std::cerr << "Incomplete light framebuffer " << width << "x" << height << std::endl;
+    }
+}
+
+void DeferredShading::begin_geometry() {
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &previous_fbo);
+    resize(viewport[2], viewport[3]);
+    glBindFramebuffer(GL_FRAMEBUFFER, gbuffer_fbo);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+}
+
+void DeferredShading::light(const std::vector<PointLight> &lights, const Matrix &P) {
+    PROFILE_ZONE("light passes");
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, gbuffer_fbo);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, light_fbo);
+    glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+    glBindFramebuffer(GL_FRAMEBUFFER, light_fbo);
+    glClear(GL_COLOR_BUFFER_BIT);
+
+    const GLuint textures[3] = { albedo, normal, depth };
+    for (int i=0; i<3; i++) {
+        glActiveTexture(GL_TEXTURE0 + ALBEDO_UNIT + i);
+        glBindTexture(GL_TEXTURE_2D, textures[i]);
+    }
+    glActiveTexture(GL_TEXTURE0);
+    float invp[16];
+    std140_mat4(invp, Matrix(P).invert());
+
+    // ambient and the light of PerFrame on every covered pixel
+    glDisable(GL_DEPTH_TEST);
+    glUseProgram(sun_prog);
+    glUniformMatrix4fv(glGetUniformLocation(sun_prog, "InvP"), 1, GL_FALSE, invp);
+    glBindVertexArray(empty_vao);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+
+    // the back faces of the spheres that are behind the surface, or reversed: the surface is not behind the sphere
+    nlights = (int)lights.size();
+    if (nlights) {
+        glBindBuffer(GL_ARRAY_BUFFER, light_buffer);
+        glBufferData(GL_ARRAY_BUFFER, lights.size()*sizeof(PointLight), lights.data(), GL_STREAM_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        glEnable(GL_DEPTH_TEST);
+        glDepthFunc(GL_LEQUAL);     // reverse-Z: the sphere is farther than the surface
+        glDepthMask(GL_FALSE);
+        glEnable(GL_CULL_FACE);
+        glCullFace(GL_FRONT);       // the back faces are there even when the camera is inside the sphere
+        glEnable(GL_BLEND);
+        glBlendFunc(GL_ONE, GL_ONE);
+        glUseProgram(volume_prog);
+        glUniformMatrix4fv(glGetUniformLocation(volume_prog, "InvP"), 1, GL_FALSE, invp);
+        glBindVertexArray(sphere_vao);
+        glDrawElementsInstanced(GL_TRIANGLES, sphere_indices, GL_UNSIGNED_INT, (void*)0, nlights);
+        glDisable(GL_BLEND);
+        glDisable(GL_CULL_FACE);
+        glCullFace(GL_BACK);
+        glDepthMask(GL_TRUE);
+        glDepthFunc(GL_GREATER);
+    }
+    glEnable(GL_DEPTH_TEST);
+    glBindVertexArray(0);
+
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, light_fbo);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, previous_fbo);
+    glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    glBindFramebuffer(GL_FRAMEBUFFER, previous_fbo);
+}
+
+void DeferredShading::release() {
+    if (gbuffer_fbo) {
+        GLuint textures[3] = { albedo, normal, depth };
+        GLuint renderbuffers[2] = { light_color, light_depth };
+        glDeleteFramebuffers(1, &gbuffer_fbo);
+        glDeleteFramebuffers(1, &light_fbo);
+        glDeleteTextures(3, textures);
+        glDeleteRenderbuffers(2, renderbuffers);
+    }
+    gbuffer_fbo = light_fbo = albedo = normal = depth = light_color = light_depth = 0;
+    width = height = 0;
+    glDeleteBuffers(2, sphere_buffers);
+    glDeleteBuffers(1, &light_buffer);
+    glDeleteVertexArrays(1, &sphere_vao);
+    glDeleteVertexArrays(1, &empty_vao);
+    sphere_buffers[0] = sphere_buffers[1] = light_buffer = sphere_vao = empty_vao = 0;
+    sun_prog = volume_prog = 0;
+}
@@ -0,0 +1,53 @@
+#ifndef __DEFERRED_H__
+#define __DEFERRED_H__
+
+#include <string>
+#include <vector>
+#include <glad/glad.h>
+#include "geometry.h"
+#include "lights.h"
+#include "shader.h"
+#include "uniforms.h"
+
+// Deferred shading for many point lights. The geometry pass writes a compact G-buffer, 12 bytes
+// per pixel:
+//     RGBA8   diffspec of the material (diffuse color, specular exponent)
+//     RG16    camera space normal, octahedral encoding
+//     D32F    the reverse-Z depth, the position is reconstructed from it
+// then the light passes shade from it: a full-screen pass for the ambient term and the light of
+// PerFrame, and one instanced sphere per point light, blended additively. The back faces of the
+// spheres are depth tested against a copy of the depth, so a light only runs on the pixels whose
+// surface is inside or in front of its sphere: the cost follows the lit pixels, not the geometry.
+class DeferredShading {
+public:
+    DeferredShading();
+    bool init(ProgramCache &programs, UniformRing &uniforms, unsigned features);   // SPECULAR of the material, false if a program failed
+    void release();
+    // false if the program is not one of the light passes: its two stages and its features tell, the
+    // visibility resolve and the micro merge share the full-screen vertex stage
+    bool reloaded(const std::vector<std::string> &files, unsigned features, GLuint prog);
+    bool enabled() const { return sun_prog!=0; }
+
+    void begin_geometry();      // bind the G-buffer, sized to the viewport, and clear it
+    void light(const std::vector<PointLight> &lights, const Matrix &P);    // shade into the framebuffer bound before begin_geometry()
+    int lights_drawn() const { return nlights; }
+
+    enum { ALBEDO_UNIT = 5, NORMAL_UNIT = 6, DEPTH_UNIT = 7 };     // texture units of the G-buffer in the light passes
+private:
+    void resize(int width, int height);
+    void setup_program(GLuint prog);
+    void make_sphere();
+
+    UniformRing *uniforms;
+    GLuint sun_prog, volume_prog;       // owned by the program cache
+    GLuint gbuffer_fbo, albedo, normal, depth;
+    GLuint light_fbo, light_color, light_depth;
+    GLuint empty_vao;                   // the full-screen triangle has no attributes
+    GLuint sphere_vao, sphere_buffers[2], light_buffer;
+    int sphere_indices;
+    int width, height;
+    GLint previous_fbo;
+    int nlights;
+};
+
+#endif //__DEFERRED_H__
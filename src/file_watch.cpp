@@ -0,0 +1,64 @@
+#include <iostream>
+#include <algorithm>
+#include "file_watch.h"
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <unistd.h>
+
+FileWatcher::~FileWatcher() {
+    if (fd>=0) close(fd);
+}
+
+bool FileWatcher::watch(const std::string &dir) {
+    if (fd<0) fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd<0) {
+        std::cerr << "inotify is not available" << std::endl;
+        return false;
+    }
+    wd = inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+    if (wd<0) {
+        std::cerr << "Failed to watch " << dir << std::endl;
+        close(fd);
+        fd = -1;
+        return false;
+    }
+    this->dir = dir;
+    std::cerr << "Watching " << dir << " for changes" << std::endl;
+    return true;
+}
+
+std::vector<std::string> FileWatcher::changed() {
+    std::vector<std::string> files;
+    if (fd<0) return files;
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for (;;) {
+        ssize_t len = read(fd, buffer, sizeof(buffer));
+        if (len<=0) break;      // EAGAIN: nothing more to read
+        for (char *ptr=buffer; ptr<buffer+len; ) {
+            const struct inotify_event *event = (const struct inotify_event *)ptr;
+            if (event->len) {
+                std::string file = dir + "/" + event->name;
+                if (std::find(files.begin(), files.end(), file)==files.end()) files.push_back(file);
+            }
+            ptr += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    return files;
+}
+
+#else
+
+FileWatcher::~FileWatcher() {}
+
+bool FileWatcher::watch(const std::string &dir) {
+    std::cerr << "File watching is only implemented on Linux, " << dir << " is not watched" << std::endl;
+    return false;
+}
+
+std::vector<std::string> FileWatcher::changed() {
+    return std::vector<std::string>();
+}
+
+#endif
+
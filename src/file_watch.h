@@ -0,0 +1,24 @@
+#ifndef __FILE_WATCH_H__
+#define __FILE_WATCH_H__
+
+#include <string>
+#include <vector>
+
+// Reports the files of a directory that were written or replaced (editors often save through a
+// rename), without blocking. Linux only (inotify), elsewhere watch() fails and nothing is reported.
+class FileWatcher {
+public:
+    FileWatcher() : fd(-1), wd(-1) {}
+    ~FileWatcher();
+    bool watch(const std::string &dir);
+    bool enabled() const { return fd>=0; }
+    std::vector<std::string> changed();     // dir/name of every file modified since the last call, no duplicates
+private:
+    FileWatcher(const FileWatcher &);
+    FileWatcher &operator=(const FileWatcher &);
+    int fd, wd;
+    std::string dir;
+};
+
+#endif //__FILE_WATCH_H__
+
@@ -0,0 +1,22 @@
+#ifndef __FRAMEBUFFER_H__
+#define __FRAMEBUFFER_H__
+
+#include <glad/glad.h>
+#include "material.h"
+
+// Offscreen render target: RGBA8 color and a 32-bit float depth (reverse-Z needs the precision).
+class Framebuffer {
+public:
+    Framebuffer(int width, int height);
+    void bind();                    // bind for drawing and set the viewport
+    void read(Image &img);          // read the color back, rows bottom-up like every Image
+    void release();
+
+    int width, height;
+private:
+    GLuint fbo;
+    GLuint color, depth;
+};
+
+#endif //__FRAMEBUFFER_H__
+
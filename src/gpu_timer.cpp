@@ -0,0 +1,231 @@
+#include <iostream>
+#include <fstream>
+#include <cstring>
+#include "stats.h"
+#include "gpu_timer.h"
+#include "shader.h"
+
+GpuTimer::GpuTimer() : supported(false), frame_index(0), pool(), pending(MAX_PENDING), first_pending(0), npending(0), current(), names(), windows(), counts(), history() {
+    GLint bits = 0;
+    glGetQueryiv(GL_TIMESTAMP, GL_QUERY_COUNTER_BITS, &bits);
+    supported = bits>0;
+    if (!supported) std::cerr << "GL_TIMESTAMP queries are not supported, GPU timings are disabled" << std::endl;
+    // the frames never allocate: their scopes and every sample kept fit in what is reserved here. The
+    // history is only address space until the samples come, its pages are touched one by one
+    for (int i=0; i<MAX_PENDING; i++) pending[i].scopes.reserve(MAX_SCOPES);
+    current.scopes.reserve(MAX_SCOPES);
+    history.reserve(MAX_SAMPLES);
+    last_report = std::chrono::steady_clock::now();
+}
+
+void GpuTimer::release() {
+    for (size_t i=0; i<pending.size(); i++) {
+        for (size_t j=0; j<pending[i].scopes.size(); j++) {
+            pool.push_back(pending[i].scopes[j].start);
+            pool.push_back(pending[i].scopes[j].stop);
+        }
+        pending[i].scopes.clear();
+    }
+    npending = 0;
+    if (!pool.empty()) glDeleteQueries((GLsizei)pool.size(), pool.data());
+    pool.clear();
+}
+
+GLuint GpuTimer::acquire() {
+    if (pool.empty()) {
+        GLuint q[16];
+        glGenQueries(16, q);
+        pool.insert(pool.end(), q, q+16);
+    }
+    GLuint q = pool.back();
+    pool.pop_back();
+    return q;
+}
+
+int GpuTimer::name_index(const char *name) {
+    for (size_t i=0; i<names.size(); i++) {
+        if (names[i]==name) return (int)i;
+    }
+    names.push_back(name);
+    windows.push_back(std::vector<double>());
+    windows.back().reserve(WINDOW);
+    counts.push_back(0);
+    return (int)names.size()-1;
+}
+
+bool GpuTimer::collect(Frame &frame) {
+    if (frame.last) {
+        GLint available = 0; // the queries complete in order, the last one issued is enough
+        glGetQueryObjectiv(frame.last, GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available) return false;
+    }
+    for (size_t i=0; i<frame.scopes.size(); i++) {
+        Scope &s = frame.scopes[i];
+        GLuint64 t0, t1;
+        glGetQueryObjectui64v(s.start, GL_QUERY_RESULT, &t0);
+        glGetQueryObjectui64v(s.stop,  GL_QUERY_RESULT, &t1);
+        double ms = (t1 - t0)*1e-6;
+
+        std::vector<double> &w = windows[s.name];
+        if (w.size()<WINDOW) w.push_back(ms); else w[counts[s.name]%WINDOW] = ms;
+        counts[s.name]++;
+        if (history.size()<MAX_SAMPLES) {
+            Sample sample = { frame.index, s.name, ms };
+            history.push_back(sample);
+        }
+        pool.push_back(s.start);
+        pool.push_back(s.stop);
+    }
+    frame.scopes.clear();
+    return true;
+}
+
+void GpuTimer::begin_frame() {
+    if (!supported) return;
+    while (npending && collect(pending[first_pending])) {
+        first_pending = (first_pending + 1) % MAX_PENDING;
+        npending--;
+    }
+    if (npending>=MAX_PENDING) { // the GPU is hopelessly late, forget the oldest frame rather than wait
+        Frame &f = pending[first_pending];
+        for (size_t i=0; i<f.scopes.size(); i++) {
+            pool.push_back(f.scopes[i].start);
+            pool.push_back(f.scopes[i].stop);
+        }
+        f.scopes.clear();
+        first_pending = (first_pending + 1) % MAX_PENDING;
+        npending--;
+    }
+    current.index = frame_index++;
+    current.scopes.clear();
+    current.last = 0;
+}
+
+void GpuTimer::end_frame() {
+    if (!supported) return;
+    Frame &f = pending[(first_pending + npending++) % MAX_PENDING];
+    f.index = current.index;
+    f.last = current.last;
+    f.scopes.swap(current.scopes);  // current gets the emptied scopes of a collected frame back
+}
+
+int GpuTimer::begin(const char *name) {
+    if (!supported) return -1;
+    Scope s;
+    s.name  = name_index(name);
+    s.start = acquire();
+    s.stop  = 0;
+    glQueryCounter(s.start, GL_TIMESTAMP);
+    current.last = s.start;
+    current.scopes.push_back(s);
+    return (int)current.scopes.size()-1;
+}
+
+void GpuTimer::end(int scope) {
+    if (scope<0) return;
+    Scope &s = current.scopes[scope];
+    s.stop = acquire();
+    glQueryCounter(s.stop, GL_TIMESTAMP);
+    current.last = s.stop;
+}
+
+void GpuTimer::finish() {
+    if (!supported) return;
+    glFinish();
+    while (npending && collect(pending[first_pending])) {
+        first_pending = (first_pending + 1) % MAX_PENDING;
+        npending--;
+    }
+}
+
+void GpuTimer::report() {
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    if (!supported || std::chrono::duration<double>(now - last_report).count() < 5.) return;
+    last_report = now;
+    for (size_t i=0; i<names.size(); i++) {
+        Summary s = summarize(windows[i]);
+        if (!s.count) continue;
+        std::cerr << "gpu " << names[i] << ": mean " << s.mean << " ms, p50 " << s.p50 << ", p95 " << s.p95 << ", p99 " << s.p99
+                  << " (last " << s.count << " frames)" << std::endl;
+    }
+}
+
+std::vector<double> GpuTimer::samples(const char *name, long first_frame) const {
+    std::vector<double> ret;
+    for (size_t i=0; i<history.size(); i++) {
+        if (history[i].frame>=first_frame && names[history[i].name]==name) ret.push_back(history[i].ms);
+    }
+    return ret;
+}
+
+bool GpuTimer::dump(const std::string &prefix) {
+    std::ofstream csv((prefix + ".csv").c_str());
+    std::ofstream json((prefix + ".json").c_str());
+    if (!csv.is_open() || !json.is_open()) {
+        std::cerr << "Failed to write the GPU timings to " << prefix << ".csv/.json" << std::endl;
+        return false;
+    }
+    csv << "frame,scope,ms" << std::endl;
+    for (size_t i=0; i<history.size(); i++) {
+        csv << history[i].frame << "," << names[history[i].name] << "," << history[i].ms << "\n";
+    }
+
+    json << "{" << std::endl;
+    for (size_t i=0; i<names.size(); i++) {
+        json << "  \"" << names[i] << "\": ";
+        write_json(json, summarize(samples(names[i].c_str())));
+        json << (i+1<names.size() ? "," : "") << std::endl;
+    }
+    json << "}" << std::endl;
+    std::cerr << "GPU timings written to " << prefix << ".csv and " << prefix << ".json" << std::endl;
+    return true;
+}
+
+PassCounter::PassCounter(GLenum target) : target(target), supported(true), next(0), latest(0), have_latest(false) {
+    if (target==GL_FRAGMENT_SHADER_INVOCATIONS) supported = GLAD_GL_VERSION_4_6 || has_gl_extension("GL_ARB_pipeline_statistics_query");
+    for (int i=0; i<NQUERIES; i++) {
+        queries[i] = 0;
+        issued[i] = false;
+    }
+    if (supported) glGenQueries(NQUERIES, queries);
+}
+
+void PassCounter::release() {
+    if (supported) glDeleteQueries(NQUERIES, queries);
+    for (int i=0; i<NQUERIES; i++) {
+        queries[i] = 0;
+        issued[i] = false;
+    }
+}
+
+void PassCounter::begin() {
+    if (!supported) return;
+    double unused;
+    if (issued[next]) last(unused);     // the oldest query, normally done by now
+    if (issued[next]) return;           // the GPU is more than NQUERIES frames behind, skip this frame
+    glBeginQuery(target, queries[next]);
+}
+
+void PassCounter::end() {
+    if (!supported || issued[next]) return;
+    glEndQuery(target);
+    issued[next] = true;
+    next = (next + 1)%NQUERIES;
+}
+
+bool PassCounter::last(double &count) {
+    for (int k=0; k<NQUERIES; k++) {    // oldest first, they complete in order
+        int i = (next + k)%NQUERIES;
+        if (!issued[i]) continue;
+        GLint available = 0;
+        glGetQueryObjectiv(queries[i], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available) break;
+        GLuint64 result = 0;
+        glGetQueryObjectui64v(queries[i], GL_QUERY_RESULT, &result);
+        latest = (double)result;
+        have_latest = true;
+        issued[i] = false;
+    }
+    count = latest;
+    return have_latest;
+}
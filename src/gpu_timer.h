@@ -0,0 +1,87 @@
+#ifndef __GPU_TIMER_H__
+#define __GPU_TIMER_H__
+
+#include <vector>
+#include <string>
+#include <chrono>
+#include <glad/glad.h>
+
+// GPU time of named scopes. Every scope is a pair of GL_TIMESTAMP queries (unlike GL_TIME_ELAPSED
+// they may nest); the results are read back several frames later, only once they are available,
+// so the timer never stalls the pipeline. Queries come from a pool that grows as needed.
+class GpuTimer {
+public:
+    GpuTimer();
+    void release();                         // delete the queries, the context must still be current
+    bool enabled() const { return supported; }
+
+    void begin_frame();                     // collect the finished frames and open a new one
+    void end_frame();
+    int  begin(const char *name);           // returns the scope handle for end()
+    void end(int scope);
+    void finish();                          // wait for the GPU and collect everything, at exit only
+
+    void report();                          // rolling mean and p50/p95/p99 per scope to stderr, every few seconds
+    bool dump(const std::string &prefix);   // all the samples to prefix.csv, the summary to prefix.json
+
+    std::vector<double> samples(const char *name, long first_frame=0) const;  // collected samples of a scope in ms, from first_frame on
+
+private:
+    struct Scope {
+        int name;                           // index in names
+        GLuint start, stop;
+    };
+    struct Frame {
+        long index;
+        std::vector<Scope> scopes;
+        GLuint last;                        // the query issued last, the enclosing scope ends after the nested ones
+    };
+    struct Sample {
+        long frame;
+        int name;
+        double ms;
+    };
+
+    GLuint acquire();
+    int name_index(const char *name);
+    bool collect(Frame &frame);             // false if the results are not available yet
+
+    enum { MAX_PENDING = 16, MAX_SCOPES = 64, WINDOW = 256, MAX_SAMPLES = 1<<20 };
+    bool supported;
+    long frame_index;
+    std::vector<GLuint> pool;               // free queries
+    std::vector<Frame> pending;             // ring of the submitted frames waiting for their results, their scopes are reused
+    int first_pending, npending;
+    Frame current;
+    std::vector<std::string> names;
+    std::vector<std::vector<double> > windows;  // the last WINDOW samples of each scope, ring buffers
+    std::vector<long> counts;                   // number of samples ever collected for each scope
+    std::vector<Sample> history;            // the first MAX_SAMPLES samples, reserved at once
+    std::chrono::steady_clock::time_point last_report;
+};
+
+// A counting query around one pass per frame, GL_SAMPLES_PASSED (fragments that passed the depth
+// test) or GL_FRAGMENT_SHADER_INVOCATIONS (GL_ARB_pipeline_statistics_query, core in 4.6; some drivers
+// count the fragments that an early depth test kills as well). The queries are in a small ring and
+// read back without waiting, like the timestamps.
+class PassCounter {
+public:
+    PassCounter(GLenum target);
+    void release();
+    bool enabled() const { return supported; }
+    void begin();
+    void end();
+    bool last(double &count);           // the most recent result that is available
+private:
+    enum { NQUERIES = 4 };
+    GLenum target;
+    bool supported;
+    GLuint queries[NQUERIES];
+    bool issued[NQUERIES];
+    int next;
+    double latest;
+    bool have_latest;
+};
+
+#endif //__GPU_TIMER_H__
+
@@ -0,0 +1,111 @@
+#include <iostream>
+#include <cstring>
+#include "headless.h"
+
+#ifdef REPDVIS_HAVE_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <glad/glad.h>
+
+static EGLDisplay display = EGL_NO_DISPLAY;
+static EGLContext context = EGL_NO_CONTEXT;
+static EGLSurface surface = EGL_NO_SURFACE;
+
+static bool has_extension(const char *extensions, const char *name) {
+    if (!extensions) return false;
+    size_t len = strlen(name);
+    for (const char *p = strstr(extensions, name); p; p = strstr(p+len, name)) {
+        if ((p==extensions || p[-1]==' ') && (p[len]==' ' || p[len]==0)) return true;
+    }
+    return false;
+}
+
+int setup_headless() {
+    std::cerr << "Starting EGL headless context, OpenGL 3.3" << std::endl;
+    const char *client_extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+    if (has_extension(client_extensions, "EGL_MESA_platform_surfaceless")) {
+        PFNEGLGETPLATFORMDISPLAYEXTPROC eglGetPlatformDisplayEXT = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+        if (eglGetPlatformDisplayEXT) display = eglGetPlatformDisplayEXT(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    }
+    if (EGL_NO_DISPLAY==display) display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+    EGLint major, minor;
+    if (EGL_NO_DISPLAY==display || !eglInitialize(display, &major, &minor)) {
+        std::cerr << "Failed to initialize EGL" << std::endl;
+        return -1;
+    }
+    if (!eglBindAPI(EGL_OPENGL_API)) {
+        std::cerr << "EGL does not support desktop OpenGL" << std::endl;
+        return -1;
+    }
+
+    const EGLint config_attribs[] = {
+        EGL_SURFACE_TYPE,    EGL_PBUFFER_BIT,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8,
+        EGL_NONE
+    };
+    EGLConfig config = 0;
+    EGLint nconfigs = 0;
+    eglChooseConfig(display, config_attribs, &config, 1, &nconfigs);
+
+    const char *extensions = eglQueryString(display, EGL_EXTENSIONS);
+    bool surfaceless = has_extension(extensions, "EGL_KHR_surfaceless_context");
+    bool configless  = has_extension(extensions, "EGL_KHR_no_config_context") || has_extension(extensions, "EGL_MESA_configless_context");
+    if (!nconfigs && !(surfaceless && configless)) {
+        std::cerr << "No suitable EGL config" << std::endl;
+        return -1;
+    }
+
+    const EGLint context_attribs[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 3,
+        EGL_CONTEXT_MINOR_VERSION, 3,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_NONE
+    };
+    context = eglCreateContext(display, nconfigs ? config : (EGLConfig)0, EGL_NO_CONTEXT, context_attribs);
+    if (EGL_NO_CONTEXT==context) {
+        std::cerr << "Failed to create the EGL context" << std::endl;
+        return -1;
+    }
+
+    if (!surfaceless) {
+        const EGLint pbuffer_attribs[] = { EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE };
+        surface = eglCreatePbufferSurface(display, config, pbuffer_attribs);
+    }
+    if (!eglMakeCurrent(display, surface, surface, context)) {
+        std::cerr << "Failed to make the EGL context current" << std::endl;
+        return -1;
+    }
+
+    if (!gladLoadGLLoader((GLADloadproc)eglGetProcAddress)) {
+        std::cerr << "Failed to initialize OpenGL context" << std::endl;
+        return -1;
+    }
+    std::cerr << "EGL " << major << "." << minor << ", " << glGetString(GL_RENDERER) << ", " << glGetString(GL_VERSION) << std::endl;
+    return 0;
+}
+
+void release_headless() {
+    if (EGL_NO_DISPLAY==display) return;
+    eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    if (EGL_NO_SURFACE!=surface) eglDestroySurface(display, surface);
+    if (EGL_NO_CONTEXT!=context) eglDestroyContext(display, context);
+    eglTerminate(display);
+    display = EGL_NO_DISPLAY;
+    context = EGL_NO_CONTEXT;
+    surface = EGL_NO_SURFACE;
+}
+
+#else
+
+int setup_headless() {
+    std::cerr << "This build has no headless support, EGL was not found at configure time" << std::endl;
+    return -1;
+}
+
+void release_headless() {
+}
+
+#endif
+
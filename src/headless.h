@@ -0,0 +1,12 @@
+#ifndef __HEADLESS_H__
+#define __HEADLESS_H__
+
+// OpenGL 3.3 core context without any window system, through EGL. The display is the Mesa
+// surfaceless platform when available (works with llvmpipe on GPU-less nodes), the default
+// display otherwise; the context is made current without a surface if the driver supports
+// EGL_KHR_surfaceless_context, with a 1x1 pbuffer if not. Rendering goes to a Framebuffer.
+int setup_headless();       // 0 on success, like setup_window
+void release_headless();
+
+#endif //__HEADLESS_H__
+
@@ -0,0 +1,14 @@
+#ifndef __LIGHTS_H__
+#define __LIGHTS_H__
+
+#include "geometry.h"
+
+// A point light of the deferred and clustered paths, in world space. The intensity falls to zero at
+// the radius: (1 - d^2/r^2)^2, so the light only touches the pixels within its sphere.
+struct PointLight {
+    Vec3f position;
+    float radius;
+    Vec3f color;        // already scaled by the intensity
+};
+
+#endif //__LIGHTS_H__
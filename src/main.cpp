@@ -1,38 +1,29 @@
 #include <iostream>
 #include <cstring>
-#include <fstream>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
 #include <chrono>
-#include <thread>
+#include <memory>
 
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
-#define STB_IMAGE_IMPLEMENTATION
-#include <stb_image.h>
 
 #include "geometry.h"
 #include "model.h"
+#include "renderer.h"
+#include "framebuffer.h"
+#include "headless.h"
+#include "render_thread.h"
+#include "bench.h"
+#include "scene.h"
+#include "software.h"
+#include "raytracer.h"
+#include "parallel.h"
+#include "profiler.h"
 
 bool animate = true;
-
-GLuint load_texture(const char * imagepath) {
-    printf("Reading image %s\n", imagepath);
-
-    stbi_set_flip_vertically_on_load(1);
-    int width, height, bpp;
-    unsigned char* rgb = stbi_load( imagepath, &width, &height, &bpp, 3 );
-
-    // Create one OpenGL texture
-    GLuint textureID;
-    glGenTextures(1, &textureID);
-    glBindTexture(GL_TEXTURE_2D, textureID);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL,  0);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, rgb);
-    glBindTexture(GL_TEXTURE_2D, 0);
-
-    stbi_image_free(rgb);
-    return textureID;
-}
+bool dirty   = true;    // the scene, the camera or the window changed since the last frame was drawn
 
 void key_callback(GLFWwindow* window, int key, int scancode, int action, int mode) {
     if (GLFW_RELEASE == action) {
@@ -44,72 +35,22 @@ void key_callback(GLFWwindow* window, int key, int scancode, int action, int mod
     }
     if (key == GLFW_KEY_SPACE && action == GLFW_PRESS) {
         animate = !animate;
+        dirty = true;
     }
 }
 
-void read_n_compile_shader(const char *filename, GLuint &hdlr, GLenum shaderType) {
-    std::cerr << "Loading " << filename << "... ";
-    std::ifstream is(filename, std::ios::in|std::ios::binary|std::ios::ate);
-    if (!is.is_open()) {
-        std::cerr << "failed" << std::endl;
-        return;
-    }
-    std::cerr << "ok" << std::endl;
-
-    long size = is.tellg();
-    char *buffer = new char[size+1];
-    is.seekg(0, std::ios::beg);
-    is.read(buffer, size);
-    is.close();
-    buffer[size] = 0;
-
-    std::cerr << "Compiling " << filename << "... ";
-    hdlr = glCreateShader(shaderType);
-    glShaderSource(hdlr, 1, (const GLchar**)&buffer, NULL);
-    glCompileShader(hdlr);
-    GLint success;
-    glGetShaderiv(hdlr, GL_COMPILE_STATUS, &success);
-    std::cerr << (success ? "ok" : "failed") << std::endl;
-
-    GLint log_length;
-    glGetShaderiv(hdlr, GL_INFO_LOG_LENGTH, &log_length);
-    if (log_length>0) {
-        std::vector<char> v(log_length, 0);
-        glGetShaderInfoLog(hdlr, log_length, NULL, v.data());
-        if (strlen(v.data())>0) {
-            std::cerr << v.data() << std::endl;
-        }
-    }
+bool pick_requested = false;    // a click, at the cursor position below, for the render thread
+double pick_x = 0, pick_y = 0;
 
-    delete [] buffer;
+void mouse_button_callback(GLFWwindow* window, int button, int action, int) {
+    if (button==GLFW_MOUSE_BUTTON_LEFT && action==GLFW_PRESS) {
+        glfwGetCursorPos(window, &pick_x, &pick_y);
+        pick_requested = true;
+    }
 }
 
-void set_shaders(GLuint &prog_hdlr, const char *vsfile, const char *fsfile) {
-    GLuint vert_hdlr, frag_hdlr;
-    read_n_compile_shader(vsfile, vert_hdlr, GL_VERTEX_SHADER);
-    read_n_compile_shader(fsfile, frag_hdlr, GL_FRAGMENT_SHADER);
-
-    std::cerr << "Linking shaders... ";
-    prog_hdlr = glCreateProgram();
-    glAttachShader(prog_hdlr, vert_hdlr);
-    glAttachShader(prog_hdlr, frag_hdlr);
-    glDeleteShader(vert_hdlr);
-    glDeleteShader(frag_hdlr);
-    glLinkProgram(prog_hdlr);
-
-    GLint success;
-    glGetProgramiv(prog_hdlr, GL_LINK_STATUS, &success);
-    std::cerr << (success ? "ok" : "failed") << std::endl;
-
-    GLint log_length;
-    glGetProgramiv(prog_hdlr, GL_INFO_LOG_LENGTH, &log_length);
-    if (log_length>0) {
-        std::vector<char> v(log_length);
-        glGetProgramInfoLog(prog_hdlr, log_length, NULL, v.data());
-        if (strlen(v.data())>0) {
-            std::cerr << v.data() << std::endl;
-        }
-    }
+void refresh_callback(GLFWwindow*) {
+    dirty = true;   // the window was exposed, its content must be redrawn
 }
 
 int setup_window(GLFWwindow* &window, const GLuint width, const GLuint height) {
@@ -128,6 +69,8 @@ int setup_window(GLFWwindow* &window, const GLuint width, const GLuint height) {
     }
 
     glfwSetKeyCallback(window, key_callback);
+    glfwSetWindowRefreshCallback(window, refresh_callback);
+    glfwSetMouseButtonCallback(window, mouse_button_callback);
 
     if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress)) {
         std::cerr << "Failed to initialize OpenGL context" << std::endl;
@@ -137,211 +80,488 @@ int setup_window(GLFWwindow* &window, const GLuint width, const GLuint height) {
     return 0;
 }
 
-int main(int argc, char** argv) {
-    std::cout << "Usage: " << argv[0] << " model.obj diffuse.jpg tangentnormals.jpg specular.jpg" << std::endl;
-    std::string file_obj ("../models/diablo3_pose.obj");
-    std::string file_diff("../models/diablo3_pose_diffuse.jpg");
-    std::string file_nm  ("../models/diablo3_pose_nm_tangent.jpg");
-    std::string file_spec("../models/diablo3_pose_spec.jpg");
-    if (5==argc) {
-        file_obj  = std::string(argv[1]);
-        file_diff = std::string(argv[2]);
-        file_nm   = std::string(argv[3]);
-        file_spec = std::string(argv[4]);
+struct Options {
+    Options() : file_obj("../models/diablo3_pose.obj"), file_diff("../models/diablo3_pose_diffuse.jpg"),
+                file_nm("../models/diablo3_pose_nm_tangent.jpg"), file_spec("../models/diablo3_pose_spec.jpg"),
+                width(800), height(800), fps(0), gpu_timings(), trace(), headless(false), frames(1), output("frame.png"),
+                bench(0), bench_output("bench.json"), quantize(false), hot_reload(false), instances(1), occlusion(false), cpu_occlusion(false),
+                depth_prepass(false), deferred(false), clustered(false), visibility(false), micro_raster(0), lights(0), software(false), raytrace(false), ao_samples(8),
+                threads(0), pin(false), scaling(false), cpu_budget_mb(0), gpu_budget_mb(0), pick(false), pick_x(0), pick_y(0) {}
+    std::string file_obj, file_diff, file_nm, file_spec;
+    int width, height;
+    int fps;
+    std::string gpu_timings;
+    std::string trace;
+    bool headless;
+    int frames;
+    std::string output;     // printf pattern with the frame number, e.g. frame%04d.png; without % only the last frame is written
+    int bench;              // number of measured frames, 0 for a normal run
+    std::string bench_output;
+    bool quantize;          // quantized vertex streams and the matching shader variant
+    bool hot_reload;
+    int instances;          // copies of the model on a grid, culled against the camera frustum
+    bool occlusion;         // and against the depth of the previous frame, on the GPU
+    bool cpu_occlusion;     // and against the depth of the nearest instances, rasterized on the CPU
+    bool depth_prepass;
+    bool deferred;
+    bool clustered;
+    bool visibility;
+    float micro_raster;     // widest triangles, in pixels, rasterized by the compute shader into the visibility buffer, 0 for none
+    int lights;             // point lights over the instances, shaded by the deferred or the clustered path
+    bool software;          // CPU rasterizer instead of OpenGL, see --frames and --output
+    bool raytrace;          // CPU ray tracer with shadows and ambient occlusion instead of OpenGL
+    int ao_samples;         // ambient occlusion rays per pixel of the ray tracer
+    int threads;            // of the job system counting the main thread, 0 for the hardware concurrency
+    bool pin;               // one CPU per thread of the job system, NUMA node by node
+    bool scaling;           // time the CPU stages with 1, 2, 4... threads instead of rendering
+    double cpu_budget_mb;   // CPU copies of the uploaded assets kept, the others come back from assetcache/ when needed
+    double gpu_budget_mb;   // reported when exceeded, 0 for no budget
+    bool pick;              // print what is under the pixel pick_x, pick_y after the last headless frame
+    int pick_x, pick_y;
+};
+
+// the enable_* of the options, their variants compile while the renderer uploads the assets
+unsigned render_paths(const Options &opt) {
+    return (opt.clustered ? PATH_CLUSTERED : 0) | (opt.occlusion ? PATH_OCCLUSION : 0) | (opt.depth_prepass ? PATH_DEPTH_PREPASS : 0) |
+           (opt.deferred ? PATH_DEFERRED : 0) | (opt.visibility ? PATH_VISIBILITY : 0) | (opt.micro_raster>0 ? PATH_MICRO_RASTER : 0);
+}
+
+// Unpaced scripted run, window is NULL in the headless mode
+int run_bench(Options &opt, Model &model, Scene &scene, Renderer &renderer, GLFWwindow *window) {
+    Matrix R, tilt;
+    std::vector<Matrix> visible;
+    std::vector<int> ids;
+    double drawn = 0;
+    GpuTimer &gpu_timer = renderer.gpu_timer;
+    Bench bench(opt.bench, std::min(opt.bench, 10));
+    std::cerr << "Benchmark: " << bench.warmup << " warmup and " << bench.frames << " measured frames" << std::endl;
+    for (int frame=0; frame<bench.total_frames(); frame++) {
+        PROFILE_ZONE("frame");
+        bench.frame_start();
+        bench_pose(frame - bench.warmup, bench.frames, R, tilt);
+        scene.pose(R, tilt);
+        CullStats cull = scene.cull(visible, &ids);
+        bench.record("visible_instances", cull.visible);
+        bench.record("culled_instances", cull.culled);
+        bench.record("cull_ms", cull.ms);
+        if (opt.cpu_occlusion) {
+            bench.record("cpu_occluded_instances", cull.occluded);
+            bench.record("cpu_occlusion_ms", cull.occlusion_ms);
+        }
+        OcclusionStats occlusion;
+        if (renderer.occlusion_stats(occlusion)) {  // a few frames late, the GPU writes them
+            bench.record("early_instances", occlusion.early);
+            bench.record("late_instances", occlusion.late);
+            bench.record("occluded_instances", occlusion.candidates - occlusion.early - occlusion.late);
+            if (frame>=bench.warmup) drawn += occlusion.early + occlusion.late;
+        } else if (frame>=bench.warmup) {
+            drawn += cull.visible;
+        }
+        double fragments;   // a few frames late as well
+        if (renderer.fragment_invocations(fragments)) bench.record("fragment_invocations", fragments);
+        if (renderer.samples_passed(fragments)) bench.record("samples_passed", fragments);
+        if (opt.deferred) bench.record("point_lights", (double)scene.lights.size());
+        ClusterStats clusters;
+        if (renderer.cluster_stats(clusters)) {
+            bench.record("point_lights", clusters.lights);
+            bench.record("cluster_light_references", clusters.references);
+            bench.record("cluster_ms", clusters.ms);
+        }
+        MicroStats micro;
+        if (renderer.micro_stats(micro)) {
+            bench.record("micro_triangles", micro.small);
+            bench.record("large_triangles", micro.large);
+        }
+
+        gpu_timer.begin_frame();
+        int frame_scope = gpu_timer.begin("frame");
+        renderer.render(visible, scene.V, scene.P, &ids, &scene.lights);
+        if (window) {
+            PROFILE_ZONE("swap");
+            glfwSwapBuffers(window);
+            glfwPollEvents();
+        } else {
+            glFlush();
+        }
+        gpu_timer.end(frame_scope);
+        gpu_timer.end_frame();
+        bench.frame_end();
     }
-    Model model(file_obj.c_str());
+    gpu_timer.finish();
+    bench.finish();
+    long triangles = (long)(model.nfaces()*drawn/std::max(1, bench.frames));
+    return bench.write_json(opt.bench_output, opt.file_obj, triangles, opt.width, opt.height, gpu_timer) ? 0 : -1;
+}
 
-    const GLuint width = 800, height = 800;
+int run_window(Options &opt, Model &model) {
     GLFWwindow* window;
-    if (setup_window(window, width, height)) {
+    if (setup_window(window, opt.width, opt.height)) {
         glfwTerminate();
         return -1;
     }
 
-    GLuint prog_hdlr;
-    set_shaders(prog_hdlr, "../shaders/vertex.glsl", "../shaders/fragment.glsl");
-
-    Matrix M = Matrix::identity();
-    Matrix V = Matrix::identity();
-    Matrix P = Matrix::identity();
-
-    // Get handles to our uniforms
-    GLuint MatrixID = glGetUniformLocation(prog_hdlr, "MVP");
-    GLuint ViewMatrixID = glGetUniformLocation(prog_hdlr, "V");
-    GLuint ModelMatrixID = glGetUniformLocation(prog_hdlr, "M");
-    GLuint LightID = glGetUniformLocation(prog_hdlr, "LightPosition_worldspace");
-    GLuint Texture0ID  = glGetUniformLocation(prog_hdlr, "diffuse");
-    GLuint Texture1ID  = glGetUniformLocation(prog_hdlr, "tangentnm");
-    GLuint Texture2ID  = glGetUniformLocation(prog_hdlr, "specular");
-
-
-    std::vector<GLfloat> vertices(3*3*model.nfaces(), 0);
-    std::vector<GLfloat>      uvs(2*3*model.nfaces(), 0);
-    std::vector<GLfloat>     normals(3*3*model.nfaces(), 0);
-    std::vector<GLfloat>    tangents(3*3*model.nfaces(), 0);
-    std::vector<GLfloat>  bitangents(3*3*model.nfaces(), 0);
-
-    for (int i=0; i<model.nfaces(); i++) {
-        Vec3f v0 = model.point(model.vert(i, 0));
-        Vec3f v1 = model.point(model.vert(i, 1));
-        Vec3f v2 = model.point(model.vert(i, 2));
-
-        Vec3f v01 = proj<3>(M*(embed<4>(v1 - v0)));
-        Vec3f v02 = proj<3>(M*(embed<4>(v2 - v0)));
-        mat<3, 3, float> A;
-        A[0] = v01;
-        A[1] = v02;
-        A[2] = cross(v01, v02).normalize();
-
-        Vec3f tgt   = A.invert() * Vec3f(model.uv(i, 1).x - model.uv(i, 0).x, model.uv(i, 2).x - model.uv(i, 0).x, 0);
-        Vec3f bitgt = A.invert() * Vec3f(model.uv(i, 1).y - model.uv(i, 0).y, model.uv(i, 2).y - model.uv(i, 0).y, 0);
-        tgt.normalize();
-        bitgt.normalize();
-
-        for (int j=0; j<3; j++) {
-            for (int k=0; k<2; k++)      uvs[(i*3+j)*2 + k] = model.uv    (i, j)[k];
-            for (int k=0; k<3; k++)  normals[(i*3+j)*3 + k] = model.normal(i, j)[k];
-            for (int k=0; k<3; k++) vertices[(i*3+j)*3 + k] = model.point(model.vert(i, j))[k];
-            for (int k=0; k<3; k++)    tangents[(i*3+j)*3 + k] = tgt[k];
-            for (int k=0; k<3; k++)  bitangents[(i*3+j)*3 + k] = bitgt[k];
-        }
+    Scene scene(model, opt.instances, float(opt.width)/opt.height);
+    if (opt.cpu_occlusion) scene.enable_occlusion(model);
+    if (opt.lights) scene.add_lights(opt.lights);
+    Renderer renderer(model, opt.file_diff.c_str(), opt.file_nm.c_str(), opt.file_spec.c_str(), opt.quantize, scene.instances(), opt.hot_reload,
+                      render_paths(opt));
+    glViewport(0, 0, opt.width, opt.height);
+    if (opt.clustered) renderer.enable_clustered();     // first, the other paths build on its variants
+    if (opt.occlusion) renderer.enable_occlusion();
+    if (opt.depth_prepass) renderer.enable_depth_prepass();
+    if (opt.deferred) renderer.enable_deferred();
+    if (opt.visibility) renderer.enable_visibility();
+    if (opt.micro_raster>0) renderer.enable_micro_raster(opt.micro_raster);
+    // everything that reads the CPU copies is uploaded
+    renderer.manage_residency(opt.file_obj.c_str(), (size_t)(opt.cpu_budget_mb*1024*1024), (size_t)(opt.gpu_budget_mb*1024*1024));
+    model.release();
+
+    if (opt.bench) {
+        glfwSwapInterval(0);
+        int ret = run_bench(opt, model, scene, renderer, window);
+        renderer.release();
+        glfwTerminate();
+        return ret;
     }
 
-    // create the VAO that we use when drawing
-    GLuint vao = 0;
-    glGenVertexArrays(1, &vao); // allocate and assign a Vertex Array Object to our handle
-    glBindVertexArray(vao);     // bind our Vertex Array Object as the current used object
-
-    GLuint vertexbuffer = 0;
-    glGenBuffers(1, &vertexbuffer);              // allocate and assign one Vertex Buffer Object to our handle
-    glBindBuffer(GL_ARRAY_BUFFER, vertexbuffer); // bind our VBO as being the active buffer and storing vertex attributes (coordinates)
-    glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat)*vertices.size(), vertices.data(), GL_STATIC_DRAW); // copy the vertex data to our buffer. The buffer contains sizeof(GLfloat) * 3 * nverts bytes
-
-    GLuint uvbuffer;
-    glGenBuffers(1, &uvbuffer);
-    glBindBuffer(GL_ARRAY_BUFFER, uvbuffer);
-    glBufferData(GL_ARRAY_BUFFER, uvs.size()*sizeof(GLfloat), uvs.data(), GL_STATIC_DRAW);
-
-    GLuint normalbuffer;
-    glGenBuffers(1, &normalbuffer);
-    glBindBuffer(GL_ARRAY_BUFFER, normalbuffer);
-    glBufferData(GL_ARRAY_BUFFER, normals.size()*sizeof(GLfloat), normals.data(), GL_STATIC_DRAW);
-
-    GLuint tangentbuffer;
-    glGenBuffers(1, &tangentbuffer);
-    glBindBuffer(GL_ARRAY_BUFFER, tangentbuffer);
-    glBufferData(GL_ARRAY_BUFFER, tangents.size() * sizeof(GLfloat), tangents.data(), GL_STATIC_DRAW);
-
-    GLuint bitangentbuffer;
-    glGenBuffers(1, &bitangentbuffer);
-    glBindBuffer(GL_ARRAY_BUFFER, bitangentbuffer);
-    glBufferData(GL_ARRAY_BUFFER, bitangents.size() * sizeof(GLfloat), bitangents.data(), GL_STATIC_DRAW);
-
-    // Load the textures
-    GLuint tex_diffuse = load_texture(file_diff.c_str());
-    GLuint tex_normals = load_texture(file_nm.c_str());
-    GLuint tex_spec    = load_texture(file_spec.c_str());
-
-    glViewport(0, 0, width, height);
-    glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
-    glEnable(GL_DEPTH_TEST);
-    glClearDepth(0);
-    glDepthFunc(GL_GREATER);   // accept fragment if it is closer to the camera than the former one
-
-    auto start = std::chrono::steady_clock::now();
+    // from here on the context belongs to the render thread, this one only handles the events and the simulation
+    RenderThread render_thread(window, renderer, opt.fps);
+    render_thread.start();
+
+    const double step = 1./std::max(opt.fps, 120);  // simulation period while animating, at least as fast as the frames
+    unsigned long version = 0;
+    std::chrono::steady_clock::time_point last = std::chrono::steady_clock::now(), last_report = last;
+    std::vector<CullStats> cull_history;
+    bool was_animating = false;
     while (!glfwWindowShouldClose(window)) {
-        auto end = std::chrono::steady_clock::now();
-        if (std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() < 20) {
-            std::this_thread::sleep_for(std::chrono::milliseconds(3));
-            continue;
+        if (animate) {
+            glfwWaitEventsTimeout(step);
+        } else {
+            glfwWaitEvents();       // sleep until the next event, the render thread keeps the last frame
+        }
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        float dt = std::chrono::duration<float>(now - last).count();
+        last = now;
+        if (animate) scene.animate(was_animating ? dt : 0.f);  // no jump after a pause
+        was_animating = animate;
+        if (std::chrono::duration<double>(now - last_report).count() >= FrameScheduler::REPORT_INTERVAL) {
+            report_cull(cull_history);
+            last_report = now;
         }
-        start = end;
-
-        Matrix R = Matrix::identity();
-        R[0][0] = R[2][2] = cos(0.01);
-        R[2][0] = sin(0.01);
-        R[0][2] = -sin(0.01);
-        if (animate) M = R*M;
-        glUseProgram(prog_hdlr);
-
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-        float tmp[16] = {0};
-        // Send our transformation to the currently bound shader
-        M.export_row_major(tmp);
-        glUniformMatrix4fv(ModelMatrixID, 1, GL_FALSE, tmp);
-        V.export_row_major(tmp);
-        glUniformMatrix4fv(ViewMatrixID,  1, GL_FALSE, tmp);
-        (P*V*M).export_row_major(tmp);
-        glUniformMatrix4fv(MatrixID,      1, GL_FALSE, tmp);
-        float lightpos[3] = {40, 40, 40};
-        glUniform3fv(LightID, 1, lightpos);
-
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, tex_diffuse);
-        glUniform1i(Texture0ID, 0);
-
-        glActiveTexture(GL_TEXTURE1);
-        glBindTexture(GL_TEXTURE_2D, tex_normals);
-        glUniform1i(Texture1ID, 1);
-
-        glActiveTexture(GL_TEXTURE2);
-        glBindTexture(GL_TEXTURE_2D, tex_spec);
-        glUniform1i(Texture2ID, 2);
-
-        // 1st attribute buffer : vertices
-        glEnableVertexAttribArray(0);
-        glBindBuffer(GL_ARRAY_BUFFER, vertexbuffer);
-        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
-
-        // 2nd attribute buffer : UVs
-        glEnableVertexAttribArray(1);
-        glBindBuffer(GL_ARRAY_BUFFER, uvbuffer);
-        glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, (void*)0);
-
-        // 3rd attribute buffer : normals
-        glEnableVertexAttribArray(2);
-        glBindBuffer(GL_ARRAY_BUFFER, normalbuffer);
-        glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
-
-        // 4th attribute buffer : tangents
-        glEnableVertexAttribArray(3);
-        glBindBuffer(GL_ARRAY_BUFFER, tangentbuffer);
-        glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
-
-        // 5th attribute buffer : bitangents
-        glEnableVertexAttribArray(4);
-        glBindBuffer(GL_ARRAY_BUFFER, bitangentbuffer);
-        glVertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
-
-        // draw the triangles!
-        glDrawArrays(GL_TRIANGLES, 0, vertices.size());
-
-        glDisableVertexAttribArray(0);
-        glDisableVertexAttribArray(1);
-        glDisableVertexAttribArray(2);
-        glDisableVertexAttribArray(3);
-        glDisableVertexAttribArray(4);
-
-        glfwSwapBuffers(window);
-        glfwPollEvents();
+        if (pick_requested) {   // the renderer and its residency belong to the render thread
+            render_thread.pick((float)pick_x, (float)pick_y, opt.width, opt.height);
+            pick_requested = false;
+        }
+        if (!animate && !dirty) continue;
+
+        SceneState &state = render_thread.write_slot();
+        cull_history.push_back(scene.cull(state.instances, &state.ids));
+        state.V = scene.V;
+        state.P = scene.P;
+        state.lights = scene.lights;
+        state.version = ++version;
+        render_thread.publish();
+        dirty = false;
     }
+    render_thread.stop();
 
-    // properly de-allocate all the resources once they have outlived their purpose
-    glUseProgram(0);
-    glDeleteProgram(prog_hdlr); // note that the shader objects are automatically detached and deleted, since they were flagged for deletion by a previous call to glDeleteShader
-    glDisableVertexAttribArray(0);
-    glDeleteBuffers(1, &vertexbuffer);
-    glDeleteBuffers(1, &uvbuffer);
-    glDeleteBuffers(1, &normalbuffer);
-    glDeleteBuffers(1, &tangentbuffer);
-    glDeleteBuffers(1, &bitangentbuffer);
-    glDeleteTextures(1, &tex_diffuse);
-    glDeleteTextures(1, &tex_normals);
-    glDeleteTextures(1, &tex_spec);
-    glDeleteVertexArrays(1, &vao);
-
+    GpuTimer &gpu_timer = renderer.gpu_timer;
+    if (!opt.gpu_timings.empty()) {
+        gpu_timer.finish();
+        gpu_timer.dump(opt.gpu_timings);
+    }
+    renderer.release();
     glfwTerminate();
     return 0;
 }
 
+// Same shaders and draw path as the window, rendered into an offscreen framebuffer
+// and written to the disk instead of being presented.
+int run_headless(Options &opt, Model &model) {
+    if (setup_headless()) {
+        release_headless();
+        return -1;
+    }
+
+    Scene scene(model, opt.instances, float(opt.width)/opt.height);
+    if (opt.cpu_occlusion) scene.enable_occlusion(model);
+    if (opt.lights) scene.add_lights(opt.lights);
+    Renderer renderer(model, opt.file_diff.c_str(), opt.file_nm.c_str(), opt.file_spec.c_str(), opt.quantize, scene.instances(), opt.hot_reload,
+                      render_paths(opt));
+    Framebuffer framebuffer(opt.width, opt.height);
+    framebuffer.bind();
+    if (opt.clustered) renderer.enable_clustered();     // first, the other paths build on its variants
+    if (opt.occlusion) renderer.enable_occlusion();
+    if (opt.depth_prepass) renderer.enable_depth_prepass();
+    if (opt.deferred) renderer.enable_deferred();
+    if (opt.visibility) renderer.enable_visibility();
+    if (opt.micro_raster>0) renderer.enable_micro_raster(opt.micro_raster);
+    // everything that reads the CPU copies is uploaded
+    renderer.manage_residency(opt.file_obj.c_str(), (size_t)(opt.cpu_budget_mb*1024*1024), (size_t)(opt.gpu_budget_mb*1024*1024));
+    model.release();
+
+    if (opt.bench) {
+        int ret = run_bench(opt, model, scene, renderer, NULL);
+        framebuffer.release();
+        renderer.release();
+        release_headless();
+        return ret;
+    }
+
+    GpuTimer &gpu_timer = renderer.gpu_timer;
+    bool every_frame = opt.output.find('%')!=std::string::npos;
+    Image img;
+    std::vector<Matrix> visible;
+    std::vector<int> ids;
+    std::vector<CullStats> cull_history;
+    for (int frame=0; frame<opt.frames; frame++) {
+        PROFILE_ZONE("frame");
+        if (animate && frame>0) scene.animate(1/50.f); // fixed time step, the output does not depend on the speed of the machine
+        cull_history.push_back(scene.cull(visible, &ids));
+
+        gpu_timer.begin_frame();
+        int frame_scope = gpu_timer.begin("frame");
+        renderer.render(visible, scene.V, scene.P, &ids, &scene.lights);
+
+        if (every_frame || frame+1==opt.frames) {
+            PROFILE_ZONE("readback");
+            int readback_scope = gpu_timer.begin("readback");
+            framebuffer.read(img);
+            gpu_timer.end(readback_scope);
+
+            char filename[1024];
+            snprintf(filename, sizeof(filename), opt.output.c_str(), frame);
+            img.save(filename);
+        }
+        gpu_timer.end(frame_scope);
+        gpu_timer.end_frame();
+        gpu_timer.report();
+    }
+    std::cerr << opt.frames << " frame(s) rendered to " << opt.output << std::endl;
+    report_cull(cull_history);
+    if (opt.pick) {
+        Pick hit;
+        Vec3f color;
+        renderer.pick(visible, scene.V, scene.P, opt.pick_x, opt.pick_y, opt.width, opt.height, hit, color);
+        print_pick(opt.pick_x, opt.pick_y, hit, ids, color);
+    }
+
+    if (!opt.gpu_timings.empty()) {
+        gpu_timer.finish();
+        gpu_timer.dump(opt.gpu_timings);
+    }
+    framebuffer.release();
+    renderer.release();
+    release_headless();
+    return 0;
+}
+
+// Headless run without OpenGL: the same scene, the same mesh streams and packed textures,
+// rasterized and shaded by SoftwareRenderer on all the cores
+int run_software(Options &opt, Model &model) {
+    std::unique_ptr<Material> material;    // decoded while the mesh streams are filled
+    Future<void> decoded = async_job([&]() { material.reset(new Material(opt.file_diff.c_str(), opt.file_nm.c_str(), opt.file_spec.c_str())); });
+    Scene scene(model, opt.instances, float(opt.width)/opt.height);
+    Mesh mesh(model);
+    model.release();    // the CPU renderers keep the mesh streams, not the model
+    decoded.get();
+    SoftwareRenderer renderer(mesh, *material, opt.width, opt.height);
+    bool every_frame = opt.output.find('%')!=std::string::npos;
+    Image img;
+    std::vector<Matrix> visible;
+    double triangles = 0, pixels = 0, geometry_ms = 0, raster_ms = 0;
+    for (int frame=0; frame<opt.frames; frame++) {
+        PROFILE_ZONE("frame");
+        if (animate && frame>0) scene.animate(1/50.f);
+        scene.cull(visible);
+        renderer.render(visible, scene.V, scene.P, img);
+        const SoftwareStats &stats = renderer.stats();
+        triangles   += stats.triangles;
+        pixels      += stats.pixels;
+        geometry_ms += stats.geometry_ms;
+        raster_ms   += stats.raster_ms;
+        if (every_frame || frame+1==opt.frames) {
+            char filename[1024];
+            snprintf(filename, sizeof(filename), opt.output.c_str(), frame);
+            img.save(filename);
+        }
+    }
+    double seconds = std::max(1e-9, (geometry_ms + raster_ms)/1000);
+    std::cerr << opt.frames << " frame(s) rendered to " << opt.output << " on the CPU, " << worker_count() << " workers" << std::endl;
+    std::cerr << "    " << (geometry_ms + raster_ms)/std::max(1, opt.frames) << " ms per frame (geometry " << geometry_ms/std::max(1, opt.frames)
+              << " ms, raster and shading " << raster_ms/std::max(1, opt.frames) << " ms)" << std::endl;
+    std::cerr << "    " << triangles/seconds*1e-6 << " Mtri/s, " << pixels/seconds*1e-6 << " Mpix/s" << std::endl;
+    return 0;
+}
+
+// Headless run without OpenGL either, ray traced: the stills with the shadows and the occlusion
+int run_raytrace(Options &opt, Model &model) {
+    std::unique_ptr<Material> material;
+    Future<void> decoded = async_job([&]() { material.reset(new Material(opt.file_diff.c_str(), opt.file_nm.c_str(), opt.file_spec.c_str())); });
+    Scene scene(model, opt.instances, float(opt.width)/opt.height);
+    Mesh mesh(model);
+    model.release();
+    decoded.get();
+    RayTracer tracer(mesh, *material, opt.width, opt.height, opt.ao_samples);
+    std::cerr << "BVH of " << mesh.indices.size()/3 << " triangles built in " << tracer.stats().build_ms << " ms" << std::endl;
+    bool every_frame = opt.output.find('%')!=std::string::npos;
+    Image img;
+    std::vector<Matrix> visible;
+    double primary = 0, secondary = 0, ms = 0;
+    for (int frame=0; frame<opt.frames; frame++) {
+        PROFILE_ZONE("frame");
+        if (animate && frame>0) scene.animate(1/50.f);
+        scene.cull(visible);
+        tracer.render(visible, scene.V, scene.P, img);
+        const RayStats &stats = tracer.stats();
+        primary   += stats.primary;
+        secondary += stats.shadow + stats.ambient;
+        ms        += stats.trace_ms;
+        if (every_frame || frame+1==opt.frames) {
+            char filename[1024];
+            snprintf(filename, sizeof(filename), opt.output.c_str(), frame);
+            img.save(filename);
+        }
+    }
+    double seconds = std::max(1e-9, ms/1000);
+    std::cerr << opt.frames << " frame(s) ray traced to " << opt.output << ", " << worker_count() << " workers, "
+              << ms/std::max(1, opt.frames) << " ms per frame" << std::endl;
+    std::cerr << "    " << (primary + secondary)/seconds*1e-6 << " Mrays/s (primary " << primary/seconds*1e-6
+              << ", shadow and occlusion " << secondary/seconds*1e-6 << ")" << std::endl;
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    std::cout << "Usage: " << argv[0] << " [options] model.obj diffuse.jpg tangentnormals.jpg specular.jpg" << std::endl;
+    std::cout << "    --fps N               pace the frames with a deadline timer instead of vsync" << std::endl;
+    std::cout << "    --gpu-timings prefix  write the GPU timings to prefix.csv and prefix.json on exit" << std::endl;
+    std::cout << "    --trace file.json     record CPU zones and write them as a Chrome trace on exit" << std::endl;
+    std::cout << "    --size WxH            size of the window or of the offscreen framebuffer" << std::endl;
+    std::cout << "    --headless            render through EGL without a window, see --frames and --output" << std::endl;
+    std::cout << "    --frames N            number of frames to render in the headless mode" << std::endl;
+    std::cout << "    --output file         .png or .ppm; a printf pattern like frame%04d.png writes every frame" << std::endl;
+    std::cout << "    --bench N             render N unpaced frames along a scripted path and write the statistics" << std::endl;
+    std::cout << "    --bench-output file   where the benchmark JSON goes, bench.json by default" << std::endl;
+    std::cout << "    --quantize            16-bit positions, 10-bit normals and tangents, 16-bit uvs" << std::endl;
+    std::cout << "    --hot-reload          recompile and swap in the shaders when they are saved" << std::endl;
+    std::cout << "    --instances N         a crowd of N copies of the model seen from a perspective camera" << std::endl;
+    std::cout << "    --occlusion           GPU occlusion culling of the instances against a depth pyramid, OpenGL 4.3" << std::endl;
+    std::cout << "    --cpu-occlusion       occlusion culling of the instances by a software depth rasterizer" << std::endl;
+    std::cout << "    --depth-prepass       draw the depth of the positions first, then shade with GL_EQUAL" << std::endl;
+    std::cout << "    --deferred            G-buffer and light volumes, the shading runs once per lit pixel" << std::endl;
+    std::cout << "    --clustered           forward shading of the point lights listed per froxel, up to 511 lights" << std::endl;
+    std::cout << "    --visibility          rasterize triangle ids, then shade every pixel once in a full-screen pass" << std::endl;
+    std::cout << "    --micro-raster N      with --visibility, the triangles up to N pixels wide by a compute shader (GL 4.3)" << std::endl;
+    std::cout << "    --software            render on the CPU without OpenGL, see --frames and --output" << std::endl;
+    std::cout << "    --raytrace            ray trace on the CPU without OpenGL, with shadows and ambient occlusion" << std::endl;
+    std::cout << "    --ao-samples N        ambient occlusion rays per pixel of --raytrace, 8 by default" << std::endl;
+    std::cout << "    --threads N           threads of the job system (loading, culling, CPU renderers), all the cores by default" << std::endl;
+    std::cout << "    --pin                 pin the threads of the job system to one core each, NUMA node by node (Linux)" << std::endl;
+    std::cout << "    --scaling             time the loading and culling stages with 1, 2, 4... up to --threads threads, see --bench-output" << std::endl;
+    std::cout << "    --lights N            N animated point lights over the instances, drawn by --deferred or --clustered" << std::endl;
+    std::cout << "    --cpu-budget MB       CPU copies of the uploaded mesh and textures to keep, 0 by default: read back from assetcache/" << std::endl;
+    std::cout << "    --gpu-budget MB       report the GPU memory of the assets over MB" << std::endl;
+    std::cout << "    --pick X,Y            print the instance and the texel under the pixel after the last headless frame (click in the window)" << std::endl;
+    Options opt;
+
+    std::vector<std::string> files;
+    for (int i=1; i<argc; i++) {
+        std::string arg(argv[i]);
+        if (arg=="--fps" && i+1<argc) {
+            opt.fps = atoi(argv[++i]);
+        } else if (arg=="--gpu-timings" && i+1<argc) {
+            opt.gpu_timings = argv[++i];
+        } else if (arg=="--trace" && i+1<argc) {
+            opt.trace = argv[++i];
+        } else if (arg=="--size" && i+1<argc) {
+            if (2!=sscanf(argv[++i], "%dx%d", &opt.width, &opt.height)) {
+                std::cerr << "Invalid size " << argv[i] << std::endl;
+                return -1;
+            }
+        } else if (arg=="--headless") {
+            opt.headless = true;
+        } else if (arg=="--frames" && i+1<argc) {
+            opt.frames = atoi(argv[++i]);
+        } else if (arg=="--output" && i+1<argc) {
+            opt.output = argv[++i];
+        } else if (arg=="--bench" && i+1<argc) {
+            opt.bench = atoi(argv[++i]);
+        } else if (arg=="--bench-output" && i+1<argc) {
+            opt.bench_output = argv[++i];
+        } else if (arg=="--quantize") {
+            opt.quantize = true;
+        } else if (arg=="--hot-reload") {
+            opt.hot_reload = true;
+        } else if (arg=="--instances" && i+1<argc) {
+            opt.instances = atoi(argv[++i]);
+        } else if (arg=="--occlusion") {
+            opt.occlusion = true;
+        } else if (arg=="--cpu-occlusion") {
+            opt.cpu_occlusion = true;
+        } else if (arg=="--depth-prepass") {
+            opt.depth_prepass = true;
+        } else if (arg=="--deferred") {
+            opt.deferred = true;
+        } else if (arg=="--clustered") {
+            opt.clustered = true;
+        } else if (arg=="--visibility") {
+            opt.visibility = true;
+        } else if (arg=="--micro-raster" && i+1<argc) {
+            opt.micro_raster = (float)atof(argv[++i]);
+            opt.visibility = true;
+        } else if (arg=="--software") {
+            opt.software = true;
+        } else if (arg=="--raytrace") {
+            opt.raytrace = true;
+        } else if (arg=="--ao-samples" && i+1<argc) {
+            opt.ao_samples = atoi(argv[++i]);
+        } else if (arg=="--threads" && i+1<argc) {
+            opt.threads = atoi(argv[++i]);
+        } else if (arg=="--pin") {
+            opt.pin = true;
+        } else if (arg=="--scaling") {
+            opt.scaling = true;
+        } else if (arg=="--lights" && i+1<argc) {
+            opt.lights = atoi(argv[++i]);
+        } else if (arg=="--cpu-budget" && i+1<argc) {
+            opt.cpu_budget_mb = atof(argv[++i]);
+        } else if (arg=="--gpu-budget" && i+1<argc) {
+            opt.gpu_budget_mb = atof(argv[++i]);
+        } else if (arg=="--pick" && i+1<argc) {
+            if (2!=sscanf(argv[++i], "%d,%d", &opt.pick_x, &opt.pick_y)) {
+                std::cerr << "Invalid pixel " << argv[i] << std::endl;
+                return -1;
+            }
+            opt.pick = true;
+        } else {
+            files.push_back(arg);
+        }
+    }
+    if (4==files.size()) {
+        opt.file_obj  = files[0];
+        opt.file_diff = files[1];
+        opt.file_nm   = files[2];
+        opt.file_spec = files[3];
+    }
+    if (!opt.trace.empty()) {
+        profiler_thread_name("main");
+        profiler_enable(true);
+    }
+
+    if (opt.threads>0 || opt.pin) JobSystem::configure(opt.threads, opt.pin);
+    if (opt.scaling) {
+        int max_threads = opt.threads>0 ? opt.threads : std::max(1u, std::thread::hardware_concurrency());
+        bool ok = scaling_bench(opt.bench_output, opt.file_obj.c_str(), opt.file_diff.c_str(), opt.file_nm.c_str(), opt.file_spec.c_str(),
+                                opt.instances>1 ? opt.instances : 4096, max_threads, opt.pin);
+        if (!opt.trace.empty()) profiler_write_trace(opt.trace.c_str());
+        return ok ? 0 : -1;
+    }
+
+    Model model(opt.file_obj.c_str());
+    int ret = opt.raytrace ? run_raytrace(opt, model) : opt.software ? run_software(opt, model) :
+              opt.headless ? run_headless(opt, model) : run_window(opt, model);
+
+    if (!opt.trace.empty()) profiler_write_trace(opt.trace.c_str());
+    return ret;
+}
+
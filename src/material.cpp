@@ -0,0 +1,169 @@
+#include <iostream>
+#include <cmath>
+#include <algorithm>
+#include <fstream>
+#include <string>
+#define STB_IMAGE_IMPLEMENTATION
+#include <stb_image.h>
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include <stb_image_write.h>
+
+#include "geometry.h"
+#include "material.h"
+#include "shader.h"
+#include "parallel.h"
+#include "profiler.h"
+#include "asset_cache.h"
+
+bool Image::load(const char *filename, int nchannels) {
+    PROFILE_ZONE("decode texture");
+    std::cerr << "Reading image " << filename << std::endl;
+    int bpp;
+    unsigned char *pixels = stbi_load(filename, &width, &height, &bpp, nchannels);
+    if (!pixels) {
+        std::cerr << "Failed to read " << filename << std::endl;
+        width = height = channels = 0;
+        data.clear();
+        return false;
+    }
+    channels = nchannels;
+    data.resize(width*height*channels);
+    size_t row = (size_t)width*channels;   // flipped here: the flag of stb is global, the maps are decoded in parallel
+    for (int y=0; y<height; y++) std::copy(pixels + (height-1-y)*row, pixels + (height-y)*row, data.begin() + y*row);
+    stbi_image_free(pixels);
+    return true;
+}
+
+bool Image::save(const char *filename) {
+    std::string name(filename);
+    bool ok = false;
+    if (name.size()>4 && name.substr(name.size()-4)==".png") {
+        stbi_flip_vertically_on_write(1);
+        ok = stbi_write_png(filename, width, height, channels, data.data(), width*channels);
+    } else if (channels>=3) {
+        std::ofstream out(filename, std::ios::binary);
+        out << "P6\n" << width << " " << height << "\n255\n";
+        for (int y=height-1; y>=0; y--) {  // PPM rows go top-down
+            for (int x=0; x<width; x++) out.write((const char *)texel(x, y), 3);
+        }
+        ok = out.good();
+    }
+    if (!ok) std::cerr << "Failed to write " << filename << std::endl;
+    return ok;
+}
+
+// nearest neighbour lookup, the maps of a material are not required to share the resolution
+static unsigned char *texel_at(Image &img, int x, int y, int width, int height) {
+    return img.texel(x*img.width/width, y*img.height/height);
+}
+
+// The three maps are decoded in parallel, each packed texture once its sources are there
+Material::Material(const char *diffuse, const char *tangentnm, const char *specular) : diffspec(), normals(), tex_diffspec(0), tex_normals(0) {
+    Image diff, nm, spec;
+    TaskGraph graph;
+    int load_diff = graph.add([&]() { diff.load(diffuse, 3); });
+    int load_nm   = graph.add([&]() { nm.load(tangentnm, 3); });
+    int load_spec = graph.add([&]() { spec.load(specular, 1); });
+    int pack_diffspec = graph.add([&]() {
+        if (!diff.width) return;
+        PROFILE_ZONE("pack material");
+        diffspec.width    = diff.width;
+        diffspec.height   = diff.height;
+        diffspec.channels = 4;
+        diffspec.data.resize(diffspec.width*diffspec.height*4);
+        parallel_for(0, diffspec.height, 16, [&](int y, int) {
+            for (int x=0; x<diffspec.width; x++) {
+                unsigned char *dst = diffspec.texel(x, y);
+                for (int k=0; k<3; k++) dst[k] = diff.texel(x, y)[k];
+                dst[3] = spec.width ? texel_at(spec, x, y, diffspec.width, diffspec.height)[0] : 0;
+            }
+        });
+    });
+    int pack_normals = graph.add([&]() {
+        if (!nm.width) return;
+        PROFILE_ZONE("pack material");
+        normals.width    = nm.width;
+        normals.height   = nm.height;
+        normals.channels = 2;
+        normals.data.resize(normals.width*normals.height*2);
+        parallel_for(0, normals.height, 16, [&](int y, int) {
+            for (int x=0; x<normals.width; x++) {
+                unsigned char *src = nm.texel(x, y);
+                Vec3f n(src[0]/127.5f - 1.f, src[1]/127.5f - 1.f, src[2]/127.5f - 1.f);
+                if (n.z<0) n.z = 0;          // tangent space normals point outwards, z>=0 is what the shader reconstructs
+                if (n.norm()>0) n.normalize();
+                unsigned char *dst = normals.texel(x, y);
+                for (int k=0; k<2; k++) dst[k] = (unsigned char)std::min(255.f, std::max(0.f, std::floor((n[k] + 1.f)*127.5f + .5f)));
+            }
+        });
+    });
+    graph.precede(load_diff, pack_diffspec);
+    graph.precede(load_spec, pack_diffspec);
+    graph.precede(load_nm, pack_normals);
+    graph.run();
+    has_normals  = nm.width>0;
+    has_specular = spec.width>0;
+}
+
+unsigned Material::shader_features(const char *tangentnm, const char *specular) {
+    int w, h, n;
+    return (stbi_info(tangentnm, &w, &h, &n) ? SHADER_NORMAL_MAP : 0) | (stbi_info(specular, &w, &h, &n) ? SHADER_SPECULAR : 0);
+}
+
+unsigned Material::shader_features() const {
+    return (has_normals ? SHADER_NORMAL_MAP : 0) | (has_specular ? SHADER_SPECULAR : 0);
+}
+
+static GLuint create_texture(const Image &img, GLint internalformat, GLenum format) {
+    GLuint textureID;
+    glGenTextures(1, &textureID);
+    glBindTexture(GL_TEXTURE_2D, textureID);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL,  0);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1); // RG8 rows are not necessarily 4-byte aligned
+    glTexImage2D(GL_TEXTURE_2D, 0, internalformat, img.width, img.height, 0, format, GL_UNSIGNED_BYTE, img.data.empty() ? NULL : img.data.data());
+    glBindTexture(GL_TEXTURE_2D, 0);
+    return textureID;
+}
+
+void Material::upload() {
+    PROFILE_ZONE("upload textures");
+    tex_diffspec = create_texture(diffspec, GL_RGBA8, GL_RGBA);
+    tex_normals  = create_texture(normals,  GL_RG8,   GL_RG);
+}
+
+void Material::bind() {
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, tex_diffspec);
+    if (has_normals) {      // the variant without normal mapping does not sample the unit 1
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_2D, tex_normals);
+    }
+}
+
+void Material::release() {
+    glDeleteTextures(1, &tex_diffspec);
+    glDeleteTextures(1, &tex_normals);
+    tex_diffspec = tex_normals = 0;
+}
+
+void Material::release_images() {
+    std::vector<unsigned char>().swap(diffspec.data);
+    std::vector<unsigned char>().swap(normals.data);
+}
+
+size_t Material::image_bytes() const {
+    return (size_t)diffspec.width*diffspec.height*diffspec.channels + (size_t)normals.width*normals.height*normals.channels;
+}
+
+bool Material::save_images(const std::string &file) const {
+    return write_cache_file(file, [this](std::ostream &out) { return write_array(out, diffspec.data) && write_array(out, normals.data); });
+}
+
+bool Material::load_images(const std::string &file) {
+    std::ifstream in(file.c_str(), std::ios::in|std::ios::binary);
+    bool ok = in && read_array(in, diffspec.data, (size_t)diffspec.width*diffspec.height*diffspec.channels)
+                 && read_array(in, normals.data, (size_t)normals.width*normals.height*normals.channels);
+    if (!ok) release_images();
+    return ok;
+}
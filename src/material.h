@@ -0,0 +1,45 @@
+#ifndef __MATERIAL_H__
+#define __MATERIAL_H__
+
+#include <vector>
+#include <string>
+#include <glad/glad.h>
+
+struct Image {
+    Image() : width(0), height(0), channels(0), data() {}
+    bool load(const char *filename, int nchannels);    // decode the file, rows are flipped to match OpenGL
+    bool save(const char *filename);                    // PNG if the name ends with .png, binary PPM otherwise
+    unsigned char *texel(int x, int y) { return data.data() + (y*width + x)*channels; }
+
+    int width, height, channels;
+    std::vector<unsigned char> data;
+};
+
+// The three source maps are packed into two textures:
+//     diffspec : RGB diffuse color, A specular exponent
+//     normals  : RG xy of the tangent space normal, z is reconstructed in the fragment shader
+class Material {
+public:
+    Material(const char *diffuse, const char *tangentnm, const char *specular);
+    static unsigned shader_features(const char *tangentnm, const char *specular);   // from the file headers, before decoding
+    unsigned shader_features() const;   // the cheapest shader variant for the maps that were actually loaded
+    void upload();      // create the OpenGL textures from the packed images
+    void bind();        // bind diffspec to the texture unit 0 and normals to the unit 1
+    void release();     // delete the OpenGL textures
+
+    // the CPU copies of the packed images once uploaded; their sizes stay, a cache file brings them back
+    void release_images();
+    bool save_images(const std::string &file) const;
+    bool load_images(const std::string &file);
+    size_t image_bytes() const;
+    size_t gpu_bytes() const { return tex_diffspec ? image_bytes() : 0; }
+
+    Image diffspec;
+    Image normals;
+    bool has_normals, has_specular;
+    GLuint tex_diffspec;
+    GLuint tex_normals;
+};
+
+#endif //__MATERIAL_H__
+
@@ -0,0 +1,248 @@
+#include <cmath>
+#include <algorithm>
+#include <fstream>
+#include "mesh.h"
+#include "asset_cache.h"
+#include "parallel.h"
+#include "profiler.h"
+
+Mesh::Mesh(Model &model) : staging(), vertices(staging), uvs(staging), normals(staging), tangents(staging), bitangents(staging),
+                           positions(staging), indices(staging), ncorners(3*model.nfaces()), nindices(3*model.nfaces()),
+                           npositions(model.nverts()), uploaded(0), vao(0), depth_vao(0), quantized(false) {
+    PROFILE_ZONE("tangent loop");
+    vertices.resize(3*ncorners);
+    uvs.resize(2*ncorners);
+    normals.resize(3*ncorners);
+    tangents.resize(3*ncorners);
+    bitangents.resize(3*ncorners);
+    positions.resize(3*npositions);
+    indices.resize(nindices);
+    for (int i=0; i<5; i++) buffers[i] = 0;
+    depth_buffers[0] = depth_buffers[1] = 0;
+    for (int i=0; i<model.nverts(); i++)
+        for (int k=0; k<3; k++) positions[i*3 + k] = model.point(i)[k];
+    parallel_for(0, model.nfaces(), 1024, [&](int i, int) {   // every triangle writes its own corners
+        Vec3f v0 = model.point(model.vert(i, 0));
+        Vec3f v1 = model.point(model.vert(i, 1));
+        Vec3f v2 = model.point(model.vert(i, 2));
+
+        Vec3f v01 = v1 - v0;    // tangents are computed in model space, the vertex shader moves them with MV
+        Vec3f v02 = v2 - v0;
+        mat<3, 3, float> A;
+        A[0] = v01;
+        A[1] = v02;
+        A[2] = cross(v01, v02).normalize();
+
+        Vec3f tgt   = A.invert() * Vec3f(model.uv(i, 1).x - model.uv(i, 0).x, model.uv(i, 2).x - model.uv(i, 0).x, 0);
+        Vec3f bitgt = A.invert() * Vec3f(model.uv(i, 1).y - model.uv(i, 0).y, model.uv(i, 2).y - model.uv(i, 0).y, 0);
+        tgt.normalize();
+        bitgt.normalize();
+
+        for (int j=0; j<3; j++) {
+            for (int k=0; k<2; k++)      uvs[(i*3+j)*2 + k] = model.uv    (i, j)[k];
+            for (int k=0; k<3; k++)  normals[(i*3+j)*3 + k] = model.normal(i, j)[k];
+            for (int k=0; k<3; k++) vertices[(i*3+j)*3 + k] = model.point(model.vert(i, j))[k];
+            indices[i*3+j] = model.vert(i, j);
+            for (int k=0; k<3; k++)    tangents[(i*3+j)*3 + k] = tgt[k];
+            for (int k=0; k<3; k++)  bitangents[(i*3+j)*3 + k] = bitgt[k];
+        }
+    });
+}
+
+static GLshort quantize_snorm16(float v) {
+    return (GLshort)std::floor(std::min(1.f, std::max(-1.f, v))*32767.f + .5f);
+}
+
+static GLuint pack_snorm_2_10_10_10(const GLfloat *v) {
+    GLuint packed = 0;
+    for (int k=0; k<3; k++) {
+        int q = (int)std::floor(std::min(1.f, std::max(-1.f, v[k]))*511.f + .5f);
+        packed |= (GLuint)(q & 0x3FF) << (10*k);
+    }
+    return packed;
+}
+
+void Mesh::upload(bool quantized_) {
+    quantized = quantized_;
+    // create the VAO that we use when drawing, the attribute layout is recorded once
+    glGenVertexArrays(1, &vao); // allocate and assign a Vertex Array Object to our handle
+    glBindVertexArray(vao);     // bind our Vertex Array Object as the current used object
+    glGenBuffers(5, buffers);
+
+    const Stream *streams[5] = { &vertices, &uvs, &normals, &tangents, &bitangents };
+    const GLint sizes[5] = { 3, 2, 3, 3, 3 };
+    if (!quantized) {
+        for (int i=0; i<5; i++) {
+            glBindBuffer(GL_ARRAY_BUFFER, buffers[i]);
+            glBufferData(GL_ARRAY_BUFFER, streams[i]->size()*sizeof(GLfloat), streams[i]->data(), GL_STATIC_DRAW);
+            uploaded += streams[i]->size()*sizeof(GLfloat);
+            glEnableVertexAttribArray(i);
+            glVertexAttribPointer(i, sizes[i], GL_FLOAT, GL_FALSE, 0, (void*)0);
+        }
+        quant_scale  = Vec3f(1, 1, 1);
+        quant_offset = Vec3f(0, 0, 0);
+    } else {
+        PROFILE_ZONE("quantize mesh");
+        int n = nverts();
+        Vec3f min(vertices[0], vertices[1], vertices[2]), max = min;
+        for (int i=0; i<n; i++) {
+            for (int k=0; k<3; k++) {
+                min[k] = std::min(min[k], vertices[i*3+k]);
+                max[k] = std::max(max[k], vertices[i*3+k]);
+            }
+        }
+        for (int k=0; k<3; k++) {
+            quant_offset[k] = (min[k] + max[k])/2;
+            quant_scale[k]  = std::max((max[k] - min[k])/2, 1e-20f);
+        }
+
+        // the packed copies are staging as well
+        std::vector<GLshort, ArenaAllocator<GLshort> > positions(n*4, 0, staging);     // padded to 8 bytes per vertex
+        for (int i=0; i<n; i++)
+            for (int k=0; k<3; k++) positions[i*4+k] = quantize_snorm16((vertices[i*3+k] - quant_offset[k])/quant_scale[k]);
+        glBindBuffer(GL_ARRAY_BUFFER, buffers[0]);
+        glBufferData(GL_ARRAY_BUFFER, positions.size()*sizeof(GLshort), positions.data(), GL_STATIC_DRAW);
+        uploaded += positions.size()*sizeof(GLshort);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 3, GL_SHORT, GL_TRUE, 4*sizeof(GLshort), (void*)0);
+
+        bool unit_uvs = true;
+        for (size_t i=0; i<uvs.size(); i++) unit_uvs = unit_uvs && uvs[i]>=0 && uvs[i]<=1;
+        glBindBuffer(GL_ARRAY_BUFFER, buffers[1]);
+        glEnableVertexAttribArray(1);
+        if (unit_uvs) {
+            std::vector<GLushort, ArenaAllocator<GLushort> > quv(uvs.size(), 0, staging);
+            for (size_t i=0; i<uvs.size(); i++) quv[i] = (GLushort)std::floor(uvs[i]*65535.f + .5f);
+            glBufferData(GL_ARRAY_BUFFER, quv.size()*sizeof(GLushort), quv.data(), GL_STATIC_DRAW);
+            uploaded += quv.size()*sizeof(GLushort);
+            glVertexAttribPointer(1, 2, GL_UNSIGNED_SHORT, GL_TRUE, 0, (void*)0);
+        } else {    // wrapping uvs keep their floats
+            glBufferData(GL_ARRAY_BUFFER, uvs.size()*sizeof(GLfloat), uvs.data(), GL_STATIC_DRAW);
+            uploaded += uvs.size()*sizeof(GLfloat);
+            glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, (void*)0);
+        }
+
+        std::vector<GLuint, ArenaAllocator<GLuint> > packed(n, 0, staging);
+        for (int i=2; i<5; i++) {
+            for (int j=0; j<n; j++) packed[j] = pack_snorm_2_10_10_10(streams[i]->data() + j*3);
+            glBindBuffer(GL_ARRAY_BUFFER, buffers[i]);
+            glBufferData(GL_ARRAY_BUFFER, packed.size()*sizeof(GLuint), packed.data(), GL_STATIC_DRAW);
+            uploaded += packed.size()*sizeof(GLuint);
+            glEnableVertexAttribArray(i);
+            glVertexAttribPointer(i, 4, GL_INT_2_10_10_10_REV, GL_TRUE, 0, (void*)0);
+        }
+    }
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+Vec3f Mesh::vertex(int i) const {
+    Vec3f p(vertices[i*3], vertices[i*3+1], vertices[i*3+2]);
+    if (!quantized) return p;
+    for (int k=0; k<3; k++) p[k] = std::max(-1.f, quantize_snorm16((p[k] - quant_offset[k])/quant_scale[k])/32767.f)*quant_scale[k] + quant_offset[k];
+    return p;
+}
+
+void Mesh::upload_depth_stream() {
+    glGenVertexArrays(1, &depth_vao);
+    glBindVertexArray(depth_vao);
+    glGenBuffers(2, depth_buffers);
+    glBindBuffer(GL_ARRAY_BUFFER, depth_buffers[0]);
+    glEnableVertexAttribArray(0);
+    if (!quantized) {
+        glBufferData(GL_ARRAY_BUFFER, positions.size()*sizeof(GLfloat), positions.data(), GL_STATIC_DRAW);
+        uploaded += positions.size()*sizeof(GLfloat);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
+    } else {    // the bounding box of upload(), the shorts are the same as in the main stream
+        int n = (int)positions.size()/3;
+        std::vector<GLshort, ArenaAllocator<GLshort> > packed(n*4, 0, staging);
+        for (int i=0; i<n; i++)
+            for (int k=0; k<3; k++) packed[i*4+k] = quantize_snorm16((positions[i*3+k] - quant_offset[k])/quant_scale[k]);
+        glBufferData(GL_ARRAY_BUFFER, packed.size()*sizeof(GLshort), packed.data(), GL_STATIC_DRAW);
+        uploaded += packed.size()*sizeof(GLshort);
+        glVertexAttribPointer(0, 3, GL_SHORT, GL_TRUE, 4*sizeof(GLshort), (void*)0);
+    }
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, depth_buffers[1]);   // recorded in the VAO
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size()*sizeof(GLuint), indices.data(), GL_STATIC_DRAW);
+    uploaded += indices.size()*sizeof(GLuint);
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+void Mesh::draw(int instances) {
+    glBindVertexArray(vao);
+    if (instances>1) glDrawArraysInstanced(GL_TRIANGLES, 0, nverts(), instances);
+    else             glDrawArrays(GL_TRIANGLES, 0, nverts());
+    glBindVertexArray(0);
+}
+
+void Mesh::draw_depth(int instances) {
+    glBindVertexArray(depth_vao);
+    if (instances>1) glDrawElementsInstanced(GL_TRIANGLES, (GLsizei)nindices, GL_UNSIGNED_INT, (void*)0, instances);
+    else             glDrawElements(GL_TRIANGLES, (GLsizei)nindices, GL_UNSIGNED_INT, (void*)0);
+    glBindVertexArray(0);
+}
+
+void Mesh::set_instance_list(GLuint buffer) {
+    glBindVertexArray(vao);
+    glBindBuffer(GL_ARRAY_BUFFER, buffer);
+    glEnableVertexAttribArray(5);
+    glVertexAttribIPointer(5, 1, GL_UNSIGNED_INT, 0, (void*)0);
+    glVertexAttribDivisor(5, 1);   // the base instance of the command selects where the list starts
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void Mesh::draw_indirect(GLintptr command) {
+    glBindVertexArray(vao);
+    glDrawArraysIndirect(GL_TRIANGLES, (const void*)command);
+    glBindVertexArray(0);
+}
+
+void Mesh::release_streams() {
+    Stream *streams[6] = { &vertices, &uvs, &normals, &tangents, &bitangents, &positions };
+    for (int i=0; i<6; i++) {
+        streams[i]->clear();
+        streams[i]->shrink_to_fit();    // no allocation, the arena frees the storage
+    }
+    indices.clear();
+    indices.shrink_to_fit();
+    staging.release();
+}
+
+size_t Mesh::stream_bytes() const {
+    return (size_t)ncorners*(3+2+3+3+3)*sizeof(GLfloat) + (size_t)npositions*3*sizeof(GLfloat) + (size_t)nindices*sizeof(GLuint);
+}
+
+// the seven streams in their order, their counts tell a stale file
+bool Mesh::save_streams(const std::string &file) const {
+    return write_cache_file(file, [this](std::ostream &out) {
+        return write_array(out, vertices) && write_array(out, uvs) && write_array(out, normals) && write_array(out, tangents)
+            && write_array(out, bitangents) && write_array(out, positions) && write_array(out, indices);
+    });
+}
+
+bool Mesh::load_streams(const std::string &file) {
+    std::ifstream in(file.c_str(), std::ios::in|std::ios::binary);
+    bool ok = in && read_array(in, vertices, 3*ncorners) && read_array(in, uvs, 2*ncorners) && read_array(in, normals, 3*ncorners)
+           && read_array(in, tangents, 3*ncorners) && read_array(in, bitangents, 3*ncorners)
+           && read_array(in, positions, 3*npositions) && read_array(in, indices, nindices);
+    if (!ok) release_streams();
+    return ok;
+}
+
+void Mesh::release() {
+    glDeleteBuffers(5, buffers);
+    glDeleteVertexArrays(1, &vao);
+    vao = 0;
+    uploaded = 0;
+    for (int i=0; i<5; i++) buffers[i] = 0;
+    if (depth_vao) {
+        glDeleteBuffers(2, depth_buffers);
+        glDeleteVertexArrays(1, &depth_vao);
+        depth_vao = 0;
+        depth_buffers[0] = depth_buffers[1] = 0;
+    }
+}
+
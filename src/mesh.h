@@ -0,0 +1,63 @@
+#ifndef __MESH_H__
+#define __MESH_H__
+
+#include <vector>
+#include <string>
+#include <glad/glad.h>
+#include "model.h"
+#include "arena.h"
+
+// Vertex streams of a Model, one vertex per triangle corner:
+//     location 0: position, 1: uv, 2: normal, 3: tangent, 4: bitangent
+//     location 5: per-instance index for the GPU driven draws, see set_instance_list()
+// Quantized upload: positions as normalized shorts in the bounding box (the QUANTIZED shader variant
+// scales them back with quant_scale and quant_offset), directions as normalized 2_10_10_10 and uvs
+// as normalized unsigned shorts when they lie in [0,1]; 8+4+4+4+4 bytes per vertex instead of 56.
+// The depth pre-pass reads a stream of its own: the shared positions of the model, indexed, in the
+// same format as location 0 so both passes compute bit-identical depths.
+// The CPU streams are staging in an arena of the mesh: the GPU paths free them in one shot with
+// release_streams() once everything that reads them is uploaded, the CPU renderers keep them. They
+// can be saved to a binary cache file and read back from it, see residency.h.
+class Mesh {
+public:
+    typedef std::vector<GLfloat, ArenaAllocator<GLfloat> > Stream;
+    Mesh(Model &model);     // fills the CPU streams, tangents are computed per triangle in model space
+    void upload(bool quantized=false);  // create the buffers and the VAO that describes them
+    void upload_depth_stream();         // the position-only buffers of draw_depth(), after upload()
+    void draw(int instances=1);
+    void draw_depth(int instances=1);   // positions only, at location 0
+    void set_instance_list(GLuint buffer);  // location 5 reads one GLuint per instance from the buffer
+    void draw_indirect(GLintptr command);   // offset of a DrawArraysIndirectCommand in the bound GL_DRAW_INDIRECT_BUFFER
+    void release();
+    void release_streams();     // the CPU streams below, after the uploads; the counts stay valid
+    bool has_streams() const { return !vertices.empty(); }
+    bool save_streams(const std::string &file) const;
+    bool load_streams(const std::string &file);     // after release_streams(), false if the file does not match the mesh
+    size_t stream_bytes() const;    // of the CPU streams once filled
+    size_t gpu_bytes() const { return uploaded; }
+    int nverts() const { return ncorners; }
+    Vec3f vertex(int i) const;  // position of the corner i as the vertex shader reads it, quantized or not
+
+private:
+    Arena staging;      // of the streams, declared before them: constructed first, destroyed last
+public:
+    Stream vertices;
+    Stream uvs;
+    Stream normals;
+    Stream tangents;
+    Stream bitangents;
+    Stream positions;   // one per model vertex, shared by the triangles
+    std::vector<GLuint, ArenaAllocator<GLuint> > indices;  // in positions, three per triangle
+    Vec3f quant_scale, quant_offset;    // model space position = quantized position*scale + offset
+private:
+    int ncorners, nindices, npositions;
+    size_t uploaded;    // bytes of the buffers
+    GLuint vao;
+    GLuint buffers[5];
+    GLuint depth_vao;
+    GLuint depth_buffers[2];    // positions and indices
+    bool quantized;
+};
+
+#endif //__MESH_H__
+
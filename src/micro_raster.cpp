@@ -0,0 +1,152 @@
+#include <iostream>
+#include <algorithm>
+#include "micro_raster.h"
+#include "uniforms.h"
+#include "profiler.h"
+
+static const char *micro_raster_shader = "../shaders/micro_raster.glsl";
+
+MicroRasterizer::MicroRasterizer() : raster_prog(0), raster_features(0), nfaces(0), max_objects(0), micro_size(0),
+    pixels(0), lists(0), empty_vao(0), frame(0), width(0), height(0), last(), has_last(false) {
+    for (int i=0; i<NREADBACK; i++) {
+        readback[i] = 0;
+        readback_full[i] = false;
+    }
+}
+
+bool MicroRasterizer::supported() {
+    return GLAD_GL_VERSION_4_3;
+}
+
+bool MicroRasterizer::init(ProgramCache &programs, const Mesh &mesh, int max_objects_, float micro_size_) {
+    nfaces = mesh.nverts()/3;
+    max_objects = std::max(1, max_objects_);
+    micro_size = micro_size_;
+    raster_features = has_gl_extension("GL_ARB_gpu_shader_int64") && has_gl_extension("GL_NV_shader_atomic_int64") ? SHADER_ATOMIC64 : 0;
+    raster_prog = programs.get(programs.submit_compute(micro_raster_shader, raster_features));
+    if (!raster_prog && raster_features) {     // an extension string the compiler does not live up to
+        raster_features = 0;
+        raster_prog = programs.get(programs.submit_compute(micro_raster_shader, raster_features));
+    }
+    if (!raster_prog) return false;
+
+    glGenBuffers(1, &lists);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, lists);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, (HEADER + (size_t)max_objects*nfaces)*sizeof(GLuint), NULL, GL_DYNAMIC_COPY);
+    glGenBuffers(NREADBACK, readback);
+    for (int i=0; i<NREADBACK; i++) {
+        glBindBuffer(GL_COPY_WRITE_BUFFER, readback[i]);
+        glBufferData(GL_COPY_WRITE_BUFFER, HEADER*sizeof(GLuint), NULL, GL_STREAM_READ);
+    }
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    glGenVertexArrays(1, &empty_vao);
+    return true;
+}
+
+void MicroRasterizer::reloaded(const std::string &file, GLuint prog) {
+    if (file==micro_raster_shader) raster_prog = prog;
+}
+
+void MicroRasterizer::resize(int w, int h) {
+    if (w==width && h==height) return;
+    width  = w;
+    height = h;
+    if (!pixels) glGenBuffers(1, &pixels);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, pixels);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, (size_t)width*height*2*sizeof(GLuint), NULL, GL_DYNAMIC_COPY);
+}
+
+void MicroRasterizer::raster(int count, const Matrix &P) {
+    PROFILE_ZONE("micro raster");
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    resize(viewport[2], viewport[3]);
+    count = std::min(count, max_objects);
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, pixels);
+    glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, NULL);     // no id, depth 0: the far plane
+    const GLuint reset[HEADER] = { 0, 1, 0, 0, 0, 0, 0, 0 };
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, lists);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(reset), reset);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    if (!count) return;
+
+    glUseProgram(raster_prog);
+    float p[16];
+    std140_mat4(p, P);
+    glUniformMatrix4fv(glGetUniformLocation(raster_prog, "P"), 1, GL_FALSE, p);
+    glUniform1ui(glGetUniformLocation(raster_prog, "NumFaces"), nfaces);
+    glUniform1ui(glGetUniformLocation(raster_prog, "Count"), count);
+    glUniform2i(glGetUniformLocation(raster_prog, "Size"), width, height);
+    glUniform1f(glGetUniformLocation(raster_prog, "MicroSize"), micro_size);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, pixels);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, lists);
+
+    GLuint groups = (GLuint)(((size_t)count*nfaces + 63)/64);  // 2D past the 65535 groups of a dimension
+    GLuint gx = std::min(groups, 65535u), gy = (groups + gx - 1)/gx;
+    int passes = atomic64() ? 1 : 2;
+    for (int pass=0; pass<passes; pass++) {
+        glUniform1i(glGetUniformLocation(raster_prog, "Pass"), pass);
+        glDispatchCompute(gx, gy, 1);
+        // the depth feeds the id pass, the pixels the merge, the list and its command the indirect draw
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | (pass==passes-1 ? GL_COMMAND_BARRIER_BIT : 0));
+    }
+}
+
+void MicroRasterizer::merge(GLuint prog) {
+    glUseProgram(prog);
+    glUniform1i(glGetUniformLocation(prog, "Width"), width);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, pixels);
+    glBindVertexArray(empty_vao);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+}
+
+void MicroRasterizer::draw_large(GLuint prog) {
+    glUseProgram(prog);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, lists);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, lists);
+    glBindVertexArray(empty_vao);
+    glDrawArraysIndirect(GL_TRIANGLES, 0);
+    glBindVertexArray(0);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+
+    // keep a copy of the counts, the one made NREADBACK-1 frames ago is most likely available by now
+    int slot = frame % NREADBACK;
+    glBindBuffer(GL_COPY_READ_BUFFER, lists);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, readback[slot]);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, HEADER*sizeof(GLuint));
+    readback_full[slot] = true;
+    frame++;
+
+    int oldest = frame % NREADBACK;
+    if (readback_full[oldest]) {
+        GLuint header[HEADER];
+        glBindBuffer(GL_COPY_READ_BUFFER, readback[oldest]);
+        glGetBufferSubData(GL_COPY_READ_BUFFER, 0, sizeof(header), header);
+        last.large = header[0]/3;
+        last.small = header[4];
+        has_last = true;
+    }
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+}
+
+bool MicroRasterizer::stats(MicroStats &stats) const {
+    if (has_last) stats = last;
+    return has_last;
+}
+
+void MicroRasterizer::release() {
+    glDeleteBuffers(1, &pixels);
+    glDeleteBuffers(1, &lists);
+    glDeleteBuffers(NREADBACK, readback);
+    glDeleteVertexArrays(1, &empty_vao);
+    pixels = lists = empty_vao = 0;
+    for (int i=0; i<NREADBACK; i++) {
+        readback[i] = 0;
+        readback_full[i] = false;
+    }
+    width = height = 0;
+    raster_prog = 0;
+}
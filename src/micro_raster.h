@@ -0,0 +1,61 @@
+#ifndef __MICRO_RASTER_H__
+#define __MICRO_RASTER_H__
+
+#include <string>
+#include <glad/glad.h>
+#include "geometry.h"
+#include "mesh.h"
+#include "shader.h"
+
+struct MicroStats {
+    MicroStats() : small(0), large(0) {}
+    int small;      // triangles rasterized by the compute shader
+    int large;      // left to the hardware
+};
+
+// Compute rasterization of the small triangles into the visibility buffer (GL 4.3). Far away, most
+// triangles cover less than a pixel and the hardware still shades 2x2 quads and sets up every one of
+// them; micro_raster.glsl takes one triangle per invocation instead and loops over the pixel centers
+// of its bounds. Every frame, between VisibilityBuffer::begin_geometry() and resolve():
+//     1. raster() keeps the nearest depth and id of every pixel with atomics in a storage buffer, one
+//        64-bit atomicMax of depth<<32 | id with GL_NV_shader_atomic_int64, otherwise a depth pass and
+//        an id pass of 32-bit atomics; the triangles wider than micro_size pixels or clipped by the
+//        near or the far plane are appended to a list whose count is the one of an indirect draw
+//     2. merge() copies those pixels into the id target and its depth buffer
+//     3. draw_large() draws the list with the hardware, depth tested against the merged pixels
+class MicroRasterizer {
+public:
+    MicroRasterizer();
+    static bool supported();    // the context is 4.3 or newer
+    bool init(ProgramCache &programs, const Mesh &mesh, int max_objects, float micro_size);    // false if the program failed
+    void release();
+    void reloaded(const std::string &file, GLuint prog);   // a hot reload of micro_raster.glsl linked
+    bool enabled() const { return raster_prog!=0; }
+    bool atomic64() const { return raster_features & SHADER_ATOMIC64; }
+
+    // the corners and the model views of the visibility buffer are bound, see VisibilityBuffer::begin_geometry
+    void raster(int count, const Matrix &P);
+    void merge(GLuint prog);        // into the bound visibility buffer, prog is the MICRO variant
+    void draw_large(GLuint prog);   // prog is the MICRO|DEPTH_ONLY|VISIBILITY variant
+
+    bool stats(MicroStats &stats) const;   // the most recent counts that reached the CPU
+
+private:
+    enum { NREADBACK = 3, HEADER = 8 };     // uints before the list: the indirect command, the small count and a pad
+    void resize(int width, int height);
+
+    GLuint raster_prog;         // owned by the program cache
+    unsigned raster_features;
+    GLuint nfaces;
+    int max_objects;
+    float micro_size;
+    GLuint pixels, lists, empty_vao;
+    GLuint readback[NREADBACK];         // copies of the header, read NREADBACK-1 frames later
+    bool readback_full[NREADBACK];
+    int frame;
+    int width, height;
+    MicroStats last;
+    bool has_last;
+};
+
+#endif //__MICRO_RASTER_H__
@@ -1,69 +1,174 @@
 #include <iostream>
 #include <cassert>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
-#include <sstream>
 #include <algorithm>
+#include <memory>
 #include "model.h"
+#include "arena.h"
+#include "parallel.h"
+#include "profiler.h"
 
-Model::Model(const char *filename) : verts(), faces(), norms(), texcoords() {
-    std::ifstream in;
-    in.open (filename, std::ifstream::in);
-    if (in.fail()) {
-        std::cerr << "Failed to open " << filename << std::endl;
-        return;
+namespace {
+    // what one slice of the lines of the file declares, in order, in the scratch arena of its worker
+    struct ObjChunk {
+        ObjChunk(Arena &scratch) : verts(ArenaAllocator<Vec3f>(scratch)), norms(ArenaAllocator<Vec3f>(scratch)),
+                                   texcoords(ArenaAllocator<Vec2f>(scratch)), faces(ArenaAllocator<Vec3i>(scratch)) {}
+        std::vector<Vec3f, ArenaAllocator<Vec3f> > verts, norms;
+        std::vector<Vec2f, ArenaAllocator<Vec2f> > texcoords;
+        std::vector<Vec3i, ArenaAllocator<Vec3i> > faces;
+    };
+    enum { CHUNK_BYTES = 1<<16, BBOX_GRAIN = 1<<14 };
+}
+
+// The numbers of the line that ends at eol, 0 for a missing one; the text ends with a '\0', strtof and
+// strtol cannot run past it, but they skip the line ends
+static float parse_float(const char *&p, const char *eol) {
+    char *next;
+    float v = std::strtof(p, &next);
+    if (next==p || next>eol) return 0;
+    p = next;
+    return v;
+}
+
+static bool parse_corner(const char *&p, const char *eol, Vec3i &corner) {   // v/vt/vn
+    for (int i=0; i<3; i++) {
+        char *next;
+        long v = std::strtol(p, &next, 10);
+        if (next==p || next>eol) return false;
+        corner[i] = (int)v - 1;     // in wavefront obj all indices start at 1, not zero
+        p = next;
+        if (i<2 && *p++!='/') return false;
     }
-    std::string line;
-    while (!in.eof()) {
-        std::getline(in, line);
-        std::istringstream iss(line.c_str());
-        char trash;
-        if (!line.compare(0, 2, "v ")) {
-            iss >> trash;
+    return true;
+}
+
+// no string and no stream per line: the numbers are read in place
+static void parse_lines(const char *begin, const char *end, ObjChunk &out) {
+    while (begin<end) {
+        const char *eol = std::find(begin, end, '\n');
+        const char *p = begin;
+        begin = eol + 1;
+        if (eol - p>=2 && !std::strncmp(p, "v ", 2)) {
+            p += 2;
             Vec3f v;
-            for (int i=0;i<3;i++) iss >> v[i];
-            verts.push_back(v);
-        } else if (!line.compare(0, 3, "vn ")) {
-            iss >> trash >> trash;
+            for (int i=0;i<3;i++) v[i] = parse_float(p, eol);
+            out.verts.push_back(v);
+        } else if (eol - p>=3 && !std::strncmp(p, "vn ", 3)) {
+            p += 3;
             Vec3f n;
-            for (int i=0;i<3;i++) iss >> n[i];
-            norms.push_back(n);
-        } else if (!line.compare(0, 3, "vt ")) {
-            iss >> trash >> trash;
+            for (int i=0;i<3;i++) n[i] = parse_float(p, eol);
+            out.norms.push_back(n);
+        } else if (eol - p>=3 && !std::strncmp(p, "vt ", 3)) {
+            p += 3;
             Vec2f uv;
-            for (int i=0;i<2;i++) iss >> uv[i];
-            texcoords.push_back(uv);
-        } else if (!line.compare(0, 2, "f ")) {
-            std::vector<Vec3i> f;
-            Vec3i tmp;
-            iss >> trash;
-            while (iss >> tmp[0] >> trash >> tmp[1] >> trash >> tmp[2]) {
-                for (int i=0; i<3; i++) tmp[i]--; // in wavefront obj all indices start at 1, not zero
-                f.push_back(tmp);
+            for (int i=0;i<2;i++) uv[i] = parse_float(p, eol);
+            out.texcoords.push_back(uv);
+        } else if (eol - p>=2 && !std::strncmp(p, "f ", 2)) {
+            p += 2;
+            Vec3i corner;
+            int n = 0;
+            while (parse_corner(p, eol, corner)) {
+                if (n++<3) out.faces.push_back(corner);
             }
-            assert(3==f.size());
-            faces.push_back(f);
+            assert(3==n);
         }
     }
-    std::cerr << "# v# " << verts.size() << " f# "  << faces.size() << std::endl;
+}
+
+// The file is read at once and cut at line ends into slices that are parsed in parallel: the indices
+// of the faces are absolute, the slices are simply concatenated in order. The text and the slices
+// live in arenas that go away at once when the model is filled.
+Model::Model(const char *filename) : verts(), faces(), norms(), texcoords(), vertex_count(0), face_count(0) {
+    PROFILE_ZONE("load model");
+    std::ifstream in;
+    in.open (filename, std::ifstream::in | std::ifstream::binary);
+    if (in.fail()) {
+        std::cerr << "Failed to open " << filename << std::endl;
+        return;
+    }
+    in.seekg(0, std::ios::end);
+    std::streamoff length = in.tellg();
+    size_t size = length>0 ? (size_t)length : 0;
+    in.seekg(0, std::ios::beg);
+    Arena scratch;
+    char *text = (char *)scratch.allocate(size + 1, 1);
+    in.read(text, size);
+    size = (size_t)in.gcount();
+    text[size] = '\0';
+    std::vector<size_t> cuts(1, 0);
+    while (cuts.back()<size) {
+        const char *from = text + std::min(size, cuts.back() + CHUNK_BYTES);
+        const char *eol = std::find(from, (const char *)text + size, '\n');
+        cuts.push_back(std::min(size, (size_t)(eol - text) + 1));
+    }
+
+    std::vector<std::unique_ptr<Arena> > worker_scratch(worker_count());
+    for (size_t w=0; w<worker_scratch.size(); w++) worker_scratch[w].reset(new Arena());
+    std::vector<std::unique_ptr<ObjChunk> > chunks(cuts.size() - 1);
+    parallel_for(0, (int)chunks.size(), 1, [&](int c, int worker) {
+        chunks[c].reset(new ObjChunk(*worker_scratch[worker]));
+        parse_lines(text + cuts[c], text + cuts[c+1], *chunks[c]);
+    });
+    size_t nverts = 0, nnorms = 0, ntexcoords = 0, ncorners = 0;
+    for (size_t c=0; c<chunks.size(); c++) {
+        nverts     += chunks[c]->verts.size();
+        nnorms     += chunks[c]->norms.size();
+        ntexcoords += chunks[c]->texcoords.size();
+        ncorners   += chunks[c]->faces.size();
+    }
+    verts.reserve(nverts);
+    norms.reserve(nnorms);
+    texcoords.reserve(ntexcoords);
+    faces.reserve(ncorners);
+    for (size_t c=0; c<chunks.size(); c++) {
+        verts.insert(verts.end(), chunks[c]->verts.begin(), chunks[c]->verts.end());
+        norms.insert(norms.end(), chunks[c]->norms.begin(), chunks[c]->norms.end());
+        texcoords.insert(texcoords.end(), chunks[c]->texcoords.begin(), chunks[c]->texcoords.end());
+        faces.insert(faces.end(), chunks[c]->faces.begin(), chunks[c]->faces.end());
+    }
+    vertex_count = (int)verts.size();
+    face_count = (int)faces.size()/3;
+    std::cerr << "# v# " << verts.size() << " f# "  << nfaces() << std::endl;
 
     Vec3f min, max;
     get_bbox(min, max);
 }
 
+void Model::release() {
+    std::vector<Vec3f>().swap(verts);
+    std::vector<Vec3i>().swap(faces);
+    std::vector<Vec3f>().swap(norms);
+    std::vector<Vec2f>().swap(texcoords);
+}
+
 int Model::nverts() {
-    return (int)verts.size();
+    return vertex_count;
 }
 
 int Model::nfaces() {
-    return (int)faces.size();
+    return face_count;
 }
 
 void Model::get_bbox(Vec3f &min, Vec3f &max) {
+    int nblocks = ((int)verts.size() + BBOX_GRAIN - 1)/BBOX_GRAIN;
+    std::vector<Vec3f> mins(nblocks), maxs(nblocks);
+    parallel_for(0, nblocks, 1, [&](int b, int) {
+        int first = b*BBOX_GRAIN, last = std::min((int)verts.size(), first + BBOX_GRAIN);
+        mins[b] = maxs[b] = verts[first];
+        for (int i=first+1; i<last; ++i) {
+            for (int j=0; j<3; j++) {
+                mins[b][j] = std::min(mins[b][j], verts[i][j]);
+                maxs[b][j] = std::max(maxs[b][j], verts[i][j]);
+            }
+        }
+    });
     min = max = verts[0];
-    for (int i=1; i<(int)verts.size(); ++i) {
+    for (int b=0; b<nblocks; b++) {
         for (int j=0; j<3; j++) {
-            min[j] = std::min(min[j], verts[i][j]);
-            max[j] = std::max(max[j], verts[i][j]);
+            min[j] = std::min(min[j], mins[b][j]);
+            max[j] = std::max(max[j], maxs[b][j]);
         }
     }
     std::cerr << "bbox: [" << min << " : " << max << "]" << std::endl;
@@ -76,16 +181,16 @@ Vec3f &Model::point(int i) {
 
 int Model::vert(int fi, int li) {
     assert(fi>=0 && fi<nfaces() && li>=0 && li<3);
-    return faces[fi][li].x;
+    return faces[fi*3+li].x;
 }
 
 Vec2f Model::uv(int fi, int li) {
     assert(fi>=0 && fi<nfaces() && li>=0 && li<3);
-    return texcoords[faces[fi][li].y];
+    return texcoords[faces[fi*3+li].y];
 }
 
 Vec3f Model::normal(int fi, int li) {
     assert(fi>=0 && fi<nfaces() && li>=0 && li<3);
-    return norms[faces[fi][li].z];
+    return norms[faces[fi*3+li].z];
 }
 
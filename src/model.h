@@ -8,12 +8,14 @@
 class Model {
 private:
     std::vector<Vec3f> verts;
-    std::vector<std::vector<Vec3i> > faces; // attention, this Vec3i means vertex/uv/normal
+    std::vector<Vec3i> faces;   // three corners per triangle, attention, this Vec3i means vertex/uv/normal
 
     std::vector<Vec3f> norms;
     std::vector<Vec2f> texcoords;
+    int vertex_count, face_count;   // valid after release()
 public:
     Model(const char *filename);
+    void release();                         // frees the vertices and the faces once the mesh is built
     void get_bbox(Vec3f &min, Vec3f &max);  // bounding box for all the vertices, including isolated ones
 
     int nverts();                           // number of vertices
@@ -0,0 +1,283 @@
+#include <iostream>
+#include <cmath>
+#include <algorithm>
+#include "occlusion.h"
+#include "uniforms.h"
+#include "profiler.h"
+#include "scheduler.h"
+
+static const char *occlusion_shader     = "../shaders/occlusion.glsl";
+static const char *depth_pyramid_shader = "../shaders/depth_pyramid.glsl";
+
+struct DrawArraysIndirectCommand {
+    GLuint count, instance_count, first, base_instance;
+};
+
+OcclusionCuller::OcclusionCuller() : cull_prog(0), pyramid_prog(0), max_instances(0), nverts(0), box(),
+    ids_buffer(0), visibility(0), lists(0), commands(0), models(0), models_tex(0), frame(0),
+    fbo(0), color(0), depth(0), pyramid(0), width(0), height(0), levels(0), previous_fbo(0), count(0), columns(), stable(), PV(Matrix::identity()),
+    last(), has_last(false), sum_candidates(0), sum_early(0), sum_late(0), nsums(0), last_report(std::chrono::steady_clock::now()) {
+    for (int i=0; i<NREADBACK; i++) {
+        readback[i] = 0;
+        readback_count[i] = -1;
+    }
+}
+
+bool OcclusionCuller::supported() {
+    return GLAD_GL_VERSION_4_3;     // glad checks the version of the context, not the one that was requested
+}
+
+bool OcclusionCuller::init(ProgramCache &programs, int max_instances_, const Aabb &box_, int nverts_) {
+    max_instances = std::max(1, max_instances_);
+    box = box_;
+    nverts = nverts_;
+    columns.reserve(max_instances*16);
+    stable.reserve(max_instances);
+    int cull_build = programs.submit_compute(occlusion_shader);
+    int pyramid_build = programs.submit_compute(depth_pyramid_shader);
+    cull_prog = programs.get(cull_build);
+    pyramid_prog = programs.get(pyramid_build);
+    if (!cull_prog || !pyramid_prog) {
+        cull_prog = pyramid_prog = 0;
+        return false;
+    }
+
+    glGenBuffers(1, &ids_buffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, ids_buffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, max_instances*sizeof(GLuint), NULL, GL_STREAM_DRAW);
+
+    std::vector<GLuint> all_visible(max_instances, 1);     // the first frame draws every candidate early
+    glGenBuffers(1, &visibility);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, visibility);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, max_instances*sizeof(GLuint), all_visible.data(), GL_DYNAMIC_COPY);
+
+    glGenBuffers(1, &lists);    // both lists, the second one starts at the number of candidates
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, lists);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, 2*max_instances*sizeof(GLuint), NULL, GL_DYNAMIC_COPY);
+
+    glGenBuffers(1, &commands);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, commands);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, 2*sizeof(DrawArraysIndirectCommand), NULL, GL_DYNAMIC_COPY);
+
+    glGenBuffers(NREADBACK, readback);
+    for (int i=0; i<NREADBACK; i++) {
+        glBindBuffer(GL_COPY_WRITE_BUFFER, readback[i]);
+        glBufferData(GL_COPY_WRITE_BUFFER, 2*sizeof(DrawArraysIndirectCommand), NULL, GL_STREAM_READ);
+    }
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    glGenBuffers(1, &models);
+    glBindBuffer(GL_TEXTURE_BUFFER, models);
+    glBufferData(GL_TEXTURE_BUFFER, max_instances*16*sizeof(GLfloat), NULL, GL_STREAM_DRAW);
+    glGenTextures(1, &models_tex);
+    glBindTexture(GL_TEXTURE_BUFFER, models_tex);
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, models);
+    glBindTexture(GL_TEXTURE_BUFFER, 0);
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+    setup_cull_program();
+    return true;
+}
+
+void OcclusionCuller::setup_cull_program() {
+    glUseProgram(cull_prog);
+    glUniform3f(glGetUniformLocation(cull_prog, "BoxMin"), box.min.x, box.min.y, box.min.z);
+    glUniform3f(glGetUniformLocation(cull_prog, "BoxMax"), box.max.x, box.max.y, box.max.z);
+    glUniform1i(glGetUniformLocation(cull_prog, "Levels"), levels);
+    glUseProgram(0);
+}
+
+void OcclusionCuller::reloaded(const std::string &file, GLuint prog) {
+    if (file==depth_pyramid_shader) pyramid_prog = prog;
+    if (file!=occlusion_shader) return;
+    cull_prog = prog;
+    setup_cull_program();
+}
+
+void OcclusionCuller::resize(int w, int h) {
+    if (w==width && h==height) return;
+    if (fbo) {
+        glDeleteFramebuffers(1, &fbo);
+        glDeleteRenderbuffers(1, &color);
+        glDeleteTextures(1, &depth);
+        glDeleteTextures(1, &pyramid);
+    }
+    width  = w;
+    height = h;
+    levels = 1 + (int)std::floor(std::log2((double)std::max(1, std::max(width, height))));
+
+    glGenRenderbuffers(1, &color);
+    glBindRenderbuffer(GL_RENDERBUFFER, color);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+    glGenTextures(1, &depth);
+    glBindTexture(GL_TEXTURE_2D, depth);
+    glTexStorage2D(GL_TEXTURE_2D, 1, GL_DEPTH_COMPONENT32F, width, height);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+    glGenTextures(1, &pyramid);
+    glBindTexture(GL_TEXTURE_2D, pyramid);
+    glTexStorage2D(GL_TEXTURE_2D, levels, GL_R32F, width, height);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    glGenFramebuffers(1, &fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, color);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depth, 0);
+    if (GL_FRAMEBUFFER_COMPLETE!=glCheckFramebufferStatus(GL_FRAMEBUFFER)) {
+        std::cerr << "Incomplete occlusion framebuffer " << width << "x" << height << std::endl;
+    }
+
+    setup_cull_program();
+}
+
+void OcclusionCuller::begin_frame(const std::vector<Matrix> &instances, const std::vector<int> *ids, const Matrix &PV_) {
+    PROFILE_ZONE("occlusion upload");
+    PV = PV_;
+    count = std::min((int)instances.size(), max_instances);
+
+    // the buffers are orphaned, the previous frames may still read their old storage
+    columns.resize(count*16);  // reserved by init(), no allocation
+    for (int i=0; i<count; i++) std140_mat4(columns.data() + i*16, instances[i]);
+    glBindBuffer(GL_TEXTURE_BUFFER, models);
+    glBufferData(GL_TEXTURE_BUFFER, max_instances*16*sizeof(GLfloat), NULL, GL_STREAM_DRAW);
+    glBufferSubData(GL_TEXTURE_BUFFER, 0, columns.size()*sizeof(GLfloat), columns.data());
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+    stable.resize(count);
+    for (int i=0; i<count; i++) stable[i] = ids ? std::min((*ids)[i], max_instances-1) : i;
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, ids_buffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, max_instances*sizeof(GLuint), NULL, GL_STREAM_DRAW);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, stable.size()*sizeof(GLuint), stable.data());
+
+    DrawArraysIndirectCommand reset[2] = { { (GLuint)nverts, 0, 0, 0 }, { (GLuint)nverts, 0, 0, (GLuint)count } };
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, commands);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(reset), reset);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &previous_fbo);
+    resize(viewport[2], viewport[3]);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+
+    glActiveTexture(GL_TEXTURE0 + MODELS_UNIT);
+    glBindTexture(GL_TEXTURE_BUFFER, models_tex);
+    glActiveTexture(GL_TEXTURE0);
+}
+
+void OcclusionCuller::cull(int phase) {
+    if (!count) return;
+    glUseProgram(cull_prog);
+    glUniform1i(glGetUniformLocation(cull_prog, "Phase"), phase);
+    glUniform1ui(glGetUniformLocation(cull_prog, "Count"), count);
+    float pv[16];
+    std140_mat4(pv, PV);
+    glUniformMatrix4fv(glGetUniformLocation(cull_prog, "PV"), 1, GL_FALSE, pv);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, ids_buffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, visibility);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, lists);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, commands);
+    glActiveTexture(GL_TEXTURE0 + PYRAMID_UNIT);
+    glBindTexture(GL_TEXTURE_2D, pyramid);
+    glActiveTexture(GL_TEXTURE0);
+    glDispatchCompute((count + 63)/64, 1, 1);
+    // the commands and the lists feed the draws, the visibility the next dispatch
+    glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
+}
+
+void OcclusionCuller::build_pyramid() {
+    if (!count) return;
+    glUseProgram(pyramid_prog);
+    GLint source_level = glGetUniformLocation(pyramid_prog, "SourceLevel");
+    glActiveTexture(GL_TEXTURE0 + SOURCE_UNIT);
+    for (int level=0; level<levels; level++) {
+        glBindTexture(GL_TEXTURE_2D, level ? pyramid : depth);  // level 0 copies the depth buffer
+        glUniform1i(source_level, level ? level-1 : 0);
+        glBindImageTexture(0, pyramid, level, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+        int w = std::max(1, width>>level), h = std::max(1, height>>level);
+        glDispatchCompute((w + 7)/8, (h + 7)/8, 1);
+        glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+    }
+    glBindImageTexture(0, 0, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glActiveTexture(GL_TEXTURE0);
+}
+
+void OcclusionCuller::draw(Mesh &mesh, int phase) {
+    if (!count) return;
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, commands);
+    mesh.draw_indirect(phase*sizeof(DrawArraysIndirectCommand));
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+}
+
+void OcclusionCuller::end_frame() {
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, previous_fbo);
+    glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    glBindFramebuffer(GL_FRAMEBUFFER, previous_fbo);
+
+    // keep a copy of the counts, the one made NREADBACK-1 frames ago is most likely available by now
+    int slot = frame % NREADBACK;
+    glBindBuffer(GL_COPY_READ_BUFFER, commands);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, readback[slot]);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, 2*sizeof(DrawArraysIndirectCommand));
+    readback_count[slot] = count;
+    frame++;
+
+    int oldest = frame % NREADBACK;
+    if (readback_count[oldest]>=0) {
+        DrawArraysIndirectCommand counts[2];
+        glBindBuffer(GL_COPY_READ_BUFFER, readback[oldest]);
+        glGetBufferSubData(GL_COPY_READ_BUFFER, 0, sizeof(counts), counts);
+        last.candidates = readback_count[oldest];
+        last.early = readback_count[oldest] ? counts[0].instance_count : 0;
+        last.late  = readback_count[oldest] ? counts[1].instance_count : 0;
+        has_last = true;
+        sum_candidates += last.candidates;
+        sum_early += last.early;
+        sum_late  += last.late;
+        nsums++;
+    }
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+}
+
+bool OcclusionCuller::stats(OcclusionStats &stats) const {
+    if (has_last) stats = last;
+    return has_last;
+}
+
+void OcclusionCuller::report() {
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    if (!nsums || std::chrono::duration<double>(now - last_report).count() < FrameScheduler::REPORT_INTERVAL) return;
+    std::cerr << "occlusion: candidates " << sum_candidates/nsums << ", drawn early " << sum_early/nsums
+              << ", late " << sum_late/nsums << ", occluded " << (sum_candidates - sum_early - sum_late)/nsums
+              << " (last " << nsums << " frames)" << std::endl;
+    sum_candidates = sum_early = sum_late = 0;
+    nsums = 0;
+    last_report = now;
+}
+
+void OcclusionCuller::release() {
+    if (fbo) {
+        glDeleteFramebuffers(1, &fbo);
+        glDeleteRenderbuffers(1, &color);
+        glDeleteTextures(1, &depth);
+        glDeleteTextures(1, &pyramid);
+    }
+    fbo = color = depth = pyramid = 0;
+    width = height = 0;
+    GLuint buffers[5] = { ids_buffer, visibility, lists, commands, models };
+    glDeleteBuffers(5, buffers);
+    glDeleteBuffers(NREADBACK, readback);
+    glDeleteTextures(1, &models_tex);
+    ids_buffer = visibility = lists = commands = models = models_tex = 0;
+    for (int i=0; i<NREADBACK; i++) readback[i] = 0;
+    cull_prog = pyramid_prog = 0;
+}
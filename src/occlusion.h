@@ -0,0 +1,76 @@
+#ifndef __OCCLUSION_H__
+#define __OCCLUSION_H__
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <glad/glad.h>
+#include "geometry.h"
+#include "culling.h"
+#include "mesh.h"
+#include "shader.h"
+
+struct OcclusionStats {
+    OcclusionStats() : candidates(0), early(0), late(0) {}
+    int candidates;     // instances that passed the frustum test on the CPU
+    int early, late;    // drawn by the first pass (visible last frame) and by the second one
+};
+
+// Two-phase hierarchical-Z occlusion culling on the GPU (GL 4.3: compute shaders, storage
+// buffers, indirect draws). Every frame:
+//     1. cull(0) lists the candidates that were visible in the previous frame, draw(0) draws them
+//     2. build_pyramid() reduces their depth into a min-depth mip chain (the farthest occluder)
+//     3. cull(1) tests the bounds of every candidate against it, lists the visible ones that were not
+//        drawn yet and records the visibility for the next frame, draw(1) draws them
+// The instance counts of both indirect commands are written by the compute shader, the CPU never
+// waits for them: the statistics are read back a few frames later. The frame is rendered into an
+// own target with a depth texture and blitted to the framebuffer that was bound.
+class OcclusionCuller {
+public:
+    OcclusionCuller();
+    static bool supported();    // the context is 4.3 or newer
+    bool init(ProgramCache &programs, int max_instances, const Aabb &box, int nverts);   // false if a program failed
+    void release();
+    void reloaded(const std::string &file, GLuint prog);   // a hot reload of one of the compute shaders linked
+    bool enabled() const { return cull_prog!=0; }
+    GLuint instance_list() const { return lists; }     // the per-instance attribute of the draws, see Mesh::set_instance_list
+
+    // uploads the model matrices of the candidates and binds the render target, ids are the stable
+    // indices of the instances that key the visibility history (the positions in the list if NULL)
+    void begin_frame(const std::vector<Matrix> &instances, const std::vector<int> *ids, const Matrix &PV);
+    void cull(int phase);
+    void build_pyramid();
+    void draw(Mesh &mesh, int phase);
+    void end_frame();           // blit the color to the framebuffer bound before begin_frame()
+
+    bool stats(OcclusionStats &stats) const;   // the most recent counts that reached the CPU
+    void report();              // mean counts to stderr, every few seconds
+
+    enum { MODELS_UNIT = 2, PYRAMID_UNIT = 3, SOURCE_UNIT = 4 };    // texture units, as in the shaders
+private:
+    enum { NREADBACK = 3 };
+    void resize(int width, int height);
+    void setup_cull_program();
+
+    GLuint cull_prog, pyramid_prog;     // owned by the program cache
+    int max_instances, nverts;
+    Aabb box;
+    GLuint ids_buffer, visibility, lists, commands, models, models_tex;
+    GLuint readback[NREADBACK];         // copies of the commands, read NREADBACK-1 frames later
+    int readback_count[NREADBACK];      // candidates of the frame in the copy, -1 if empty
+    int frame;
+    GLuint fbo, color, depth, pyramid;
+    int width, height, levels;
+    GLint previous_fbo;
+    int count;                          // candidates of the current frame
+    std::vector<GLfloat> columns;       // upload staging of the model matrices
+    std::vector<GLuint> stable;         // and of the ids
+    Matrix PV;
+    OcclusionStats last;
+    bool has_last;
+    double sum_candidates, sum_early, sum_late;
+    int nsums;
+    std::chrono::steady_clock::time_point last_report;
+};
+
+#endif //__OCCLUSION_H__
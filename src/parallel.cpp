@@ -0,0 +1,247 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+#include "parallel.h"
+#include "profiler.h"
+
+static int configured_threads = 0;
+static bool configured_pin = false;
+static std::unique_ptr<JobSystem> pool;
+static std::atomic<JobSystem*> started(NULL);   // pool once it runs, read without the lock
+static std::mutex pool_lock;                    // starting and restarting only
+static thread_local int current_queue = 0;     // the pool threads set theirs, the others share 0
+
+JobSystem &JobSystem::get() {
+    JobSystem *jobs = started.load(std::memory_order_acquire);
+    if (jobs) return *jobs;
+    std::lock_guard<std::mutex> guard(pool_lock);
+    if (!pool) {
+        pool.reset(new JobSystem(configured_threads, configured_pin));
+        started.store(pool.get(), std::memory_order_release);
+    }
+    return *pool;
+}
+
+void JobSystem::configure(int threads, bool pin) {
+    std::lock_guard<std::mutex> guard(pool_lock);
+    configured_threads = threads;
+    configured_pin = pin;
+    started.store(NULL, std::memory_order_release);
+    pool.reset();   // the next get() starts the new pool
+}
+
+// CPUs the process may run on, with their NUMA node, node by node
+static std::vector<std::pair<int, int> > numa_cpus() {
+    std::vector<std::pair<int, int> > cpus;
+#ifdef __linux__
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed)) return cpus;
+    for (int node=0; ; node++) {
+        std::ostringstream path;
+        path << "/sys/devices/system/node/node" << node << "/cpulist";
+        std::ifstream in(path.str().c_str());
+        if (!in) break;
+        std::string range;  // e.g. 0-3,8-11
+        while (std::getline(in, range, ',')) {
+            int first = 0, last = -1;
+            char dash;
+            std::istringstream iss(range);
+            if (!(iss >> first)) continue;
+            if (!(iss >> dash >> last)) last = first;
+            for (int cpu=first; cpu<=last; cpu++) {
+                if (cpu<CPU_SETSIZE && CPU_ISSET(cpu, &allowed)) cpus.push_back(std::make_pair(node, cpu));
+            }
+        }
+    }
+    if (cpus.empty()) {     // no NUMA information: one node
+        for (int cpu=0; cpu<CPU_SETSIZE; cpu++) if (CPU_ISSET(cpu, &allowed)) cpus.push_back(std::make_pair(0, cpu));
+    }
+#endif
+    return cpus;
+}
+
+JobSystem::JobSystem(int nthreads, bool pin_) : pin(pin_), nnodes(1), queues(), victims(), threads(), queued(0), waiting(0), stop(false) {
+    if (nthreads<=0) nthreads = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::pair<int, int> > cpus;
+    if (pin) {
+        cpus = numa_cpus();
+        if (cpus.empty()) {
+            std::cerr << "Job system: the threads cannot be pinned on this system" << std::endl;
+            pin = false;
+        }
+    }
+    for (int i=0; i<nthreads; i++) {
+        queues.push_back(std::unique_ptr<Queue>(new Queue()));
+        queues[i]->front = queues[i]->size = 0;
+        queues[i]->node = pin ? cpus[i % cpus.size()].first : 0;
+        nnodes = std::max(nnodes, queues[i]->node + 1);
+    }
+    victims.resize(nthreads);
+    for (int i=0; i<nthreads; i++) {
+        for (int pass=0; pass<2; pass++) {  // the deques of the same node first, the nearest index first
+            for (int k=1; k<nthreads; k++) {
+                int v = (i + k) % nthreads;
+                if ((queues[v]->node==queues[i]->node)==(pass==0)) victims[i].push_back(v);
+            }
+        }
+    }
+    for (int i=1; i<nthreads; i++) {
+        threads.push_back(std::thread(&JobSystem::worker, this, i));
+#ifdef __linux__
+        if (pin) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpus[i % cpus.size()].second, &set);
+            pthread_setaffinity_np(threads.back().native_handle(), sizeof(set), &set);
+        }
+#endif
+    }
+}
+
+JobSystem::~JobSystem() {
+    {
+        std::lock_guard<std::mutex> guard(sleep_lock);
+        stop = true;
+    }
+    wake.notify_all();
+    for (size_t i=0; i<threads.size(); i++) threads[i].join();
+}
+
+void JobSystem::worker(int index) {
+    current_queue = index;
+    if (profiler_enabled()) {   // the trace buffer of a thread is never freed
+        std::ostringstream name;
+        name << "worker " << index;
+        profiler_thread_name(name.str().c_str());
+    }
+    for (;;) {
+        if (run_one(index)) continue;
+        std::unique_lock<std::mutex> guard(sleep_lock);
+        wake.wait(guard, [this]() { return stop || queued.load()>0; });
+        if (stop) return;
+    }
+}
+
+void JobSystem::submit(Function function, void *context, std::atomic<int> *counter) {
+    Queue &queue = *queues[current_queue<workers() ? current_queue : 0];
+    bool full;
+    {
+        std::lock_guard<std::mutex> guard(queue.lock);
+        full = queue.size==CAPACITY;
+        if (!full) {
+            Item item = { function, context, counter };
+            queue.items[(queue.front + queue.size++) % CAPACITY] = item;
+        }
+    }
+    if (full) {
+        function(context);
+        if (counter) finish(*counter);
+        return;
+    }
+    queued.fetch_add(1);
+    {
+        std::lock_guard<std::mutex> guard(sleep_lock);     // a worker between its check and its wait gets the notification
+    }
+    wake.notify_one();
+}
+
+void JobSystem::wait(const std::atomic<int> &counter) {
+    int self = current_queue<workers() ? current_queue : 0;
+    int idle = 0;
+    while (counter.load()>0) {
+        if (run_one(self)) {
+            idle = 0;
+        } else if (++idle<WAIT_SPINS) {
+            std::this_thread::yield();
+        } else {    // the last jobs run on other threads: sleep until one of them is done or a job comes
+            std::unique_lock<std::mutex> guard(sleep_lock);
+            waiting.fetch_add(1);
+            wake.wait(guard, [this, &counter]() { return counter.load()<=0 || queued.load()>0; });
+            waiting.fetch_sub(1);
+            idle = 0;
+        }
+    }
+}
+
+bool JobSystem::run_one(int self) {
+    Item item;
+    bool found = false;
+    {
+        Queue &own = *queues[self];
+        std::lock_guard<std::mutex> guard(own.lock);
+        if (own.size) {
+            item = own.items[(own.front + --own.size) % CAPACITY];
+            found = true;
+        }
+    }
+    for (size_t k=0; !found && k<victims[self].size(); k++) {
+        Queue &victim = *queues[victims[self][k]];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if (victim.size) {
+            item = victim.items[victim.front];
+            victim.front = (victim.front + 1) % CAPACITY;
+            victim.size--;
+            found = true;
+        }
+    }
+    if (!found) return false;
+    queued.fetch_sub(1);
+    item.function(item.context);
+    if (item.counter) finish(*item.counter);
+    return true;
+}
+
+void JobSystem::finish(std::atomic<int> &counter) {
+    // last: the waiter may release the counter right away. A waiter counts itself in before it checks
+    // the counter, one of the two sees the other
+    if (counter.fetch_sub(1)==1 && waiting.load()>0) {
+        {
+            std::lock_guard<std::mutex> guard(sleep_lock);
+        }
+        wake.notify_all();
+    }
+}
+
+int TaskGraph::add(const Job &job) {
+    tasks.push_back(std::unique_ptr<Task>(new Task()));
+    tasks.back()->graph = this;
+    tasks.back()->job = job;
+    tasks.back()->predecessors = 0;
+    return (int)tasks.size() - 1;
+}
+
+void TaskGraph::precede(int before, int after) {
+    tasks[before]->successors.push_back(after);
+    tasks[after]->predecessors++;
+}
+
+void TaskGraph::run_task(void *context) {
+    Task &task = *static_cast<Task*>(context);
+    TaskGraph &graph = *task.graph;
+    task.job();
+    for (size_t s=0; s<task.successors.size(); s++) {
+        // submitted before this task counts down, pending cannot reach 0 in between
+        if (graph.tasks[task.successors[s]]->remaining.fetch_sub(1)==1) graph.submit(task.successors[s]);
+    }
+}
+
+void TaskGraph::submit(int t) {
+    JobSystem::get().submit(&TaskGraph::run_task, tasks[t].get(), pending);
+}
+
+void TaskGraph::run() {
+    std::atomic<int> counter((int)tasks.size());
+    pending = &counter;
+    for (size_t t=0; t<tasks.size(); t++) tasks[t]->remaining = tasks[t]->predecessors;
+    for (size_t t=0; t<tasks.size(); t++) {
+        if (!tasks[t]->predecessors) submit((int)t);
+    }
+    JobSystem::get().wait(counter);
+    pending = NULL;
+}
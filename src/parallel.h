@@ -0,0 +1,157 @@
+#ifndef __PARALLEL_H__
+#define __PARALLEL_H__
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <future>
+#include <memory>
+#include <algorithm>
+
+// Work-stealing pool shared by the loader, the culling and the CPU renderers. It owns workers()-1
+// threads, a thread that waits for jobs takes part as well. Every pool thread has a deque of its own,
+// the threads outside the pool (main, render) share one: a thread runs the newest job of its deque
+// and, out of work, steals the oldest job of another deque, the ones of its NUMA node first. Waiting
+// runs jobs meanwhile, so a job may submit jobs and wait for them. A deque is a fixed ring of CAPACITY
+// jobs and a job is a function and a pointer: submitting does not allocate.
+// Pinned (Linux only), every pool thread is bound to one CPU, the CPUs of a node one after the other.
+class JobSystem {
+public:
+    typedef void (*Function)(void *context);
+    static JobSystem &get();    // started on the first use, with the settings of configure()
+    // threads counting the caller, 0 for the hardware concurrency; restarts the pool, no job may be in flight
+    static void configure(int threads, bool pin);
+    ~JobSystem();
+    int workers() const { return (int)queues.size(); }
+    bool pinned() const { return pin; }
+    int nodes() const { return nnodes; }
+
+    // runs function(context) on some thread, then finishes counter if not NULL: the caller counts the job
+    // in beforehand and keeps the context until then. With a full deque the job runs right away.
+    void submit(Function function, void *context, std::atomic<int> *counter);
+    template <typename F> void submit(F &f, std::atomic<int> *counter) { submit(&call<F>, &f, counter); }
+    void finish(std::atomic<int> &counter);     // counts a job out, for the jobs that do it themselves
+    void wait(const std::atomic<int> &counter);     // runs jobs until the counter is 0, sleeps if there are none
+
+private:
+    JobSystem(int threads, bool pin);
+    template <typename F> static void call(void *f) { (*static_cast<F*>(f))(); }
+    enum { CAPACITY = 256 };    // jobs of a deque
+    struct Item {
+        Function function;
+        void *context;
+        std::atomic<int> *counter;
+    };
+    struct Queue {
+        std::mutex lock;
+        Item items[CAPACITY];   // ring, the owner takes the back, the thieves the front
+        int front, size;
+        int node;               // NUMA node of the thread, 0 unless pinned
+    };
+    void worker(int index);
+    bool run_one(int self);     // false if no deque had a job
+
+    bool pin;
+    int nnodes;
+    std::vector<std::unique_ptr<Queue> > queues;   // 0 is shared by the threads outside the pool
+    std::vector<std::vector<int> > victims;         // steal order of every deque, its node first
+    std::vector<std::thread> threads;
+    enum { WAIT_SPINS = 64 };   // tries of wait() before it sleeps
+    std::atomic<int> queued;
+    std::atomic<int> waiting;   // wait() calls asleep
+    std::mutex sleep_lock;
+    std::condition_variable wake;   // the idle workers and the waits
+    bool stop;
+};
+
+// Number of threads parallel_for uses at most, the hardware concurrency unless configured.
+inline int worker_count() {
+    return JobSystem::get().workers();
+}
+
+// Calls f(i, worker) for every i in [begin, end), in chunks of grain indices handed out through an
+// atomic counter; worker is in [0, worker_count()) and no two threads of the call share it, so the
+// callers can keep per-thread outputs. The calling thread takes part, the pool threads join through
+// one job each: keep it for work of at least a few microseconds.
+template <typename F> void parallel_for(int begin, int end, int grain, const F &f) {
+    if (end<=begin) return;
+    grain = std::max(1, grain);
+    JobSystem &jobs = JobSystem::get();
+    int nchunks  = (end - begin + grain - 1)/grain;
+    int nworkers = std::min(jobs.workers(), nchunks);
+    std::atomic<int> next(begin), joined(0);
+    auto run = [&]() {
+        int worker = joined.fetch_add(1);
+        for (int first=next.fetch_add(grain); first<end; first=next.fetch_add(grain)) {
+            int last = std::min(end, first + grain);
+            for (int i=first; i<last; i++) f(i, worker);
+        }
+    };
+    std::atomic<int> pending(nworkers-1);
+    for (int w=1; w<nworkers; w++) jobs.submit(run, &pending);   // run outlives the jobs
+    run();
+    jobs.wait(pending);
+}
+
+// Jobs with dependencies, run once per run(): the jobs without predecessors are submitted first, the
+// job that finishes last among the predecessors of another one submits it. The graph must be acyclic.
+class TaskGraph {
+public:
+    typedef std::function<void()> Job;
+    TaskGraph() : tasks(), pending(NULL) {}
+    int  add(const Job &job);               // returns the task for precede()
+    void precede(int before, int after);   // after starts once before is done
+    void run();                             // returns when every task is done, the caller takes part
+private:
+    struct Task {
+        TaskGraph *graph;
+        Job job;
+        std::vector<int> successors;
+        int predecessors;
+        std::atomic<int> remaining;
+    };
+    static void run_task(void *task);
+    void submit(int task);
+    std::vector<std::unique_ptr<Task> > tasks;
+    std::atomic<int> *pending;  // of run()
+};
+
+// Result of async_job(): get() runs other jobs until the value is there, so jobs may wait for jobs.
+template <typename T> class Future {
+public:
+    Future(const std::shared_ptr<std::atomic<int> > &pending, std::future<T> &&value) : pending(pending), value(std::move(value)) {}
+    bool ready() const { return !pending->load(); }
+    T get() {
+        JobSystem::get().wait(*pending);
+        return value.get();
+    }
+private:
+    std::shared_ptr<std::atomic<int> > pending;
+    std::future<T> value;
+};
+
+// The job of async_job(), it keeps the counter alive until it is counted out
+template <typename T> struct AsyncJob {
+    std::packaged_task<T()> task;
+    std::shared_ptr<std::atomic<int> > pending;
+    static void run(void *context) {
+        std::unique_ptr<AsyncJob> job(static_cast<AsyncJob*>(context));
+        job->task();
+        JobSystem::get().finish(*job->pending);
+    }
+};
+
+template <typename F> Future<typename std::result_of<F()>::type> async_job(const F &f) {
+    typedef typename std::result_of<F()>::type T;
+    AsyncJob<T> *job = new AsyncJob<T>();
+    job->task = std::packaged_task<T()>(f);
+    job->pending = std::make_shared<std::atomic<int> >(1);
+    Future<T> result(job->pending, job->task.get_future());
+    JobSystem::get().submit(&AsyncJob<T>::run, job, NULL);
+    return result;
+}
+
+#endif //__PARALLEL_H__
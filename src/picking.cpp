@@ -0,0 +1,96 @@
+#include <cmath>
+#include <iostream>
+#include <algorithm>
+#include "picking.h"
+
+// the point of the normalized device coordinates moved by inverse, divided by w
+static Vec3f unproject(const Matrix &inverse, float x, float y, float z) {
+    Vec4f p;
+    p[0] = x; p[1] = y; p[2] = z; p[3] = 1;
+    p = inverse*p;
+    return Vec3f(p[0]/p[3], p[1]/p[3], p[2]/p[3]);
+}
+
+// the ray o + t*d crosses the box for some t in [0, tmax]
+static bool ray_box(const Vec3f &o, const Vec3f &d, const Aabb &box, float tmax) {
+    float t0 = 0, t1 = tmax;
+    for (int k=0; k<3; k++) {
+        if (std::abs(d[k])<1e-30f) {
+            if (o[k]<box.min[k] || o[k]>box.max[k]) return false;
+            continue;
+        }
+        float a = (box.min[k] - o[k])/d[k], b = (box.max[k] - o[k])/d[k];
+        t0 = std::max(t0, std::min(a, b));
+        t1 = std::min(t1, std::max(a, b));
+    }
+    return t0<=t1;
+}
+
+bool pick(const Mesh &mesh, const Aabb &box, const std::vector<Matrix> &instances, const Matrix &V, const Matrix &P,
+          float x, float y, int width, int height, Pick &hit) {
+    hit = Pick();
+    if (!mesh.has_streams()) return false;
+    // reverse-Z: the near plane is at the depth 1, the second point halfway to the infinity. The model
+    // matrices are affine, the parameter of a point along the ray is the same in every model space.
+    float nx = (x + .5f)/width*2 - 1, ny = 1 - (y + .5f)/height*2;
+    float tbest = 1e30f;
+    float ubest = 0, vbest = 0;
+    Vec3f obest, dbest;
+    int nfaces = (int)mesh.indices.size()/3;
+    for (size_t i=0; i<instances.size(); i++) {
+        Matrix inverse = (P*V*instances[i]).invert();
+        Vec3f o = unproject(inverse, nx, ny, 1), d = unproject(inverse, nx, ny, .5f) - o;
+        if (!ray_box(o, d, box, tbest)) continue;
+        for (int f=0; f<nfaces; f++) {     // Moller-Trumbore, both sides
+            const float *p0 = &mesh.positions[mesh.indices[f*3]*3];
+            const float *p1 = &mesh.positions[mesh.indices[f*3+1]*3];
+            const float *p2 = &mesh.positions[mesh.indices[f*3+2]*3];
+            Vec3f v0(p0[0], p0[1], p0[2]);
+            Vec3f e1 = Vec3f(p1[0], p1[1], p1[2]) - v0, e2 = Vec3f(p2[0], p2[1], p2[2]) - v0;
+            Vec3f pv = cross(d, e2);
+            float det = e1*pv;
+            if (std::abs(det)<1e-20f) continue;
+            float inv = 1/det;
+            Vec3f tv = o - v0;
+            float u = (tv*pv)*inv;
+            if (u<0 || u>1) continue;
+            Vec3f qv = cross(tv, e1);
+            float v = (d*qv)*inv;
+            if (v<0 || u + v>1) continue;
+            float t = (e2*qv)*inv;
+            if (t<0 || t>=tbest) continue;
+            tbest = t;
+            ubest = u;
+            vbest = v;
+            obest = o;
+            dbest = d;
+            hit.instance = (int)i;
+            hit.triangle = f;
+        }
+    }
+    if (hit.instance<0) return false;
+
+    Vec3f local = obest + dbest*tbest;
+    Vec4f p;
+    p[0] = local.x; p[1] = local.y; p[2] = local.z; p[3] = 1;
+    p = instances[hit.instance]*p;
+    hit.position = Vec3f(p[0], p[1], p[2]);
+    float l[3] = { 1 - ubest - vbest, ubest, vbest };
+    for (int j=0; j<3; j++) {
+        int c = hit.triangle*3 + j;
+        hit.uv.x += l[j]*mesh.uvs[c*2];
+        hit.uv.y += l[j]*mesh.uvs[c*2+1];
+    }
+    return true;
+}
+
+void print_pick(float x, float y, const Pick &hit, const std::vector<int> &ids, const Vec3f &color) {
+    if (hit.instance<0) {
+        std::cerr << "pick " << x << "," << y << ": background" << std::endl;
+        return;
+    }
+    Vec3f position = hit.position, diffuse = color;
+    Vec2f uv = hit.uv;
+    std::cerr << "pick " << x << "," << y << ": instance " << ids[hit.instance] << ", triangle " << hit.triangle
+              << ", at " << position << ", uv " << uv << ", diffuse " << diffuse << std::endl;
+}
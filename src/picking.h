@@ -0,0 +1,28 @@
+#ifndef __PICKING_H__
+#define __PICKING_H__
+
+#include <vector>
+#include "geometry.h"
+#include "culling.h"
+#include "mesh.h"
+
+struct Pick {
+    Pick() : instance(-1), triangle(-1), position(), uv() {}
+    int instance;       // in the list given to pick(), -1 for the background
+    int triangle;       // of the mesh
+    Vec3f position;     // world space
+    Vec2f uv;
+};
+
+// The nearest triangle under the pixel (x, y), counted from the top left corner of a width x height
+// viewport. The ray of the pixel is moved into the model space of every instance whose box it
+// crosses and tested against the triangles of the CPU streams: the positions and the indices, the
+// uvs for the texture coordinates of the hit. False if it misses every instance.
+bool pick(const Mesh &mesh, const Aabb &box, const std::vector<Matrix> &instances, const Matrix &V, const Matrix &P,
+          float x, float y, int width, int height, Pick &hit);
+
+// one line to stderr: the pixel, the stable id of the instance hit (ids, in the order of the instances)
+// with the triangle, the position and the diffuse color, or the background
+void print_pick(float x, float y, const Pick &hit, const std::vector<int> &ids, const Vec3f &color);
+
+#endif //__PICKING_H__
@@ -0,0 +1,99 @@
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <mutex>
+#include <chrono>
+#include <iomanip>
+#include "profiler.h"
+
+std::atomic<bool> profiler_enabled_flag(false);
+
+namespace {
+    struct Event {
+        const char *name;
+        uint64_t start, end;
+    };
+
+    enum { CAPACITY = 1<<16 };  // events kept per thread, the oldest ones are overwritten
+
+    struct ThreadBuffer {
+        ThreadBuffer(int tid) : head(0), tid(tid), name() {}
+        Event events[CAPACITY];
+        std::atomic<uint64_t> head;
+        int tid;
+        std::string name;
+    };
+
+    // buffers are registered once per thread and never freed, the trace keeps the threads that exited
+    std::mutex registry_mutex;
+    std::vector<ThreadBuffer *> registry;
+    thread_local ThreadBuffer *local_buffer = 0;
+
+    const std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+
+    ThreadBuffer *thread_buffer() {
+        if (!local_buffer) {
+            std::lock_guard<std::mutex> lock(registry_mutex);
+            local_buffer = new ThreadBuffer((int)registry.size());
+            registry.push_back(local_buffer);
+        }
+        return local_buffer;
+    }
+}
+
+void profiler_enable(bool enable) {
+    profiler_enabled_flag.store(enable, std::memory_order_relaxed);
+}
+
+uint64_t profiler_now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+}
+
+void profiler_record(const char *name, uint64_t start, uint64_t end) {
+    ThreadBuffer *buf = thread_buffer();
+    uint64_t h = buf->head.load(std::memory_order_relaxed);
+    Event &e = buf->events[h % CAPACITY];
+    e.name  = name;
+    e.start = start;
+    e.end   = end;
+    buf->head.store(h+1, std::memory_order_release);
+}
+
+void profiler_thread_name(const char *name) {
+    thread_buffer()->name = name;
+}
+
+bool profiler_write_trace(const char *filename) {
+    std::ofstream out(filename);
+    if (!out.is_open()) {
+        std::cerr << "Failed to write the trace " << filename << std::endl;
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    out << std::fixed << std::setprecision(3); // microseconds with a nanosecond resolution
+    out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [" << std::endl;
+    bool first = true;
+    size_t nevents = 0;
+    for (size_t t=0; t<registry.size(); t++) {
+        ThreadBuffer *buf = registry[t];
+        if (!buf->name.empty()) {
+            out << (first ? "" : ",\n") << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << buf->tid
+                << ", \"args\": {\"name\": \"" << buf->name << "\"}}";
+            first = false;
+        }
+        uint64_t head = buf->head.load(std::memory_order_acquire);
+        uint64_t begin = head>CAPACITY ? head-CAPACITY : 0;
+        for (uint64_t i=begin; i<head; i++) {
+            const Event &e = buf->events[i % CAPACITY];
+            out << (first ? "" : ",\n") << "{\"name\": \"" << e.name << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << buf->tid
+                << ", \"ts\": " << e.start/1000. << ", \"dur\": " << (e.end - e.start)/1000. << "}";
+            first = false;
+        }
+        nevents += head - begin;
+    }
+    out << std::endl << "]}" << std::endl;
+    std::cerr << "Trace with " << nevents << " zones written to " << filename << std::endl;
+    return true;
+}
+
@@ -0,0 +1,41 @@
+#ifndef __PROFILER_H__
+#define __PROFILER_H__
+
+#include <atomic>
+#include <cstdint>
+
+// Scoped CPU zones exported as Chrome trace events (chrome://tracing, ui.perfetto.dev).
+// Each thread records into its own ring buffer, the hot path takes no lock.
+// PROFILE_ZONE compiles to nothing without REPDVIS_PROFILER; when compiled in but
+// disabled at run time it costs one relaxed atomic load and a branch.
+
+extern std::atomic<bool> profiler_enabled_flag;
+
+inline bool profiler_enabled() { return profiler_enabled_flag.load(std::memory_order_relaxed); }
+void profiler_enable(bool enable);
+uint64_t profiler_now();                                            // nanoseconds since the start of the process
+void profiler_record(const char *name, uint64_t start, uint64_t end);  // name must outlive the export, string literals only
+void profiler_thread_name(const char *name);                        // label the calling thread in the trace
+bool profiler_write_trace(const char *filename);                    // call once the recording threads are done
+
+class ProfileZone {
+public:
+    ProfileZone(const char *name) : name(profiler_enabled() ? name : 0), start(this->name ? profiler_now() : 0) {}
+    ~ProfileZone() { if (name) profiler_record(name, start, profiler_now()); }
+private:
+    ProfileZone(const ProfileZone &);
+    ProfileZone &operator=(const ProfileZone &);
+    const char *name;
+    uint64_t start;
+};
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#ifdef REPDVIS_PROFILER
+#define PROFILE_ZONE(name) ProfileZone PROFILE_CONCAT(profile_zone_, __LINE__)(name)
+#else
+#define PROFILE_ZONE(name)
+#endif
+
+#endif //__PROFILER_H__
+
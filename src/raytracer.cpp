@@ -0,0 +1,600 @@
+#include <cmath>
+#include <chrono>
+#include <algorithm>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "raytracer.h"
+#include "uniforms.h"
+#include "shading.h"
+#include "parallel.h"
+#include "profiler.h"
+
+static float area(const Aabb &box) {
+    Vec3f e = box.max - box.min;
+    return 2*(e.x*e.y + e.y*e.z + e.z*e.x);
+}
+
+static void grow(Aabb &box, const Aabb &other) {
+    for (int k=0; k<3; k++) {
+        box.min[k] = std::min(box.min[k], other.min[k]);
+        box.max[k] = std::max(box.max[k], other.max[k]);
+    }
+}
+
+static Aabb empty_box() {
+    Aabb box;
+    box.min = Vec3f( 1e30f,  1e30f,  1e30f);
+    box.max = Vec3f(-1e30f, -1e30f, -1e30f);
+    return box;
+}
+
+Bvh4::BuildNode Bvh4::make_node(int first, int count) const {
+    BuildNode node;
+    node.left = node.right = node.subtree = -1;
+    node.first = first;
+    node.count = count;
+    node.box = empty_box();
+    for (int i=first; i<first+count; i++) grow(node.box, boxes[order[i]]);
+    return node;
+}
+
+int Bvh4::split(int first, int count) {
+    if (count<=1) return -1;
+    Vec3f cmin = centers[order[first]], cmax = cmin;
+    Aabb parent = empty_box();
+    for (int i=first; i<first+count; i++) {
+        grow(parent, boxes[order[i]]);
+        for (int k=0; k<3; k++) {
+            cmin[k] = std::min(cmin[k], centers[order[i]][k]);
+            cmax[k] = std::max(cmax[k], centers[order[i]][k]);
+        }
+    }
+    // cost of a traversal step and of a primitive test both 1, relative to the area of the parent
+    float best = count*area(parent);
+    int best_axis = -1, best_bin = 0;
+    for (int axis=0; axis<3; axis++) {
+        float extent = cmax[axis] - cmin[axis];
+        if (extent<=0) continue;
+        int counts[BINS] = { 0 };
+        Aabb bins[BINS];
+        for (int b=0; b<BINS; b++) bins[b] = empty_box();
+        for (int i=first; i<first+count; i++) {
+            int b = std::min((int)BINS - 1, (int)((centers[order[i]][axis] - cmin[axis])*BINS/extent));
+            counts[b]++;
+            grow(bins[b], boxes[order[i]]);
+        }
+        // areas and counts right of every plane, then the sweep from the left
+        float right_area[BINS];
+        int right_count[BINS];
+        Aabb box = empty_box();
+        int n = 0;
+        for (int b=BINS-1; b>0; b--) {
+            grow(box, bins[b]);
+            n += counts[b];
+            right_area[b] = area(box);
+            right_count[b] = n;
+        }
+        box = empty_box();
+        n = 0;
+        for (int b=1; b<BINS; b++) {
+            grow(box, bins[b-1]);
+            n += counts[b-1];
+            if (!n || !right_count[b]) continue;
+            float cost = area(parent) + n*area(box) + right_count[b]*right_area[b];
+            if (cost<best) {
+                best = cost;
+                best_axis = axis;
+                best_bin = b;
+            }
+        }
+    }
+    if (best_axis<0) return count>MAX_LEAF ? first + count/2 : -1;  // a leaf is cheaper, or all the centers coincide
+
+    float lo = cmin[best_axis], extent = cmax[best_axis] - lo;
+    std::vector<int>::iterator mid = std::partition(order.begin()+first, order.begin()+first+count, [&](int i) {
+        return std::min((int)BINS - 1, (int)((centers[i][best_axis] - lo)*BINS/extent))<best_bin;
+    });
+    return (int)(mid - order.begin());
+}
+
+int Bvh4::build_subtree(int first, int count, std::vector<BuildNode> &out) {
+    int index = out.size();
+    out.push_back(make_node(first, count));
+    int mid = split(first, count);
+    if (mid>=0) {
+        int left  = build_subtree(first, mid - first, out);
+        int right = build_subtree(mid, first + count - mid, out);
+        out[index].left  = left;
+        out[index].right = right;
+    }
+    return index;
+}
+
+void Bvh4::build(const std::vector<Aabb> &boxes) {
+    this->boxes = boxes;
+    int n = boxes.size();
+    order.resize(n);
+    centers.resize(n);
+    for (int i=0; i<n; i++) {
+        order[i] = i;
+        centers[i] = (boxes[i].min + boxes[i].max)*.5f;
+    }
+    nodes.clear();
+    subtrees.clear();
+    if (!n) return;
+
+    // split the largest ranges on this thread until there are enough subtrees to keep the workers busy
+    std::vector<BuildNode> top(1, make_node(0, n));
+    std::vector<int> open(1, 0);
+    size_t wanted = 4*worker_count();
+    while (open.size()<wanted) {
+        size_t largest = 0;
+        for (size_t i=1; i<open.size(); i++) if (top[open[i]].count>top[open[largest]].count) largest = i;
+        int node = open[largest], first = top[node].first, count = top[node].count;
+        if (count<MIN_TASK) break;
+        int mid = split(first, count);
+        if (mid<0) break;
+        top.push_back(make_node(first, mid - first));
+        top.push_back(make_node(mid, first + count - mid));
+        top[node].left  = top.size() - 2;
+        top[node].right = top.size() - 1;
+        open[largest] = top[node].left;
+        open.push_back(top[node].right);
+    }
+    subtrees.resize(open.size());
+    parallel_for(0, (int)open.size(), 1, [&](int t, int) {
+        build_subtree(top[open[t]].first, top[open[t]].count, subtrees[t]);
+    });
+    for (size_t t=0; t<open.size(); t++) top[open[t]].subtree = t;
+    collapse(&top, 0);
+    subtrees.clear();
+}
+
+// The node of the binary tree and its children, up to four: the inner child with the largest area is
+// opened until there are four or only leaves
+int Bvh4::collapse(const std::vector<BuildNode> *tree, int index) {
+    struct Ref {
+        const std::vector<BuildNode> *tree;
+        int index;
+    };
+    auto resolve = [&](Ref r) {
+        const BuildNode &node = (*r.tree)[r.index];
+        if (node.subtree>=0) {
+            r.tree = &subtrees[node.subtree];
+            r.index = 0;
+        }
+        return r;
+    };
+    Ref self = { tree, index };
+    self = resolve(self);
+    const BuildNode &root = (*self.tree)[self.index];
+    Ref children[4];
+    int n = 0;
+    if (root.left<0) {  // a single leaf, the root is still a node
+        children[n++] = self;
+    } else {
+        Ref left = { self.tree, root.left }, right = { self.tree, root.right };
+        children[n++] = resolve(left);
+        children[n++] = resolve(right);
+    }
+    while (n<4) {
+        int best = -1;
+        float best_area = -1;
+        for (int j=0; j<n; j++) {
+            const BuildNode &c = (*children[j].tree)[children[j].index];
+            if (c.left>=0 && area(c.box)>best_area) {
+                best = j;
+                best_area = area(c.box);
+            }
+        }
+        if (best<0) break;
+        const BuildNode &c = (*children[best].tree)[children[best].index];
+        Ref left = { children[best].tree, c.left }, right = { children[best].tree, c.right };
+        children[best] = resolve(left);
+        children[n++]  = resolve(right);
+    }
+
+    int result = nodes.size();
+    nodes.push_back(Node());
+    Node node;
+    for (int j=0; j<4; j++) {
+        node.child[j] = -1;
+        node.count[j] = 0;
+        for (int k=0; k<3; k++) node.min[k][j] = node.max[k][j] = 0;
+    }
+    for (int j=0; j<n; j++) {
+        const BuildNode &c = (*children[j].tree)[children[j].index];
+        for (int k=0; k<3; k++) {
+            node.min[k][j] = c.box.min[k];
+            node.max[k][j] = c.box.max[k];
+        }
+        if (c.left<0) {
+            node.child[j] = c.first;
+            node.count[j] = c.count;
+        } else {
+            node.child[j] = collapse(children[j].tree, children[j].index);
+        }
+    }
+    nodes[result] = node;
+    return result;
+}
+
+// Mask of the children at least one active ray enters before its tfar, and the nearest entry of each
+int Bvh4::hit_children(const Node &node, const RayPacket &p, const float inv[3][4], float tnear[4]) const {
+    int mask = 0;
+#ifdef __SSE2__
+    const __m128 o[3] = { _mm_loadu_ps(p.ox), _mm_loadu_ps(p.oy), _mm_loadu_ps(p.oz) };
+    const __m128 id[3] = { _mm_loadu_ps(inv[0]), _mm_loadu_ps(inv[1]), _mm_loadu_ps(inv[2]) };
+    const __m128 tfar = _mm_loadu_ps(p.tfar);
+    const __m128i lanes = _mm_setr_epi32(1, 2, 4, 8);
+    const __m128 active = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(_mm_set1_epi32(p.active), lanes), lanes));
+    for (int c=0; c<4; c++) {
+        if (node.child[c]<0) continue;
+        __m128 tmin = _mm_setzero_ps(), tmax = tfar;
+        for (int k=0; k<3; k++) {
+            __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.min[k][c]), o[k]), id[k]);
+            __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.max[k][c]), o[k]), id[k]);
+            tmin = _mm_max_ps(tmin, _mm_min_ps(t0, t1));
+            tmax = _mm_min_ps(tmax, _mm_max_ps(t0, t1));
+        }
+        int hits = _mm_movemask_ps(_mm_and_ps(_mm_cmple_ps(tmin, tmax), active));
+        if (!hits) continue;
+        float t[4];
+        _mm_storeu_ps(t, tmin);
+        tnear[c] = 1e30f;
+        for (int i=0; i<4; i++) if (hits & (1<<i)) tnear[c] = std::min(tnear[c], t[i]);
+        mask |= 1<<c;
+    }
+#else
+    const float *o[3] = { p.ox, p.oy, p.oz };
+    for (int c=0; c<4; c++) {
+        if (node.child[c]<0) continue;
+        tnear[c] = 1e30f;
+        for (int i=0; i<4; i++) {
+            if (!(p.active & (1<<i))) continue;
+            float tmin = 0, tmax = p.tfar[i];
+            for (int k=0; k<3; k++) {
+                float t0 = (node.min[k][c] - o[k][i])*inv[k][i], t1 = (node.max[k][c] - o[k][i])*inv[k][i];
+                tmin = std::max(tmin, std::min(t0, t1));
+                tmax = std::min(tmax, std::max(t0, t1));
+            }
+            if (tmin<=tmax) {
+                mask |= 1<<c;
+                tnear[c] = std::min(tnear[c], tmin);
+            }
+        }
+    }
+#endif
+    return mask;
+}
+
+// Moller-Trumbore for the four rays of the packet against the triangle v0, e1 = v1-v0, e2 = v2-v0:
+// the mask of the active lanes that hit it nearer than their tfar, their distances and barycentrics
+static int intersect(const float *tri, const RayPacket &p, float t[4], float u[4], float v[4]) {
+    const float *v0 = tri, *e1 = tri + 3, *e2 = tri + 6;
+#ifdef __SSE2__
+    __m128 dx = _mm_loadu_ps(p.dx), dy = _mm_loadu_ps(p.dy), dz = _mm_loadu_ps(p.dz);
+    __m128 e1x = _mm_set1_ps(e1[0]), e1y = _mm_set1_ps(e1[1]), e1z = _mm_set1_ps(e1[2]);
+    __m128 e2x = _mm_set1_ps(e2[0]), e2y = _mm_set1_ps(e2[1]), e2z = _mm_set1_ps(e2[2]);
+    __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));     // d x e2
+    __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+    __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+    __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+    __m128 inv = _mm_div_ps(_mm_set1_ps(1.f), det);     // the comparisons below fail on the NaNs of det = 0
+    __m128 tx = _mm_sub_ps(_mm_loadu_ps(p.ox), _mm_set1_ps(v0[0]));
+    __m128 ty = _mm_sub_ps(_mm_loadu_ps(p.oy), _mm_set1_ps(v0[1]));
+    __m128 tz = _mm_sub_ps(_mm_loadu_ps(p.oz), _mm_set1_ps(v0[2]));
+    __m128 bu = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), inv);
+    __m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));     // (o - v0) x e1
+    __m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+    __m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+    __m128 bv = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), inv);
+    __m128 bt = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inv);
+    __m128 zero = _mm_setzero_ps();
+    __m128 hit = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(bu, zero), _mm_cmpge_ps(bv, zero)),
+                            _mm_and_ps(_mm_cmple_ps(_mm_add_ps(bu, bv), _mm_set1_ps(1.f)),
+                                       _mm_and_ps(_mm_cmpgt_ps(bt, zero), _mm_cmplt_ps(bt, _mm_loadu_ps(p.tfar)))));
+    _mm_storeu_ps(t, bt);
+    _mm_storeu_ps(u, bu);
+    _mm_storeu_ps(v, bv);
+    return _mm_movemask_ps(hit) & p.active;
+#else
+    int mask = 0;
+    for (int i=0; i<4; i++) {
+        if (!(p.active & (1<<i))) continue;
+        float d[3] = { p.dx[i], p.dy[i], p.dz[i] }, tv[3] = { p.ox[i] - v0[0], p.oy[i] - v0[1], p.oz[i] - v0[2] };
+        float pv[3] = { d[1]*e2[2] - d[2]*e2[1], d[2]*e2[0] - d[0]*e2[2], d[0]*e2[1] - d[1]*e2[0] };
+        float qv[3] = { tv[1]*e1[2] - tv[2]*e1[1], tv[2]*e1[0] - tv[0]*e1[2], tv[0]*e1[1] - tv[1]*e1[0] };
+        float det = e1[0]*pv[0] + e1[1]*pv[1] + e1[2]*pv[2];
+        if (det==0) continue;
+        u[i] = (tv[0]*pv[0] + tv[1]*pv[1] + tv[2]*pv[2])/det;
+        v[i] = (d[0]*qv[0] + d[1]*qv[1] + d[2]*qv[2])/det;
+        t[i] = (e2[0]*qv[0] + e2[1]*qv[1] + e2[2]*qv[2])/det;
+        if (u[i]>=0 && v[i]>=0 && u[i]+v[i]<=1 && t[i]>0 && t[i]<p.tfar[i]) mask |= 1<<i;
+    }
+    return mask;
+#endif
+}
+
+// Barycentrics of the point where the ray crosses the plane of the triangle, inside or not
+static void plane_barycentrics(const Vec3f &v0, const Vec3f &e1, const Vec3f &e2, const Vec3f &o, const Vec3f &d, float l[3]) {
+    Vec3f pv = cross(d, e2), tv = o - v0, qv = cross(tv, e1);
+    float det = e1*pv;
+    if (det==0) det = 1e-30f;
+    l[1] = (tv*pv)/det;
+    l[2] = (d*qv)/det;
+    l[0] = 1 - l[1] - l[2];
+}
+
+// Deterministic random numbers in [0,1), the same image on every run and for any number of workers
+static float hash01(unsigned x) {
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return (x >> 8)*(1.f/16777216);
+}
+
+static int popcount4(int mask) {
+    return (mask & 1) + (mask>>1 & 1) + (mask>>2 & 1) + (mask>>3 & 1);
+}
+
+RayTracer::RayTracer(const Mesh &mesh, const Material &material, int width, int height, int ao_samples) :
+    width(std::max(1, width)), height(std::max(1, height)), ao_samples(std::max(0, ao_samples)), mesh(mesh), material(material),
+    ao_radius(0), epsilon(0), inverse_projection(Matrix::identity()), inverse_view(Matrix::identity()), light(0, 0, 0), light_world(40, 40, 40),
+    worker_rays(), last() {
+    PROFILE_ZONE("triangle BVH");
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    int nfaces = (int)mesh.indices.size()/3;
+    std::vector<Aabb> boxes(nfaces);
+    parallel_for(0, nfaces, 1024, [&](int f, int) {
+        boxes[f] = empty_box();
+        for (int j=0; j<3; j++) {
+            const float *p = &mesh.positions[mesh.indices[f*3+j]*3];
+            for (int k=0; k<3; k++) {
+                boxes[f].min[k] = std::min(boxes[f].min[k], p[k]);
+                boxes[f].max[k] = std::max(boxes[f].max[k], p[k]);
+            }
+        }
+    });
+    triangles.build(boxes);
+    corners.resize(nfaces*9);
+    parallel_for(0, nfaces, 1024, [&](int i, int) {
+        int f = triangles.order[i];
+        const float *p[3];
+        for (int j=0; j<3; j++) p[j] = &mesh.positions[mesh.indices[f*3+j]*3];
+        for (int k=0; k<3; k++) {
+            corners[i*9+k]   = p[0][k];
+            corners[i*9+3+k] = p[1][k] - p[0][k];
+            corners[i*9+6+k] = p[2][k] - p[0][k];
+        }
+    });
+    local_box = empty_box();
+    for (int f=0; f<nfaces; f++) grow(local_box, boxes[f]);
+    float diagonal = nfaces ? (local_box.max - local_box.min).norm() : 1.f;
+    ao_radius = .2f*diagonal;
+    epsilon   = 1e-4f*diagonal;
+    last.build_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+void RayTracer::camera_ray(float x, float y, Vec3f &origin, Vec3f &direction) const {
+    // from the near plane, z = 1 with the reverse-Z projections, to a point further away
+    float nx = 2*x/width - 1, ny = 2*y/height - 1;
+    Vec4f a = inverse_projection*embed<4>(Vec3f(nx, ny, 1)), b = inverse_projection*embed<4>(Vec3f(nx, ny, .5f));
+    Vec3f near = proj<3>(inverse_view*embed<4>(proj<3>(a/a[3]))), far = proj<3>(inverse_view*embed<4>(proj<3>(b/b[3])));
+    origin = near;
+    direction = far - near;
+}
+
+void RayTracer::trace_mesh(RayPacket &p, bool any_hit) const {
+    triangles.traverse(p, [&](int first, int count, RayPacket &p) {
+        for (int i=first; i<first+count && p.active; i++) {
+            float t[4], u[4], v[4];
+            int hits = intersect(&corners[i*9], p, t, u, v);
+            if (!hits) continue;
+            for (int lane=0; lane<4; lane++) {
+                if (!(hits & (1<<lane))) continue;
+                p.tfar[lane] = t[lane];
+                p.prim[lane] = triangles.order[i];
+                p.u[lane] = u[lane];
+                p.v[lane] = v[lane];
+            }
+            if (any_hit) p.active &= ~hits;
+        }
+    });
+}
+
+void RayTracer::trace(RayPacket &p, bool any_hit) const {
+    objects.traverse(p, [&](int first, int count, RayPacket &p) {
+        for (int i=first; i<first+count && p.active; i++) {
+            int instance = objects.order[i];
+            const Matrix &W = inverses[instance];
+            RayPacket local = p;    // in the model space of the instance, the distances do not change
+            for (int lane=0; lane<4; lane++) {
+                Vec3f o(p.ox[lane], p.oy[lane], p.oz[lane]), d(p.dx[lane], p.dy[lane], p.dz[lane]);
+                Vec3f lo = proj<3>(W*embed<4>(o)), ld = proj<3>(W*embed<4>(d, 0.f));
+                local.ox[lane] = lo.x;
+                local.oy[lane] = lo.y;
+                local.oz[lane] = lo.z;
+                local.dx[lane] = ld.x;
+                local.dy[lane] = ld.y;
+                local.dz[lane] = ld.z;
+                local.prim[lane] = -1;
+            }
+            trace_mesh(local, any_hit);
+            for (int lane=0; lane<4; lane++) {
+                if (local.prim[lane]<0) continue;
+                p.tfar[lane] = local.tfar[lane];
+                p.prim[lane] = local.prim[lane];
+                p.u[lane] = local.u[lane];
+                p.v[lane] = local.v[lane];
+                p.instance[lane] = instance;
+            }
+            if (any_hit) p.active = local.active;
+        }
+    });
+}
+
+void RayTracer::shade(const RayPacket &primary, const int x[4], const int y[4], Vec3f color[4], long rays[3]) const {
+    int hits = 0;
+    Vec3f position[4], normal[4];
+    RayPacket shadow;
+    for (int lane=0; lane<4; lane++) {
+        shadow.prim[lane] = shadow.instance[lane] = -1;
+        shadow.ox[lane] = shadow.oy[lane] = shadow.oz[lane] = shadow.dx[lane] = shadow.dy[lane] = shadow.dz[lane] = 0;
+        shadow.u[lane] = shadow.v[lane] = 0;
+        shadow.tfar[lane] = 1;      // the segments end at the light and at the occlusion radius
+        if (!(primary.active & (1<<lane)) || primary.prim[lane]<0) continue;
+        hits |= 1<<lane;
+        int instance = primary.instance[lane], face = primary.prim[lane];
+        const Matrix &M = models[instance], &W = inverses[instance];
+        Vec3f v[3];
+        for (int j=0; j<3; j++) {
+            const float *p = &mesh.positions[mesh.indices[face*3+j]*3];
+            v[j] = Vec3f(p[0], p[1], p[2]);
+        }
+        Vec3f e1 = v[1] - v[0], e2 = v[2] - v[0];
+        Vec3f p = v[0] + e1*primary.u[lane] + e2*primary.v[lane];
+        position[lane] = proj<3>(M*embed<4>(p));
+        Vec3f n = cross(e1, e2), d(primary.dx[lane], primary.dy[lane], primary.dz[lane]);
+        for (int k=0; k<3; k++) normal[lane][k] = W[0][k]*n[0] + W[1][k]*n[1] + W[2][k]*n[2];  // inverse transpose
+        normal[lane].normalize();
+        if (normal[lane]*d>0) normal[lane] = normal[lane]*-1.f;     // the side the ray comes from
+
+        Vec3f o = position[lane] + normal[lane]*epsilon, to_light = light_world - o;
+        shadow.ox[lane] = o.x;
+        shadow.oy[lane] = o.y;
+        shadow.oz[lane] = o.z;
+        shadow.dx[lane] = to_light.x;
+        shadow.dy[lane] = to_light.y;
+        shadow.dz[lane] = to_light.z;
+    }
+    if (!hits) return;
+
+    RayPacket ambient = shadow;
+    shadow.active = hits;
+    trace(shadow, true);
+    rays[1] += popcount4(hits);
+
+    // cosine weighted directions of the hemisphere of the geometric normal
+    float unoccluded[4] = { 0, 0, 0, 0 };
+    for (int s=0; s<ao_samples; s++) {
+        for (int lane=0; lane<4; lane++) {
+            if (!(hits & (1<<lane))) continue;
+            const Vec3f &n = normal[lane];
+            Vec3f t = cross(n, std::abs(n.x)>.5f ? Vec3f(0, 1, 0) : Vec3f(1, 0, 0)).normalize(), b = cross(n, t);
+            unsigned seed = ((unsigned)(y[lane]*width + x[lane])*(unsigned)ao_samples + s)*2u;
+            float r = std::sqrt(hash01(seed)), phi = 2*(float)M_PI*hash01(seed + 1);
+            Vec3f d = (t*(r*std::cos(phi)) + b*(r*std::sin(phi)) + n*std::sqrt(std::max(0.f, 1 - r*r)))*ao_radius;
+            ambient.dx[lane] = d.x;
+            ambient.dy[lane] = d.y;
+            ambient.dz[lane] = d.z;
+            ambient.tfar[lane] = 1;
+        }
+        ambient.active = hits;
+        trace(ambient, true);
+        rays[2] += popcount4(hits);
+        for (int lane=0; lane<4; lane++) if (ambient.active & (1<<lane)) unoccluded[lane]++;
+    }
+
+    for (int lane=0; lane<4; lane++) {
+        if (!(hits & (1<<lane))) continue;
+        int instance = primary.instance[lane], face = primary.prim[lane];
+        const Matrix &W = inverses[instance];
+        float l[3] = { 1 - primary.u[lane] - primary.v[lane], primary.u[lane], primary.v[lane] }, lx[3], ly[3];
+        // the rays of the neighbour pixels against the plane of the triangle, for the filtering of the textures
+        Vec3f v0, e1, e2, o, d;
+        for (int k=0; k<3; k++) {
+            v0[k] = mesh.positions[mesh.indices[face*3]*3+k];
+            e1[k] = mesh.positions[mesh.indices[face*3+1]*3+k] - v0[k];
+            e2[k] = mesh.positions[mesh.indices[face*3+2]*3+k] - v0[k];
+        }
+        camera_ray(x[lane] + 1.5f, y[lane] + .5f, o, d);
+        plane_barycentrics(v0, e1, e2, proj<3>(W*embed<4>(o)), proj<3>(W*embed<4>(d, 0.f)), lx);
+        camera_ray(x[lane] + .5f, y[lane] + 1.5f, o, d);
+        plane_barycentrics(v0, e1, e2, proj<3>(W*embed<4>(o)), proj<3>(W*embed<4>(d, 0.f)), ly);
+
+        Fragment f = interpolate_fragment(mesh, face, l, lx, ly, model_views[instance], normal_matrices[instance]);
+        float direct = shadow.active & (1<<lane) ? 1.f : 0.f;
+        float ao = ao_samples ? unoccluded[lane]/ao_samples : 1.f;
+        color[lane] = shade_fragment(material, f, light, ao, direct);
+    }
+}
+
+void RayTracer::render(const std::vector<Matrix> &instances, const Matrix &V, const Matrix &P, Image &out) {
+    PROFILE_ZONE("ray tracing");
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    int count = (int)instances.size();
+    models = instances;
+    inverses.resize(count);
+    model_views.resize(count);
+    normal_matrices.resize(count);
+    std::vector<Aabb> boxes(count);
+    for (int i=0; i<count; i++) {
+        inverses[i] = models[i].invert();
+        model_views[i] = V*models[i];
+        normal_matrices[i] = normal_matrix(model_views[i]);
+        boxes[i] = transform_aabb(models[i], local_box);
+    }
+    objects.build(boxes);
+    Matrix projection = P, view = V;
+    inverse_projection = projection.invert();
+    inverse_view = view.invert();
+    light = proj<3>(V*embed<4>(light_world));
+
+    out.width = width;
+    out.height = height;
+    out.channels = 3;
+    out.data.resize(width*height*3);
+    int tiles_x = (width + TILE - 1)/TILE, tiles_y = (height + TILE - 1)/TILE;
+    worker_rays.assign(3*worker_count(), 0);
+    parallel_for(0, tiles_x*tiles_y, 1, [&](int tile, int worker) {
+        int ox = (tile%tiles_x)*TILE, oy = (tile/tiles_x)*TILE;
+        long *rays = &worker_rays[3*worker];
+        for (int py=oy; py<std::min(oy + TILE, height); py+=2) {
+            for (int px=ox; px<std::min(ox + TILE, width); px+=2) {
+                RayPacket packet;
+                int x[4], y[4];
+                packet.active = 0;
+                for (int lane=0; lane<4; lane++) {
+                    x[lane] = px + lane%2;
+                    y[lane] = py + lane/2;
+                    Vec3f o(0, 0, 0), d(0, 0, 1);
+                    if (x[lane]<width && y[lane]<height) {
+                        camera_ray(x[lane] + .5f, y[lane] + .5f, o, d);
+                        packet.active |= 1<<lane;
+                    }
+                    packet.ox[lane] = o.x;
+                    packet.oy[lane] = o.y;
+                    packet.oz[lane] = o.z;
+                    packet.dx[lane] = d.x;
+                    packet.dy[lane] = d.y;
+                    packet.dz[lane] = d.z;
+                    packet.tfar[lane] = 1e30f;
+                    packet.prim[lane] = packet.instance[lane] = -1;
+                    packet.u[lane] = packet.v[lane] = 0;
+                }
+                int pixels = packet.active;
+                trace(packet, false);
+                rays[0] += popcount4(pixels);
+                Vec3f color[4];
+                for (int lane=0; lane<4; lane++) color[lane] = Vec3f(.2f, .3f, .3f);  // glClearColor of the renderer
+                shade(packet, x, y, color, rays);
+                for (int lane=0; lane<4; lane++) {
+                    if (!(pixels & (1<<lane))) continue;
+                    unsigned char *dst = out.data.data() + (y[lane]*width + x[lane])*3;
+                    for (int k=0; k<3; k++) dst[k] = (unsigned char)(std::min(1.f, std::max(0.f, color[lane][k]))*255.f + .5f);
+                }
+            }
+        }
+    });
+    last.primary = last.shadow = last.ambient = 0;
+    for (int w=0; w<worker_count(); w++) {
+        last.primary += worker_rays[3*w];
+        last.shadow  += worker_rays[3*w+1];
+        last.ambient += worker_rays[3*w+2];
+    }
+    last.trace_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
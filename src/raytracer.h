@@ -0,0 +1,137 @@
+#ifndef __RAYTRACER_H__
+#define __RAYTRACER_H__
+
+#include <vector>
+#include <cmath>
+#include "geometry.h"
+#include "culling.h"
+#include "mesh.h"
+#include "material.h"
+
+// Four rays traced together, one SIMD lane each
+struct RayPacket {
+    float ox[4], oy[4], oz[4];
+    float dx[4], dy[4], dz[4];  // not normalized, the points of a ray are o + t*d
+    float tfar[4];              // nearest hit so far; for the occlusion rays, the end of the segment
+    int instance[4], prim[4];   // what was hit, -1 for nothing
+    float u[4], v[4];           // barycentrics of the corners 1 and 2 of the hit triangle
+    int active;                 // mask of the lanes still traced
+};
+
+// Bounding volume hierarchy with four children per node, over boxes. The binary tree is built with
+// the binned surface area heuristic: its top is split on the calling thread until there are enough
+// subtrees for the workers, which build them in parallel. It is then collapsed into 4-wide nodes
+// whose child bounds are stored as structure of arrays, a packet is tested against one child per
+// SSE slab test.
+class Bvh4 {
+public:
+    struct Node {
+        float min[3][4], max[3][4];     // bounds of the children
+        int child[4];                   // node, or first primitive in order for the leaves, -1 for the empty slots
+        int count[4];                   // primitives of the leaves, 0 for the nodes
+    };
+    void build(const std::vector<Aabb> &boxes);
+    // Calls leaf(first, count, packet) for every leaf an active ray reaches, the nearest children first.
+    // The occlusion rays are done as soon as leaf() clears them from packet.active.
+    template <typename Leaf> void traverse(RayPacket &packet, const Leaf &leaf) const;
+
+    std::vector<Node> nodes;    // the root first
+    std::vector<int> order;     // primitives sorted by leaf
+private:
+    struct BuildNode {
+        Aabb box;
+        int left, right;        // -1 for the leaves
+        int first, count;       // range in order
+        int subtree;            // built by a worker into subtrees[subtree], -1 otherwise
+    };
+    enum { BINS = 16, MAX_LEAF = 8, MIN_TASK = 256, STACK = 128 };
+
+    BuildNode make_node(int first, int count) const;
+    int  split(int first, int count);   // partition of the range, first<mid<first+count, or -1 for a leaf
+    int  build_subtree(int first, int count, std::vector<BuildNode> &out);
+    int  collapse(const std::vector<BuildNode> *tree, int index);
+    int  hit_children(const Node &node, const RayPacket &packet, const float inv[3][4], float tnear[4]) const;
+
+    std::vector<Aabb> boxes;
+    std::vector<Vec3f> centers;
+    std::vector<std::vector<BuildNode> > subtrees;
+};
+
+template <typename Leaf> void Bvh4::traverse(RayPacket &p, const Leaf &leaf) const {
+    if (nodes.empty()) return;
+    float inv[3][4];
+    const float *d[3] = { p.dx, p.dy, p.dz };
+    for (int k=0; k<3; k++) {
+        for (int i=0; i<4; i++) inv[k][i] = std::abs(d[k][i])>1e-30f ? 1/d[k][i] : (d[k][i]<0 ? -1e30f : 1e30f);
+    }
+    int stack[STACK];   // nodes, and the leaves as ~(first*MAX_LEAF*2 + count)
+    int top = 0;
+    stack[top++] = 0;
+    while (top && p.active) {
+        int entry = stack[--top];
+        if (entry<0) {
+            entry = ~entry;
+            leaf(entry/(MAX_LEAF*2), entry%(MAX_LEAF*2), p);
+            continue;
+        }
+        const Node &node = nodes[entry];
+        float tnear[4];
+        int mask = hit_children(node, p, inv, tnear);
+        int slots[4], n = 0;
+        for (int c=0; c<4; c++) {
+            if (!(mask & (1<<c))) continue;
+            int j = n++;
+            for (; j>0 && tnear[slots[j-1]]<tnear[c]; j--) slots[j] = slots[j-1];  // the nearest last, popped first
+            slots[j] = c;
+        }
+        for (int j=0; j<n && top<STACK; j++) {
+            int c = slots[j];
+            stack[top++] = node.count[c] ? ~(node.child[c]*MAX_LEAF*2 + node.count[c]) : node.child[c];
+        }
+    }
+}
+
+struct RayStats {
+    RayStats() : primary(0), shadow(0), ambient(0), build_ms(0), trace_ms(0) {}
+    long primary, shadow, ambient;  // rays traced
+    double build_ms;                // BVH of the triangles, once
+    double trace_ms;                // the instance BVH, the tracing and the shading of a frame
+};
+
+// Reference renderer without OpenGL: the primary rays of the pixels, a shadow ray to the light and
+// ambient occlusion rays, in 2x2 pixel packets over 16x16 pixel tiles shared by the workers. The
+// triangles of the mesh are in one model space BVH, the instances of the frame in a BVH of their
+// world boxes whose leaves trace the packet in the model space of each instance. The shading is the
+// one of fragment.glsl: the shadows scale the direct light, the occlusion the ambient term.
+class RayTracer {
+public:
+    RayTracer(const Mesh &mesh, const Material &material, int width, int height, int ao_samples);
+    void render(const std::vector<Matrix> &instances, const Matrix &V, const Matrix &P, Image &out);
+    const RayStats &stats() const { return last; }
+
+    int width, height;
+    int ao_samples;
+private:
+    enum { TILE = 16 };
+    void camera_ray(float x, float y, Vec3f &origin, Vec3f &direction) const;
+    void trace(RayPacket &packet, bool any_hit) const;     // nearest hits, or only the occlusion
+    void trace_mesh(RayPacket &packet, bool any_hit) const;
+    // shadow and occlusion rays of the hits, then fragment.glsl; x and y are the pixels of the lanes
+    void shade(const RayPacket &primary, const int x[4], const int y[4], Vec3f color[4], long rays[3]) const;
+
+    const Mesh &mesh;
+    const Material &material;
+    Bvh4 triangles;
+    std::vector<float> corners;     // v0, v1-v0, v2-v0 of the triangles, in the order of the BVH
+    Aabb local_box;
+    float ao_radius, epsilon;       // length of the occlusion rays, offset of the secondary rays
+    Bvh4 objects;                   // the instances of the frame
+    std::vector<Matrix> models, inverses, model_views;
+    std::vector<mat<3,3,float> > normal_matrices;
+    Matrix inverse_projection, inverse_view;
+    Vec3f light, light_world;
+    std::vector<long> worker_rays;  // primary, shadow and ambient per worker
+    RayStats last;
+};
+
+#endif //__RAYTRACER_H__
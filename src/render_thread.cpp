@@ -0,0 +1,105 @@
+#include "render_thread.h"
+#include "profiler.h"
+
+const double RenderThread::SHADER_POLL_INTERVAL = .1;
+
+RenderThread::RenderThread(GLFWwindow *window, Renderer &renderer, int fps) : window(window), renderer(renderer), scheduler(fps), quit(false),
+    pick_pending(false), pick_x(0), pick_y(0), pick_width(0), pick_height(0) {}
+
+void RenderThread::start() {
+    glfwMakeContextCurrent(NULL);   // a context can be current on one thread only
+    thread = std::thread(&RenderThread::run, this);
+}
+
+void RenderThread::stop() {
+    quit.store(true);
+    { std::lock_guard<std::mutex> lock(wake_mutex); }
+    wake.notify_one();
+    thread.join();
+    glfwMakeContextCurrent(window);
+}
+
+void RenderThread::publish() {
+    scene.publish();
+    { std::lock_guard<std::mutex> lock(wake_mutex); }  // the render thread is either asleep or has not checked fresh() yet
+    wake.notify_one();
+}
+
+void RenderThread::pick(float x, float y, int width, int height) {
+    {
+        std::lock_guard<std::mutex> lock(wake_mutex);
+        pick_x = x;
+        pick_y = y;
+        pick_width = width;
+        pick_height = height;
+        pick_pending.store(true);
+    }
+    wake.notify_one();
+}
+
+// between two frames: the residency of the renderer may read the CPU copies back and free them again
+void RenderThread::run_pick() {
+    PROFILE_ZONE("pick");
+    float x, y;
+    int width, height;
+    {
+        std::lock_guard<std::mutex> lock(wake_mutex);
+        x = pick_x;
+        y = pick_y;
+        width = pick_width;
+        height = pick_height;
+        pick_pending.store(false);
+    }
+    const SceneState &state = scene.read_slot();    // the frame on the screen
+    Pick hit;
+    Vec3f color;
+    renderer.pick(state.instances, state.V, state.P, x, y, width, height, hit, color);
+    print_pick(x, y, hit, state.ids, color);
+}
+
+void RenderThread::run() {
+    profiler_thread_name("render");
+    glfwMakeContextCurrent(window);
+    scheduler.set_swap_interval();
+
+    GpuTimer &gpu_timer = renderer.gpu_timer;
+    bool redraw = false;    // the last state again, a shader was swapped in
+    while (!quit.load()) {
+        if (pick_pending.load()) run_pick();
+        if (!scene.update() && !redraw) {   // nothing new to draw, sleep until the next state or the next report
+            PROFILE_ZONE("idle");
+            // with hot reload the shaders are polled as well, an edit shows up without a new state
+            double timeout = renderer.hot_reload() ? SHADER_POLL_INTERVAL : FrameScheduler::REPORT_INTERVAL;
+            {
+                std::unique_lock<std::mutex> lock(wake_mutex);
+                wake.wait_for(lock, std::chrono::duration<double>(timeout),
+                              [this]() { return quit.load() || scene.fresh() || pick_pending.load(); });
+            }
+            scheduler.idle();
+            redraw = renderer.hot_reload() && renderer.update_shaders();
+            continue;
+        }
+        redraw = false;
+        PROFILE_ZONE("frame");
+        scheduler.wait_for_slot();
+        const SceneState &state = scene.read_slot();
+
+        gpu_timer.begin_frame();
+        int frame_scope = gpu_timer.begin("frame");
+        renderer.render(state.instances, state.V, state.P, &state.ids, &state.lights);
+
+        int swap_scope = gpu_timer.begin("swap");
+        {
+            PROFILE_ZONE("swap");
+            glfwSwapBuffers(window);
+        }
+        gpu_timer.end(swap_scope);
+        gpu_timer.end(frame_scope);
+        gpu_timer.end_frame();
+        gpu_timer.report();
+
+        scheduler.frame_done();
+    }
+    glfwMakeContextCurrent(NULL);
+}
+
@@ -0,0 +1,50 @@
+#ifndef __RENDER_THREAD_H__
+#define __RENDER_THREAD_H__
+
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <GLFW/glfw3.h>
+#include "renderer.h"
+#include "scheduler.h"
+#include "scene.h"
+#include "triple_buffer.h"
+
+// Owns the GL context of the window while it runs. The main thread keeps the GLFW events and the
+// simulation, it writes the scene into write_slot() and calls publish(); the render thread draws
+// the latest published state. Neither side waits for the other: a slow frame does not delay the
+// input and a burst of events does not delay the frames.
+class RenderThread {
+public:
+    RenderThread(GLFWwindow *window, Renderer &renderer, int fps);
+    void start();               // the context must be current on the caller, it is handed over to the render thread
+    void stop();                // join, the context is current on the caller again
+
+    SceneState &write_slot() { return scene.write_slot(); }
+    void publish();             // hand the state over and wake the render thread up if it sleeps
+    // what is under the pixel (x, y) of the last published state, looked up by the render thread before
+    // its next frame and printed, see Renderer::pick(); a pending pick is replaced
+    void pick(float x, float y, int width, int height);
+
+private:
+    static const double SHADER_POLL_INTERVAL;  // seconds between two looks at the edited shaders when idle
+    void run();
+    void run_pick();
+
+    GLFWwindow *window;
+    Renderer &renderer;
+    FrameScheduler scheduler;
+    TripleBuffer<SceneState> scene;
+    std::atomic<bool> quit;
+    std::thread thread;
+
+    std::mutex wake_mutex;      // guards the sleep when there is nothing to draw and the pick, never the scene
+    std::condition_variable wake;
+    std::atomic<bool> pick_pending;
+    float pick_x, pick_y;
+    int pick_width, pick_height;
+};
+
+#endif //__RENDER_THREAD_H__
+
@@ -0,0 +1,496 @@
+#include <iostream>
+#include <fstream>
+#include <cmath>
+#include <algorithm>
+#include "renderer.h"
+#include "shader.h"
+#include "profiler.h"
+
+static const char *vertex_shader   = "../shaders/vertex.glsl";
+static const char *fragment_shader = "../shaders/fragment.glsl";
+static const char *depth_shader    = "../shaders/depth.glsl";
+static const char *visibility_shader = "../shaders/visibility.glsl";
+static const char *fullscreen_shader = "../shaders/fullscreen.glsl";
+static const char *micro_merge_shader = "../shaders/micro_merge.glsl";
+static const char *large_triangles_shader = "../shaders/large_triangles.glsl";
+
+Renderer::Renderer(Model &model, const char *diffuse, const char *tangentnm, const char *specular, bool quantized, int max_instances,
+                   bool hot_reload, unsigned paths) :
+    gpu_timer(), programs("shadercache", hot_reload),     // before the first submit, an edit then recompiles its stage only
+    program_build(programs.submit(vertex_shader, fragment_shader, Material::shader_features(tangentnm, specular) | (quantized ? SHADER_QUANTIZED : 0))),
+    prog_hdlr(0), prog_instanced(0), prog_gpu_driven(0), prog_depth(0), prog_depth_instanced(0), prog_gbuffer(0), prog_gbuffer_instanced(0), prog_ids(0), prog_ids_instanced(0), prog_resolve(0), prog_merge(0), prog_large(0), prog_features(0), mesh(model), material(diffuse, tangentnm, specular), bounds(),
+    uniforms(std::max(1, max_instances)), occlusion(), deferred(), clusters(), visibility(), micro(),
+    fragment_invocations_counter(GL_FRAGMENT_SHADER_INVOCATIONS), samples_passed_counter(GL_SAMPLES_PASSED), quantized(quantized), variants(),
+    shader_watcher(), reloads(), texture_files(), assets("assetcache"), residency(), mesh_asset(-1), material_asset(-1) {
+    texture_files.push_back(diffuse);
+    texture_files.push_back(tangentnm);
+    texture_files.push_back(specular);
+    model.get_bbox(bounds.min, bounds.max);
+    submit_paths(paths, programs.features(program_build), max_instances>1 && uniforms.instancing());
+    mesh.upload(quantized);
+    // Load the textures, specular goes to the alpha channel of the diffuse map, normals are stored as two channels
+    material.upload();
+
+    // the cheapest variant for the maps that were actually loaded, normally the one submitted above
+    prog_features = material.shader_features() | (quantized ? SHADER_QUANTIZED : 0);
+    prog_hdlr = program(prog_features);
+    if (max_instances>1 && uniforms.instancing()) prog_instanced = program(prog_features | SHADER_INSTANCING);
+
+    glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
+    glEnable(GL_DEPTH_TEST);
+    glClearDepth(0);
+    glDepthFunc(GL_GREATER);   // accept fragment if it is closer to the camera than the former one
+    if (hot_reload) shader_watcher.watch("../shaders");
+}
+
+GLuint Renderer::program(unsigned features) {
+    std::map<unsigned, GLuint>::iterator it = variants.find(features);
+    if (it!=variants.end()) return it->second;
+
+    GLuint prog = programs.get(submit(features));
+    variants[features] = prog;
+    if (prog) setup_program(prog, features);
+    return prog;
+}
+
+int Renderer::submit(unsigned features) {
+    const char *vs = vertex_shader, *fs = fragment_shader;
+    if (features & SHADER_MICRO) {  // the large triangles into the visibility buffer, or the merge of the small ones
+        vs = features & SHADER_DEPTH_ONLY ? large_triangles_shader : fullscreen_shader;
+        fs = features & SHADER_DEPTH_ONLY ? visibility_shader : micro_merge_shader;
+    } else if (features & SHADER_DEPTH_ONLY) fs = features & SHADER_VISIBILITY ? visibility_shader : depth_shader;
+    else if (features & SHADER_VISIBILITY) vs = fullscreen_shader;    // the shading pass of the visibility buffer
+    return programs.submit(vs, fs, features);
+}
+
+// the features the enable_* will ask for, in the order the caller runs them: program() finds these
+// builds in the cache and only waits for what is left of their compile
+void Renderer::submit_paths(unsigned paths, unsigned features, bool instancing) {
+    unsigned depth = (features & SHADER_QUANTIZED) | SHADER_DEPTH_ONLY;
+    if (instancing) submit(features | SHADER_INSTANCING);
+    if (paths & PATH_CLUSTERED) {
+        submit(features | SHADER_CLUSTERED);
+        if (instancing) submit(features | SHADER_CLUSTERED | SHADER_INSTANCING);
+        features |= SHADER_CLUSTERED;
+    }
+    if ((paths & PATH_OCCLUSION) && OcclusionCuller::supported()) submit(features | SHADER_GPU_DRIVEN);
+    if (paths & PATH_DEPTH_PREPASS) {
+        submit(depth);
+        if (instancing) submit(depth | SHADER_INSTANCING);
+    }
+    if (paths & PATH_DEFERRED) {
+        submit(features | SHADER_GBUFFER);
+        if (instancing) submit(features | SHADER_GBUFFER | SHADER_INSTANCING);
+    }
+    if (paths & PATH_VISIBILITY) {
+        submit(depth | SHADER_VISIBILITY);
+        if (instancing) submit(depth | SHADER_VISIBILITY | SHADER_INSTANCING);
+        submit(features | SHADER_VISIBILITY);
+    }
+    if ((paths & PATH_MICRO_RASTER) && MicroRasterizer::supported()) {
+        submit(SHADER_MICRO);
+        submit(SHADER_MICRO | SHADER_DEPTH_ONLY | SHADER_VISIBILITY);
+    }
+}
+
+void Renderer::setup_program(GLuint prog, unsigned features) {
+    // per-frame and per-object constants live in a ring-buffered uniform buffer
+    uniforms.bind_blocks(prog);
+
+    // the samplers never change their texture units, set them once
+    glUseProgram(prog);
+    glUniform1i(glGetUniformLocation(prog, "diffspec"),  0);
+    glUniform1i(glGetUniformLocation(prog, "tangentnm"), 1);
+    if (features & SHADER_GPU_DRIVEN) glUniform1i(glGetUniformLocation(prog, "Models"), OcclusionCuller::MODELS_UNIT);
+    if (features & SHADER_CLUSTERED)  clusters.setup_program(prog);
+    if (features & SHADER_VISIBILITY) visibility.setup_program(prog);
+    if (features & SHADER_QUANTIZED) {
+        glUniform3f(glGetUniformLocation(prog, "QuantScale"),  mesh.quant_scale.x,  mesh.quant_scale.y,  mesh.quant_scale.z);
+        glUniform3f(glGetUniformLocation(prog, "QuantOffset"), mesh.quant_offset.x, mesh.quant_offset.y, mesh.quant_offset.z);
+    }
+}
+
+void Renderer::manage_residency(const char *model_file, size_t cpu_budget, size_t gpu_budget) {
+    PROFILE_ZONE("residency");
+    residency.set_budgets(cpu_budget, gpu_budget);
+    // a copy that cannot be cached stays on the CPU
+    std::string mesh_file = assets.file("mesh1", std::vector<std::string>(1, model_file));
+    if (!std::ifstream(mesh_file.c_str()) && !mesh.save_streams(mesh_file)) mesh_file = "";
+    mesh_asset = residency.add(std::string("mesh ") + model_file, mesh_file, mesh.stream_bytes(),
+                               [this, mesh_file]() { return mesh.load_streams(mesh_file); }, [this]() { mesh.release_streams(); });
+    residency.uploaded(mesh_asset, mesh.gpu_bytes());
+
+    std::string material_file = assets.file("textures1", texture_files);
+    if (!std::ifstream(material_file.c_str()) && !material.save_images(material_file)) material_file = "";
+    material_asset = residency.add("textures " + texture_files[0], material_file, material.image_bytes(),
+                                   [this, material_file]() { return material.load_images(material_file); }, [this]() { material.release_images(); });
+    residency.uploaded(material_asset, material.gpu_bytes());
+
+    residency.trim();
+    residency.report();
+}
+
+bool Renderer::pick(const std::vector<Matrix> &instances, const Matrix &V, const Matrix &P, float x, float y, int width, int height,
+                    Pick &hit, Vec3f &color) {
+    PROFILE_ZONE("pick");
+    bool managed = mesh_asset>=0;
+    if (managed && (!residency.acquire(mesh_asset) || !residency.acquire(material_asset))) return false;
+    bool found = ::pick(mesh, bounds, instances, V, P, x, y, width, height, hit);
+    color = Vec3f(0, 0, 0);
+    Image &diffuse = material.diffspec;
+    if (found && !diffuse.data.empty()) {     // nearest texel, the uvs may wrap
+        int tx = (int)std::floor((hit.uv.x - std::floor(hit.uv.x))*diffuse.width);
+        int ty = (int)std::floor((hit.uv.y - std::floor(hit.uv.y))*diffuse.height);
+        unsigned char *texel = diffuse.texel(std::min(tx, diffuse.width-1), std::min(ty, diffuse.height-1));
+        color = Vec3f(texel[0], texel[1], texel[2])/255.f;
+    }
+    if (managed) residency.trim();
+    return found;
+}
+
+bool Renderer::enable_occlusion() {
+    if (!OcclusionCuller::supported()) {
+        std::cerr << "Occlusion culling needs OpenGL 4.3, the context is " << glGetString(GL_VERSION) << ": frustum culling only" << std::endl;
+        return false;
+    }
+    prog_gpu_driven = program(prog_features | SHADER_GPU_DRIVEN);
+    if (!prog_gpu_driven || !occlusion.init(programs, uniforms.max_objects(), bounds, mesh.nverts())) {
+        std::cerr << "Occlusion culling disabled, the programs failed" << std::endl;
+        prog_gpu_driven = 0;
+        return false;
+    }
+    mesh.set_instance_list(occlusion.instance_list());
+    std::cerr << "Occlusion culling: two-phase, hierarchical depth" << std::endl;
+    return true;
+}
+
+bool Renderer::enable_depth_prepass() {
+    if (!mesh.has_streams()) {
+        std::cerr << "Depth pre-pass ignored: the mesh streams were released" << std::endl;
+        return false;
+    }
+    if (prog_gbuffer) {
+        std::cerr << "Depth pre-pass ignored: the light passes of the deferred shading run once per pixel already" << std::endl;
+        return false;
+    }
+    if (prog_gpu_driven) {
+        std::cerr << "Depth pre-pass ignored: the occlusion culling draws the depth of the visible instances first already" << std::endl;
+        return false;
+    }
+    unsigned features = (prog_features & SHADER_QUANTIZED) | SHADER_DEPTH_ONLY;  // the material does not matter
+    prog_depth = program(features);
+    if (prog_instanced) prog_depth_instanced = program(features | SHADER_INSTANCING);
+    if (!prog_depth || (prog_instanced && !prog_depth_instanced)) {
+        std::cerr << "Depth pre-pass disabled, the program failed" << std::endl;
+        prog_depth = prog_depth_instanced = 0;
+        return false;
+    }
+    mesh.upload_depth_stream();
+    std::cerr << "Depth pre-pass: " << mesh.positions.size()/3 << " shared positions instead of " << mesh.nverts() << " vertices"
+              << (fragment_invocations_counter.enabled() ? "" : ", fragment invocations are not counted (no pipeline statistics)") << std::endl;
+    return true;
+}
+
+bool Renderer::enable_clustered() {
+    if (prog_gpu_driven || prog_depth || prog_gbuffer) {
+        std::cerr << "Clustered shading ignored: it has to be enabled before the other paths" << std::endl;
+        return false;
+    }
+    GLuint single = program(prog_features | SHADER_CLUSTERED);
+    GLuint instanced = prog_instanced ? program(prog_features | SHADER_CLUSTERED | SHADER_INSTANCING) : 0;
+    if (!single || (prog_instanced && !instanced)) {
+        std::cerr << "Clustered shading disabled, the program failed" << std::endl;
+        return false;
+    }
+    clusters.init();
+    prog_features |= SHADER_CLUSTERED;     // the variants enabled from now on shade the lights as well
+    prog_hdlr = single;
+    prog_instanced = instanced;
+    std::cerr << "Clustered shading: up to " << MAX_LIGHTS << " point lights" << std::endl;
+    return true;
+}
+
+bool Renderer::cluster_stats(ClusterStats &stats) const {
+    if (!clusters.enabled()) return false;
+    stats = clusters.stats();
+    return true;
+}
+
+bool Renderer::enable_visibility() {
+    if (!mesh.has_streams()) {
+        std::cerr << "Visibility buffer ignored: the mesh streams were released" << std::endl;
+        return false;
+    }
+    if (prog_gpu_driven || prog_depth || prog_gbuffer) {
+        std::cerr << "Visibility buffer ignored: not combined with the occlusion culling, the depth pre-pass nor the deferred shading" << std::endl;
+        return false;
+    }
+    if (!visibility.init(mesh, uniforms.max_objects())) return false;
+    unsigned features = (prog_features & SHADER_QUANTIZED) | SHADER_DEPTH_ONLY | SHADER_VISIBILITY;
+    prog_ids = program(features);
+    if (prog_instanced) prog_ids_instanced = program(features | SHADER_INSTANCING);
+    prog_resolve = program(prog_features | SHADER_VISIBILITY);
+    if (!prog_ids || (prog_instanced && !prog_ids_instanced) || !prog_resolve) {
+        std::cerr << "Visibility buffer disabled, the programs failed" << std::endl;
+        prog_ids = prog_ids_instanced = prog_resolve = 0;
+        visibility.release();
+        return false;
+    }
+    mesh.upload_depth_stream();
+    std::cerr << "Visibility buffer: 32-bit triangle ids from " << mesh.positions.size()/3 << " shared positions, one shading pass" << std::endl;
+    return true;
+}
+
+bool Renderer::enable_micro_raster(float micro_size) {
+    if (!prog_resolve) {
+        std::cerr << "Compute rasterization ignored: it writes into the visibility buffer, enable it first" << std::endl;
+        return false;
+    }
+    if (!MicroRasterizer::supported()) {
+        std::cerr << "Compute rasterization needs OpenGL 4.3, the context is " << glGetString(GL_VERSION) << std::endl;
+        return false;
+    }
+    prog_merge = program(SHADER_MICRO);
+    prog_large = program(SHADER_MICRO | SHADER_DEPTH_ONLY | SHADER_VISIBILITY);
+    if (!prog_merge || !prog_large || !micro.init(programs, mesh, uniforms.max_objects(), micro_size)) {
+        std::cerr << "Compute rasterization disabled, the programs failed" << std::endl;
+        prog_merge = prog_large = 0;
+        micro.release();
+        return false;
+    }
+    std::cerr << "Compute rasterization: triangles up to " << micro_size << " pixels wide, "
+              << (micro.atomic64() ? "64-bit atomics" : "a depth and an id pass of 32-bit atomics") << std::endl;
+    return true;
+}
+
+bool Renderer::enable_deferred() {
+    if (prog_gpu_driven || prog_depth || clusters.enabled()) {
+        std::cerr << "Deferred shading ignored: not combined with the occlusion culling, the depth pre-pass nor the clustered shading" << std::endl;
+        return false;
+    }
+    prog_gbuffer = program(prog_features | SHADER_GBUFFER);
+    if (prog_instanced) prog_gbuffer_instanced = program(prog_features | SHADER_GBUFFER | SHADER_INSTANCING);
+    if (!prog_gbuffer || (prog_instanced && !prog_gbuffer_instanced) || !deferred.init(programs, uniforms, prog_features)) {
+        std::cerr << "Deferred shading disabled, the programs failed" << std::endl;
+        prog_gbuffer = prog_gbuffer_instanced = 0;
+        return false;
+    }
+    std::cerr << "Deferred shading: 12 bytes per pixel G-buffer, one light volume per point light" << std::endl;
+    return true;
+}
+
+bool Renderer::update_shaders() {
+    std::vector<std::string> files = shader_watcher.changed();
+    bool swapped = false;
+    for (size_t i=0; i<files.size(); i++) {
+        std::vector<int> handles = programs.reload(files[i]);
+        reloads.insert(reloads.end(), handles.begin(), handles.end());
+    }
+    for (size_t i=0; i<reloads.size(); ) {
+        if (!programs.ready(reloads[i])) {  // still compiling in the driver threads, keep drawing with the old program
+            i++;
+            continue;
+        }
+        unsigned features = programs.features(reloads[i]);
+        std::vector<std::string> files = programs.files(reloads[i]);
+        GLuint prog = programs.get(reloads[i]);
+        if (prog && files.size()==1) {   // a compute shader of the occlusion culling or of the compute rasterizer
+            occlusion.reloaded(files[0], prog);
+            micro.reloaded(files[0], prog);
+        } else if (prog && deferred.reloaded(files, features, prog)) {
+            // a light pass
+        } else if (prog) {     // linked: the previous program of the variant is gone, use the new one from this frame on
+            setup_program(prog, features);
+            variants[features] = prog;
+            if (features==prog_features) prog_hdlr = prog;
+            if (features==(prog_features | SHADER_INSTANCING)) prog_instanced = prog;
+            if (features==(prog_features | SHADER_GPU_DRIVEN)) prog_gpu_driven = prog;
+            // the passes by their variant, most specific bit first: the large triangles of the micro
+            // rasterizer and the ids of the visibility buffer are depth-only variants as well
+            if (features & SHADER_MICRO) {
+                if (prog_merge) (features & SHADER_DEPTH_ONLY ? prog_large : prog_merge) = prog;
+            } else if (features & SHADER_VISIBILITY) {
+                if (prog_resolve && (features & SHADER_DEPTH_ONLY)) (features & SHADER_INSTANCING ? prog_ids_instanced : prog_ids) = prog;
+                else if (prog_resolve)                            prog_resolve = prog;
+            } else if (features & SHADER_GBUFFER) {
+                if (prog_gbuffer) (features & SHADER_INSTANCING ? prog_gbuffer_instanced : prog_gbuffer) = prog;
+            } else if (features & SHADER_DEPTH_ONLY) {
+                if (prog_depth) (features & SHADER_INSTANCING ? prog_depth_instanced : prog_depth) = prog;
+            }
+        }
+        swapped = swapped || prog;
+        reloads.erase(reloads.begin()+i);
+    }
+    return swapped;
+}
+
+void Renderer::frame_uniforms(const Matrix &V, const Matrix &P, const std::vector<PointLight> *lights) {
+    FrameUniforms &frame = uniforms.frame();
+    std140_mat4(frame.V, V);
+    std140_mat4(frame.P, P);
+    Vec4f light = V*embed<4>(Vec3f(40, 40, 40));
+    for (int k=0; k<4; k++) frame.LightPosition_cameraspace[k] = light[k];
+    if (clusters.enabled()) {
+        static const std::vector<PointLight> no_lights;
+        GLint viewport[4];
+        glGetIntegerv(GL_VIEWPORT, viewport);
+        clusters.update(lights ? *lights : no_lights, V, P, viewport[2], viewport[3]);
+        clusters.bind();
+    }
+}
+
+void Renderer::render(const std::vector<Matrix> &instances, const Matrix &V, const Matrix &P, const std::vector<int> *ids,
+                      const std::vector<PointLight> *lights) {
+    if (shader_watcher.enabled()) update_shaders();
+    if (prog_gpu_driven) {
+        render_occluded(instances, V, P, ids, lights);
+        return;
+    }
+    int count = std::min((int)instances.size(), uniforms.max_objects());
+
+    int clear_scope = gpu_timer.begin("clear");
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    if (prog_gbuffer) deferred.begin_geometry();
+    gpu_timer.end(clear_scope);
+
+    {
+        // Send our transformations to the shader: the frame constants once, then one block per object
+        PROFILE_ZONE("uniforms");
+        frame_uniforms(V, P, lights);
+        for (int i=0; i<count; i++) {
+            const Matrix &M = instances[i];
+            Matrix MV = V*M;
+            ObjectUniforms &object = uniforms.object(i);
+            std140_mat4(object.M, M);
+            std140_mat4(object.MV, MV);
+            std140_mat4(object.MVP, P*MV);
+            std140_mat3(object.N, normal_matrix(MV));
+            object.info[0] = (float)i;
+        }
+        uniforms.upload(count);
+    }
+
+    if (prog_depth) {
+        int depth_scope = gpu_timer.begin("depth prepass");
+        glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+        draw_objects(count, prog_depth, prog_depth_instanced, true);
+        glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+        glDepthFunc(GL_EQUAL);      // only the nearest surface is shaded, the depth is final
+        glDepthMask(GL_FALSE);
+        gpu_timer.end(depth_scope);
+    }
+
+    if (prog_resolve) {
+        int ids_scope = gpu_timer.begin("visibility ids");
+        visibility.begin_geometry(instances, count, V);
+        if (prog_merge) {
+            int micro_scope = gpu_timer.begin("micro raster");
+            micro.raster(count, P);
+            gpu_timer.end(micro_scope);
+            micro.merge(prog_merge);
+            micro.draw_large(prog_large);
+        } else {
+            draw_objects(count, prog_ids, prog_ids_instanced, true);
+        }
+        gpu_timer.end(ids_scope);
+    }
+
+    int draw_scope = gpu_timer.begin(prog_gbuffer ? "geometry" : prog_resolve ? "resolve" : "draw");
+    fragment_invocations_counter.begin();
+    samples_passed_counter.begin();
+    material.bind();
+    if (prog_gbuffer)      draw_objects(count, prog_gbuffer, prog_gbuffer_instanced, false);
+    else if (prog_resolve) visibility.resolve(prog_resolve);
+    else                   draw_objects(count, prog_hdlr, prog_instanced, false);
+    fragment_invocations_counter.end();
+    samples_passed_counter.end();
+    if (prog_depth) {
+        glDepthFunc(GL_GREATER);
+        glDepthMask(GL_TRUE);       // or the next glClear leaves the depth alone
+    }
+    gpu_timer.end(draw_scope);
+    if (prog_gbuffer) {
+        int light_scope = gpu_timer.begin("lights");
+        static const std::vector<PointLight> no_lights;
+        deferred.light(lights ? *lights : no_lights, P);
+        gpu_timer.end(light_scope);
+    }
+    uniforms.end_frame();
+}
+
+void Renderer::draw_objects(int count, GLuint single, GLuint instanced, bool depth_only) {
+    PROFILE_ZONE("draw submit");
+    if (count>1 && instanced) {
+        glUseProgram(instanced);
+        for (int first=0; first<count; first+=MAX_INSTANCES) {
+            int n = std::min((int)MAX_INSTANCES, count-first);
+            uniforms.bind_objects(first, n);
+            if (depth_only) mesh.draw_depth(n);
+            else            mesh.draw(n);
+        }
+    } else {
+        glUseProgram(single);
+        for (int i=0; i<count; i++) {
+            uniforms.bind_object(i);
+            if (depth_only) mesh.draw_depth();
+            else            mesh.draw();    // draw the triangles!
+        }
+    }
+}
+
+// The instances drawn last frame first, then the ones the depth pyramid of those reveals, see occlusion.h
+void Renderer::render_occluded(const std::vector<Matrix> &instances, const Matrix &V, const Matrix &P, const std::vector<int> *ids,
+                               const std::vector<PointLight> *lights) {
+    PROFILE_ZONE("draw submit");
+    occlusion.begin_frame(instances, ids, P*V);
+    frame_uniforms(V, P, lights);
+    uniforms.upload(0);
+
+    int clear_scope = gpu_timer.begin("clear");
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    gpu_timer.end(clear_scope);
+
+    fragment_invocations_counter.begin();
+    samples_passed_counter.begin();
+    int early_scope = gpu_timer.begin("draw early");
+    occlusion.cull(0);
+    material.bind();
+    glUseProgram(prog_gpu_driven);
+    occlusion.draw(mesh, 0);
+    gpu_timer.end(early_scope);
+
+    int pyramid_scope = gpu_timer.begin("depth pyramid");
+    occlusion.build_pyramid();
+    gpu_timer.end(pyramid_scope);
+
+    int late_scope = gpu_timer.begin("draw late");
+    occlusion.cull(1);
+    glUseProgram(prog_gpu_driven);
+    occlusion.draw(mesh, 1);
+    gpu_timer.end(late_scope);
+    fragment_invocations_counter.end();
+    samples_passed_counter.end();
+
+    occlusion.end_frame();
+    uniforms.end_frame();
+    occlusion.report();
+}
+
+void Renderer::release() {
+    // properly de-allocate all the resources once they have outlived their purpose
+    glUseProgram(0);
+    programs.release();     // all the variants
+    variants.clear();
+    occlusion.release();
+    deferred.release();
+    clusters.release();
+    visibility.release();
+    micro.release();
+    fragment_invocations_counter.release();
+    samples_passed_counter.release();
+    mesh.release();
+    material.release();
+    uniforms.release();
+    gpu_timer.release();
+}
+
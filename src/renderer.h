@@ -0,0 +1,116 @@
+#ifndef __RENDERER_H__
+#define __RENDERER_H__
+
+#include <map>
+#include <vector>
+#include <glad/glad.h>
+#include "geometry.h"
+#include "model.h"
+#include "mesh.h"
+#include "material.h"
+#include "uniforms.h"
+#include "gpu_timer.h"
+#include "shader.h"
+#include "file_watch.h"
+#include "occlusion.h"
+#include "deferred.h"
+#include "clustered.h"
+#include "visibility.h"
+#include "micro_raster.h"
+#include "lights.h"
+#include "asset_cache.h"
+#include "residency.h"
+#include "picking.h"
+
+// The enable_* the caller runs after the construction, see the constructor
+enum RenderPath {
+    PATH_CLUSTERED     = 1,
+    PATH_OCCLUSION     = 2,
+    PATH_DEPTH_PREPASS = 4,
+    PATH_DEFERRED      = 8,
+    PATH_VISIBILITY    = 16,
+    PATH_MICRO_RASTER  = 32
+};
+
+// The draw path shared by the windowed and the headless modes. It renders into whatever
+// framebuffer is bound; the caller owns the context, the viewport and the presentation.
+class Renderer {
+public:
+    // hot_reload watches the shaders directory, edited shaders are swapped in between two frames. The
+    // variants of paths (RenderPath bits) are submitted before the mesh and the textures upload, the
+    // driver compiles them meanwhile; a path that turns out to be ignored leaves its variants unused.
+    Renderer(Model &model, const char *diffuse, const char *tangentnm, const char *specular, bool quantized=false, int max_instances=1,
+             bool hot_reload=false, unsigned paths=0);
+    // clear and draw the instances of the model, ids are their stable indices for the occlusion culling,
+    // the point lights are shaded by the deferred or the clustered path
+    void render(const std::vector<Matrix> &instances, const Matrix &V, const Matrix &P, const std::vector<int> *ids=NULL,
+                const std::vector<PointLight> *lights=NULL);
+    void release();
+    bool hot_reload() const { return shader_watcher.enabled(); }
+    // start the rebuilds of the edited shaders, swap in the ones that linked; true if one was, the last
+    // frame is then out of date. render() calls it, a caller that does not draw polls it
+    bool update_shaders();
+    bool enable_occlusion();    // GPU occlusion culling of the instances, false if the context is older than 4.3
+    bool occlusion_stats(OcclusionStats &stats) const { return occlusion.stats(stats); }
+    bool enable_depth_prepass();    // depth of the positions first, then shading with GL_EQUAL: one shaded fragment per pixel
+    bool enable_deferred();     // G-buffer, then one light volume per point light, see deferred.h
+    bool enable_clustered();    // forward shading of the point lights by clusters, before the other enable_*, see clustered.h
+    bool cluster_stats(ClusterStats &stats) const;
+    bool enable_visibility();   // ids of the triangles first, then one full-screen shading pass, see visibility.h
+    // the triangles of the visibility buffer up to micro_size pixels wide by a compute shader, after enable_visibility(), see micro_raster.h
+    bool enable_micro_raster(float micro_size);
+    bool micro_stats(MicroStats &stats) const { return micro.stats(stats); }
+    // after the enable_* that read the CPU copies: tracks the copies of the mesh and the textures, writes
+    // their cache files and frees the CPU copies over the budget; budgets in bytes, a GPU budget of 0 is not checked
+    void manage_residency(const char *model_file, size_t cpu_budget, size_t gpu_budget);
+    // the instance and the texel under the pixel (x, y) from the top left corner, see picking.h; the CPU
+    // copies come back from the cache for it and are released again over the budget
+    bool pick(const std::vector<Matrix> &instances, const Matrix &V, const Matrix &P, float x, float y, int width, int height,
+              Pick &hit, Vec3f &color);
+    // counts of the shading pass, a few frames late
+    bool fragment_invocations(double &count) { return fragment_invocations_counter.last(count); }
+    bool samples_passed(double &count) { return samples_passed_counter.last(count); }
+
+    GpuTimer gpu_timer;
+private:
+    GLuint program(unsigned features);     // the variant, built and set up on the first use
+    int submit(unsigned features);          // the build of the variant, queued only
+    void submit_paths(unsigned paths, unsigned features, bool instancing);  // the variants the enable_* will ask for
+    void setup_program(GLuint prog, unsigned features);
+    void frame_uniforms(const Matrix &V, const Matrix &P, const std::vector<PointLight> *lights);
+    void render_occluded(const std::vector<Matrix> &instances, const Matrix &V, const Matrix &P, const std::vector<int> *ids,
+                         const std::vector<PointLight> *lights);
+    void draw_objects(int count, GLuint single, GLuint instanced, bool depth_only);     // the uniforms of the objects are uploaded
+
+    ProgramCache programs;
+    int program_build;  // submitted before the members below, the driver compiles while the assets load
+    GLuint prog_hdlr;
+    GLuint prog_instanced;     // 0 if the instances are drawn one by one
+    GLuint prog_gpu_driven;    // the indirect draws of the occlusion culling
+    GLuint prog_depth, prog_depth_instanced;    // the depth pre-pass, 0 without it
+    GLuint prog_gbuffer, prog_gbuffer_instanced;    // the geometry pass of the deferred shading, 0 without it
+    GLuint prog_ids, prog_ids_instanced, prog_resolve;  // the visibility buffer, 0 without it
+    GLuint prog_merge, prog_large;  // the passes of the compute rasterizer after its dispatch, 0 without it
+    unsigned prog_features;
+    Mesh mesh;
+    Material material;
+    Aabb bounds;        // of the model
+    UniformRing uniforms;
+    OcclusionCuller occlusion;
+    DeferredShading deferred;
+    LightClusters clusters;
+    VisibilityBuffer visibility;
+    MicroRasterizer micro;
+    PassCounter fragment_invocations_counter, samples_passed_counter;
+    bool quantized;
+    std::map<unsigned, GLuint> variants;
+    FileWatcher shader_watcher;
+    std::vector<int> reloads;   // pending rebuilds, handles in programs
+    std::vector<std::string> texture_files;
+    AssetCache assets;
+    Residency residency;
+    int mesh_asset, material_asset;     // -1 until manage_residency()
+};
+
+#endif //__RENDERER_H__
+
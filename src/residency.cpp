@@ -0,0 +1,84 @@
+#include <iostream>
+#include <chrono>
+#include "residency.h"
+
+static double mb(size_t bytes) {
+    return bytes/(1024.*1024.);
+}
+
+Residency::Residency() : assets(), cpu_budget(0), gpu_budget(0), uses(0) {
+}
+
+void Residency::set_budgets(size_t cpu_bytes, size_t gpu_bytes) {
+    cpu_budget = cpu_bytes;
+    gpu_budget = gpu_bytes;
+}
+
+int Residency::add(const std::string &name, const std::string &cache_file, size_t cpu_bytes, const Load &load, const Release &release) {
+    Asset asset = { name, cache_file, load, release, cpu_bytes, 0, true, uses++ };
+    assets.push_back(asset);
+    return (int)assets.size() - 1;
+}
+
+void Residency::uploaded(int asset, size_t gpu_bytes) {
+    assets[asset].gpu = gpu_bytes;
+    if (gpu_budget && this->gpu_bytes()>gpu_budget) {
+        std::cerr << "Residency: " << mb(this->gpu_bytes()) << " MB on the GPU, over the budget of " << mb(gpu_budget) << " MB" << std::endl;
+    }
+}
+
+bool Residency::acquire(int asset) {
+    Asset &a = assets[asset];
+    a.last_use = uses++;
+    if (a.on_cpu) return true;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    if (!a.load()) {
+        std::cerr << "Residency: " << a.name << " could not be read back from " << a.cache_file << std::endl;
+        return false;
+    }
+    a.on_cpu = true;
+    std::cerr << "Residency: " << a.name << " read back from the cache, " << mb(a.cpu) << " MB in "
+              << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() << " ms" << std::endl;
+    return true;
+}
+
+void Residency::trim() {
+    size_t total = cpu_bytes();
+    while (total>cpu_budget) {
+        int oldest = -1;    // released first: the least recently used copy that can come back
+        for (size_t i=0; i<assets.size(); i++) {
+            const Asset &a = assets[i];
+            if (!a.on_cpu || !a.gpu || a.cache_file.empty()) continue;
+            if (oldest<0 || a.last_use<assets[oldest].last_use) oldest = (int)i;
+        }
+        if (oldest<0) return;   // the rest cannot be released
+        Asset &a = assets[oldest];
+        a.release();
+        a.on_cpu = false;
+        total -= a.cpu;
+    }
+}
+
+size_t Residency::cpu_bytes() const {
+    size_t total = 0;
+    for (size_t i=0; i<assets.size(); i++) if (assets[i].on_cpu) total += assets[i].cpu;
+    return total;
+}
+
+size_t Residency::gpu_bytes() const {
+    size_t total = 0;
+    for (size_t i=0; i<assets.size(); i++) total += assets[i].gpu;
+    return total;
+}
+
+void Residency::report() const {
+    for (size_t i=0; i<assets.size(); i++) {
+        const Asset &a = assets[i];
+        std::cerr << "Residency: " << a.name << ", CPU " << (a.on_cpu ? mb(a.cpu) : 0.) << " MB, GPU " << mb(a.gpu) << " MB"
+                  << (a.cache_file.empty() ? ", not cached" : "") << std::endl;
+    }
+    std::cerr << "Residency: " << mb(cpu_bytes()) << " MB on the CPU (budget " << mb(cpu_budget) << " MB), "
+              << mb(gpu_bytes()) << " MB on the GPU";
+    if (gpu_budget) std::cerr << " (budget " << mb(gpu_budget) << " MB)";
+    std::cerr << std::endl;
+}
@@ -0,0 +1,44 @@
+#ifndef __RESIDENCY_H__
+#define __RESIDENCY_H__
+
+#include <string>
+#include <vector>
+#include <functional>
+
+// Where the copies of the assets live, in CPU memory, on the GPU or both, and their sizes. Once an
+// asset is on the GPU its CPU copy is only kept within the CPU budget, the least recently acquired
+// copies go first; acquire() brings a released copy back from its cache file. An asset without a
+// cache file keeps its CPU copy whatever the budget. Every asset is drawn every frame, there is
+// nothing to page out of the GPU: the GPU budget is checked and an overrun reported.
+// Not thread safe: only the thread that draws with the renderer uses it, the render thread in the window.
+class Residency {
+public:
+    typedef std::function<bool()> Load;     // the CPU copy from the cache file, false if it failed
+    typedef std::function<void()> Release;  // frees the CPU copy
+
+    Residency();
+    void set_budgets(size_t cpu_bytes, size_t gpu_bytes);
+    // an asset with its CPU copy, cache_file may be empty: the copy is then kept
+    int  add(const std::string &name, const std::string &cache_file, size_t cpu_bytes, const Load &load, const Release &release);
+    void uploaded(int asset, size_t gpu_bytes);     // the GPU copy is complete, the CPU one may go
+    bool acquire(int asset);    // the CPU copy, loaded again if it was released; false if it cannot be
+    void trim();                // release the CPU copies over the budget
+    size_t cpu_bytes() const;
+    size_t gpu_bytes() const;
+    void report() const;        // the copies of every asset to stderr
+
+private:
+    struct Asset {
+        std::string name, cache_file;
+        Load load;
+        Release release;
+        size_t cpu, gpu;        // sizes of the copies, gpu is 0 before the upload
+        bool on_cpu;
+        long last_use;
+    };
+    std::vector<Asset> assets;
+    size_t cpu_budget, gpu_budget;
+    long uses;
+};
+
+#endif //__RESIDENCY_H__
@@ -0,0 +1,210 @@
+#include <cmath>
+#include <chrono>
+#include <algorithm>
+#include "scene.h"
+#include <iostream>
+#include "profiler.h"
+#include "stats.h"
+#include "parallel.h"
+
+static Matrix rotation_y(float angle) {
+    Matrix R = Matrix::identity();
+    R[0][0] = R[2][2] = cos(angle);
+    R[2][0] = sin(angle);
+    R[0][2] = -sin(angle);
+    return R;
+}
+
+static Matrix lookat(Vec3f eye, Vec3f center, Vec3f up) {
+    Vec3f z = (eye - center).normalize();
+    Vec3f x = cross(up, z).normalize();
+    Vec3f y = cross(z, x).normalize();
+    Matrix V = Matrix::identity();
+    for (int i=0; i<3; i++) {
+        V[0][i] = x[i];
+        V[1][i] = y[i];
+        V[2][i] = z[i];
+    }
+    V[0][3] = -(x*eye);
+    V[1][3] = -(y*eye);
+    V[2][3] = -(z*eye);
+    return V;
+}
+
+// Infinite reverse-Z perspective: the near plane maps to the depth 1 and the infinity to 0,
+// which fits the GL_GREATER test and the depth cleared to 0.
+static Matrix perspective(float fovy, float aspect, float near) {
+    float f = 1.f/tan(fovy/2);
+    Matrix P;
+    P[0][0] = f/aspect;
+    P[1][1] = f;
+    P[2][3] = near;
+    P[3][2] = -1;
+    return P;
+}
+
+Scene::Scene(Model &model, int instances, float aspect) : V(Matrix::identity()), P(Matrix::identity()), lights(), view(Matrix::identity()),
+    light_angle(0), occlusion(256, (int)(256/aspect + .5f)), occlusion_enabled(false) {
+    model.get_bbox(local_box.min, local_box.max);
+    int n = std::max(1, instances);
+    placement.assign(n, Matrix::identity());
+    rotation.assign(n, Matrix::identity());
+    speed.assign(n, .5f);   // radians per second, independent of the frame rate
+
+    if (n>1) {
+        Vec3f size = local_box.max - local_box.min;
+        float spacing = 1.5f*std::max(size.x, size.z);
+        int side = (int)ceil(sqrt((double)n));
+        for (int i=0; i<n; i++) {
+            placement[i][0][3] = (i%side - (side-1)*.5f)*spacing;
+            placement[i][1][3] = -local_box.min.y;              // standing on the ground plane
+            placement[i][2][3] = (i/side - (side-1)*.5f)*spacing;
+            speed[i] = .25f*(1 + i%4);
+        }
+        // above the heads in the middle of the crowd, looking ahead and slightly down
+        view = lookat(Vec3f(0, 2.5f*size.y, 0), Vec3f(0, 0, -side*spacing/4), Vec3f(0, 1, 0));
+        P = perspective(M_PI/3, aspect, .05f*spacing);
+    }
+    V = view;
+
+    std::vector<Aabb> boxes(n);
+    for (int i=0; i<n; i++) boxes[i] = transform_aabb(placement[i]*rotation[i], local_box);
+    bvh.build(boxes);
+    // the lists of cull() hold every instance at most, the frames do not allocate them
+    visible_indices.reserve(n);
+    by_distance.reserve(n);
+    keep.reserve(n);
+}
+
+void Scene::enable_occlusion(Model &model) {
+    if (instances()<2) return;  // a single instance hides nothing
+    OccluderMesh mesh = simplify(model, 8);
+    std::cerr << "CPU occlusion: " << occlusion.width << "x" << occlusion.height << " depth, occluder of " << mesh.tris.size()
+              << " triangles (" << model.nfaces() << " in the model), " << OCCLUDERS << " occluders, " << worker_count() << " threads" << std::endl;
+    occlusion.set_occluder(mesh);
+    occlusion_enabled = true;
+}
+
+void Scene::add_lights(int n) {
+    Vec3f size = local_box.max - local_box.min;
+    Vec3f min = local_box.min, max = local_box.max;
+    for (int i=0; i<instances(); i++) {
+        for (int k=0; k<3; k++) {
+            min[k] = std::min(min[k], local_box.min[k] + placement[i][k][3]);
+            max[k] = std::max(max[k], local_box.max[k] + placement[i][k][3]);
+        }
+    }
+    max.y += size.y*.5f;    // up to half a model above the heads
+    float radius = 1.5f*std::max(size.x, size.z);   // the spacing of the crowd
+    lights.resize(n);
+    light_centers.resize(n);
+    for (int i=0; i<n; i++) {
+        // R3 low-discrepancy sequence, evenly spread whatever n is
+        Vec3f u(std::fmod(.5f + i*.8191725f, 1.f), std::fmod(.5f + i*.6710436f, 1.f), std::fmod(.5f + i*.5497005f, 1.f));
+        for (int k=0; k<3; k++) light_centers[i][k] = min[k] + u[k]*(max[k] - min[k]);
+        float hue = 6.f*std::fmod(i*.618034f, 1.f);      // saturated colors around the wheel
+        Vec3f color;
+        for (int k=0; k<3; k++) color[k] = std::min(1.f, std::max(0.f, std::abs(std::fmod(hue + 4.f - 2.f*k, 6.f) - 3.f) - 1.f));
+        lights[i].radius = radius;
+        lights[i].color  = color*1.5f;
+    }
+    light_angle = 0;
+    animate_lights(0);
+    std::cerr << n << " point lights of radius " << radius << std::endl;
+}
+
+void Scene::animate_lights(float dt) {
+    light_angle += .5f*dt;
+    float orbit = lights.empty() ? 0 : lights[0].radius/3;
+    for (size_t i=0; i<lights.size(); i++) {
+        float a = light_angle*(i%2 ? 1 : -1) + i;  // half of them clockwise
+        lights[i].position = light_centers[i] + Vec3f(std::cos(a), 0, std::sin(a))*orbit;
+    }
+}
+
+void Scene::moved(int i) {
+    bvh.update(i, transform_aabb(placement[i]*rotation[i], local_box));
+}
+
+void Scene::animate(float dt) {
+    PROFILE_ZONE("simulate");
+    for (int i=0; i<instances(); i++) {
+        rotation[i] = rotation_y(speed[i]*dt)*rotation[i];
+        moved(i);
+    }
+    animate_lights(dt);
+}
+
+void Scene::pose(const Matrix &R, const Matrix &tilt) {
+    for (int i=0; i<instances(); i++) {
+        rotation[i] = R;
+        moved(i);
+    }
+    V = tilt*view;
+}
+
+CullStats Scene::cull(std::vector<Matrix> &visible, std::vector<int> *ids) {
+    PROFILE_ZONE("cull");
+    CullStats stats;
+    visible.reserve(instances());
+    if (ids) ids->reserve(instances());
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    bvh.refit();
+    bvh.cull(Frustum(P*V), visible_indices);
+    stats.ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    stats.visible = visible_indices.size();
+    stats.culled  = instances() - stats.visible;
+
+    if (occlusion_enabled && !visible_indices.empty()) {
+        PROFILE_ZONE("cpu occlusion");
+        start = std::chrono::steady_clock::now();
+        Matrix PV = P*V;
+        // the nearest instances occlude, w in clip space is the distance along the view axis
+        by_distance.resize(visible_indices.size());
+        for (size_t i=0; i<visible_indices.size(); i++) {
+            const Matrix &M = placement[visible_indices[i]];
+            by_distance[i] = std::make_pair(PV[3][0]*M[0][3] + PV[3][1]*M[1][3] + PV[3][2]*M[2][3] + PV[3][3], visible_indices[i]);
+        }
+        size_t n = std::min(by_distance.size(), (size_t)OCCLUDERS);
+        std::nth_element(by_distance.begin(), by_distance.begin() + n - 1, by_distance.end());
+        occluders.resize(n);
+        for (size_t i=0; i<n; i++) occluders[i] = placement[by_distance[i].second]*rotation[by_distance[i].second];
+        occlusion.render(occluders, PV);
+
+        keep.resize(visible_indices.size());
+        parallel_for(0, (int)visible_indices.size(), 256, [&](int i, int) {
+            keep[i] = occlusion.visible(placement[visible_indices[i]]*rotation[visible_indices[i]], local_box);
+        });
+        size_t kept = 0;
+        for (size_t i=0; i<visible_indices.size(); i++) if (keep[i]) visible_indices[kept++] = visible_indices[i];
+        visible_indices.resize(kept);
+        stats.occlusion_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        stats.occluded = stats.visible - kept;
+        stats.visible  = kept;
+    }
+    visible.resize(stats.visible);
+    for (int i=0; i<stats.visible; i++) visible[i] = placement[visible_indices[i]]*rotation[visible_indices[i]];
+    if (ids) *ids = visible_indices;
+    return stats;
+}
+
+void report_cull(std::vector<CullStats> &history) {
+    if (history.empty()) return;
+    std::vector<double> ms(history.size()), occlusion_ms(history.size());
+    double visible = 0, culled = 0, occluded = 0;
+    for (size_t i=0; i<history.size(); i++) {
+        ms[i] = history[i].ms;
+        occlusion_ms[i] = history[i].occlusion_ms;
+        visible  += history[i].visible;
+        culled   += history[i].culled;
+        occluded += history[i].occluded;
+    }
+    Summary s = summarize(ms);
+    std::cerr << "cull: visible " << visible/history.size() << ", culled " << culled/history.size() << ", mean " << s.mean
+              << " ms, p95 " << s.p95 << " ms (last " << history.size() << " frames)" << std::endl;
+    Summary o = summarize(occlusion_ms);
+    if (o.max>0) std::cerr << "cpu occlusion: occluded " << occluded/history.size() << ", mean " << o.mean << " ms, p95 " << o.p95 << " ms" << std::endl;
+    history.clear();
+}
+
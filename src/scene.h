@@ -0,0 +1,70 @@
+#ifndef __SCENE_H__
+#define __SCENE_H__
+
+#include <vector>
+#include "geometry.h"
+#include "model.h"
+#include "culling.h"
+#include "cpu_occlusion.h"
+#include "lights.h"
+
+// Everything the renderer needs to draw a frame. The simulation produces it on the main
+// thread, the render thread consumes it through a TripleBuffer.
+struct SceneState {
+    SceneState() : instances(), ids(), lights(), V(Matrix::identity()), P(Matrix::identity()), version(0) {}
+    std::vector<Matrix> instances;  // model matrices of the visible instances
+    std::vector<int> ids;           // their indices in the scene
+    std::vector<PointLight> lights;
+    Matrix V, P;
+    unsigned long version;  // incremented by the simulation for every published state
+};
+
+struct CullStats {
+    CullStats() : visible(0), culled(0), occluded(0), ms(0), occlusion_ms(0) {}
+    int visible, culled;
+    int occluded;           // in the frustum but hidden, by the CPU occlusion
+    double ms;              // BVH refit and frustum test
+    double occlusion_ms;    // occluder rasterization and box tests
+};
+
+void report_cull(std::vector<CullStats> &history);     // mean counts and time percentiles to stderr, clears the history
+
+// Instances of one model. A single instance keeps the original setup: identity camera and
+// projection, the model spins in the [-1,1] box. Several instances stand on a square grid,
+// seen through a perspective camera from the middle of the crowd.
+class Scene {
+public:
+    Scene(Model &model, int instances, float aspect);
+    void animate(float dt);                     // every instance spins about its vertical axis
+    void pose(const Matrix &R, const Matrix &tilt);    // scripted: rotation of all the instances, camera tilt
+    CullStats cull(std::vector<Matrix> &visible, std::vector<int> *ids=NULL);  // model matrices (and indices) of the instances in the frustum
+    void enable_occlusion(Model &model);        // cull against the depth of the nearest instances as well, on the CPU
+    void add_lights(int n);                     // point lights scattered over the instances, they circle as the scene animates
+
+    int instances() const { return (int)placement.size(); }
+    Matrix V, P;
+    std::vector<PointLight> lights;
+private:
+    void moved(int i);                          // the transform of the instance changed
+    void animate_lights(float dt);
+
+    Aabb local_box;
+    Matrix view;                                // camera before the tilt
+    std::vector<Matrix> placement;              // translation of the instances
+    std::vector<Matrix> rotation;
+    std::vector<float> speed;                   // radians per second
+    std::vector<Vec3f> light_centers;           // of the circles of the lights
+    float light_angle;                          // radians along the circles
+    InstanceBvh bvh;
+    std::vector<int> visible_indices;
+
+    enum { OCCLUDERS = 64 };                    // nearest instances rasterized by the CPU occlusion
+    CpuOcclusion occlusion;
+    bool occlusion_enabled;
+    std::vector<std::pair<float,int> > by_distance;
+    std::vector<Matrix> occluders;
+    std::vector<char> keep;
+};
+
+#endif //__SCENE_H__
+
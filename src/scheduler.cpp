@@ -0,0 +1,59 @@
+#include <iostream>
+#include <thread>
+#include <GLFW/glfw3.h>
+#include "scheduler.h"
+#include "profiler.h"
+
+const double FrameScheduler::REPORT_INTERVAL = 5.;
+
+FrameScheduler::FrameScheduler(int fps) : fps(fps), resumed(true), report_cpu(std::clock()), report_frames(0) {
+    period = fps>0 ? std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(1./fps)) : clock::duration(0);
+    deadline = report_start = clock::now();
+}
+
+void FrameScheduler::set_swap_interval() {
+    glfwSwapInterval(fps>0 ? 0 : 1);
+    std::cerr << "Frame pacing: " << (fps>0 ? "deadline timer" : "vsync");
+    if (fps>0) std::cerr << " at " << fps << " fps";
+    std::cerr << std::endl;
+}
+
+void FrameScheduler::idle() {
+    resumed = true;
+    report();
+}
+
+void FrameScheduler::wait_for_slot() {
+    if (fps<=0) return;             // the swap waits for the vertical blank
+    PROFILE_ZONE("wait");
+    clock::time_point now = clock::now();
+    if (resumed || now - deadline > period) {
+        deadline = now;             // too late or just woke up, do not try to catch up
+    } else {
+        // sleep coarsely, then yield for the last millisecond to hit the deadline precisely
+        std::this_thread::sleep_until(deadline - std::chrono::milliseconds(1));
+        while (clock::now() < deadline) std::this_thread::yield();
+    }
+    deadline += period;
+    resumed = false;
+}
+
+void FrameScheduler::frame_done() {
+    report_frames++;
+    resumed = false;
+    report();
+}
+
+void FrameScheduler::report() {
+    clock::time_point now = clock::now();
+    double wall = std::chrono::duration<double>(now - report_start).count();
+    if (wall < REPORT_INTERVAL) return;
+    std::clock_t cpu = std::clock();
+    double busy = double(cpu - report_cpu)/CLOCKS_PER_SEC;
+    std::cerr << (fps>0 ? "deadline" : "vsync") << ": " << report_frames << " frames in " << wall << " s, "
+              << report_frames/wall << " fps, CPU " << 100.*busy/wall << "%" << std::endl;
+    report_start  = now;
+    report_cpu    = cpu;
+    report_frames = 0;
+}
+
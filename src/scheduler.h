@@ -0,0 +1,35 @@
+#ifndef __SCHEDULER_H__
+#define __SCHEDULER_H__
+
+#include <chrono>
+#include <ctime>
+
+// Paces the render thread. With fps<=0 the frames are throttled by the swap (vsync),
+// otherwise by a deadline timer with the swap interval set to zero.
+// Nothing here touches the GLFW events, they belong to the main thread.
+class FrameScheduler {
+public:
+    FrameScheduler(int fps);
+    void set_swap_interval();       // on the thread that owns the context
+
+    void idle();                    // there was nothing to draw, the next frame must not try to catch up
+    void wait_for_slot();           // deadline timer mode: sleep until the next frame is due
+    void frame_done();              // account for the frame and periodically log the CPU utilization
+    void report();                  // log the CPU utilization if the report interval has elapsed
+
+    static const double REPORT_INTERVAL;    // seconds between two CPU utilization reports
+private:
+    typedef std::chrono::steady_clock clock;
+
+    int fps;
+    clock::duration period;
+    clock::time_point deadline;
+    bool resumed;                   // the previous iteration was idle
+
+    clock::time_point report_start;
+    std::clock_t report_cpu;
+    int report_frames;
+};
+
+#endif //__SCHEDULER_H__
+
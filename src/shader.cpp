@@ -0,0 +1,338 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <cstring>
+#include <cstdio>
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+#include <sys/stat.h>
+#include "shader.h"
+#include "profiler.h"
+
+#ifndef GL_COMPLETION_STATUS_KHR
+#define GL_COMPLETION_STATUS_KHR 0x91B1    // GL_KHR_parallel_shader_compile, not in our glad
+#endif
+
+std::string shader_defines(unsigned features) {
+    std::string defines;
+    if (features & SHADER_NORMAL_MAP) defines += "#define NORMAL_MAP\n";
+    if (features & SHADER_SPECULAR)   defines += "#define SPECULAR\n";
+    if (features & SHADER_QUANTIZED)  defines += "#define QUANTIZED\n";
+    if (features & SHADER_INSTANCING) {
+        std::ostringstream ss;
+        ss << "#define INSTANCING\n#define MAX_INSTANCES " << MAX_INSTANCES << "\n";
+        defines += ss.str();
+    }
+    if (features & SHADER_GPU_DRIVEN) defines += "#define GPU_DRIVEN\n";
+    if (features & SHADER_DEPTH_ONLY) defines += "#define DEPTH_ONLY\n";
+    if (features & SHADER_GBUFFER)    defines += "#define GBUFFER\n";
+    if (features & SHADER_LIGHT_VOLUME) defines += "#define LIGHT_VOLUME\n";
+    if (features & SHADER_VISIBILITY) defines += "#define VISIBILITY\n";
+    if (features & SHADER_MICRO)      defines += "#define MICRO\n";
+    if (features & SHADER_ATOMIC64)   defines += "#define ATOMIC64\n";
+    if (features & SHADER_CLUSTERED) {
+        std::ostringstream ss;
+        ss << "#define CLUSTERED\n#define MAX_LIGHTS " << MAX_LIGHTS << "\n";
+        defines += ss.str();
+    }
+    return defines;
+}
+
+std::string shader_variant_name(unsigned features) {
+    const char *names[12] = { "NORMAL_MAP", "SPECULAR", "QUANTIZED", "INSTANCING", "GPU_DRIVEN", "DEPTH_ONLY", "GBUFFER", "LIGHT_VOLUME",
+                              "CLUSTERED", "VISIBILITY", "MICRO", "ATOMIC64" };
+    std::string name;
+    for (int i=0; i<12; i++) {
+        if (!(features & (1u<<i))) continue;
+        if (!name.empty()) name += "|";
+        name += names[i];
+    }
+    return name.empty() ? "base" : name;
+}
+
+// the defines must come after the #version directive, the only thing allowed before it
+static std::string insert_defines(const std::string &source, const std::string &defines) {
+    if (defines.empty()) return source;
+    size_t pos = 0;
+    size_t version = source.find("#version");
+    if (version!=std::string::npos && version==source.find_first_not_of(" \t\r\n")) {
+        pos = source.find('\n', version);
+        pos = pos==std::string::npos ? source.size() : pos+1;
+    }
+    std::string result = source.substr(0, pos);
+    if (!result.empty() && result[result.size()-1]!='\n') result += '\n';
+    return result + defines + source.substr(pos);
+}
+
+bool read_file(const char *filename, std::string &content) {
+    std::ifstream is(filename, std::ios::in|std::ios::binary);
+    if (!is.is_open()) return false;
+    std::ostringstream ss;
+    ss << is.rdbuf();
+    content = ss.str();
+    return true;
+}
+
+static void print_shader_log(GLuint hdlr) {
+    GLint log_length;
+    glGetShaderiv(hdlr, GL_INFO_LOG_LENGTH, &log_length);
+    if (log_length>0) {
+        std::vector<char> v(log_length, 0);
+        glGetShaderInfoLog(hdlr, log_length, NULL, v.data());
+        if (strlen(v.data())>0) {
+            std::cerr << v.data() << std::endl;
+        }
+    }
+}
+
+static void print_program_log(GLuint hdlr) {
+    GLint log_length;
+    glGetProgramiv(hdlr, GL_INFO_LOG_LENGTH, &log_length);
+    if (log_length>0) {
+        std::vector<char> v(log_length, 0);
+        glGetProgramInfoLog(hdlr, log_length, NULL, v.data());
+        if (strlen(v.data())>0) {
+            std::cerr << v.data() << std::endl;
+        }
+    }
+}
+
+uint64_t fnv1a(const std::string &s, uint64_t h) {
+    for (size_t i=0; i<s.size(); i++) {
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+bool has_gl_extension(const char *name) {
+    GLint n = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &n);
+    for (GLint i=0; i<n; i++) {
+        const char *ext = (const char *)glGetStringi(GL_EXTENSIONS, i);
+        if (ext && !strcmp(ext, name)) return true;
+    }
+    return false;
+}
+
+static double elapsed_ms(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+ProgramCache::ProgramCache(const std::string &dir, bool keep_stages) : dir(dir), binary_supported(false), parallel_compile(false), keep_stages(keep_stages) {
+    const char *strings[3] = { (const char *)glGetString(GL_VENDOR), (const char *)glGetString(GL_RENDERER), (const char *)glGetString(GL_VERSION) };
+    for (int i=0; i<3; i++) driver += std::string(strings[i] ? strings[i] : "") + "\n";
+
+    GLint formats = 0;
+    if (glad_glGetProgramBinary && glad_glProgramBinary && glad_glProgramParameteri) glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+    binary_supported = formats>0 && !dir.empty();
+    if (binary_supported) mkdir(dir.c_str(), 0755);   // fails harmlessly if it exists
+
+    // the driver picks its number of compiler threads, glMaxShaderCompilerThreadsKHR is not needed
+    parallel_compile = has_gl_extension("GL_KHR_parallel_shader_compile") || has_gl_extension("GL_ARB_parallel_shader_compile");
+    std::cerr << "Program binary cache: " << (binary_supported ? dir : "disabled")
+              << ", parallel shader compile: " << (parallel_compile ? "yes" : "no") << std::endl;
+}
+
+bool ProgramCache::load_binary(Build &build) {
+    if (!binary_supported) return false;
+    std::string content;
+    if (!read_file((dir + "/" + build.key + ".bin").c_str(), content) || content.size()<=sizeof(GLenum)) return false;
+    GLenum format;
+    memcpy(&format, content.data(), sizeof(GLenum));
+    glProgramBinary(build.prog, format, content.data()+sizeof(GLenum), content.size()-sizeof(GLenum));
+    GLint success;
+    glGetProgramiv(build.prog, GL_LINK_STATUS, &success);
+    return success;     // a rejected binary (driver update) falls back to the compilation
+}
+
+void ProgramCache::save_binary(const Build &build) {
+    if (!binary_supported) return;
+    GLint length = 0;
+    glGetProgramiv(build.prog, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length<=0) return;
+    std::vector<char> data(sizeof(GLenum) + length);
+    GLenum format;
+    glGetProgramBinary(build.prog, length, NULL, &format, data.data()+sizeof(GLenum));
+    memcpy(data.data(), &format, sizeof(GLenum));
+
+    // write aside and rename, a concurrent run never reads a partial file
+    std::string filename = dir + "/" + build.key + ".bin";
+    std::string tmp = filename + ".tmp";
+    std::ofstream os(tmp.c_str(), std::ios::out|std::ios::binary);
+    if (!os.write(data.data(), data.size())) return;
+    os.close();
+    std::rename(tmp.c_str(), filename.c_str());
+}
+
+void ProgramCache::release() {
+    for (size_t i=0; i<builds.size(); i++) {
+        if (!builds[i].done) get(i);    // finish the pending builds before deleting them
+        if (builds[i].prog) glDeleteProgram(builds[i].prog);
+        builds[i].prog = 0;
+    }
+    for (std::map<std::string, Stage>::iterator it=stages.begin(); it!=stages.end(); ++it) glDeleteShader(it->second.shader);
+    builds.clear();
+    variants.clear();
+    latest.clear();
+    stages.clear();
+}
+
+std::string ProgramCache::build_name(const std::vector<std::string> &files, unsigned features) {
+    std::string name;
+    for (size_t i=0; i<files.size(); i++) name += (i ? " + " : "") + files[i];
+    return name + " [" + shader_variant_name(features) + "]";
+}
+
+int ProgramCache::submit(const char *vsfile, const char *fsfile, unsigned features) {
+    std::vector<std::string> files;
+    files.push_back(vsfile);
+    files.push_back(fsfile);
+    std::map<std::string, int>::iterator it = variants.find(build_name(files, features));
+    if (it!=variants.end()) return it->second;
+    std::vector<GLenum> types;
+    types.push_back(GL_VERTEX_SHADER);
+    types.push_back(GL_FRAGMENT_SHADER);
+    return build(files, types, features, false);
+}
+
+int ProgramCache::submit_compute(const char *csfile, unsigned features) {
+    std::vector<std::string> files(1, csfile);
+    std::map<std::string, int>::iterator it = variants.find(build_name(files, features));
+    if (it!=variants.end()) return it->second;
+    return build(files, std::vector<GLenum>(1, GL_COMPUTE_SHADER), features, false);
+}
+
+std::vector<int> ProgramCache::reload(const std::string &file) {
+    std::vector<int> handles;
+    std::vector<int> live;
+    for (std::map<std::string, int>::iterator it=variants.begin(); it!=variants.end(); ++it) live.push_back(it->second);
+    for (size_t i=0; i<live.size(); i++) {
+        const Build &b = builds[live[i]];
+        if (std::find(b.files.begin(), b.files.end(), file)==b.files.end()) continue;
+        std::vector<std::string> files = b.files;   // build() may reallocate builds
+        std::vector<GLenum> types = b.types;
+        handles.push_back(build(files, types, b.features, true));
+    }
+    return handles;
+}
+
+GLuint ProgramCache::compile_stage(const std::string &key, GLenum type, const std::string &source) {
+    uint64_t hash = fnv1a(source);
+    std::map<std::string, Stage>::iterator it = stages.find(key);
+    if (it!=stages.end() && it->second.hash==hash) return it->second.shader;   // unchanged, reuse the compiled object
+
+    GLuint shader = glCreateShader(type);
+    const char *src = source.c_str();
+    glShaderSource(shader, 1, &src, NULL);
+    glCompileShader(shader);    // no status query here, it would wait for the compiler
+    if (keep_stages) {
+        if (it!=stages.end()) glDeleteShader(it->second.shader);    // deferred by GL while attached
+        Stage stage = { shader, hash };
+        stages[key] = stage;
+    }
+    return shader;
+}
+
+int ProgramCache::build(const std::vector<std::string> &files, const std::vector<GLenum> &types, unsigned features, bool reload) {
+    PROFILE_ZONE("submit program");
+    Build build;
+    build.start = std::chrono::steady_clock::now();
+    build.files = files;
+    build.types = types;
+    build.features = features;
+    build.name = build_name(files, features);
+    build.done = build.linked = false;
+    build.reload = reload;
+
+    std::string defines = shader_defines(features);
+    std::vector<std::string> sources(files.size());
+    uint64_t hash = fnv1a(driver);
+    for (size_t i=0; i<files.size(); i++) {
+        if (!read_file(files[i].c_str(), sources[i])) std::cerr << "Failed to load " << files[i] << std::endl;
+        sources[i] = insert_defines(sources[i], defines);
+        hash = fnv1a(sources[i], hash);
+    }
+    std::ostringstream key;
+    key << std::hex << std::setw(16) << std::setfill('0') << hash;
+    build.key = key.str();
+
+    build.prog = glCreateProgram();
+    if (keep_stages || !load_binary(build)) {  // a binary has no stages to keep
+        std::string variant = " [" + shader_variant_name(features) + "]";
+        for (size_t i=0; i<files.size(); i++) {
+            build.shaders.push_back(compile_stage(files[i] + variant, types[i], sources[i]));
+            glAttachShader(build.prog, build.shaders[i]);
+        }
+        if (binary_supported) glProgramParameteri(build.prog, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+        glLinkProgram(build.prog);
+    }
+    build.blocked = elapsed_ms(build.start);
+    builds.push_back(build);
+    int handle = builds.size()-1;
+    latest[build.name] = handle;
+    if (!reload) variants[build.name] = handle;    // a reload replaces the variant only once it links
+    return handle;
+}
+
+bool ProgramCache::ready(int build) {
+    const Build &b = builds[build];
+    if (b.done || b.shaders.empty() || !parallel_compile) return true;
+    GLint done = GL_TRUE;
+    glGetProgramiv(b.prog, GL_COMPLETION_STATUS_KHR, &done);
+    return done;
+}
+
+GLuint ProgramCache::get(int build) {
+    Build &b = builds[build];
+    if (b.done) return b.linked ? b.prog : 0;
+
+    PROFILE_ZONE("link program");
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    bool cached = b.shaders.empty();
+    GLint success = GL_TRUE;
+    if (!cached) {
+        glGetProgramiv(b.prog, GL_LINK_STATUS, &success);
+        if (!success) {
+            for (size_t i=0; i<b.shaders.size(); i++) {
+                GLint compiled;
+                glGetShaderiv(b.shaders[i], GL_COMPILE_STATUS, &compiled);
+                if (!compiled) print_shader_log(b.shaders[i]);
+            }
+            print_program_log(b.prog);
+        }
+        for (size_t i=0; i<b.shaders.size(); i++) {
+            glDetachShader(b.prog, b.shaders[i]);
+            if (!keep_stages) glDeleteShader(b.shaders[i]);
+        }
+        b.shaders.clear();
+        if (success) save_binary(b);
+    }
+    b.done = true;
+    b.linked = success;
+    b.blocked += elapsed_ms(start);
+
+    const char *status = cached ? "cache hit" : (success ? "compiled" : "failed");
+    if (b.reload && latest[b.name]!=build) {
+        status = "superseded by a newer edit";
+        b.linked = false;
+    } else if (b.reload && success) {   // swap: the previous program of the variant goes away
+        Build &previous = builds[variants[b.name]];
+        glDeleteProgram(previous.prog);
+        previous.prog = 0;
+        previous.linked = false;
+        variants[b.name] = build;
+    } else if (b.reload) {
+        status = "failed, keeping the previous program";
+    }
+    if (!b.linked && b.reload) {
+        glDeleteProgram(b.prog);
+        b.prog = 0;
+    }
+    std::cerr << "Program " << b.name << (b.reload ? " reload: " : ": ") << status << ", " << b.blocked << " ms blocking";
+    if (!cached) std::cerr << ", ready " << elapsed_ms(b.start) << " ms after the submit";
+    std::cerr << std::endl;
+    return b.linked ? b.prog : 0;
+}
@@ -0,0 +1,97 @@
+#ifndef __SHADER_H__
+#define __SHADER_H__
+
+#include <string>
+#include <cstdint>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <glad/glad.h>
+
+// Feature flags of the shader permutations, each one is a #define inserted after the #version line
+enum ShaderFeature {
+    SHADER_NORMAL_MAP = 1,      // tangent space normal map
+    SHADER_SPECULAR   = 2,      // specular exponent in the alpha of the diffuse map
+    SHADER_QUANTIZED  = 4,      // quantized vertex positions, see Mesh::upload
+    SHADER_INSTANCING = 8,      // PerObject is an array of MAX_INSTANCES blocks indexed by gl_InstanceID
+    SHADER_GPU_DRIVEN = 16,     // the instance comes from a list written on the GPU, see occlusion.h
+    SHADER_DEPTH_ONLY = 32,     // gl_Position only, for the depth pre-pass
+    SHADER_GBUFFER    = 64,     // the fragment shader writes the G-buffer of the deferred shading instead of a color
+    SHADER_LIGHT_VOLUME = 128,  // the deferred light pass of the point lights, one sphere per light
+    SHADER_CLUSTERED  = 256,    // forward shading of the point lights listed in the cluster of the fragment, see clustered.h
+    SHADER_VISIBILITY = 512,    // with DEPTH_ONLY the ids of the visibility buffer, otherwise its full-screen shading, see visibility.h
+    SHADER_MICRO      = 1024,   // the compute rasterizer of the small triangles and its passes, see micro_raster.h
+    SHADER_ATOMIC64   = 2048    // 64-bit atomics in storage buffers (GL_NV_shader_atomic_int64)
+};
+enum { MAX_INSTANCES = 64 };    // 64 blocks of 256 bytes, the minimum GL_MAX_UNIFORM_BLOCK_SIZE
+enum { MAX_LIGHTS = 511 };      // 32 bytes each after a 32-byte header, 16 KB as well
+
+std::string shader_defines(unsigned features);
+std::string shader_variant_name(unsigned features);    // e.g. "NORMAL_MAP|SPECULAR", "base" without features
+
+bool read_file(const char *filename, std::string &content);
+bool has_gl_extension(const char *name);    // in the list of the current context
+uint64_t fnv1a(const std::string &s, uint64_t h=14695981039346656037ULL);  // 64-bit FNV-1a, the keys of the caches
+
+// Builds the programs and keeps their linked binaries on the disk (glGetProgramBinary), keyed by a hash
+// of the sources, of the feature defines and of the driver strings, so a new driver or an edited shader
+// simply misses the cache. Every variant is built once, the cache owns the programs.
+// submit() only queues the work: with GL_KHR_parallel_shader_compile the driver compiles in its own
+// threads while the caller loads the assets, get() waits for the link and stores the binary on a miss.
+class ProgramCache {
+public:
+    // empty dir disables the disk cache; keep_stages for the hot reload, see reload()
+    ProgramCache(const std::string &dir, bool keep_stages=false);
+    void   release();                                       // delete all the programs
+    int    submit(const char *vsfile, const char *fsfile, unsigned features=0);    // returns the build handle for get()
+    int    submit_compute(const char *csfile, unsigned features=0);    // a compute program, GL 4.3
+    bool   ready(int build);                                // the link is done, get() will not block
+    GLuint get(int build);                                  // the linked program, 0 if it failed
+    unsigned features(int build) const { return builds[build].features; }
+    const std::vector<std::string> &files(int build) const { return builds[build].files; }
+
+    // Hot reload: rebuild every variant that uses the file. get() on the returned handles swaps the new
+    // program in only if it links, the previous program of the variant is deleted then; on a failure
+    // the variant keeps its previous program. With keep_stages every variant is compiled from its
+    // sources, even on a cache hit, and its shader objects are kept: from the first edit on only the
+    // stages whose source changed are compiled again.
+    std::vector<int> reload(const std::string &file);
+
+    bool parallel() const { return parallel_compile; }
+private:
+    struct Build {
+        std::vector<std::string> files;     // one per stage
+        std::vector<GLenum> types;
+        unsigned features;
+        std::string name;           // files and variant, for the logs
+        std::string key;            // hex hash, name of the cache file
+        GLuint prog;
+        std::vector<GLuint> shaders;    // empty when the program came from the cache or is linked
+        bool done, linked;
+        bool reload;                // replaces the variant on success
+        std::chrono::steady_clock::time_point start;
+        double blocked;             // ms the caller spent in submit() and get()
+    };
+    struct Stage {
+        GLuint shader;
+        uint64_t hash;              // of the source with the defines
+    };
+    int  build(const std::vector<std::string> &files, const std::vector<GLenum> &types, unsigned features, bool reload);
+    static std::string build_name(const std::vector<std::string> &files, unsigned features);
+    GLuint compile_stage(const std::string &key, GLenum type, const std::string &source);
+    bool load_binary(Build &build);
+    void save_binary(const Build &build);
+
+    std::string dir;
+    std::string driver;             // vendor, renderer and version strings
+    bool binary_supported;
+    bool parallel_compile;
+    bool keep_stages;
+    std::vector<Build> builds;
+    std::map<std::string, int> variants;    // name to the handle of the live build
+    std::map<std::string, int> latest;      // name to the handle of the last submitted build
+    std::map<std::string, Stage> stages;    // compiled shader objects by file and variant, with keep_stages
+};
+
+#endif //__SHADER_H__
+
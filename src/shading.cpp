@@ -0,0 +1,82 @@
+#include <cmath>
+#include <algorithm>
+#include "shading.h"
+
+Fragment interpolate_fragment(const Mesh &mesh, int face, const float l[3], const float lx[3], const float ly[3],
+                              const Matrix &MV, const mat<3,3,float> &N) {
+    Fragment f;
+    Vec3f p(0, 0, 0), n(0, 0, 0), tg(0, 0, 0), btg(0, 0, 0);
+    for (int k=0; k<2; k++) f.uv[k] = f.duvdx[k] = f.duvdy[k] = 0;
+    for (int j=0; j<3; j++) {
+        int c = face*3 + j;
+        for (int k=0; k<3; k++) {
+            p[k]   += l[j]*mesh.vertices[c*3+k];
+            n[k]   += l[j]*mesh.normals[c*3+k];
+            tg[k]  += l[j]*mesh.tangents[c*3+k];
+            btg[k] += l[j]*mesh.bitangents[c*3+k];
+        }
+        for (int k=0; k<2; k++) {
+            f.uv[k]    += l[j]*mesh.uvs[c*2+k];
+            f.duvdx[k] += (lx[j] - l[j])*mesh.uvs[c*2+k];
+            f.duvdy[k] += (ly[j] - l[j])*mesh.uvs[c*2+k];
+        }
+    }
+    f.position  = proj<3>(MV*embed<4>(p));
+    f.normal    = N*n;
+    f.tangent   = proj<3>(MV*embed<4>(tg, 0.f));
+    f.bitangent = proj<3>(MV*embed<4>(btg, 0.f));
+    return f;
+}
+
+void sample_texture(const Image &img, const float uv[2], const float dx[2], const float dy[2], float *out) {
+    if (!img.width) {
+        for (int k=0; k<img.channels; k++) out[k] = 0;
+        return;
+    }
+    float u = uv[0], v = uv[1], w2 = (float)img.width*img.width, h2 = (float)img.height*img.height;
+    float rho2 = std::max(dx[0]*dx[0]*w2 + dx[1]*dx[1]*h2, dy[0]*dy[0]*w2 + dy[1]*dy[1]*h2);
+    if (rho2>1) {
+        int x = (int)std::floor(u*img.width), y = (int)std::floor(v*img.height);
+        x = ((x % img.width) + img.width) % img.width;
+        y = ((y % img.height) + img.height) % img.height;
+        const unsigned char *t = img.data.data() + (y*img.width + x)*img.channels;
+        for (int k=0; k<img.channels; k++) out[k] = t[k]/255.f;
+        return;
+    }
+    float fx = u*img.width - .5f, fy = v*img.height - .5f;
+    int x0 = (int)std::floor(fx), y0 = (int)std::floor(fy);
+    float wx = fx - x0, wy = fy - y0;
+    int xs[2] = { ((x0 % img.width) + img.width) % img.width, ((x0 + 1) % img.width + img.width) % img.width };
+    int ys[2] = { ((y0 % img.height) + img.height) % img.height, ((y0 + 1) % img.height + img.height) % img.height };
+    for (int k=0; k<img.channels; k++) out[k] = 0;
+    for (int j=0; j<2; j++) {
+        for (int i=0; i<2; i++) {
+            float w = (i ? wx : 1 - wx)*(j ? wy : 1 - wy);
+            const unsigned char *t = img.data.data() + (ys[j]*img.width + xs[i])*img.channels;
+            for (int k=0; k<img.channels; k++) out[k] += w*t[k]/255.f;
+        }
+    }
+}
+
+Vec3f shade_fragment(const Material &material, const Fragment &f, const Vec3f &light, float ambient, float direct) {
+    Vec3f n = f.normal;
+    n.normalize();
+    float ds[4];
+    sample_texture(material.diffspec, f.uv, f.duvdx, f.duvdy, ds);
+    if (material.has_normals) {
+        float nm[2];
+        sample_texture(material.normals, f.uv, f.duvdx, f.duvdy, nm);
+        float nx = nm[0]*2 - 1, ny = nm[1]*2 - 1, nz = std::sqrt(std::max(0.f, 1 - nx*nx - ny*ny));
+        Vec3f T = f.tangent, B = f.bitangent;
+        n = (T.normalize()*nx + B.normalize()*ny + n*nz).normalize();
+    }
+    Vec3f L = (light - f.position).normalize();
+    float cos_theta = std::min(1.f, std::max(0.f, n*L));
+    float intensity = .1f*ambient + 1.5f*cos_theta*direct;
+    if (material.has_specular) {
+        Vec3f R = n*(2*(n*L)) - L;      // -reflect(l, n)
+        float cos_alpha = std::min(1.f, std::max(0.f, R.z));  // E = (0, 0, 1), as in vertex.glsl
+        intensity += 1.5f*std::pow(cos_alpha, ds[3]*250 + 1)*direct;
+    }
+    return Vec3f(ds[0], ds[1], ds[2])*intensity;
+}
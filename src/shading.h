@@ -0,0 +1,27 @@
+#ifndef __SHADING_H__
+#define __SHADING_H__
+
+#include "geometry.h"
+#include "mesh.h"
+#include "material.h"
+
+// What fragment.glsl receives from the vertex shader, in camera space, for the CPU renderers
+struct Fragment {
+    Vec3f position;
+    Vec3f normal, tangent, bitangent;   // not normalized
+    float uv[2], duvdx[2], duvdy[2];    // and the change of the uvs one pixel right and one pixel up
+};
+
+// The corners of the triangle face of the mesh interpolated with the barycentrics l of the pixel,
+// lx and ly are the barycentrics of the pixel to the right and of the pixel above
+Fragment interpolate_fragment(const Mesh &mesh, int face, const float l[3], const float lx[3], const float ly[3],
+                              const Matrix &MV, const mat<3,3,float> &N);
+
+// GL_REPEAT; GL_LINEAR when magnified, otherwise the nearest texel of the only level of the textures
+void sample_texture(const Image &img, const float uv[2], const float dx[2], const float dy[2], float *out);
+
+// fragment.glsl for the light at the camera space position light; ambient and direct scale the two
+// terms of the lighting, for the occlusion and the shadows of the ray tracer
+Vec3f shade_fragment(const Material &material, const Fragment &f, const Vec3f &light, float ambient=1, float direct=1);
+
+#endif //__SHADING_H__
@@ -0,0 +1,254 @@
+#include <cmath>
+#include <chrono>
+#include <algorithm>
+#ifdef __AVX2__
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "software.h"
+#include "uniforms.h"
+#include "shading.h"
+#include "parallel.h"
+#include "profiler.h"
+
+SoftwareRenderer::SoftwareRenderer(const Mesh &mesh, const Material &material, int width, int height) :
+    width(std::max(1, width)), height(std::max(1, height)), mesh(mesh), material(material), light(0, 0, 0), last() {
+    tiles_x = (this->width  + TILE - 1)/TILE;
+    tiles_y = (this->height + TILE - 1)/TILE;
+    bins.resize(tiles_x*tiles_y);
+    worker_clip.resize(worker_count());
+    worker_triangles.resize(worker_count());
+    worker_depth.assign(worker_count(), std::vector<float>(TILE*TILE));
+    worker_ids.assign(worker_count(), std::vector<int>(TILE*TILE));
+    worker_pixels.assign(worker_count(), 0);
+}
+
+void SoftwareRenderer::setup(int instance, const Matrix &MVP, std::vector<Vec4f> &clip, std::vector<Triangle> &out) const {
+    int npositions = (int)mesh.positions.size()/3;
+    clip.resize(npositions);
+    for (int i=0; i<npositions; i++) {
+        const float *p = &mesh.positions[i*3];
+        for (int k=0; k<4; k++) clip[i][k] = MVP[k][0]*p[0] + MVP[k][1]*p[1] + MVP[k][2]*p[2] + MVP[k][3];
+    }
+    int nfaces = (int)mesh.indices.size()/3;
+    for (int f=0; f<nfaces; f++) {
+        const Vec4f &v0 = clip[mesh.indices[f*3]], &v1 = clip[mesh.indices[f*3+1]], &v2 = clip[mesh.indices[f*3+2]];
+        // trivial rejects: all three vertices outside of one plane of the frustum, or behind the eye
+        bool out_of_frustum = false;
+        for (int k=0; k<3 && !out_of_frustum; k++) {
+            out_of_frustum = (v0[k]> v0[3] && v1[k]> v1[3] && v2[k]> v2[3]) ||
+                             (v0[k]<-v0[3] && v1[k]<-v1[3] && v2[k]<-v2[3]);
+        }
+        if (out_of_frustum || (v0[3]<=0 && v1[3]<=0 && v2[3]<=0)) continue;
+
+        // the columns (x, y, w) of the vertices, its inverse maps (x, y, 1) in NDC to lambda/w
+        double m[3][3] = { { v0[0], v1[0], v2[0] }, { v0[1], v1[1], v2[1] }, { v0[3], v1[3], v2[3] } };
+        double inv[3][3];
+        inv[0][0] = m[1][1]*m[2][2] - m[1][2]*m[2][1];
+        inv[0][1] = m[0][2]*m[2][1] - m[0][1]*m[2][2];
+        inv[0][2] = m[0][1]*m[1][2] - m[0][2]*m[1][1];
+        inv[1][0] = m[1][2]*m[2][0] - m[1][0]*m[2][2];
+        inv[1][1] = m[0][0]*m[2][2] - m[0][2]*m[2][0];
+        inv[1][2] = m[0][2]*m[1][0] - m[0][0]*m[1][2];
+        inv[2][0] = m[1][0]*m[2][1] - m[1][1]*m[2][0];
+        inv[2][1] = m[0][1]*m[2][0] - m[0][0]*m[2][1];
+        inv[2][2] = m[0][0]*m[1][1] - m[0][1]*m[1][0];
+        double det = m[0][0]*inv[0][0] + m[0][1]*inv[1][0] + m[0][2]*inv[2][0];
+        if (std::abs(det)<1e-20) continue;     // seen edge on
+
+        Triangle t;
+        double za = 0, zb = 0, zc = 0;
+        const float z[3] = { v0[2], v1[2], v2[2] };
+        for (int i=0; i<3; i++) {
+            // NDC x = 2*px/width - 1 at the pixel px, same for y
+            double a = inv[i][0]/det, b = inv[i][1]/det, c = inv[i][2]/det;
+            t.a[i] = (float)(a*2/width);
+            t.b[i] = (float)(b*2/height);
+            t.c[i] = (float)(c - a - b);
+            za += t.a[i]*z[i];
+            zb += t.b[i]*z[i];
+            zc += t.c[i]*z[i];
+        }
+        t.za = (float)(za*.5);     // window depth, [0,1] from NDC
+        t.zb = (float)(zb*.5);
+        t.zc = (float)(zc*.5 + .5);
+
+        t.xmin = 0;
+        t.ymin = 0;
+        t.xmax = width - 1;
+        t.ymax = height - 1;
+        if (v0[3]>0 && v1[3]>0 && v2[3]>0) {   // otherwise the whole screen, the edge functions do the rest
+            float sx[3], sy[3];
+            const Vec4f *v[3] = { &v0, &v1, &v2 };
+            for (int i=0; i<3; i++) {
+                sx[i] = ((*v[i])[0]/(*v[i])[3]*.5f + .5f)*width;
+                sy[i] = ((*v[i])[1]/(*v[i])[3]*.5f + .5f)*height;
+            }
+            t.xmin = std::max(t.xmin, (int)std::ceil (std::min(sx[0], std::min(sx[1], sx[2])) - .5f));
+            t.xmax = std::min(t.xmax, (int)std::floor(std::max(sx[0], std::max(sx[1], sx[2])) - .5f));
+            t.ymin = std::max(t.ymin, (int)std::ceil (std::min(sy[0], std::min(sy[1], sy[2])) - .5f));
+            t.ymax = std::min(t.ymax, (int)std::floor(std::max(sy[0], std::max(sy[1], sy[2])) - .5f));
+        }
+        if (t.xmin>t.xmax || t.ymin>t.ymax) continue;
+        t.instance = instance;
+        t.face = f;
+        out.push_back(t);
+    }
+}
+
+// Coverage at the pixel centers: lambda_i/w >= 0 for the three corners, in front of the near plane
+// and nearer than the depth so far; the winding does not matter, nothing is culled as in the GL path
+void SoftwareRenderer::raster(const Triangle &t, int id, int tile, float *depth, int *ids) const {
+    int tx = tile%tiles_x, ty = tile/tiles_x;
+    int ox = tx*TILE, oy = ty*TILE;
+    int x0 = std::max(ox, t.xmin), x1 = std::min(ox + TILE - 1, t.xmax);
+    int y0 = std::max(oy, t.ymin), y1 = std::min(oy + TILE - 1, t.ymax);
+#ifdef __AVX2__
+    x0 = ox + ((x0 - ox) & ~7);         // 8-pixel groups never cross a tile, TILE is a multiple of 8
+    const __m256 centers = _mm256_setr_ps(.5f, 1.5f, 2.5f, 3.5f, 4.5f, 5.5f, 6.5f, 7.5f);
+    const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.f);
+    const __m256i vid = _mm256_set1_epi32(id);
+    __m256 a0 = _mm256_set1_ps(t.a[0]), a1 = _mm256_set1_ps(t.a[1]), a2 = _mm256_set1_ps(t.a[2]), za = _mm256_set1_ps(t.za);
+    for (int y=y0; y<=y1; y++) {
+        float py = y + .5f;
+        __m256 r0 = _mm256_set1_ps(t.b[0]*py + t.c[0]), r1 = _mm256_set1_ps(t.b[1]*py + t.c[1]), r2 = _mm256_set1_ps(t.b[2]*py + t.c[2]);
+        __m256 rz = _mm256_set1_ps(t.zb*py + t.zc);
+        float *drow = depth + (y - oy)*TILE - ox;
+        int *irow = ids + (y - oy)*TILE - ox;
+        for (int x=x0; x<=x1; x+=8) {
+            __m256 px = _mm256_add_ps(_mm256_set1_ps((float)x), centers);
+            __m256 z = _mm256_fmadd_ps(za, px, rz);
+            __m256 old = _mm256_loadu_ps(drow + x);
+            __m256 inside = _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(_mm256_fmadd_ps(a0, px, r0), zero, _CMP_GE_OQ),
+                                                        _mm256_cmp_ps(_mm256_fmadd_ps(a1, px, r1), zero, _CMP_GE_OQ)),
+                                          _mm256_and_ps(_mm256_cmp_ps(_mm256_fmadd_ps(a2, px, r2), zero, _CMP_GE_OQ),
+                                                        _mm256_and_ps(_mm256_cmp_ps(z, old, _CMP_GT_OQ), _mm256_cmp_ps(z, one, _CMP_LE_OQ))));
+            if (_mm256_testz_ps(inside, inside)) continue;
+            _mm256_storeu_ps(drow + x, _mm256_blendv_ps(old, z, inside));
+            __m256i oldid = _mm256_loadu_si256((const __m256i *)(irow + x));
+            _mm256_storeu_si256((__m256i *)(irow + x), _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(oldid), _mm256_castsi256_ps(vid), inside)));
+        }
+    }
+#elif defined(__SSE2__)
+    x0 = ox + ((x0 - ox) & ~3);
+    const __m128 centers = _mm_setr_ps(.5f, 1.5f, 2.5f, 3.5f);
+    const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.f);
+    const __m128 vid = _mm_castsi128_ps(_mm_set1_epi32(id));
+    __m128 a0 = _mm_set1_ps(t.a[0]), a1 = _mm_set1_ps(t.a[1]), a2 = _mm_set1_ps(t.a[2]), za = _mm_set1_ps(t.za);
+    for (int y=y0; y<=y1; y++) {
+        float py = y + .5f;
+        __m128 r0 = _mm_set1_ps(t.b[0]*py + t.c[0]), r1 = _mm_set1_ps(t.b[1]*py + t.c[1]), r2 = _mm_set1_ps(t.b[2]*py + t.c[2]);
+        __m128 rz = _mm_set1_ps(t.zb*py + t.zc);
+        float *drow = depth + (y - oy)*TILE - ox;
+        int *irow = ids + (y - oy)*TILE - ox;
+        for (int x=x0; x<=x1; x+=4) {
+            __m128 px = _mm_add_ps(_mm_set1_ps((float)x), centers);
+            __m128 z = _mm_add_ps(_mm_mul_ps(za, px), rz);
+            __m128 old = _mm_loadu_ps(drow + x);
+            __m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(a0, px), r0), zero),
+                                                  _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(a1, px), r1), zero)),
+                                       _mm_and_ps(_mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(a2, px), r2), zero),
+                                                  _mm_and_ps(_mm_cmpgt_ps(z, old), _mm_cmple_ps(z, one))));
+            if (!_mm_movemask_ps(inside)) continue;
+            _mm_storeu_ps(drow + x, _mm_or_ps(_mm_and_ps(inside, z), _mm_andnot_ps(inside, old)));
+            __m128 oldid = _mm_loadu_ps((const float *)(irow + x));
+            _mm_storeu_ps((float *)(irow + x), _mm_or_ps(_mm_and_ps(inside, vid), _mm_andnot_ps(inside, oldid)));
+        }
+    }
+#else
+    for (int y=y0; y<=y1; y++) {
+        float py = y + .5f;
+        float *drow = depth + (y - oy)*TILE - ox;
+        int *irow = ids + (y - oy)*TILE - ox;
+        for (int x=x0; x<=x1; x++) {
+            float px = x + .5f;
+            bool inside = true;
+            for (int i=0; i<3; i++) inside = inside && t.a[i]*px + t.b[i]*py + t.c[i]>=0;
+            float z = t.za*px + t.zb*py + t.zc;
+            if (inside && z>drow[x] && z<=1) {
+                drow[x] = z;
+                irow[x] = id;
+            }
+        }
+    }
+#endif
+}
+
+// fragment.glsl, the attributes interpolated with the perspective correct barycentrics
+Vec3f SoftwareRenderer::shade(const Triangle &t, float x, float y) const {
+    float h[3], hx[3], hy[3], sum = 0, sumx = 0, sumy = 0;
+    for (int i=0; i<3; i++) {
+        sum  += h[i]  = t.a[i]*x + t.b[i]*y + t.c[i];
+        sumx += hx[i] = h[i] + t.a[i];  // one pixel right, one pixel up: the derivatives the quads give to GL
+        sumy += hy[i] = h[i] + t.b[i];
+    }
+    float l[3], lx[3], ly[3];
+    for (int i=0; i<3; i++) {
+        l[i]  = h[i]/sum;
+        lx[i] = hx[i]/sumx;
+        ly[i] = hy[i]/sumy;
+    }
+    Fragment f = interpolate_fragment(mesh, t.face, l, lx, ly, model_views[t.instance], normal_matrices[t.instance]);
+    return shade_fragment(material, f, light);
+}
+
+void SoftwareRenderer::render(const std::vector<Matrix> &instances, const Matrix &V, const Matrix &P, Image &out) {
+    PROFILE_ZONE("software render");
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    int count = (int)instances.size();
+    model_views.resize(count);
+    normal_matrices.resize(count);
+    light = proj<3>(V*embed<4>(Vec3f(40, 40, 40)));
+    for (size_t w=0; w<worker_triangles.size(); w++) worker_triangles[w].clear();
+    parallel_for(0, count, 1, [&](int i, int worker) {
+        model_views[i] = V*instances[i];
+        normal_matrices[i] = normal_matrix(model_views[i]);
+        setup(i, P*model_views[i], worker_clip[worker], worker_triangles[worker]);
+    });
+    std::chrono::steady_clock::time_point geometry = std::chrono::steady_clock::now();
+
+    last.triangles = 0;
+    for (size_t b=0; b<bins.size(); b++) bins[b].clear();
+    for (size_t w=0; w<worker_triangles.size(); w++) {
+        last.triangles += worker_triangles[w].size();
+        for (size_t i=0; i<worker_triangles[w].size(); i++) {
+            const Triangle &t = worker_triangles[w][i];
+            for (int ty=t.ymin/TILE; ty<=t.ymax/TILE; ty++)
+                for (int tx=t.xmin/TILE; tx<=t.xmax/TILE; tx++) bins[ty*tiles_x + tx].push_back(&t);
+        }
+    }
+
+    out.width = width;
+    out.height = height;
+    out.channels = 3;
+    out.data.resize(width*height*3);
+    std::fill(worker_pixels.begin(), worker_pixels.end(), 0);
+    parallel_for(0, tiles_x*tiles_y, 1, [&](int tile, int worker) {
+        float *depth = worker_depth[worker].data();
+        int *ids = worker_ids[worker].data();
+        std::fill(depth, depth + TILE*TILE, 0.f);   // reverse-Z: cleared to the far plane
+        std::fill(ids, ids + TILE*TILE, -1);
+        const std::vector<const Triangle *> &bin = bins[tile];
+        for (size_t i=0; i<bin.size(); i++) raster(*bin[i], (int)i, tile, depth, ids);
+
+        int ox = (tile%tiles_x)*TILE, oy = (tile/tiles_x)*TILE;
+        for (int y=oy; y<std::min(oy + TILE, height); y++) {
+            for (int x=ox; x<std::min(ox + TILE, width); x++) {
+                int id = ids[(y - oy)*TILE + x - ox];
+                Vec3f color(.2f, .3f, .3f);     // glClearColor of the renderer
+                if (id>=0) {
+                    color = shade(*bin[id], x + .5f, y + .5f);
+                    worker_pixels[worker]++;
+                }
+                unsigned char *dst = out.data.data() + (y*width + x)*3;
+                for (int k=0; k<3; k++) dst[k] = (unsigned char)(std::min(1.f, std::max(0.f, color[k]))*255.f + .5f);
+            }
+        }
+    });
+    last.pixels = 0;
+    for (size_t w=0; w<worker_pixels.size(); w++) last.pixels += worker_pixels[w];
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    last.geometry_ms = std::chrono::duration<double, std::milli>(geometry - start).count();
+    last.raster_ms   = std::chrono::duration<double, std::milli>(end - geometry).count();
+}
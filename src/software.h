@@ -0,0 +1,61 @@
+#ifndef __SOFTWARE_H__
+#define __SOFTWARE_H__
+
+#include <vector>
+#include "geometry.h"
+#include "mesh.h"
+#include "material.h"
+
+struct SoftwareStats {
+    SoftwareStats() : triangles(0), pixels(0), geometry_ms(0), raster_ms(0) {}
+    long triangles;     // set up and binned, after the trivial rejects
+    long pixels;        // shaded, one per covered pixel
+    double geometry_ms; // transform and setup
+    double raster_ms;   // binning, rasterization and shading
+};
+
+// Rendering backend without OpenGL, for the machines without a GPU: the streams of Mesh and the
+// packed images of Material, the same reverse-Z depth and the same shading as fragment.glsl.
+//     1. geometry, in parallel over the instances: the shared positions are transformed once, every
+//        triangle gets its three interpolation planes lambda_i/w, affine on the screen, from the
+//        inverse of its clip space vertex matrix (homogeneous rasterization: no clipping, the
+//        triangles that cross the plane of the eye simply keep the pixels in front of it)
+//     2. binning of the triangles into TILE x TILE screen tiles
+//     3. per tile, in parallel: the depth and the triangle of every pixel are rasterized with SIMD
+//        edge functions (AVX2 8 pixels per step, SSE2 4), then every covered pixel is shaded once
+// The output rows are bottom-up, like Framebuffer::read.
+class SoftwareRenderer {
+public:
+    SoftwareRenderer(const Mesh &mesh, const Material &material, int width, int height);
+    void render(const std::vector<Matrix> &instances, const Matrix &V, const Matrix &P, Image &out);
+    const SoftwareStats &stats() const { return last; }
+
+    int width, height;
+private:
+    enum { TILE = 64 };
+    struct Triangle {
+        float a[3], b[3], c[3];     // lambda_i/w = a*x + b*y + c, pixel centers at half integers
+        float za, zb, zc;           // window depth plane
+        int xmin, ymin, xmax, ymax; // pixel bounds, inclusive
+        int instance, face;
+    };
+    void setup(int instance, const Matrix &MVP, std::vector<Vec4f> &clip, std::vector<Triangle> &out) const;
+    void raster(const Triangle &t, int id, int tile, float *depth, int *ids) const;
+    Vec3f shade(const Triangle &t, float x, float y) const;
+
+    const Mesh &mesh;
+    const Material &material;
+    int tiles_x, tiles_y;
+    std::vector<Matrix> model_views;    // of the instances of the frame
+    std::vector<mat<3,3,float> > normal_matrices;
+    Vec3f light;                        // camera space
+    std::vector<std::vector<Vec4f> > worker_clip;
+    std::vector<std::vector<Triangle> > worker_triangles;
+    std::vector<std::vector<const Triangle *> > bins;
+    std::vector<std::vector<float> > worker_depth;  // one tile each
+    std::vector<std::vector<int> > worker_ids;
+    std::vector<long> worker_pixels;
+    SoftwareStats last;
+};
+
+#endif //__SOFTWARE_H__
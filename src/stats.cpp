@@ -0,0 +1,28 @@
+#include <algorithm>
+#include "stats.h"
+
+static double percentile(const std::vector<double> &sorted, double p) {
+    size_t i = std::min(sorted.size()-1, size_t(p*(sorted.size()-1) + .5));
+    return sorted[i];
+}
+
+Summary summarize(std::vector<double> samples) {
+    Summary s;
+    if (samples.empty()) return s;
+    std::sort(samples.begin(), samples.end());
+    s.count = (int)samples.size();
+    for (size_t i=0; i<samples.size(); i++) s.mean += samples[i];
+    s.mean /= samples.size();
+    s.min = samples.front();
+    s.max = samples.back();
+    s.p50 = percentile(samples, .50);
+    s.p95 = percentile(samples, .95);
+    s.p99 = percentile(samples, .99);
+    return s;
+}
+
+void write_json(std::ostream &out, const Summary &s) {
+    out << "{\"count\": " << s.count << ", \"mean\": " << s.mean << ", \"min\": " << s.min << ", \"max\": " << s.max
+        << ", \"p50\": " << s.p50 << ", \"p95\": " << s.p95 << ", \"p99\": " << s.p99 << "}";
+}
+
@@ -0,0 +1,18 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <vector>
+#include <ostream>
+
+struct Summary {
+    Summary() : count(0), mean(0), min(0), max(0), p50(0), p95(0), p99(0) {}
+    int count;
+    double mean, min, max;
+    double p50, p95, p99;
+};
+
+Summary summarize(std::vector<double> samples);                  // the copy gets sorted
+void write_json(std::ostream &out, const Summary &s);           // {"count":...,"mean":...,...}
+
+#endif //__STATS_H__
+
@@ -0,0 +1,36 @@
+#ifndef __TRIPLE_BUFFER_H__
+#define __TRIPLE_BUFFER_H__
+
+#include <atomic>
+
+// Single producer, single consumer exchange that never blocks either side.
+// The writer owns the back slot, the reader owns the front slot, the third one sits in the middle.
+// publish() swaps the back and the middle slots and marks the middle as fresh; update() swaps the
+// middle and the front slots if the middle is fresh. The reader always sees the latest complete
+// state, intermediate states are simply overwritten when the writer is faster.
+template <typename T> class TripleBuffer {
+public:
+    TripleBuffer() : middle(1), back(0), front(2) {}
+
+    T &write_slot() { return slots[back]; }             // writer side
+    void publish() {
+        back = middle.exchange(back | FRESH, std::memory_order_acq_rel) & INDEX;
+    }
+
+    bool fresh() const { return middle.load(std::memory_order_relaxed) & FRESH; }
+    bool update() {                                     // reader side, true if a new state arrived
+        if (!fresh()) return false;
+        front = middle.exchange(front, std::memory_order_acq_rel) & INDEX;
+        return true;
+    }
+    const T &read_slot() const { return slots[front]; }
+
+private:
+    enum { INDEX = 3, FRESH = 4 };
+    T slots[3];
+    std::atomic<unsigned> middle;   // index of the middle slot | FRESH
+    unsigned back, front;
+};
+
+#endif //__TRIPLE_BUFFER_H__
+
@@ -0,0 +1,98 @@
+#include <iostream>
+#include <cstring>
+#include "uniforms.h"
+
+void std140_mat4(float *dst, Matrix m) {
+    m.export_row_major(dst);
+}
+
+void std140_mat3(float *dst, mat<3,3,float> m) {
+    for (int j=0; j<3; j++) {
+        for (int i=0; i<3; i++) dst[j*4+i] = m[i][j];
+        dst[j*4+3] = 0;
+    }
+}
+
+mat<3,3,float> normal_matrix(Matrix MV) {
+    mat<3,3,float> A;
+    for (int i=0; i<3; i++)
+        for (int j=0; j<3; j++) A[i][j] = MV[i][j];
+    return A.invert_transpose();
+}
+
+static GLsizeiptr align_up(GLsizeiptr size, GLint alignment) {
+    return (size + alignment - 1)/alignment*alignment;
+}
+
+UniformRing::UniformRing(int max_objects) : ubo(0), current(0), max_objects_(max_objects), staging() {
+    GLint alignment = 256;
+    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+    frame_stride  = align_up(sizeof(FrameUniforms),  alignment);
+    object_stride = align_up(sizeof(ObjectUniforms), alignment);
+    segment_size  = frame_stride + object_stride*max_objects_;
+    staging.resize(segment_size, 0);
+    for (int i=0; i<NFRAMES; i++) fences[i] = 0;
+
+    glGenBuffers(1, &ubo);
+    glBindBuffer(GL_UNIFORM_BUFFER, ubo);
+    glBufferData(GL_UNIFORM_BUFFER, segment_size*NFRAMES, NULL, GL_STREAM_DRAW);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+void UniformRing::release() {
+    for (int i=0; i<NFRAMES; i++) {
+        if (fences[i]) glDeleteSync(fences[i]);
+        fences[i] = 0;
+    }
+    glDeleteBuffers(1, &ubo);
+    ubo = 0;
+}
+
+void UniformRing::bind_blocks(GLuint prog) {
+    GLuint frame_idx  = glGetUniformBlockIndex(prog, "PerFrame");
+    GLuint object_idx = glGetUniformBlockIndex(prog, "PerObject");
+    if (GL_INVALID_INDEX!=frame_idx)  glUniformBlockBinding(prog, frame_idx,  FRAME_UNIFORMS_BINDING);
+    if (GL_INVALID_INDEX!=object_idx) glUniformBlockBinding(prog, object_idx, OBJECT_UNIFORMS_BINDING);
+}
+
+FrameUniforms &UniformRing::frame() {
+    return *reinterpret_cast<FrameUniforms *>(staging.data());
+}
+
+ObjectUniforms &UniformRing::object(int i) {
+    return *reinterpret_cast<ObjectUniforms *>(staging.data() + frame_stride + object_stride*i);
+}
+
+void UniformRing::upload(int nobjects) {
+    if (fences[current]) { // the segment was used NFRAMES frames ago, normally this never waits
+        while (GL_TIMEOUT_EXPIRED==glClientWaitSync(fences[current], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000));
+        glDeleteSync(fences[current]);
+        fences[current] = 0;
+    }
+
+    GLsizeiptr size = frame_stride + object_stride*nobjects;
+    glBindBuffer(GL_UNIFORM_BUFFER, ubo);
+    void *dst = glMapBufferRange(GL_UNIFORM_BUFFER, segment_size*current, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+    if (dst) {
+        memcpy(dst, staging.data(), size);
+        glUnmapBuffer(GL_UNIFORM_BUFFER);
+    } else {
+        std::cerr << "Failed to map the uniform buffer" << std::endl;
+    }
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    glBindBufferRange(GL_UNIFORM_BUFFER, FRAME_UNIFORMS_BINDING, ubo, segment_size*current, sizeof(FrameUniforms));
+}
+
+void UniformRing::bind_object(int i) {
+    glBindBufferRange(GL_UNIFORM_BUFFER, OBJECT_UNIFORMS_BINDING, ubo, segment_size*current + frame_stride + object_stride*i, sizeof(ObjectUniforms));
+}
+
+void UniformRing::bind_objects(int first, int count) {
+    glBindBufferRange(GL_UNIFORM_BUFFER, OBJECT_UNIFORMS_BINDING, ubo, segment_size*current + frame_stride + object_stride*first, object_stride*count);
+}
+
+void UniformRing::end_frame() {
+    fences[current] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    current = (current + 1) % NFRAMES;
+}
+
@@ -0,0 +1,65 @@
+#ifndef __UNIFORMS_H__
+#define __UNIFORMS_H__
+
+#include <vector>
+#include <glad/glad.h>
+#include "geometry.h"
+
+// std140 mirrors of the uniform blocks declared in the shaders, keep them in sync with shaders/*.glsl
+struct FrameUniforms {          // uniform block PerFrame, binding point 0
+    float V[16];
+    float P[16];
+    float LightPosition_cameraspace[4];     // V*light, the light does not depend on the object
+};
+
+struct ObjectUniforms {         // uniform block PerObject, binding point 1
+    float M[16];
+    float MV[16];
+    float MVP[16];
+    float N[12];                // normal matrix; std140 stores a mat3 as three vec4 columns
+    float info[4];              // x: index of the object in the frame, the rest pads the block to 256 bytes, the array stride of the instancing variant
+};
+
+enum { FRAME_UNIFORMS_BINDING = 0, OBJECT_UNIFORMS_BINDING = 1, LIGHT_UNIFORMS_BINDING = 2 };   // PointLights, see clustered.h
+
+void std140_mat4(float *dst, Matrix m);
+void std140_mat3(float *dst, mat<3,3,float> m);
+mat<3,3,float> normal_matrix(Matrix MV);   // inverse transpose of the upper-left 3x3 block
+
+// One uniform buffer split into NFRAMES segments; each segment holds the per-frame block
+// followed by the blocks of all the objects. The CPU fills a staging copy of the current
+// segment and uploads it with a single unsynchronized map; a fence per segment guarantees
+// that the GPU is done reading a segment before it gets overwritten.
+class UniformRing {
+public:
+    UniformRing(int max_objects);
+    void release();                         // delete the buffer and the fences, the context must still be current
+    void bind_blocks(GLuint prog);          // assign the binding points to the blocks of the program
+
+    FrameUniforms  &frame();                // staging copy of the current segment
+    ObjectUniforms &object(int i);
+
+    void upload(int nobjects);              // one upload for the per-frame block and nobjects object blocks
+    void bind_object(int i);                // select the object block for the next draw call
+    void bind_objects(int first, int count);    // an array of blocks for an instanced draw, see instancing()
+    void end_frame();                       // fence the segment and move to the next one
+
+    int max_objects() const { return max_objects_; }
+    bool instancing() const { return object_stride==(GLsizeiptr)sizeof(ObjectUniforms); }  // the stride is the std140 array stride
+private:
+    enum { NFRAMES = 3 };
+    UniformRing(const UniformRing &);
+    UniformRing &operator=(const UniformRing &);
+
+    GLuint ubo;
+    GLsync fences[NFRAMES];
+    int current;
+    int max_objects_;
+    GLsizeiptr frame_stride;                // sizeof(FrameUniforms) rounded up to GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT
+    GLsizeiptr object_stride;
+    GLsizeiptr segment_size;
+    std::vector<char> staging;
+};
+
+#endif //__UNIFORMS_H__
+
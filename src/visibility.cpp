@@ -0,0 +1,139 @@
+#include <iostream>
+#include <algorithm>
+#include "visibility.h"
+#include "uniforms.h"
+#include "profiler.h"
+
+VisibilityBuffer::VisibilityBuffer() : nfaces(0), fbo(0), ids(0), depth(0), corners(0), corners_tex(0), model_views(0), model_views_tex(0),
+    empty_vao(0), width(0), height(0), previous_fbo(0), staging() {}
+
+bool VisibilityBuffer::init(const Mesh &mesh, int max_objects) {
+    nfaces = mesh.nverts()/3;
+    if ((double)nfaces*max_objects>=4294967295.) {
+        std::cerr << "Visibility buffer: " << max_objects << " objects of " << nfaces << " triangles overflow the 32-bit ids" << std::endl;
+        return false;
+    }
+    std::vector<GLfloat> texels(mesh.nverts()*16);
+    for (int i=0; i<mesh.nverts(); i++) {
+        GLfloat *t = &texels[i*16];
+        Vec3f p = mesh.vertex(i);
+        for (int k=0; k<3; k++) {
+            t[k]    = p[k];
+            t[4+k]  = mesh.normals[i*3+k];
+            t[8+k]  = mesh.tangents[i*3+k];
+            t[12+k] = mesh.bitangents[i*3+k];
+        }
+        t[3] = mesh.uvs[i*2];
+        t[7] = mesh.uvs[i*2+1];
+    }
+    glGenBuffers(1, &corners);
+    glBindBuffer(GL_TEXTURE_BUFFER, corners);
+    glBufferData(GL_TEXTURE_BUFFER, texels.size()*sizeof(GLfloat), texels.data(), GL_STATIC_DRAW);
+    glGenTextures(1, &corners_tex);
+    glBindTexture(GL_TEXTURE_BUFFER, corners_tex);
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, corners);
+
+    glGenBuffers(1, &model_views);
+    glBindBuffer(GL_TEXTURE_BUFFER, model_views);
+    glBufferData(GL_TEXTURE_BUFFER, max_objects*16*sizeof(GLfloat), NULL, GL_STREAM_DRAW);
+    glGenTextures(1, &model_views_tex);
+    glBindTexture(GL_TEXTURE_BUFFER, model_views_tex);
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, model_views);
+    glBindTexture(GL_TEXTURE_BUFFER, 0);
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+    staging.resize(max_objects*16);
+
+    glGenVertexArrays(1, &empty_vao);
+    return true;
+}
+
+void VisibilityBuffer::setup_program(GLuint prog) {
+    glUseProgram(prog);
+    glUniform1ui(glGetUniformLocation(prog, "NumFaces"), nfaces);
+    glUniform1i(glGetUniformLocation(prog, "VisibilityIds"), IDS_UNIT);
+    glUniform1i(glGetUniformLocation(prog, "Corners"), CORNERS_UNIT);
+    glUniform1i(glGetUniformLocation(prog, "ModelViews"), MODEL_VIEWS_UNIT);
+}
+
+void VisibilityBuffer::resize(int w, int h) {
+    if (w==width && h==height) return;
+    if (fbo) {
+        glDeleteFramebuffers(1, &fbo);
+        glDeleteTextures(1, &ids);
+        glDeleteRenderbuffers(1, &depth);
+    }
+    width  = w;
+    height = h;
+    glGenTextures(1, &ids);
+    glBindTexture(GL_TEXTURE_2D, ids);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_R32UI, width, height, 0, GL_RED_INTEGER, GL_UNSIGNED_INT, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glGenRenderbuffers(1, &depth);
+    glBindRenderbuffer(GL_RENDERBUFFER, depth);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT32F, width, height);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+    glGenFramebuffers(1, &fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, ids, 0);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depth);
+    if (GL_FRAMEBUFFER_COMPLETE!=glCheckFramebufferStatus(GL_FRAMEBUFFER)) {
+        std::cerr << "Incomplete visibility buffer " << width << "x" << height << std::endl;
+    }
+}
+
+void VisibilityBuffer::begin_geometry(const std::vector<Matrix> &instances, int count, const Matrix &V) {
+    count = std::min(count, (int)staging.size()/16);
+    for (int i=0; i<count; i++) std140_mat4(&staging[i*16], V*instances[i]);
+    glBindBuffer(GL_TEXTURE_BUFFER, model_views);     // orphaned, the previous frames may still read their old storage
+    glBufferData(GL_TEXTURE_BUFFER, staging.size()*sizeof(GLfloat), NULL, GL_STREAM_DRAW);
+    glBufferSubData(GL_TEXTURE_BUFFER, 0, count*16*sizeof(GLfloat), staging.data());
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+    glActiveTexture(GL_TEXTURE0 + CORNERS_UNIT);
+    glBindTexture(GL_TEXTURE_BUFFER, corners_tex);
+    glActiveTexture(GL_TEXTURE0 + MODEL_VIEWS_UNIT);
+    glBindTexture(GL_TEXTURE_BUFFER, model_views_tex);
+    glActiveTexture(GL_TEXTURE0);
+
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &previous_fbo);
+    resize(viewport[2], viewport[3]);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    const GLuint background[4] = { 0, 0, 0, 0 };
+    glClearBufferuiv(GL_COLOR, 0, background);
+    glClear(GL_DEPTH_BUFFER_BIT);
+}
+
+void VisibilityBuffer::resolve(GLuint prog) {
+    PROFILE_ZONE("visibility resolve");
+    glBindFramebuffer(GL_FRAMEBUFFER, previous_fbo);
+    glActiveTexture(GL_TEXTURE0 + IDS_UNIT);
+    glBindTexture(GL_TEXTURE_2D, ids);
+    glActiveTexture(GL_TEXTURE0);
+
+    glDisable(GL_DEPTH_TEST);   // the depth test happened in the geometry pass, once per pixel from here on
+    glUseProgram(prog);
+    glBindVertexArray(empty_vao);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+    glBindVertexArray(0);
+    glEnable(GL_DEPTH_TEST);
+}
+
+void VisibilityBuffer::release() {
+    if (fbo) {
+        glDeleteFramebuffers(1, &fbo);
+        glDeleteTextures(1, &ids);
+        glDeleteRenderbuffers(1, &depth);
+    }
+    fbo = ids = depth = 0;
+    width = height = 0;
+    glDeleteBuffers(1, &corners);
+    glDeleteBuffers(1, &model_views);
+    glDeleteTextures(1, &corners_tex);
+    glDeleteTextures(1, &model_views_tex);
+    glDeleteVertexArrays(1, &empty_vao);
+    corners = corners_tex = model_views = model_views_tex = empty_vao = 0;
+}
@@ -0,0 +1,42 @@
+#ifndef __VISIBILITY_H__
+#define __VISIBILITY_H__
+
+#include <vector>
+#include <glad/glad.h>
+#include "geometry.h"
+#include "mesh.h"
+
+// Visibility buffer: the geometry pass rasterizes the position-only stream and writes one 32-bit id
+// per pixel, object*nfaces + triangle + 1, into an R32UI target with its own depth. One full-screen
+// pass then shades every covered pixel exactly once: fragment.glsl with VISIBILITY fetches the three
+// corners of the triangle from a buffer texture, rebuilds the perspective correct barycentrics and the
+// uv derivatives analytically and runs the same lighting. Small triangles no longer pay for the 2x2
+// quads of the rasterizer, the cost of the shading follows the pixels.
+class VisibilityBuffer {
+public:
+    VisibilityBuffer();
+    bool init(const Mesh &mesh, int max_objects);   // false if the ids of max_objects do not fit in 32 bits
+    void release();
+    void setup_program(GLuint prog);    // the uniforms of the geometry and of the shading programs
+    bool enabled() const { return corners!=0; }
+
+    // upload the model views of the objects, bind the corners and them to their units for the geometry
+    // and the shading passes, bind the id target, sized to the viewport, and clear it
+    void begin_geometry(const std::vector<Matrix> &instances, int count, const Matrix &V);
+    void resolve(GLuint prog);  // shade into the framebuffer bound before begin_geometry()
+
+    enum { IDS_UNIT = 9, CORNERS_UNIT = 10, MODEL_VIEWS_UNIT = 11 };   // texture units of the shading pass
+private:
+    void resize(int width, int height);
+
+    GLuint nfaces;
+    GLuint fbo, ids, depth;
+    GLuint corners, corners_tex;        // model space attributes, 4 RGBA32F texels per corner
+    GLuint model_views, model_views_tex;
+    GLuint empty_vao;
+    int width, height;
+    GLint previous_fbo;
+    std::vector<float> staging;         // MV of the objects, column-major
+};
+
+#endif //__VISIBILITY_H__